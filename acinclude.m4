@@ -31,6 +31,16 @@ AC_DEFUN([AC_FUNC_PPOLL], [
 			[Define to 1 if you need the ppoll() function.]))
 ])
 
+AC_DEFUN([AC_FUNC_SENDMMSG], [
+	AC_CHECK_FUNC(sendmmsg, AC_DEFINE(HAVE_SENDMMSG, 1,
+			[Define to 1 if you have the sendmmsg() function.]))
+])
+
+AC_DEFUN([AC_FUNC_RECVMMSG], [
+	AC_CHECK_FUNC(recvmmsg, AC_DEFINE(HAVE_RECVMMSG, 1,
+			[Define to 1 if you have the recvmmsg() function.]))
+])
+
 AC_DEFUN([AC_INIT_BLUEZ], [
 	AC_PREFIX_DEFAULT(/usr/local)
 
@@ -376,7 +386,7 @@ AC_DEFUN([AC_ARG_BLUEZ], [
 	AM_CONDITIONAL(SNDFILE, test "${sndfile_enable}" = "yes" && test "${sndfile_found}" = "yes")
 	AM_CONDITIONAL(USB, test "${usb_enable}" = "yes" && test "${usb_found}" = "yes")
 	AM_CONDITIONAL(SBC, test "${alsa_enable}" = "yes" || test "${gstreamer_enable}" = "yes" ||
-									test "${test_enable}" = "yes")
+				test "${audio_enable}" = "yes" || test "${test_enable}" = "yes")
 	AM_CONDITIONAL(ALSA, test "${alsa_enable}" = "yes" && test "${alsa_found}" = "yes")
 	AM_CONDITIONAL(GSTREAMER, test "${gstreamer_enable}" = "yes" && test "${gstreamer_found}" = "yes")
 	AM_CONDITIONAL(AUDIOPLUGIN, test "${audio_enable}" = "yes")
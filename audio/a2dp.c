@@ -46,6 +46,7 @@
 #include "source.h"
 #include "unix.h"
 #include "a2dp.h"
+#include "codec.h"
 #include "sdpd.h"
 
 /* The duration that streams without users are allowed to stay in
@@ -413,7 +414,7 @@ done:
 	return FALSE;
 }
 
-static gboolean sbc_setconf_ind(struct avdtp *session,
+static gboolean codec_setconf_ind(struct avdtp *session,
 					struct avdtp_local_sep *sep,
 					struct avdtp_stream *stream,
 					GSList *caps,
@@ -421,6 +422,7 @@ static gboolean sbc_setconf_ind(struct avdtp *session,
 					void *user_data)
 {
 	struct a2dp_sep *a2dp_sep = user_data;
+	const struct a2dp_codec *engine;
 	struct a2dp_setup *setup;
 
 	if (a2dp_sep->type == AVDTP_SEP_TYPE_SINK)
@@ -437,11 +439,12 @@ static gboolean sbc_setconf_ind(struct avdtp *session,
 	setup->stream = stream;
 	setup->setconf_cb = cb;
 
+	engine = a2dp_codec_find(a2dp_sep->codec);
+
 	/* Check valid settings */
 	for (; caps != NULL; caps = g_slist_next(caps)) {
 		struct avdtp_service_capability *cap = caps->data;
 		struct avdtp_media_codec_capability *codec_cap;
-		struct sbc_codec_cap *sbc_cap;
 
 		if (cap->category == AVDTP_DELAY_REPORTING &&
 					!a2dp_sep->delay_reporting) {
@@ -451,21 +454,18 @@ static gboolean sbc_setconf_ind(struct avdtp *session,
 			goto done;
 		}
 
-		if (cap->category != AVDTP_MEDIA_CODEC)
+		if (cap->category != AVDTP_MEDIA_CODEC || engine == NULL)
 			continue;
 
-		if (cap->length < sizeof(struct sbc_codec_cap))
+		if (cap->length < sizeof(*codec_cap) + engine->caps_size)
 			continue;
 
 		codec_cap = (void *) cap->data;
 
-		if (codec_cap->media_codec_type != A2DP_CODEC_SBC)
+		if (codec_cap->media_codec_type != engine->type)
 			continue;
 
-		sbc_cap = (void *) codec_cap;
-
-		if (sbc_cap->min_bitpool < MIN_BITPOOL ||
-					sbc_cap->max_bitpool > MAX_BITPOOL) {
+		if (engine->check_configuration(codec_cap->data) < 0) {
 			setup->err = g_new(struct avdtp_error, 1);
 			avdtp_error_init(setup->err, AVDTP_MEDIA_CODEC,
 					AVDTP_UNSUPPORTED_CONFIGURATION);
@@ -478,124 +478,27 @@ done:
 	return TRUE;
 }
 
-static gboolean sbc_getcap_ind(struct avdtp *session, struct avdtp_local_sep *sep,
-				gboolean get_all, GSList **caps, uint8_t *err,
-				void *user_data)
-{
-	struct a2dp_sep *a2dp_sep = user_data;
-	struct avdtp_service_capability *media_transport, *media_codec;
-	struct sbc_codec_cap sbc_cap;
-
-	if (a2dp_sep->type == AVDTP_SEP_TYPE_SINK)
-		DBG("Sink %p: Get_Capability_Ind", sep);
-	else
-		DBG("Source %p: Get_Capability_Ind", sep);
-
-	*caps = NULL;
-
-	media_transport = avdtp_service_cap_new(AVDTP_MEDIA_TRANSPORT,
-						NULL, 0);
-
-	*caps = g_slist_append(*caps, media_transport);
-
-	memset(&sbc_cap, 0, sizeof(struct sbc_codec_cap));
-
-	sbc_cap.cap.media_type = AVDTP_MEDIA_TYPE_AUDIO;
-	sbc_cap.cap.media_codec_type = A2DP_CODEC_SBC;
-
-	sbc_cap.frequency = ( SBC_SAMPLING_FREQ_48000 |
-				SBC_SAMPLING_FREQ_44100 |
-				SBC_SAMPLING_FREQ_32000 |
-				SBC_SAMPLING_FREQ_16000 );
-
-	sbc_cap.channel_mode = ( SBC_CHANNEL_MODE_JOINT_STEREO |
-					SBC_CHANNEL_MODE_STEREO |
-					SBC_CHANNEL_MODE_DUAL_CHANNEL |
-					SBC_CHANNEL_MODE_MONO );
-
-	sbc_cap.block_length = ( SBC_BLOCK_LENGTH_16 |
-					SBC_BLOCK_LENGTH_12 |
-					SBC_BLOCK_LENGTH_8 |
-					SBC_BLOCK_LENGTH_4 );
-
-	sbc_cap.subbands = ( SBC_SUBBANDS_8 | SBC_SUBBANDS_4 );
-
-	sbc_cap.allocation_method = ( SBC_ALLOCATION_LOUDNESS |
-					SBC_ALLOCATION_SNR );
-
-	sbc_cap.min_bitpool = MIN_BITPOOL;
-	sbc_cap.max_bitpool = MAX_BITPOOL;
-
-	media_codec = avdtp_service_cap_new(AVDTP_MEDIA_CODEC, &sbc_cap,
-						sizeof(sbc_cap));
-
-	*caps = g_slist_append(*caps, media_codec);
-
-	if (get_all) {
-		struct avdtp_service_capability *delay_reporting;
-		delay_reporting = avdtp_service_cap_new(AVDTP_DELAY_REPORTING,
-								NULL, 0);
-		*caps = g_slist_append(*caps, delay_reporting);
-	}
-
-	return TRUE;
-}
-
-static gboolean mpeg_setconf_ind(struct avdtp *session,
-					struct avdtp_local_sep *sep,
-					struct avdtp_stream *stream,
-					GSList *caps,
-					avdtp_set_configuration_cb cb,
-					void *user_data)
-{
-	struct a2dp_sep *a2dp_sep = user_data;
-	struct a2dp_setup *setup;
-
-	if (a2dp_sep->type == AVDTP_SEP_TYPE_SINK)
-		DBG("Sink %p: Set_Configuration_Ind", sep);
-	else
-		DBG("Source %p: Set_Configuration_Ind", sep);
-
-	setup = a2dp_setup_get(session);
-	if (!setup)
-		return FALSE;
-
-	a2dp_sep->stream = stream;
-	setup->sep = a2dp_sep;
-	setup->stream = stream;
-	setup->setconf_cb = cb;
-
-	for (; caps != NULL; caps = g_slist_next(caps)) {
-		struct avdtp_service_capability *cap = caps->data;
-
-		if (cap->category == AVDTP_DELAY_REPORTING &&
-					!a2dp_sep->delay_reporting) {
-			setup->err = g_new(struct avdtp_error, 1);
-			avdtp_error_init(setup->err, AVDTP_DELAY_REPORTING,
-					AVDTP_UNSUPPORTED_CONFIGURATION);
-			goto done;
-		}
-	}
-
-done:
-	g_idle_add(auto_config, setup);
-	return TRUE;
-}
-
-static gboolean mpeg_getcap_ind(struct avdtp *session,
+static gboolean codec_getcap_ind(struct avdtp *session,
 				struct avdtp_local_sep *sep,
 				gboolean get_all,
 				GSList **caps, uint8_t *err, void *user_data)
 {
 	struct a2dp_sep *a2dp_sep = user_data;
 	struct avdtp_service_capability *media_transport, *media_codec;
-	struct mpeg_codec_cap mpeg_cap;
+	struct avdtp_media_codec_capability *codec_caps;
+	const struct a2dp_codec *engine;
 
 	if (a2dp_sep->type == AVDTP_SEP_TYPE_SINK)
 		DBG("Sink %p: Get_Capability_Ind", sep);
 	else
 		DBG("Source %p: Get_Capability_Ind", sep);
 
+	engine = a2dp_codec_find(a2dp_sep->codec);
+	if (engine == NULL) {
+		*err = AVDTP_UNSUPPORTED_CONFIGURATION;
+		return FALSE;
+	}
+
 	*caps = NULL;
 
 	media_transport = avdtp_service_cap_new(AVDTP_MEDIA_TRANSPORT,
@@ -603,31 +506,16 @@ static gboolean mpeg_getcap_ind(struct avdtp *session,
 
 	*caps = g_slist_append(*caps, media_transport);
 
-	memset(&mpeg_cap, 0, sizeof(struct mpeg_codec_cap));
-
-	mpeg_cap.cap.media_type = AVDTP_MEDIA_TYPE_AUDIO;
-	mpeg_cap.cap.media_codec_type = A2DP_CODEC_MPEG12;
-
-	mpeg_cap.frequency = ( MPEG_SAMPLING_FREQ_48000 |
-				MPEG_SAMPLING_FREQ_44100 |
-				MPEG_SAMPLING_FREQ_32000 |
-				MPEG_SAMPLING_FREQ_24000 |
-				MPEG_SAMPLING_FREQ_22050 |
-				MPEG_SAMPLING_FREQ_16000 );
-
-	mpeg_cap.channel_mode = ( MPEG_CHANNEL_MODE_JOINT_STEREO |
-					MPEG_CHANNEL_MODE_STEREO |
-					MPEG_CHANNEL_MODE_DUAL_CHANNEL |
-					MPEG_CHANNEL_MODE_MONO );
-
-	mpeg_cap.layer = ( MPEG_LAYER_MP3 | MPEG_LAYER_MP2 | MPEG_LAYER_MP1 );
-
-	mpeg_cap.bitrate = 0xFFFF;
+	codec_caps = g_malloc0(sizeof(*codec_caps) + engine->caps_size);
+	codec_caps->media_type = AVDTP_MEDIA_TYPE_AUDIO;
+	codec_caps->media_codec_type = engine->type;
+	engine->get_capabilities(codec_caps->data);
 
-	media_codec = avdtp_service_cap_new(AVDTP_MEDIA_CODEC, &mpeg_cap,
-						sizeof(mpeg_cap));
+	media_codec = avdtp_service_cap_new(AVDTP_MEDIA_CODEC, codec_caps,
+					sizeof(*codec_caps) + engine->caps_size);
 
 	*caps = g_slist_append(*caps, media_codec);
+	g_free(codec_caps);
 
 	if (get_all) {
 		struct avdtp_service_capability *delay_reporting;
@@ -1267,22 +1155,9 @@ static struct avdtp_sep_cfm cfm = {
 	.delay_report		= delay_report_cfm,
 };
 
-static struct avdtp_sep_ind sbc_ind = {
-	.get_capability		= sbc_getcap_ind,
-	.set_configuration	= sbc_setconf_ind,
-	.get_configuration	= getconf_ind,
-	.open			= open_ind,
-	.start			= start_ind,
-	.suspend		= suspend_ind,
-	.close			= close_ind,
-	.abort			= abort_ind,
-	.reconfigure		= reconf_ind,
-	.delayreport		= delayreport_ind,
-};
-
-static struct avdtp_sep_ind mpeg_ind = {
-	.get_capability		= mpeg_getcap_ind,
-	.set_configuration	= mpeg_setconf_ind,
+static struct avdtp_sep_ind codec_ind = {
+	.get_capability		= codec_getcap_ind,
+	.set_configuration	= codec_setconf_ind,
 	.get_configuration	= getconf_ind,
 	.open			= open_ind,
 	.start			= start_ind,
@@ -1612,7 +1487,7 @@ struct a2dp_sep *a2dp_add_sep(const bdaddr_t *src, uint8_t type,
 		goto proceed;
 	}
 
-	ind = (codec == A2DP_CODEC_MPEG12) ? &mpeg_ind : &sbc_ind;
+	ind = &codec_ind;
 
 proceed:
 	sep->lsep = avdtp_register_sep(&server->src, type,
@@ -1739,137 +1614,54 @@ struct a2dp_sep *a2dp_get(struct avdtp *session,
 	return NULL;
 }
 
-static uint8_t default_bitpool(uint8_t freq, uint8_t mode)
-{
-	switch (freq) {
-	case SBC_SAMPLING_FREQ_16000:
-	case SBC_SAMPLING_FREQ_32000:
-		return 53;
-	case SBC_SAMPLING_FREQ_44100:
-		switch (mode) {
-		case SBC_CHANNEL_MODE_MONO:
-		case SBC_CHANNEL_MODE_DUAL_CHANNEL:
-			return 31;
-		case SBC_CHANNEL_MODE_STEREO:
-		case SBC_CHANNEL_MODE_JOINT_STEREO:
-			return 53;
-		default:
-			error("Invalid channel mode %u", mode);
-			return 53;
-		}
-	case SBC_SAMPLING_FREQ_48000:
-		switch (mode) {
-		case SBC_CHANNEL_MODE_MONO:
-		case SBC_CHANNEL_MODE_DUAL_CHANNEL:
-			return 29;
-		case SBC_CHANNEL_MODE_STEREO:
-		case SBC_CHANNEL_MODE_JOINT_STEREO:
-			return 51;
-		default:
-			error("Invalid channel mode %u", mode);
-			return 51;
-		}
-	default:
-		error("Invalid sampling freq %u", freq);
-		return 53;
-	}
-}
-
-static gboolean select_sbc_params(struct sbc_codec_cap *cap,
-					struct sbc_codec_cap *supported)
+static gboolean select_capabilities(struct avdtp *session,
+					struct avdtp_remote_sep *rsep,
+					GSList **caps)
 {
-	unsigned int max_bitpool, min_bitpool;
-
-	memset(cap, 0, sizeof(struct sbc_codec_cap));
-
-	cap->cap.media_type = AVDTP_MEDIA_TYPE_AUDIO;
-	cap->cap.media_codec_type = A2DP_CODEC_SBC;
+	struct avdtp_service_capability *media_transport, *media_codec;
+	struct avdtp_media_codec_capability *remote, *codec_caps;
+	const struct a2dp_codec *engine;
+	int err;
 
-	if (supported->frequency & SBC_SAMPLING_FREQ_44100)
-		cap->frequency = SBC_SAMPLING_FREQ_44100;
-	else if (supported->frequency & SBC_SAMPLING_FREQ_48000)
-		cap->frequency = SBC_SAMPLING_FREQ_48000;
-	else if (supported->frequency & SBC_SAMPLING_FREQ_32000)
-		cap->frequency = SBC_SAMPLING_FREQ_32000;
-	else if (supported->frequency & SBC_SAMPLING_FREQ_16000)
-		cap->frequency = SBC_SAMPLING_FREQ_16000;
-	else {
-		error("No supported frequencies");
+	media_codec = avdtp_get_codec(rsep);
+	if (!media_codec)
 		return FALSE;
-	}
 
-	if (supported->channel_mode & SBC_CHANNEL_MODE_JOINT_STEREO)
-		cap->channel_mode = SBC_CHANNEL_MODE_JOINT_STEREO;
-	else if (supported->channel_mode & SBC_CHANNEL_MODE_STEREO)
-		cap->channel_mode = SBC_CHANNEL_MODE_STEREO;
-	else if (supported->channel_mode & SBC_CHANNEL_MODE_DUAL_CHANNEL)
-		cap->channel_mode = SBC_CHANNEL_MODE_DUAL_CHANNEL;
-	else if (supported->channel_mode & SBC_CHANNEL_MODE_MONO)
-		cap->channel_mode = SBC_CHANNEL_MODE_MONO;
-	else {
-		error("No supported channel modes");
-		return FALSE;
-	}
+	remote = (void *) media_codec->data;
 
-	if (supported->block_length & SBC_BLOCK_LENGTH_16)
-		cap->block_length = SBC_BLOCK_LENGTH_16;
-	else if (supported->block_length & SBC_BLOCK_LENGTH_12)
-		cap->block_length = SBC_BLOCK_LENGTH_12;
-	else if (supported->block_length & SBC_BLOCK_LENGTH_8)
-		cap->block_length = SBC_BLOCK_LENGTH_8;
-	else if (supported->block_length & SBC_BLOCK_LENGTH_4)
-		cap->block_length = SBC_BLOCK_LENGTH_4;
-	else {
-		error("No supported block lengths");
+	engine = a2dp_codec_find(remote->media_codec_type);
+	if (engine == NULL) {
+		error("No engine for codec 0x%02x", remote->media_codec_type);
 		return FALSE;
 	}
 
-	if (supported->subbands & SBC_SUBBANDS_8)
-		cap->subbands = SBC_SUBBANDS_8;
-	else if (supported->subbands & SBC_SUBBANDS_4)
-		cap->subbands = SBC_SUBBANDS_4;
-	else {
-		error("No supported subbands");
+	if (media_codec->length < sizeof(*remote) + engine->caps_size) {
+		error("Invalid %s capabilities", engine->name);
 		return FALSE;
 	}
 
-	if (supported->allocation_method & SBC_ALLOCATION_LOUDNESS)
-		cap->allocation_method = SBC_ALLOCATION_LOUDNESS;
-	else if (supported->allocation_method & SBC_ALLOCATION_SNR)
-		cap->allocation_method = SBC_ALLOCATION_SNR;
-
-	min_bitpool = MAX(MIN_BITPOOL, supported->min_bitpool);
-	max_bitpool = MIN(default_bitpool(cap->frequency, cap->channel_mode),
-							supported->max_bitpool);
-
-	cap->min_bitpool = min_bitpool;
-	cap->max_bitpool = max_bitpool;
-
-	return TRUE;
-}
-
-static gboolean select_capabilities(struct avdtp *session,
-					struct avdtp_remote_sep *rsep,
-					GSList **caps)
-{
-	struct avdtp_service_capability *media_transport, *media_codec;
-	struct sbc_codec_cap sbc_cap;
+	codec_caps = g_malloc0(sizeof(*codec_caps) + engine->caps_size);
+	codec_caps->media_type = AVDTP_MEDIA_TYPE_AUDIO;
+	codec_caps->media_codec_type = engine->type;
 
-	media_codec = avdtp_get_codec(rsep);
-	if (!media_codec)
+	err = engine->select_configuration(remote->data, codec_caps->data);
+	if (err < 0) {
+		error("No usable %s configuration: %s (%d)", engine->name,
+							strerror(-err), -err);
+		g_free(codec_caps);
 		return FALSE;
-
-	select_sbc_params(&sbc_cap, (struct sbc_codec_cap *) media_codec->data);
+	}
 
 	media_transport = avdtp_service_cap_new(AVDTP_MEDIA_TRANSPORT,
 						NULL, 0);
 
 	*caps = g_slist_append(*caps, media_transport);
 
-	media_codec = avdtp_service_cap_new(AVDTP_MEDIA_CODEC, &sbc_cap,
-						sizeof(sbc_cap));
+	media_codec = avdtp_service_cap_new(AVDTP_MEDIA_CODEC, codec_caps,
+					sizeof(*codec_caps) + engine->caps_size);
 
 	*caps = g_slist_append(*caps, media_codec);
+	g_free(codec_caps);
 
 	if (avdtp_get_delay_reporting(rsep)) {
 		struct avdtp_service_capability *delay_reporting;
@@ -0,0 +1,328 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include "at.h"
+
+#define AT_TRIE_NONE	-1
+
+/* Children of a node are kept as a linked list of siblings, there are
+ * only a handful of them below each node for AT commands */
+struct at_trie_node {
+	char c;
+	int child;
+	int next;
+	int id;
+};
+
+struct at_trie {
+	struct at_trie_node *nodes;
+	unsigned int n_nodes;
+};
+
+void at_buf_reset(struct at_buf *buf)
+{
+	buf->head = 0;
+	buf->len = 0;
+	buf->scanned = 0;
+}
+
+/* Returns the bytes read, -ENOBUFS if there is no room left because a
+ * line doesn't fit the ring */
+ssize_t at_buf_read(struct at_buf *buf, int fd)
+{
+	struct iovec iov[2];
+	unsigned int tail, space;
+	ssize_t ret;
+	int n_iov = 1;
+
+	space = AT_BUF_SIZE - buf->len;
+	if (space == 0)
+		return -ENOBUFS;
+
+	tail = (buf->head + buf->len) % AT_BUF_SIZE;
+
+	iov[0].iov_base = buf->data + tail;
+	iov[0].iov_len = MIN(space, AT_BUF_SIZE - tail);
+
+	if (iov[0].iov_len < space) {
+		iov[1].iov_base = buf->data;
+		iov[1].iov_len = space - iov[0].iov_len;
+		n_iov = 2;
+	}
+
+	ret = readv(fd, iov, n_iov);
+	if (ret < 0)
+		return -errno;
+
+	buf->len += ret;
+
+	return ret;
+}
+
+/* Returns the next complete line without its terminator or NULL. The
+ * line stays valid until the next at_buf_read(). Empty lines, e.g. the
+ * ones around result codes, are skipped. */
+char *at_buf_get_line(struct at_buf *buf)
+{
+	while (buf->scanned < buf->len) {
+		unsigned int end = buf->head + buf->scanned;
+		unsigned int len = buf->scanned;
+		char c, *line;
+
+		c = buf->data[end % AT_BUF_SIZE];
+		if (c != '\r' && c != '\n') {
+			buf->scanned++;
+			continue;
+		}
+
+		if (len == 0) {
+			buf->head = (buf->head + 1) % AT_BUF_SIZE;
+			buf->len--;
+			continue;
+		}
+
+		if (end <= AT_BUF_SIZE) {
+			line = buf->data + buf->head;
+			line[len] = '\0';
+		} else {
+			unsigned int first = AT_BUF_SIZE - buf->head;
+
+			line = buf->line;
+			memcpy(line, buf->data + buf->head, first);
+			memcpy(line + first, buf->data, len - first);
+			line[len] = '\0';
+		}
+
+		buf->head = (buf->head + len + 1) % AT_BUF_SIZE;
+		buf->len -= len + 1;
+		buf->scanned = 0;
+
+		return line;
+	}
+
+	return NULL;
+}
+
+struct at_trie *at_trie_new(void)
+{
+	struct at_trie *trie;
+
+	trie = g_new0(struct at_trie, 1);
+
+	/* The root matches the empty prefix */
+	trie->nodes = g_new0(struct at_trie_node, 1);
+	trie->nodes[0].child = AT_TRIE_NONE;
+	trie->nodes[0].next = AT_TRIE_NONE;
+	trie->nodes[0].id = AT_TRIE_NONE;
+	trie->n_nodes = 1;
+
+	return trie;
+}
+
+void at_trie_free(struct at_trie *trie)
+{
+	if (trie == NULL)
+		return;
+
+	g_free(trie->nodes);
+	g_free(trie);
+}
+
+static int find_child(const struct at_trie *trie, int node, char c)
+{
+	int i;
+
+	for (i = trie->nodes[node].child; i != AT_TRIE_NONE;
+						i = trie->nodes[i].next) {
+		if (trie->nodes[i].c == c)
+			return i;
+	}
+
+	return AT_TRIE_NONE;
+}
+
+int at_trie_add(struct at_trie *trie, const char *prefix, unsigned int id)
+{
+	int node = 0;
+
+	for (; *prefix; prefix++) {
+		struct at_trie_node *new;
+		int child;
+
+		child = find_child(trie, node, *prefix);
+		if (child != AT_TRIE_NONE) {
+			node = child;
+			continue;
+		}
+
+		trie->nodes = g_renew(struct at_trie_node, trie->nodes,
+							trie->n_nodes + 1);
+
+		new = &trie->nodes[trie->n_nodes];
+		new->c = *prefix;
+		new->child = AT_TRIE_NONE;
+		new->id = AT_TRIE_NONE;
+		new->next = trie->nodes[node].child;
+		trie->nodes[node].child = trie->n_nodes;
+
+		node = trie->n_nodes++;
+	}
+
+	if (trie->nodes[node].id != AT_TRIE_NONE)
+		return -EALREADY;
+
+	trie->nodes[node].id = id;
+
+	return 0;
+}
+
+/* Returns the id of the longest prefix matching the line, -ENOENT if
+ * there is none */
+int at_trie_lookup(const struct at_trie *trie, const char *line)
+{
+	int node = 0, id = AT_TRIE_NONE;
+
+	for (; *line; line++) {
+		node = find_child(trie, node, *line);
+		if (node == AT_TRIE_NONE)
+			break;
+
+		if (trie->nodes[node].id != AT_TRIE_NONE)
+			id = trie->nodes[node].id;
+	}
+
+	return id == AT_TRIE_NONE ? -ENOENT : id;
+}
+
+gboolean at_args_init(struct at_args *args, const char *line)
+{
+	const char *pos = strpbrk(line, "=:");
+
+	if (pos == NULL)
+		return FALSE;
+
+	args->pos = pos + 1;
+
+	return TRUE;
+}
+
+static void skip_spaces(struct at_args *args)
+{
+	while (*args->pos == ' ')
+		args->pos++;
+}
+
+/* Steps over the separator after an argument, fails if anything else
+ * follows it */
+static gboolean next_arg(struct at_args *args)
+{
+	skip_spaces(args);
+
+	if (*args->pos == ',') {
+		args->pos++;
+		return TRUE;
+	}
+
+	return *args->pos == '\0';
+}
+
+gboolean at_args_skip(struct at_args *args)
+{
+	gboolean quoted = FALSE;
+
+	skip_spaces(args);
+
+	for (; *args->pos; args->pos++) {
+		if (*args->pos == '"')
+			quoted = !quoted;
+		else if (*args->pos == ',' && !quoted)
+			break;
+	}
+
+	return next_arg(args);
+}
+
+gboolean at_args_int(struct at_args *args, int *val)
+{
+	char *end;
+	long ret;
+
+	skip_spaces(args);
+
+	ret = strtol(args->pos, &end, 10);
+	if (end == args->pos)
+		return FALSE;
+
+	args->pos = end;
+	*val = ret;
+
+	return next_arg(args);
+}
+
+/* Takes a quoted or a bare string, the quotes are removed */
+gboolean at_args_string(struct at_args *args, char *buf, size_t len)
+{
+	const char *start, *end;
+	size_t size;
+
+	skip_spaces(args);
+
+	if (*args->pos == '"') {
+		start = args->pos + 1;
+		end = strchr(start, '"');
+		if (end == NULL)
+			return FALSE;
+
+		args->pos = end + 1;
+	} else {
+		start = args->pos;
+		end = strchr(start, ',');
+		if (end == NULL)
+			end = start + strlen(start);
+
+		args->pos = end;
+	}
+
+	size = end - start;
+	if (size >= len)
+		return FALSE;
+
+	memcpy(buf, start, size);
+	buf[size] = '\0';
+
+	return next_arg(args);
+}
@@ -0,0 +1,60 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Lines longer than this are treated as garbage from the remote */
+#define AT_BUF_SIZE	1024
+
+/* Splits the byte stream of an RFCOMM channel into lines. Data is read
+ * straight into the ring and lines are handed out in place, only lines
+ * that wrap around the end of the ring are copied. */
+struct at_buf {
+	char data[AT_BUF_SIZE + 1];	/* One spare byte for a NUL */
+	char line[AT_BUF_SIZE];
+	unsigned int head;		/* Oldest byte not handed out */
+	unsigned int len;		/* Bytes in the ring */
+	unsigned int scanned;		/* Bytes searched for a terminator */
+};
+
+void at_buf_reset(struct at_buf *buf);
+ssize_t at_buf_read(struct at_buf *buf, int fd);
+char *at_buf_get_line(struct at_buf *buf);
+
+/* Maps command prefixes to ids with a single pass over the line */
+struct at_trie;
+
+struct at_trie *at_trie_new(void);
+void at_trie_free(struct at_trie *trie);
+int at_trie_add(struct at_trie *trie, const char *prefix, unsigned int id);
+int at_trie_lookup(const struct at_trie *trie, const char *line);
+
+/* Comma separated arguments after the '=' of a command or the ':' of
+ * a result code */
+struct at_args {
+	const char *pos;
+};
+
+gboolean at_args_init(struct at_args *args, const char *line);
+gboolean at_args_skip(struct at_args *args);
+gboolean at_args_int(struct at_args *args, int *val);
+gboolean at_args_string(struct at_args *args, char *buf, size_t len);
@@ -57,6 +57,9 @@
 
 #define QUIRK_NO_RELEASE 1 << 0
 
+/* Seconds a remote may hold a button without repeating the press */
+#define AVC_PRESS_TIMEOUT	2
+
 /* Message types */
 #define AVCTP_COMMAND		0
 #define AVCTP_RESPONSE		1
@@ -135,6 +138,9 @@ struct avctp {
 	uint16_t mtu;
 
 	uint8_t key_quirks[256];
+
+	uint16_t key_held;		/* uinput code of the held button */
+	guint key_timer;
 };
 
 struct avctp_pdu_handler {
@@ -159,31 +165,104 @@ static struct {
 	{ NULL }
 };
 
+/* Auto-repeat of held buttons, in msec. Unless configured the input
+ * layer defaults apply, a delay of 0 disables repeating. */
+static struct {
+	int delay;
+	int period;
+} key_repeat = { -1, -1 };
+
 static GSList *callbacks = NULL;
 static GSList *servers = NULL;
-static GSList *handlers = NULL;
+
+/* Indexed by AV/C opcode */
+static struct avctp_pdu_handler *handlers[256];
 
 static void auth_cb(DBusError *derr, void *user_data);
 
-static int send_event(int fd, uint16_t type, uint16_t code, int32_t value)
+static int queue_event(struct uinput_event *events, int n, uint16_t type,
+						uint16_t code, int32_t value)
 {
-	struct uinput_event event;
+	memset(&events[n], 0, sizeof(events[n]));
+	events[n].type	= type;
+	events[n].code	= code;
+	events[n].value	= value;
+
+	return n + 1;
+}
 
-	memset(&event, 0, sizeof(event));
-	event.type	= type;
-	event.code	= code;
-	event.value	= value;
+static int queue_key(struct uinput_event *events, int n, uint16_t key,
+								int pressed)
+{
+	n = queue_event(events, n, EV_KEY, key, pressed);
+
+	return queue_event(events, n, EV_SYN, SYN_REPORT, 0);
+}
+
+/* All events of a button go to uinput in a single write */
+static void send_events(int fd, const struct uinput_event *events, int n)
+{
+	if (fd < 0 || n == 0)
+		return;
 
-	return write(fd, &event, sizeof(event));
+	if (write(fd, events, n * sizeof(*events)) < 0)
+		error("Can't write uinput events: %s (%d)", strerror(errno),
+									errno);
 }
 
-static void send_key(int fd, uint16_t key, int pressed)
+static void release_held_key(struct avctp *session)
 {
-	if (fd < 0)
+	struct uinput_event events[2];
+	int n;
+
+	if (session->key_timer) {
+		g_source_remove(session->key_timer);
+		session->key_timer = 0;
+	}
+
+	if (session->key_held == 0)
 		return;
 
-	send_event(fd, EV_KEY, key, pressed);
-	send_event(fd, EV_SYN, SYN_REPORT, 0);
+	n = queue_key(events, 0, session->key_held, 0);
+	send_events(session->uinput, events, n);
+
+	session->key_held = 0;
+}
+
+static gboolean key_timeout(gpointer user_data)
+{
+	struct avctp *session = user_data;
+
+	DBG("AV/C: no press repeated, releasing the button");
+
+	session->key_timer = 0;
+	release_held_key(session);
+
+	return FALSE;
+}
+
+/* Repeats of a held button come from the input layer, the press PDUs a
+ * remote repeats while holding it only keep it held */
+static void hold_key(struct avctp *session, uint16_t key)
+{
+	struct uinput_event events[4];
+	int n = 0;
+
+	if (session->key_held != key) {
+		if (session->key_held != 0)
+			n = queue_key(events, n, session->key_held, 0);
+
+		n = queue_key(events, n, key, 1);
+		send_events(session->uinput, events, n);
+
+		session->key_held = key;
+	}
+
+	if (session->key_timer)
+		g_source_remove(session->key_timer);
+
+	session->key_timer = g_timeout_add_seconds(AVC_PRESS_TIMEOUT,
+							key_timeout, session);
 }
 
 static size_t handle_panel_passthrough(struct avctp *session,
@@ -191,8 +270,9 @@ static size_t handle_panel_passthrough(struct avctp *session,
 					uint8_t *subunit, uint8_t *operands,
 					size_t operand_count, void *user_data)
 {
+	struct uinput_event events[4];
 	const char *status;
-	int pressed, i;
+	int pressed, i, n;
 
 	if (*code != AVC_CTYPE_CONTROL || *subunit != AVC_SUBUNIT_PANEL) {
 		*code = AVC_CTYPE_REJECTED;
@@ -227,12 +307,21 @@ static size_t handle_panel_passthrough(struct avctp *session,
 			}
 
 			DBG("AV/C: treating key press as press + release");
-			send_key(session->uinput, key_map[i].uinput, 1);
-			send_key(session->uinput, key_map[i].uinput, 0);
+			n = queue_key(events, 0, key_map[i].uinput, 1);
+			n = queue_key(events, n, key_map[i].uinput, 0);
+			send_events(session->uinput, events, n);
 			break;
 		}
 
-		send_key(session->uinput, key_map[i].uinput, pressed);
+		if (pressed)
+			hold_key(session, key_map[i].uinput);
+		else if (session->key_held == key_map[i].uinput)
+			release_held_key(session);
+		else {
+			n = queue_key(events, 0, key_map[i].uinput, 0);
+			send_events(session->uinput, events, n);
+		}
+
 		break;
 	}
 
@@ -295,18 +384,6 @@ static size_t handle_subunit_info(struct avctp *session,
 	return 0;
 }
 
-static struct avctp_pdu_handler *find_handler(GSList *list, uint8_t opcode)
-{
-	for (; list; list = list->next) {
-		struct avctp_pdu_handler *handler = list->data;
-
-		if (handler->opcode == opcode)
-			return handler;
-	}
-
-	return NULL;
-}
-
 static void avctp_disconnected(struct avctp *session)
 {
 	struct avctp_server *server = session->server;
@@ -334,6 +411,8 @@ static void avctp_disconnected(struct avctp *session)
 		}
 	}
 
+	release_held_key(session);
+
 	if (session->uinput >= 0) {
 		char address[18];
 
@@ -462,7 +541,7 @@ static gboolean session_cb(GIOChannel *chan, GIOCondition cond,
 		goto done;
 	}
 
-	handler = find_handler(handlers, avc->opcode);
+	handler = handlers[avc->opcode];
 	if (!handler) {
 		DBG("handler not found for 0x%02x", avc->opcode);
 		packet_size += avrcp_handle_vendor_reject(&code, operands);
@@ -531,7 +610,8 @@ static int uinput_create(char *name)
 
 	ioctl(fd, UI_SET_EVBIT, EV_KEY);
 	ioctl(fd, UI_SET_EVBIT, EV_REL);
-	ioctl(fd, UI_SET_EVBIT, EV_REP);
+	if (key_repeat.delay != 0)
+		ioctl(fd, UI_SET_EVBIT, EV_REP);
 	ioctl(fd, UI_SET_EVBIT, EV_SYN);
 
 	for (i = 0; key_map[i].name != NULL; i++)
@@ -545,6 +625,18 @@ static int uinput_create(char *name)
 		return err;
 	}
 
+	if (key_repeat.delay > 0) {
+		struct uinput_event events[3];
+		int n;
+
+		n = queue_event(events, 0, EV_REP, REP_DELAY,
+							key_repeat.delay);
+		n = queue_event(events, n, EV_REP, REP_PERIOD,
+							key_repeat.period);
+		n = queue_event(events, n, EV_SYN, SYN_REPORT, 0);
+		send_events(fd, events, n);
+	}
+
 	return fd;
 }
 
@@ -964,8 +1056,7 @@ unsigned int avctp_register_pdu_handler(uint8_t opcode, avctp_pdu_cb cb,
 	struct avctp_pdu_handler *handler;
 	static unsigned int id = 0;
 
-	handler = find_handler(handlers, opcode);
-	if (handler)
+	if (handlers[opcode])
 		return 0;
 
 	handler = g_new(struct avctp_pdu_handler, 1);
@@ -974,20 +1065,20 @@ unsigned int avctp_register_pdu_handler(uint8_t opcode, avctp_pdu_cb cb,
 	handler->user_data = user_data;
 	handler->id = ++id;
 
-	handlers = g_slist_append(handlers, handler);
+	handlers[opcode] = handler;
 
 	return handler->id;
 }
 
 gboolean avctp_unregister_pdu_handler(unsigned int id)
 {
-	GSList *l;
+	unsigned int i;
 
-	for (l = handlers; l != NULL; l = l->next) {
-		struct avctp_pdu_handler *handler = l->data;
+	for (i = 0; i < G_N_ELEMENTS(handlers); i++) {
+		struct avctp_pdu_handler *handler = handlers[i];
 
-		if (handler->id == id) {
-			handlers = g_slist_remove(handlers, handler);
+		if (handler && handler->id == id) {
+			handlers[i] = NULL;
 			g_free(handler);
 			return TRUE;
 		}
@@ -996,6 +1087,12 @@ gboolean avctp_unregister_pdu_handler(unsigned int id)
 	return FALSE;
 }
 
+void avctp_set_key_repeat(int delay, int period)
+{
+	key_repeat.delay = delay;
+	key_repeat.period = period;
+}
+
 struct avctp *avctp_connect(const bdaddr_t *src, const bdaddr_t *dst)
 {
 	struct avctp *session;
@@ -84,6 +84,7 @@ gboolean avctp_remove_state_cb(unsigned int id);
 
 int avctp_register(const bdaddr_t *src, gboolean master);
 void avctp_unregister(const bdaddr_t *src);
+void avctp_set_key_repeat(int delay, int period);
 
 struct avctp *avctp_connect(const bdaddr_t *src, const bdaddr_t *dst);
 struct avctp *avctp_get(const bdaddr_t *src, const bdaddr_t *dst);
@@ -93,6 +93,7 @@
 #define ABORT_TIMEOUT 2
 #define DISCONNECT_TIMEOUT 1
 #define STREAM_TIMEOUT 20
+#define SEP_CACHE_SIZE 8
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
@@ -329,9 +330,18 @@ struct avdtp_remote_sep {
 struct avdtp_server {
 	bdaddr_t src;
 	uint16_t version;
+	gboolean low_latency;	/* Default for new streams */
 	GIOChannel *io;
 	GSList *seps;
 	GSList *sessions;
+	GSList *sep_cache;	/* Elements of type struct sep_cache * */
+};
+
+/* Remote SEPs of a device kept after its session is gone, so that the
+ * next session can skip discovery. Most recently used entry last. */
+struct sep_cache {
+	bdaddr_t dst;
+	GSList *seps;
 };
 
 struct avdtp_local_sep {
@@ -379,6 +389,8 @@ struct avdtp_stream {
 	gboolean delay_reporting;
 	uint16_t delay;		/* AVDTP 1.3 Delay Reporting feature */
 	gboolean starting;	/* only valid while sep state == OPEN */
+	gboolean low_latency;	/* Keep as little as possible queued */
+	int send_buffer_size;	/* Send buffer outside low latency mode */
 };
 
 /* Structure describing an AVDTP connection between two devices */
@@ -429,6 +441,10 @@ struct avdtp {
 	/* Attempt stream setup instead of disconnecting */
 	gboolean stream_setup;
 
+	/* Remote SEPs came from the cache and may be out of date */
+	gboolean seps_cached;
+	gboolean seps_stale;
+
 	DBusPendingCall *pending_auth;
 };
 
@@ -438,6 +454,9 @@ static GSList *avdtp_callbacks = NULL;
 
 static gboolean auto_connect = TRUE;
 
+/* Seconds an idle signalling channel is kept before disconnecting */
+static unsigned int idle_timeout = DISCONNECT_TIMEOUT;
+
 static int send_request(struct avdtp *session, gboolean priority,
 			struct avdtp_stream *stream, uint8_t signal_id,
 			void *buffer, size_t size);
@@ -686,6 +705,11 @@ static void remove_disconnect_timer(struct avdtp *session)
 
 static void set_disconnect_timer(struct avdtp *session)
 {
+	unsigned int timeout;
+
+	/* Waiting for the remote to set up a stream is not idling */
+	timeout = session->stream_setup ? DISCONNECT_TIMEOUT : idle_timeout;
+
 	if (session->dc_timer)
 		remove_disconnect_timer(session);
 
@@ -694,7 +718,7 @@ static void set_disconnect_timer(struct avdtp *session)
 		return;
 	}
 
-	session->dc_timer = g_timeout_add_seconds(DISCONNECT_TIMEOUT,
+	session->dc_timer = g_timeout_add_seconds(timeout,
 						disconnect_timeout,
 						session);
 }
@@ -755,6 +779,14 @@ static struct avdtp_remote_sep *find_remote_sep(GSList *seps, uint8_t seid)
 	return NULL;
 }
 
+static void remote_sep_free(void *data)
+{
+	struct avdtp_remote_sep *sep = data;
+
+	g_slist_free_full(sep->caps, g_free);
+	g_free(sep);
+}
+
 static void avdtp_set_state(struct avdtp *session,
 					avdtp_session_state_t new_state)
 {
@@ -927,6 +959,15 @@ static void handle_transport_connect(struct avdtp *session, GIOChannel *io,
 		DBG("send buffer size to be increassed to %d",
 				min_buf_size);
 		set_send_buffer_size(sk, min_buf_size);
+		buf_size = min_buf_size;
+	}
+
+	stream->send_buffer_size = buf_size;
+
+	/* Anything queued beyond a couple of packets is pure latency */
+	if (stream->low_latency) {
+		DBG("low latency, send buffer size %d", min_buf_size);
+		set_send_buffer_size(sk, min_buf_size);
 	}
 
 proceed:
@@ -1196,6 +1237,83 @@ static void connection_lost(struct avdtp *session, int err)
 		avdtp_unref(session);
 }
 
+static void sep_cache_free(void *data)
+{
+	struct sep_cache *cache = data;
+
+	g_slist_free_full(cache->seps, remote_sep_free);
+	g_free(cache);
+}
+
+static struct sep_cache *sep_cache_find(struct avdtp_server *server,
+							const bdaddr_t *dst)
+{
+	GSList *l;
+
+	for (l = server->sep_cache; l != NULL; l = g_slist_next(l)) {
+		struct sep_cache *cache = l->data;
+
+		if (bacmp(&cache->dst, dst) == 0)
+			return cache;
+	}
+
+	return NULL;
+}
+
+static void sep_cache_store(struct avdtp *session)
+{
+	struct avdtp_server *server = session->server;
+	struct sep_cache *cache;
+	GSList *l;
+
+	cache = sep_cache_find(server, &session->dst);
+	if (cache) {
+		server->sep_cache = g_slist_remove(server->sep_cache, cache);
+		sep_cache_free(cache);
+	}
+
+	if (session->seps == NULL)
+		return;
+
+	for (l = session->seps; l != NULL; l = g_slist_next(l)) {
+		struct avdtp_remote_sep *sep = l->data;
+
+		sep->stream = NULL;
+	}
+
+	cache = g_new0(struct sep_cache, 1);
+	bacpy(&cache->dst, &session->dst);
+	cache->seps = session->seps;
+	session->seps = NULL;
+
+	server->sep_cache = g_slist_append(server->sep_cache, cache);
+
+	if (g_slist_length(server->sep_cache) > SEP_CACHE_SIZE) {
+		cache = server->sep_cache->data;
+		server->sep_cache = g_slist_remove(server->sep_cache, cache);
+		sep_cache_free(cache);
+	}
+}
+
+static void sep_cache_restore(struct avdtp *session)
+{
+	struct avdtp_server *server = session->server;
+	struct sep_cache *cache;
+
+	cache = sep_cache_find(server, &session->dst);
+	if (cache == NULL)
+		return;
+
+	server->sep_cache = g_slist_remove(server->sep_cache, cache);
+
+	DBG("%u cached remote seps", g_slist_length(cache->seps));
+
+	session->seps = cache->seps;
+	session->seps_cached = TRUE;
+
+	g_free(cache);
+}
+
 void avdtp_unref(struct avdtp *session)
 {
 	struct avdtp_server *server;
@@ -1240,7 +1358,11 @@ void avdtp_unref(struct avdtp *session)
 	if (session->req)
 		pending_req_free(session->req);
 
-	g_slist_free_full(session->seps, g_free);
+	/* Stale SEPs are dropped here so the next session rediscovers */
+	if (!session->seps_stale)
+		sep_cache_store(session);
+
+	g_slist_free_full(session->seps, remote_sep_free);
 
 	g_free(session->buf);
 
@@ -1533,6 +1655,7 @@ static gboolean avdtp_setconf_cmd(struct avdtp *session, uint8_t transaction,
 	stream->session = session;
 	stream->lsep = sep;
 	stream->rseid = req->int_seid;
+	stream->low_latency = session->server->low_latency;
 	stream->caps = caps_to_list(req->caps,
 					size - sizeof(struct setconf_req),
 					&stream->codec,
@@ -2314,6 +2437,8 @@ static struct avdtp *avdtp_get_internal(const bdaddr_t *src, const bdaddr_t *dst
 
 	session->version = get_version(session);
 
+	sep_cache_restore(session);
+
 	server->sessions = g_slist_append(server->sessions, session);
 
 	return session;
@@ -2731,6 +2856,23 @@ static int send_request(struct avdtp *session, gboolean priority,
 	return send_req(session, priority, req);
 }
 
+static void remove_idle_remote_seps(struct avdtp *session)
+{
+	GSList *l, *next;
+
+	for (l = session->seps; l != NULL; l = next) {
+		struct avdtp_remote_sep *sep = l->data;
+
+		next = g_slist_next(l);
+
+		if (sep->stream)
+			continue;
+
+		session->seps = g_slist_delete_link(session->seps, l);
+		remote_sep_free(sep);
+	}
+}
+
 static gboolean avdtp_discover_resp(struct avdtp *session,
 					struct discover_resp *resp, int size)
 {
@@ -2739,6 +2881,13 @@ static gboolean avdtp_discover_resp(struct avdtp *session,
 	int ret = 0;
 	gboolean getcap_pending = FALSE;
 
+	/* The response replaces whatever was known, cached or not, except
+	 * for SEPs still referenced by a stream */
+	remove_idle_remote_seps(session);
+
+	session->seps_cached = FALSE;
+	session->seps_stale = FALSE;
+
 	if (session->version >= 0x0103 && session->server->version >= 0x0103)
 		getcap_cmd = AVDTP_GET_ALL_CAPABILITIES;
 	else
@@ -3086,6 +3235,10 @@ static gboolean avdtp_parse_rej(struct avdtp *session,
 			return FALSE;
 		error("SET_CONFIGURATION request rejected: %s (%d)",
 				avdtp_strerror(&err), err.err.error_code);
+		if (session->seps_cached) {
+			DBG("Rejected with cached seps, rediscover next time");
+			session->seps_stale = TRUE;
+		}
 		if (sep && sep->cfm && sep->cfm->set_configuration)
 			sep->cfm->set_configuration(session, sep, stream,
 							&err, sep->user_data);
@@ -3173,6 +3326,29 @@ gboolean avdtp_is_connected(const bdaddr_t *src, const bdaddr_t *dst)
 	return FALSE;
 }
 
+void avdtp_stream_set_low_latency(struct avdtp_stream *stream,
+							gboolean enable)
+{
+	int sk, size;
+
+	if (stream->low_latency == enable)
+		return;
+
+	stream->low_latency = enable;
+
+	/* Applied when the transport connects otherwise */
+	if (stream->io == NULL || stream->send_buffer_size == 0)
+		return;
+
+	sk = g_io_channel_unix_get_fd(stream->io);
+	size = enable ? stream->omtu * 2 : stream->send_buffer_size;
+
+	DBG("stream %p low latency %s, send buffer size %d", stream,
+					enable ? "on" : "off", size);
+
+	set_send_buffer_size(sk, size);
+}
+
 struct avdtp_service_capability *avdtp_stream_get_codec(
 						struct avdtp_stream *stream)
 {
@@ -3346,7 +3522,9 @@ int avdtp_discover(struct avdtp *session, avdtp_discover_cb_t cb,
 	if (session->discov_cb)
 		return -EBUSY;
 
-	if (session->seps) {
+	/* Cached SEPs are trusted until the remote rejects a configuration
+	 * based on them, then the next call goes to the remote again */
+	if (session->seps && !session->seps_stale) {
 		session->discov_cb = cb;
 		session->user_data = user_data;
 		g_idle_add(process_discover, session);
@@ -3458,6 +3636,7 @@ int avdtp_set_configuration(struct avdtp *session,
 	new_stream->session = session;
 	new_stream->lsep = lsep;
 	new_stream->rseid = rsep->seid;
+	new_stream->low_latency = session->server->low_latency;
 
 	if (rsep->delay_reporting && lsep->delay_reporting) {
 		struct avdtp_service_capability *delay_reporting;
@@ -3834,7 +4013,8 @@ void avdtp_get_peers(struct avdtp *session, bdaddr_t *src, bdaddr_t *dst)
 int avdtp_init(const bdaddr_t *src, GKeyFile *config, uint16_t *version)
 {
 	GError *err = NULL;
-	gboolean tmp, master = TRUE;
+	gboolean tmp, master = TRUE, low_latency = FALSE;
+	int timeout;
 	struct avdtp_server *server;
 	uint16_t ver = 0x0102;
 
@@ -3859,12 +4039,22 @@ int avdtp_init(const bdaddr_t *src, GKeyFile *config, uint16_t *version)
 	if (g_key_file_get_boolean(config, "A2DP", "DelayReporting", NULL))
 		ver = 0x0103;
 
+	low_latency = g_key_file_get_boolean(config, "A2DP", "LowLatency",
+									NULL);
+
+	timeout = g_key_file_get_integer(config, "A2DP", "IdleTimeout", &err);
+	if (err)
+		g_clear_error(&err);
+	else if (timeout > 0)
+		idle_timeout = timeout;
+
 proceed:
 	server = g_new0(struct avdtp_server, 1);
 	if (!server)
 		return -ENOMEM;
 
 	server->version = ver;
+	server->low_latency = low_latency;
 
 	if (version)
 		*version = server->version;
@@ -3905,6 +4095,8 @@ void avdtp_exit(const bdaddr_t *src)
 
 	servers = g_slist_remove(servers, server);
 
+	g_slist_free_full(server->sep_cache, sep_cache_free);
+
 	g_io_channel_shutdown(server->io, TRUE, NULL);
 	g_io_channel_unref(server->io);
 	g_free(server);
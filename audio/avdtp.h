@@ -251,6 +251,8 @@ gboolean avdtp_stream_remove_cb(struct avdtp *session,
 gboolean avdtp_stream_get_transport(struct avdtp_stream *stream, int *sock,
 					uint16_t *imtu, uint16_t *omtu,
 					GSList **caps);
+void avdtp_stream_set_low_latency(struct avdtp_stream *stream,
+							gboolean enable);
 struct avdtp_service_capability *avdtp_stream_get_codec(
 						struct avdtp_stream *stream);
 gboolean avdtp_stream_has_capability(struct avdtp_stream *stream,
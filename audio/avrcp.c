@@ -137,10 +137,27 @@ struct avrcp_server {
 	struct avrcp_player *active_player;
 };
 
+struct media_attribute_header {
+	uint32_t id;
+	uint16_t charset;
+	uint16_t len;
+} __attribute__ ((packed));
+
 struct pending_pdu {
 	uint8_t pdu_id;
-	GList *attr_ids;
-	uint16_t offset;
+	unsigned int offset;		/* Into the cached response */
+};
+
+/* Encoded GetElementAttributes entries of the current track. Kept until
+ * the track changes so that polling controllers are answered, and the
+ * fragments of long responses sent, without asking the player again. */
+struct metadata_cache {
+	GByteArray *attrs[AVRCP_MEDIA_ATTRIBUTE_LAST + 1];
+	gboolean valid;			/* response answers request */
+	GByteArray *request;		/* Attribute list of the last request */
+	GByteArray *response;		/* Entries answering it */
+	GArray *entries;		/* Offset of each entry in response */
+	uint8_t count;
 };
 
 struct avrcp_player {
@@ -150,8 +167,13 @@ struct avrcp_player {
 
 	unsigned int handler;
 	uint16_t registered_events;
+	uint16_t changed_events;
+	uint8_t changed_order[AVRCP_EVENT_LAST];	/* Arrival order */
+	uint8_t n_changed;
+	guint changed_id;
 	uint8_t transaction_events[AVRCP_EVENT_LAST + 1];
 	struct pending_pdu *pending_pdu;
+	struct metadata_cache metadata;
 
 	struct avrcp_player_cb *cb;
 	void *user_data;
@@ -350,19 +372,45 @@ static void set_company_id(uint8_t cid[3], const uint32_t cid_in)
 	cid[2] = cid_in;
 }
 
-int avrcp_player_event(struct avrcp_player *player, uint8_t id, void *data)
+static void metadata_cache_invalidate(struct metadata_cache *cache)
+{
+	unsigned int i;
+
+	for (i = 0; i <= AVRCP_MEDIA_ATTRIBUTE_LAST; i++) {
+		if (cache->attrs[i] == NULL)
+			continue;
+
+		g_byte_array_free(cache->attrs[i], TRUE);
+		cache->attrs[i] = NULL;
+	}
+
+	cache->valid = FALSE;
+}
+
+static void metadata_cache_free(struct metadata_cache *cache)
+{
+	metadata_cache_invalidate(cache);
+
+	if (cache->request)
+		g_byte_array_free(cache->request, TRUE);
+
+	if (cache->response)
+		g_byte_array_free(cache->response, TRUE);
+
+	if (cache->entries)
+		g_array_free(cache->entries, TRUE);
+
+	memset(cache, 0, sizeof(*cache));
+}
+
+static int player_send_event(struct avrcp_player *player, uint8_t id)
 {
 	uint8_t buf[AVRCP_HEADER_LENGTH + 9];
 	struct avrcp_header *pdu = (void *) buf;
 	uint16_t size;
+	uint64_t uid;
 	int err;
 
-	if (player->session == NULL)
-		return -ENOTCONN;
-
-	if (!(player->registered_events & (1 << id)))
-		return 0;
-
 	memset(buf, 0, sizeof(buf));
 
 	set_company_id(pdu->company_id, IEEEID_BTSIG);
@@ -375,21 +423,18 @@ int avrcp_player_event(struct avrcp_player *player, uint8_t id, void *data)
 	switch (id) {
 	case AVRCP_EVENT_STATUS_CHANGED:
 		size = 2;
-		pdu->params[1] = *((uint8_t *)data);
+		pdu->params[1] = player->cb->get_status(player->user_data);
 
 		break;
 	case AVRCP_EVENT_TRACK_CHANGED:
 		size = 9;
-		memcpy(&pdu->params[1], data, sizeof(uint64_t));
+		uid = player->cb->get_uid(player->user_data);
+		memcpy(&pdu->params[1], &uid, sizeof(uint64_t));
 
 		break;
-	case AVRCP_EVENT_TRACK_REACHED_END:
-	case AVRCP_EVENT_TRACK_REACHED_START:
+	default:
 		size = 1;
 		break;
-	default:
-		error("Unknown event %u", id);
-		return -EINVAL;
 	}
 
 	pdu->params_len = htons(size);
@@ -406,95 +451,232 @@ int avrcp_player_event(struct avrcp_player *player, uint8_t id, void *data)
 	return 0;
 }
 
-static uint16_t player_write_media_attribute(struct avrcp_player *player,
-						uint32_t id, uint8_t *buf,
-						uint16_t *pos,
-						uint16_t *offset)
+static gboolean player_send_changed(gpointer user_data)
 {
-	uint16_t len;
-	uint16_t attr_len;
+	struct avrcp_player *player = user_data;
+	uint8_t order[AVRCP_EVENT_LAST];
+	uint8_t i, n = player->n_changed;
+
+	memcpy(order, player->changed_order, n);
+
+	player->changed_id = 0;
+	player->changed_events = 0;
+	player->n_changed = 0;
+
+	if (player->session == NULL)
+		return FALSE;
+
+	/* In the order the events first happened, e.g. the end of a track
+	 * is reported before the change to the next one */
+	for (i = 0; i < n; i++) {
+		uint8_t id = order[i];
+		int err;
+
+		if (!(player->registered_events & (1 << id)))
+			continue;
+
+		err = player_send_event(player, id);
+		if (err < 0)
+			error("Unable to notify event %u: %s (%d)", id,
+							strerror(-err), -err);
+	}
+
+	return FALSE;
+}
+
+/* The CHANGED responses go out from the main loop with the state the
+ * player has by then, so a burst of changes costs one per event */
+int avrcp_player_event(struct avrcp_player *player, uint8_t id, void *data)
+{
+	if (id == AVRCP_EVENT_TRACK_CHANGED)
+		metadata_cache_invalidate(&player->metadata);
+
+	if (player->session == NULL)
+		return -ENOTCONN;
+
+	switch (id) {
+	case AVRCP_EVENT_STATUS_CHANGED:
+	case AVRCP_EVENT_TRACK_CHANGED:
+	case AVRCP_EVENT_TRACK_REACHED_END:
+	case AVRCP_EVENT_TRACK_REACHED_START:
+		break;
+	default:
+		error("Unknown event %u", id);
+		return -EINVAL;
+	}
+
+	if (!(player->registered_events & (1 << id)))
+		return 0;
+
+	if (!(player->changed_events & (1 << id))) {
+		player->changed_events |= 1 << id;
+		player->changed_order[player->n_changed++] = id;
+	}
+
+	if (player->changed_id == 0)
+		player->changed_id = g_idle_add(player_send_changed, player);
+
+	return 0;
+}
+
+static GByteArray *player_get_media_attribute(struct avrcp_player *player,
+								uint32_t id)
+{
+	struct metadata_cache *cache = &player->metadata;
+	struct media_attribute_header hdr;
+	GByteArray *entry;
 	char valstr[20];
 	void *value;
+	uint16_t len;
+
+	if (cache->attrs[id] != NULL)
+		return cache->attrs[id];
 
 	DBG("%u", id);
 
 	value = player->cb->get_metadata(id, player->user_data);
-	if (value == NULL) {
-		*offset = 0;
-		return 0;
-	}
+	if (value != NULL) {
+		switch (id) {
+		case AVRCP_MEDIA_ATTRIBUTE_TRACK:
+		case AVRCP_MEDIA_ATTRIBUTE_N_TRACKS:
+		case AVRCP_MEDIA_ATTRIBUTE_DURATION:
+			snprintf(valstr, 20, "%u", GPOINTER_TO_UINT(value));
+			value = valstr;
+			break;
+		}
 
-	switch (id) {
-	case AVRCP_MEDIA_ATTRIBUTE_TRACK:
-	case AVRCP_MEDIA_ATTRIBUTE_N_TRACKS:
-	case AVRCP_MEDIA_ATTRIBUTE_DURATION:
-		snprintf(valstr, 20, "%u", GPOINTER_TO_UINT(value));
-		value = valstr;
-		break;
+		len = strlen(value);
+	} else
+		len = 0;
+
+	hdr.id = htonl(id);
+	hdr.charset = htons(0x6A); /* Always use UTF-8 */
+	hdr.len = htons(len);
+
+	entry = g_byte_array_sized_new(sizeof(hdr) + len);
+	g_byte_array_append(entry, (guint8 *) &hdr, sizeof(hdr));
+	g_byte_array_append(entry, value, len);
+
+	cache->attrs[id] = entry;
+
+	return entry;
+}
+
+static void player_add_media_attribute(struct avrcp_player *player,
+								uint32_t id)
+{
+	struct metadata_cache *cache = &player->metadata;
+	GByteArray *entry = player_get_media_attribute(player, id);
+	unsigned int offset = cache->response->len;
+
+	g_array_append_val(cache->entries, offset);
+	g_byte_array_append(cache->response, entry->data, entry->len);
+	cache->count++;
+}
+
+/* Encodes the response to the attribute list of a GetElementAttributes
+ * request, unless the cached one already answers it */
+static uint8_t player_fill_metadata(struct avrcp_player *player,
+					const uint8_t *request, uint16_t len)
+{
+	struct metadata_cache *cache = &player->metadata;
+	uint8_t nattr = request[0];
+	unsigned int i;
+
+	if (cache->valid && cache->request->len == len &&
+				memcmp(cache->request->data, request, len) == 0)
+		return cache->count;
+
+	if (cache->request == NULL) {
+		cache->request = g_byte_array_new();
+		cache->response = g_byte_array_new();
+		cache->entries = g_array_new(FALSE, FALSE,
+							sizeof(unsigned int));
 	}
 
-	attr_len = strlen(value);
-	value = ((char *) value) + *offset;
-	len = attr_len - *offset;
+	g_byte_array_set_size(cache->request, 0);
+	g_byte_array_append(cache->request, request, len);
+	g_byte_array_set_size(cache->response, 0);
+	g_array_set_size(cache->entries, 0);
+	cache->count = 0;
+
+	if (!nattr) {
+		/*
+		 * Return all available information, at least
+		 * title must be returned if there's a track selected.
+		 */
+		GList *attr_ids, *l;
+
+		attr_ids = player->cb->list_metadata(player->user_data);
+
+		for (l = attr_ids; l != NULL; l = l->next)
+			player_add_media_attribute(player,
+						GPOINTER_TO_UINT(l->data));
 
-	if (len > AVRCP_PDU_MTU - *pos) {
-		len = AVRCP_PDU_MTU - *pos;
-		*offset += len;
+		g_list_free(attr_ids);
 	} else {
-		*offset = 0;
+		const uint32_t *attr = (const void *) &request[1];
+
+		for (i = 0; i < nattr; i++, attr++) {
+			uint32_t id = ntohl(bt_get_unaligned(attr));
+
+			/* Don't add invalid attributes */
+			if (id == AVRCP_MEDIA_ATTRIBUTE_ILLEGAL ||
+					id > AVRCP_MEDIA_ATTRIBUTE_LAST)
+				continue;
+
+			player_add_media_attribute(player, id);
+		}
 	}
 
-	memcpy(&buf[*pos], value, len);
-	*pos += len;
+	cache->valid = TRUE;
 
-	return attr_len;
+	return cache->count;
 }
 
-static GList *player_fill_media_attribute(struct avrcp_player *player,
-					GList *attr_ids, uint8_t *buf,
-					uint16_t *pos, uint16_t *offset)
+/* Copies the cached response from offset on into buf, as much as fits in
+ * a PDU without cutting through an attribute header. Returns the new
+ * position in buf. */
+static uint16_t player_fill_media_attribute(struct avrcp_player *player,
+						uint8_t *buf, uint16_t pos,
+						unsigned int *offset)
 {
-	struct media_attribute_header {
-		uint32_t id;
-		uint16_t charset;
-		uint16_t len;
-	} *hdr = NULL;
-	GList *l;
-
-	for (l = attr_ids; l != NULL; l = g_list_delete_link(l, l)) {
-		uint32_t attr = GPOINTER_TO_UINT(l->data);
-		uint16_t attr_len;
-
-		if (*offset == 0) {
-			if (*pos + sizeof(*hdr) >= AVRCP_PDU_MTU)
-				break;
-
-			hdr = (void *) &buf[*pos];
-			hdr->id = htonl(attr);
-			hdr->charset = htons(0x6A); /* Always use UTF-8 */
-			*pos += sizeof(*hdr);
-		}
+	struct metadata_cache *cache = &player->metadata;
+	unsigned int end = *offset + AVRCP_PDU_MTU - pos;
+	unsigned int i;
 
-		attr_len = player_write_media_attribute(player, attr, buf,
-								pos, offset);
+	if (end >= cache->response->len) {
+		end = cache->response->len;
+		goto done;
+	}
 
-		if (hdr != NULL)
-			hdr->len = htons(attr_len);
+	for (i = 0; i < cache->entries->len; i++) {
+		unsigned int start = g_array_index(cache->entries,
+							unsigned int, i);
+
+		if (start >= end)
+			break;
 
-		if (*offset > 0)
+		if (end <= start + sizeof(struct media_attribute_header)) {
+			end = start;
 			break;
+		}
 	}
 
-	return l;
+done:
+	memcpy(&buf[pos], cache->response->data + *offset, end - *offset);
+	pos += end - *offset;
+	*offset = end;
+
+	return pos;
 }
 
-static struct pending_pdu *pending_pdu_new(uint8_t pdu_id, GList *attr_ids,
+static struct pending_pdu *pending_pdu_new(uint8_t pdu_id,
 							unsigned int offset)
 {
 	struct pending_pdu *pending = g_new(struct pending_pdu, 1);
 
 	pending->pdu_id = pdu_id;
-	pending->attr_ids = attr_ids;
 	pending->offset = offset;
 
 	return pending;
@@ -505,7 +687,6 @@ static gboolean player_abort_pending_pdu(struct avrcp_player *player)
 	if (player->pending_pdu == NULL)
 		return FALSE;
 
-	g_list_free(player->pending_pdu->attr_ids);
 	g_free(player->pending_pdu);
 	player->pending_pdu = NULL;
 
@@ -641,8 +822,7 @@ static uint8_t avrcp_handle_get_element_attributes(struct avrcp_player *player,
 	uint64_t *identifier = (uint64_t *) &pdu->params[0];
 	uint16_t pos;
 	uint8_t nattr;
-	GList *attr_ids;
-	uint16_t offset;
+	unsigned int offset;
 
 	if (len < 9 || *identifier != 0)
 		goto err;
@@ -652,49 +832,22 @@ static uint8_t avrcp_handle_get_element_attributes(struct avrcp_player *player,
 	if (len < nattr * sizeof(uint32_t) + 1)
 		goto err;
 
-	if (!nattr) {
-		/*
-		 * Return all available information, at least
-		 * title must be returned if there's a track selected.
-		 */
-		attr_ids = player->cb->list_metadata(player->user_data);
-		len = g_list_length(attr_ids);
-	} else {
-		unsigned int i;
-		uint32_t *attr = (uint32_t *) &pdu->params[9];
-
-		for (i = 0, len = 0, attr_ids = NULL; i < nattr; i++, attr++) {
-			uint32_t id = ntohl(bt_get_unaligned(attr));
-
-			/* Don't add invalid attributes */
-			if (id == AVRCP_MEDIA_ATTRIBUTE_ILLEGAL ||
-					id > AVRCP_MEDIA_ATTRIBUTE_LAST)
-				continue;
-
-			len++;
-			attr_ids = g_list_prepend(attr_ids,
-							GUINT_TO_POINTER(id));
-		}
-
-		attr_ids = g_list_reverse(attr_ids);
-	}
+	player_abort_pending_pdu(player);
 
-	if (!len)
+	nattr = player_fill_metadata(player, &pdu->params[8],
+					1 + nattr * sizeof(uint32_t));
+	if (!nattr)
 		goto err;
 
-	player_abort_pending_pdu(player);
-	pos = 1;
 	offset = 0;
-	attr_ids = player_fill_media_attribute(player, attr_ids, pdu->params,
-								&pos, &offset);
+	pos = player_fill_media_attribute(player, pdu->params, 1, &offset);
 
-	if (attr_ids != NULL) {
-		player->pending_pdu = pending_pdu_new(pdu->pdu_id, attr_ids,
-								offset);
+	if (offset < player->metadata.response->len) {
+		player->pending_pdu = pending_pdu_new(pdu->pdu_id, offset);
 		pdu->packet_type = AVRCP_PACKET_TYPE_START;
 	}
 
-	pdu->params[0] = len;
+	pdu->params[0] = nattr;
 	pdu->params_len = htons(pos);
 
 	return AVC_CTYPE_STABLE;
@@ -944,14 +1097,11 @@ static uint8_t avrcp_handle_request_continuing(struct avrcp_player *player,
 		goto err;
 
 
-	len = 0;
-	pending->attr_ids = player_fill_media_attribute(player,
-							pending->attr_ids,
-							pdu->params, &len,
+	len = player_fill_media_attribute(player, pdu->params, 0,
 							&pending->offset);
 	pdu->pdu_id = pending->pdu_id;
 
-	if (pending->attr_ids == NULL) {
+	if (pending->offset == player->metadata.response->len) {
 		g_free(player->pending_pdu);
 		player->pending_pdu = NULL;
 		pdu->packet_type = AVRCP_PACKET_TYPE_END;
@@ -1033,6 +1183,9 @@ static struct pdu_handler {
 		{ },
 };
 
+/* PDU ID to handler, filled from handlers on the first registration */
+static struct pdu_handler *pdu_handlers[AVRCP_ABORT_CONTINUING + 1];
+
 /* handle vendordep pdu inside an avctp packet */
 static size_t handle_vendordep_pdu(struct avctp *session, uint8_t transaction,
 					uint8_t *code, uint8_t *subunit,
@@ -1060,10 +1213,10 @@ static size_t handle_vendordep_pdu(struct avctp *session, uint8_t transaction,
 		goto err_metadata;
 	}
 
-	for (handler = handlers; handler; handler++) {
-		if (handler->pdu_id == pdu->pdu_id)
-			break;
-	}
+	if (pdu->pdu_id < G_N_ELEMENTS(pdu_handlers))
+		handler = pdu_handlers[pdu->pdu_id];
+	else
+		handler = NULL;
 
 	if (!handler || handler->code != *code) {
 		pdu->params[0] = E_INVALID_COMMAND;
@@ -1184,6 +1337,7 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 {
 	sdp_record_t *record;
 	gboolean tmp, master = TRUE;
+	int delay = -1, period = -1;
 	GError *err = NULL;
 	struct avrcp_server *server;
 
@@ -1192,9 +1346,34 @@ int avrcp_register(DBusConnection *conn, const bdaddr_t *src, GKeyFile *config)
 							"Master", &err);
 		if (err) {
 			DBG("audio.conf: %s", err->message);
-			g_error_free(err);
+			g_clear_error(&err);
 		} else
 			master = tmp;
+
+		delay = g_key_file_get_integer(config, "AVRCP",
+						"KeyRepeatDelay", &err);
+		if (err) {
+			DBG("audio.conf: %s", err->message);
+			g_clear_error(&err);
+			delay = -1;
+		}
+
+		period = g_key_file_get_integer(config, "AVRCP",
+						"KeyRepeatPeriod", &err);
+		if (err) {
+			DBG("audio.conf: %s", err->message);
+			g_clear_error(&err);
+			period = -1;
+		}
+	}
+
+	avctp_set_key_repeat(delay, period);
+
+	if (pdu_handlers[AVRCP_GET_CAPABILITIES] == NULL) {
+		struct pdu_handler *handler;
+
+		for (handler = handlers; handler->pdu_id; handler++)
+			pdu_handlers[handler->pdu_id] = handler;
 	}
 
 	server = g_new0(struct avrcp_server, 1);
@@ -1253,6 +1432,10 @@ static void player_destroy(gpointer data)
 		player->destroy(player->user_data);
 
 	player_abort_pending_pdu(player);
+	metadata_cache_free(&player->metadata);
+
+	if (player->changed_id)
+		g_source_remove(player->changed_id);
 
 	if (player->handler)
 		avctp_unregister_pdu_handler(player->handler);
@@ -0,0 +1,166 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2011  BMW Car IT GmbH. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+
+#include "a2dp-codecs.h"
+#include "codec.h"
+
+/* MPEG audio is only negotiated here, there's no encoder or RTP
+ * packetiser for it in the daemon so the engine has no streaming
+ * operations */
+
+static void mpeg_get_capabilities(void *caps)
+{
+	a2dp_mpeg_t *mpeg = caps;
+
+	memset(mpeg, 0, sizeof(*mpeg));
+
+	mpeg->frequency = ( MPEG_SAMPLING_FREQ_48000 |
+				MPEG_SAMPLING_FREQ_44100 |
+				MPEG_SAMPLING_FREQ_32000 |
+				MPEG_SAMPLING_FREQ_24000 |
+				MPEG_SAMPLING_FREQ_22050 |
+				MPEG_SAMPLING_FREQ_16000 );
+
+	mpeg->channel_mode = ( MPEG_CHANNEL_MODE_JOINT_STEREO |
+					MPEG_CHANNEL_MODE_STEREO |
+					MPEG_CHANNEL_MODE_DUAL_CHANNEL |
+					MPEG_CHANNEL_MODE_MONO );
+
+	mpeg->layer = ( MPEG_LAYER_MP3 | MPEG_LAYER_MP2 | MPEG_LAYER_MP1 );
+
+	mpeg->bitrate = 0xFFFF;
+}
+
+static int mpeg_select_configuration(const void *caps, void *config)
+{
+	const a2dp_mpeg_t *supported = caps;
+	a2dp_mpeg_t *mpeg = config;
+
+	memset(mpeg, 0, sizeof(*mpeg));
+
+	if (supported->layer & MPEG_LAYER_MP3)
+		mpeg->layer = MPEG_LAYER_MP3;
+	else if (supported->layer & MPEG_LAYER_MP2)
+		mpeg->layer = MPEG_LAYER_MP2;
+	else if (supported->layer & MPEG_LAYER_MP1)
+		mpeg->layer = MPEG_LAYER_MP1;
+	else
+		return -EINVAL;
+
+	if (supported->frequency & MPEG_SAMPLING_FREQ_44100)
+		mpeg->frequency = MPEG_SAMPLING_FREQ_44100;
+	else if (supported->frequency & MPEG_SAMPLING_FREQ_48000)
+		mpeg->frequency = MPEG_SAMPLING_FREQ_48000;
+	else if (supported->frequency & MPEG_SAMPLING_FREQ_32000)
+		mpeg->frequency = MPEG_SAMPLING_FREQ_32000;
+	else if (supported->frequency & MPEG_SAMPLING_FREQ_24000)
+		mpeg->frequency = MPEG_SAMPLING_FREQ_24000;
+	else if (supported->frequency & MPEG_SAMPLING_FREQ_22050)
+		mpeg->frequency = MPEG_SAMPLING_FREQ_22050;
+	else if (supported->frequency & MPEG_SAMPLING_FREQ_16000)
+		mpeg->frequency = MPEG_SAMPLING_FREQ_16000;
+	else
+		return -EINVAL;
+
+	if (supported->channel_mode & MPEG_CHANNEL_MODE_JOINT_STEREO)
+		mpeg->channel_mode = MPEG_CHANNEL_MODE_JOINT_STEREO;
+	else if (supported->channel_mode & MPEG_CHANNEL_MODE_STEREO)
+		mpeg->channel_mode = MPEG_CHANNEL_MODE_STEREO;
+	else if (supported->channel_mode & MPEG_CHANNEL_MODE_DUAL_CHANNEL)
+		mpeg->channel_mode = MPEG_CHANNEL_MODE_DUAL_CHANNEL;
+	else if (supported->channel_mode & MPEG_CHANNEL_MODE_MONO)
+		mpeg->channel_mode = MPEG_CHANNEL_MODE_MONO;
+	else
+		return -EINVAL;
+
+	mpeg->crc = 0;
+	mpeg->mpf = 0;
+	mpeg->bitrate = supported->bitrate;
+
+	return 0;
+}
+
+static int mpeg_check_configuration(const void *config)
+{
+	const a2dp_mpeg_t *mpeg = config;
+
+	if (mpeg->layer == 0 || mpeg->frequency == 0)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int mpeg_get_pcm_format(const void *config, unsigned int *rate,
+						unsigned int *channels)
+{
+	const a2dp_mpeg_t *mpeg = config;
+
+	switch (mpeg->frequency) {
+	case MPEG_SAMPLING_FREQ_16000:
+		*rate = 16000;
+		break;
+	case MPEG_SAMPLING_FREQ_22050:
+		*rate = 22050;
+		break;
+	case MPEG_SAMPLING_FREQ_24000:
+		*rate = 24000;
+		break;
+	case MPEG_SAMPLING_FREQ_32000:
+		*rate = 32000;
+		break;
+	case MPEG_SAMPLING_FREQ_44100:
+		*rate = 44100;
+		break;
+	case MPEG_SAMPLING_FREQ_48000:
+		*rate = 48000;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*channels = mpeg->channel_mode == MPEG_CHANNEL_MODE_MONO ? 1 : 2;
+
+	return 0;
+}
+
+const struct a2dp_codec a2dp_codec_mpeg12 = {
+	.type			= A2DP_CODEC_MPEG12,
+	.name			= "MPEG",
+	.caps_size		= sizeof(a2dp_mpeg_t),
+	.get_capabilities	= mpeg_get_capabilities,
+	.select_configuration	= mpeg_select_configuration,
+	.check_configuration	= mpeg_check_configuration,
+	.get_pcm_format		= mpeg_get_pcm_format,
+};
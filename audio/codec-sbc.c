@@ -0,0 +1,363 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2011  BMW Car IT GmbH. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/types.h>
+
+#include "sbc.h"
+#include "a2dp-codecs.h"
+#include "codec.h"
+
+#ifndef MIN
+# define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif
+
+#ifndef MAX
+# define MAX(x, y) ((x) > (y) ? (x) : (y))
+#endif
+
+static void sbc_get_capabilities(void *caps)
+{
+	a2dp_sbc_t *sbc = caps;
+
+	memset(sbc, 0, sizeof(*sbc));
+
+	sbc->frequency = ( SBC_SAMPLING_FREQ_48000 |
+				SBC_SAMPLING_FREQ_44100 |
+				SBC_SAMPLING_FREQ_32000 |
+				SBC_SAMPLING_FREQ_16000 );
+
+	sbc->channel_mode = ( SBC_CHANNEL_MODE_JOINT_STEREO |
+					SBC_CHANNEL_MODE_STEREO |
+					SBC_CHANNEL_MODE_DUAL_CHANNEL |
+					SBC_CHANNEL_MODE_MONO );
+
+	sbc->block_length = ( SBC_BLOCK_LENGTH_16 |
+					SBC_BLOCK_LENGTH_12 |
+					SBC_BLOCK_LENGTH_8 |
+					SBC_BLOCK_LENGTH_4 );
+
+	sbc->subbands = ( SBC_SUBBANDS_8 | SBC_SUBBANDS_4 );
+
+	sbc->allocation_method = ( SBC_ALLOCATION_LOUDNESS |
+					SBC_ALLOCATION_SNR );
+
+	sbc->min_bitpool = MIN_BITPOOL;
+	sbc->max_bitpool = MAX_BITPOOL;
+}
+
+static uint8_t default_bitpool(uint8_t freq, uint8_t mode)
+{
+	switch (freq) {
+	case SBC_SAMPLING_FREQ_16000:
+	case SBC_SAMPLING_FREQ_32000:
+		return 53;
+	case SBC_SAMPLING_FREQ_44100:
+		switch (mode) {
+		case SBC_CHANNEL_MODE_MONO:
+		case SBC_CHANNEL_MODE_DUAL_CHANNEL:
+			return 31;
+		default:
+			return 53;
+		}
+	case SBC_SAMPLING_FREQ_48000:
+		switch (mode) {
+		case SBC_CHANNEL_MODE_MONO:
+		case SBC_CHANNEL_MODE_DUAL_CHANNEL:
+			return 29;
+		default:
+			return 51;
+		}
+	default:
+		return 53;
+	}
+}
+
+static int sbc_select_configuration(const void *caps, void *config)
+{
+	const a2dp_sbc_t *supported = caps;
+	a2dp_sbc_t *sbc = config;
+
+	memset(sbc, 0, sizeof(*sbc));
+
+	if (supported->frequency & SBC_SAMPLING_FREQ_44100)
+		sbc->frequency = SBC_SAMPLING_FREQ_44100;
+	else if (supported->frequency & SBC_SAMPLING_FREQ_48000)
+		sbc->frequency = SBC_SAMPLING_FREQ_48000;
+	else if (supported->frequency & SBC_SAMPLING_FREQ_32000)
+		sbc->frequency = SBC_SAMPLING_FREQ_32000;
+	else if (supported->frequency & SBC_SAMPLING_FREQ_16000)
+		sbc->frequency = SBC_SAMPLING_FREQ_16000;
+	else
+		return -EINVAL;
+
+	if (supported->channel_mode & SBC_CHANNEL_MODE_JOINT_STEREO)
+		sbc->channel_mode = SBC_CHANNEL_MODE_JOINT_STEREO;
+	else if (supported->channel_mode & SBC_CHANNEL_MODE_STEREO)
+		sbc->channel_mode = SBC_CHANNEL_MODE_STEREO;
+	else if (supported->channel_mode & SBC_CHANNEL_MODE_DUAL_CHANNEL)
+		sbc->channel_mode = SBC_CHANNEL_MODE_DUAL_CHANNEL;
+	else if (supported->channel_mode & SBC_CHANNEL_MODE_MONO)
+		sbc->channel_mode = SBC_CHANNEL_MODE_MONO;
+	else
+		return -EINVAL;
+
+	if (supported->block_length & SBC_BLOCK_LENGTH_16)
+		sbc->block_length = SBC_BLOCK_LENGTH_16;
+	else if (supported->block_length & SBC_BLOCK_LENGTH_12)
+		sbc->block_length = SBC_BLOCK_LENGTH_12;
+	else if (supported->block_length & SBC_BLOCK_LENGTH_8)
+		sbc->block_length = SBC_BLOCK_LENGTH_8;
+	else if (supported->block_length & SBC_BLOCK_LENGTH_4)
+		sbc->block_length = SBC_BLOCK_LENGTH_4;
+	else
+		return -EINVAL;
+
+	if (supported->subbands & SBC_SUBBANDS_8)
+		sbc->subbands = SBC_SUBBANDS_8;
+	else if (supported->subbands & SBC_SUBBANDS_4)
+		sbc->subbands = SBC_SUBBANDS_4;
+	else
+		return -EINVAL;
+
+	if (supported->allocation_method & SBC_ALLOCATION_LOUDNESS)
+		sbc->allocation_method = SBC_ALLOCATION_LOUDNESS;
+	else if (supported->allocation_method & SBC_ALLOCATION_SNR)
+		sbc->allocation_method = SBC_ALLOCATION_SNR;
+
+	sbc->min_bitpool = MAX(MIN_BITPOOL, supported->min_bitpool);
+	sbc->max_bitpool = MIN(default_bitpool(sbc->frequency,
+						sbc->channel_mode),
+						supported->max_bitpool);
+
+	return 0;
+}
+
+static int sbc_check_configuration(const void *config)
+{
+	const a2dp_sbc_t *sbc = config;
+
+	if (sbc->min_bitpool < MIN_BITPOOL || sbc->max_bitpool > MAX_BITPOOL)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int sbc_get_pcm_format(const void *config, unsigned int *rate,
+						unsigned int *channels)
+{
+	const a2dp_sbc_t *sbc = config;
+
+	switch (sbc->frequency) {
+	case SBC_SAMPLING_FREQ_16000:
+		*rate = 16000;
+		break;
+	case SBC_SAMPLING_FREQ_32000:
+		*rate = 32000;
+		break;
+	case SBC_SAMPLING_FREQ_44100:
+		*rate = 44100;
+		break;
+	case SBC_SAMPLING_FREQ_48000:
+		*rate = 48000;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*channels = sbc->channel_mode == SBC_CHANNEL_MODE_MONO ? 1 : 2;
+
+	return 0;
+}
+
+static int sbc_setup(sbc_t *sbc, const a2dp_sbc_t *config)
+{
+	switch (config->frequency) {
+	case SBC_SAMPLING_FREQ_16000:
+		sbc->frequency = SBC_FREQ_16000;
+		break;
+	case SBC_SAMPLING_FREQ_32000:
+		sbc->frequency = SBC_FREQ_32000;
+		break;
+	case SBC_SAMPLING_FREQ_44100:
+		sbc->frequency = SBC_FREQ_44100;
+		break;
+	case SBC_SAMPLING_FREQ_48000:
+		sbc->frequency = SBC_FREQ_48000;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (config->channel_mode) {
+	case SBC_CHANNEL_MODE_MONO:
+		sbc->mode = SBC_MODE_MONO;
+		break;
+	case SBC_CHANNEL_MODE_DUAL_CHANNEL:
+		sbc->mode = SBC_MODE_DUAL_CHANNEL;
+		break;
+	case SBC_CHANNEL_MODE_STEREO:
+		sbc->mode = SBC_MODE_STEREO;
+		break;
+	case SBC_CHANNEL_MODE_JOINT_STEREO:
+		sbc->mode = SBC_MODE_JOINT_STEREO;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (config->subbands) {
+	case SBC_SUBBANDS_4:
+		sbc->subbands = SBC_SB_4;
+		break;
+	case SBC_SUBBANDS_8:
+		sbc->subbands = SBC_SB_8;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (config->block_length) {
+	case SBC_BLOCK_LENGTH_4:
+		sbc->blocks = SBC_BLK_4;
+		break;
+	case SBC_BLOCK_LENGTH_8:
+		sbc->blocks = SBC_BLK_8;
+		break;
+	case SBC_BLOCK_LENGTH_12:
+		sbc->blocks = SBC_BLK_12;
+		break;
+	case SBC_BLOCK_LENGTH_16:
+		sbc->blocks = SBC_BLK_16;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	sbc->allocation = config->allocation_method == SBC_ALLOCATION_SNR ?
+						SBC_AM_SNR : SBC_AM_LOUDNESS;
+	sbc->bitpool = config->max_bitpool;
+
+	return 0;
+}
+
+static int sbc_codec_init(void **data, const void *config)
+{
+	sbc_t *sbc;
+	int err;
+
+	sbc = malloc(sizeof(*sbc));
+	if (sbc == NULL)
+		return -ENOMEM;
+
+	sbc_init(sbc, 0);
+
+	err = sbc_setup(sbc, config);
+	if (err < 0) {
+		sbc_finish(sbc);
+		free(sbc);
+		return err;
+	}
+
+	*data = sbc;
+
+	return 0;
+}
+
+static void sbc_codec_free(void *data)
+{
+	sbc_finish(data);
+	free(data);
+}
+
+static size_t sbc_codec_get_codesize(void *data)
+{
+	return sbc_get_codesize(data);
+}
+
+static size_t sbc_codec_get_frame_length(void *data)
+{
+	return sbc_get_frame_length(data);
+}
+
+static unsigned int sbc_codec_get_frame_duration(void *data)
+{
+	return sbc_get_frame_duration(data);
+}
+
+static ssize_t sbc_codec_encode(void *data, const void *input,
+				size_t input_len, void *output,
+				size_t output_len, size_t *written)
+{
+	ssize_t ret, len = 0;
+
+	ret = sbc_encode(data, input, input_len, output, output_len, &len);
+	if (ret < 0)
+		return ret;
+
+	*written = len;
+
+	return ret;
+}
+
+static ssize_t sbc_codec_decode(void *data, const void *input,
+				size_t input_len, void *output,
+				size_t output_len, size_t *written)
+{
+	ssize_t ret;
+
+	ret = sbc_decode(data, input, input_len, output, output_len, written);
+	if (ret == -1)
+		return 0;	/* Frame not complete yet */
+	if (ret < 0)
+		return -EINVAL;
+
+	return ret;
+}
+
+const struct a2dp_codec a2dp_codec_sbc = {
+	.type			= A2DP_CODEC_SBC,
+	.name			= "SBC",
+	.caps_size		= sizeof(a2dp_sbc_t),
+	.get_capabilities	= sbc_get_capabilities,
+	.select_configuration	= sbc_select_configuration,
+	.check_configuration	= sbc_check_configuration,
+	.get_pcm_format		= sbc_get_pcm_format,
+	.init			= sbc_codec_init,
+	.free			= sbc_codec_free,
+	.get_codesize		= sbc_codec_get_codesize,
+	.get_frame_length	= sbc_codec_get_frame_length,
+	.get_frame_duration	= sbc_codec_get_frame_duration,
+	.encode			= sbc_codec_encode,
+	.decode			= sbc_codec_decode,
+};
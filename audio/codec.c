@@ -0,0 +1,80 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2011  BMW Car IT GmbH. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "codec.h"
+
+/* The in-tree engines are always there, others register at runtime */
+static const struct a2dp_codec *engines[A2DP_CODEC_ENGINES_MAX] = {
+	&a2dp_codec_sbc,
+	&a2dp_codec_mpeg12,
+};
+
+const struct a2dp_codec *a2dp_codec_find(uint8_t type)
+{
+	unsigned int i;
+
+	for (i = 0; i < A2DP_CODEC_ENGINES_MAX; i++) {
+		if (engines[i] && engines[i]->type == type)
+			return engines[i];
+	}
+
+	return NULL;
+}
+
+int a2dp_codec_register(const struct a2dp_codec *codec)
+{
+	unsigned int i;
+
+	if (a2dp_codec_find(codec->type))
+		return -EALREADY;
+
+	for (i = 0; i < A2DP_CODEC_ENGINES_MAX; i++) {
+		if (engines[i] == NULL) {
+			engines[i] = codec;
+			return 0;
+		}
+	}
+
+	return -ENOSPC;
+}
+
+void a2dp_codec_unregister(const struct a2dp_codec *codec)
+{
+	unsigned int i;
+
+	for (i = 0; i < A2DP_CODEC_ENGINES_MAX; i++) {
+		if (engines[i] == codec)
+			engines[i] = NULL;
+	}
+}
@@ -0,0 +1,69 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2011  BMW Car IT GmbH. All rights reserved.
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define A2DP_CODEC_ENGINES_MAX	8
+
+/* An A2DP codec engine. Capabilities and configurations are the codec
+ * specific information elements, e.g. a2dp_sbc_t, without the AVDTP
+ * media codec capability header in front. */
+struct a2dp_codec {
+	uint8_t type;			/* A2DP_CODEC_* */
+	const char *name;
+	size_t caps_size;
+
+	/* Everything the engine can handle */
+	void (*get_capabilities)(void *caps);
+	/* Picks one configuration out of the remote capabilities */
+	int (*select_configuration)(const void *caps, void *config);
+	/* Checks a configuration chosen by the remote */
+	int (*check_configuration)(const void *config);
+	/* PCM side of a configuration */
+	int (*get_pcm_format)(const void *config, unsigned int *rate,
+						unsigned int *channels);
+
+	/* The rest is optional, NULL for engines that only negotiate the
+	 * configuration. Callers check init and the direction they need. */
+	int (*init)(void **data, const void *config);
+	void (*free)(void *data);
+	/* Input bytes needed for one output frame, 0 if that varies */
+	size_t (*get_codesize)(void *data);
+	/* Output bytes per frame, of the last one for variable sizes */
+	size_t (*get_frame_length)(void *data);
+	unsigned int (*get_frame_duration)(void *data);	/* usec */
+	/* Both return the input consumed, 0 when more is needed */
+	ssize_t (*encode)(void *data, const void *input, size_t input_len,
+				void *output, size_t output_len,
+				size_t *written);
+	ssize_t (*decode)(void *data, const void *input, size_t input_len,
+				void *output, size_t output_len,
+				size_t *written);
+};
+
+int a2dp_codec_register(const struct a2dp_codec *codec);
+void a2dp_codec_unregister(const struct a2dp_codec *codec);
+const struct a2dp_codec *a2dp_codec_find(uint8_t type);
+
+extern const struct a2dp_codec a2dp_codec_sbc;
+extern const struct a2dp_codec a2dp_codec_mpeg12;
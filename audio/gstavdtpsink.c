@@ -1720,9 +1720,22 @@ static GstFlowReturn gst_avdtp_sink_render(GstBaseSink *basesink,
 					GstBuffer *buffer)
 {
 	GstAvdtpSink *self = GST_AVDTP_SINK(basesink);
+	GstClockTime duration;
 	ssize_t ret;
 	int fd;
 
+	/* A packet needs about its own duration to get across the link,
+	 * account for it in the latency reported to the pipeline */
+	duration = GST_BUFFER_DURATION(buffer);
+	if (GST_CLOCK_TIME_IS_VALID(duration) &&
+			duration > gst_base_sink_get_render_delay(basesink)) {
+		GST_DEBUG_OBJECT(self, "render delay %" GST_TIME_FORMAT,
+						GST_TIME_ARGS(duration));
+		gst_base_sink_set_render_delay(basesink, duration);
+		gst_element_post_message(GST_ELEMENT(self),
+				gst_message_new_latency(GST_OBJECT(self)));
+	}
+
 	fd = g_io_channel_unix_get_fd(self->stream);
 
 	ret = write(fd, GST_BUFFER_DATA(buffer), GST_BUFFER_SIZE(buffer));
@@ -1829,10 +1842,9 @@ static void gst_avdtp_sink_init(GstAvdtpSink *self,
 
 	self->sink_lock = g_mutex_new();
 
-	/* FIXME this is for not synchronizing with clock, should be tested
-	 * with devices to see the behaviour
-	gst_base_sink_set_sync(GST_BASE_SINK(self), FALSE);
-	*/
+	/* Writes are paced by the buffer timestamps, which advance by the
+	 * negotiated frame duration for every frame in a packet */
+	gst_base_sink_set_sync(GST_BASE_SINK(self), TRUE);
 }
 
 static int gst_avdtp_sink_audioservice_send(GstAvdtpSink *self,
@@ -33,6 +33,7 @@
 #define RTP_SBC_PAYLOAD_HEADER_SIZE 1
 #define DEFAULT_MIN_FRAMES 0
 #define RTP_SBC_HEADER_TOTAL (12 + RTP_SBC_PAYLOAD_HEADER_SIZE)
+#define RTP_SBC_MAX_FRAMES 15
 
 #if __BYTE_ORDER == __LITTLE_ENDIAN
 
@@ -153,6 +154,8 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 				bitpool, channel_mode);
 
 	sbcpay->frame_length = frame_len;
+	sbcpay->frame_duration = gst_util_uint64_scale_int(blocks * subbands,
+							GST_SECOND, rate);
 
 	gst_basertppayload_set_options(payload, "audio", TRUE, "SBC", rate);
 
@@ -161,77 +164,375 @@ static gboolean gst_rtp_sbc_pay_set_caps(GstBaseRTPPayload *payload,
 	return gst_basertppayload_set_outcaps(payload, NULL);
 }
 
-static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay)
+static gboolean gst_rtp_sbc_pay_frame_fits(GstRtpSBCPay *sbcpay)
 {
-	guint available;
-	guint max_payload;
-	GstBuffer *outbuf;
-	guint8 *payload_data;
-	guint frame_count;
-	guint payload_length;
-	struct rtp_payload *payload;
+	guint size = GST_BASE_RTP_PAYLOAD_MTU(sbcpay);
 
-	if (sbcpay->frame_length == 0) {
-		GST_ERROR_OBJECT(sbcpay, "Frame length is 0");
-		return GST_FLOW_ERROR;
+	if (sbcpay->frame_count >= RTP_SBC_MAX_FRAMES)
+		return FALSE;
+
+	/* The MTU may have changed since the packet was allocated */
+	if (sbcpay->packet != NULL)
+		size = MIN(size, GST_BUFFER_SIZE(sbcpay->packet));
+
+	return RTP_SBC_HEADER_TOTAL + sbcpay->packet_length +
+					sbcpay->frame_length <= size;
+}
+
+static GstClockTime gst_rtp_sbc_pay_get_packet_duration(
+						GstRtpSBCPay *sbcpay)
+{
+	guint mtu = GST_BASE_RTP_PAYLOAD_MTU(sbcpay);
+	guint frames;
+
+	if (sbcpay->frame_length == 0 || mtu <= RTP_SBC_HEADER_TOTAL)
+		return 0;
+
+	frames = (mtu - RTP_SBC_HEADER_TOTAL) / sbcpay->frame_length;
+	frames = MIN(frames, RTP_SBC_MAX_FRAMES);
+	if (sbcpay->min_frames < frames)
+		frames = sbcpay->min_frames + 1;
+
+	return frames * sbcpay->frame_duration;
+}
+
+static void gst_rtp_sbc_pay_reset(GstRtpSBCPay *sbcpay)
+{
+	GST_OBJECT_LOCK(sbcpay);
+
+	gst_adapter_clear(sbcpay->adapter);
+
+	if (sbcpay->packet != NULL) {
+		gst_buffer_unref(sbcpay->packet);
+		sbcpay->packet = NULL;
 	}
 
-	available = gst_adapter_available(sbcpay->adapter);
+	sbcpay->packet_length = 0;
+	sbcpay->frame_count = 0;
+	sbcpay->duration = 0;
+	sbcpay->alloc_pending = FALSE;
+
+	GST_OBJECT_UNLOCK(sbcpay);
+}
+
+static GstBuffer *gst_rtp_sbc_pay_new_packet(GstRtpSBCPay *sbcpay)
+{
+	guint max_payload;
 
 	max_payload = gst_rtp_buffer_calc_payload_len(
-		GST_BASE_RTP_PAYLOAD_MTU(sbcpay) - RTP_SBC_PAYLOAD_HEADER_SIZE,
-		0, 0);
+				GST_BASE_RTP_PAYLOAD_MTU(sbcpay), 0, 0);
 
-	max_payload = MIN(max_payload, available);
-	frame_count = max_payload / sbcpay->frame_length;
-	payload_length = frame_count * sbcpay->frame_length;
-	if (payload_length == 0) /* Nothing to send */
-		return GST_FLOW_OK;
+	return gst_rtp_buffer_new_allocate(max_payload, 0, 0);
+}
+
+/* Completes the packet being filled and returns it for pushing, called
+ * with the object lock held */
+static GstBuffer *gst_rtp_sbc_pay_finish_packet(GstRtpSBCPay *sbcpay)
+{
+	GstBuffer *outbuf = sbcpay->packet;
+	struct rtp_payload *payload;
+
+	if (outbuf == NULL || sbcpay->frame_count == 0) /* Nothing to send */
+		return NULL;
 
-	outbuf = gst_rtp_buffer_new_allocate(payload_length +
-			RTP_SBC_PAYLOAD_HEADER_SIZE, 0, 0);
+	sbcpay->packet = NULL;
+	sbcpay->alloc_pending = FALSE;
+
+	/* The packet was allocated for a full MTU */
+	GST_BUFFER_SIZE(outbuf) = gst_rtp_buffer_calc_packet_len(
+				sbcpay->packet_length +
+				RTP_SBC_PAYLOAD_HEADER_SIZE, 0, 0);
 
 	gst_rtp_buffer_set_payload_type(outbuf,
 			GST_BASE_RTP_PAYLOAD_PT(sbcpay));
 
-	payload_data = gst_rtp_buffer_get_payload(outbuf);
-	payload = (struct rtp_payload *) payload_data;
+	payload = (struct rtp_payload *) gst_rtp_buffer_get_payload(outbuf);
 	memset(payload, 0, sizeof(struct rtp_payload));
-	payload->frame_count = frame_count;
-
-	gst_adapter_copy(sbcpay->adapter, payload_data +
-			RTP_SBC_PAYLOAD_HEADER_SIZE, 0, payload_length);
-	gst_adapter_flush(sbcpay->adapter, payload_length);
+	payload->frame_count = sbcpay->frame_count;
 
 	GST_BUFFER_TIMESTAMP(outbuf) = sbcpay->timestamp;
-	GST_DEBUG_OBJECT(sbcpay, "Pushing %d bytes", payload_length);
+	GST_BUFFER_DURATION(outbuf) = sbcpay->duration;
+	GST_DEBUG_OBJECT(sbcpay, "Pushing %d bytes", sbcpay->packet_length);
+
+	sbcpay->packet_length = 0;
+	sbcpay->frame_count = 0;
+	sbcpay->duration = 0;
+
+	return outbuf;
+}
+
+static GstFlowReturn gst_rtp_sbc_pay_flush_buffers(GstRtpSBCPay *sbcpay)
+{
+	GstBuffer *outbuf;
+
+	GST_OBJECT_LOCK(sbcpay);
+	outbuf = gst_rtp_sbc_pay_finish_packet(sbcpay);
+	GST_OBJECT_UNLOCK(sbcpay);
+
+	if (outbuf == NULL)
+		return GST_FLOW_OK;
 
 	return gst_basertppayload_push(GST_BASE_RTP_PAYLOAD(sbcpay), outbuf);
 }
 
+/* Called with the object lock held, returns the packet if it's complete */
+static GstBuffer *gst_rtp_sbc_pay_add_frames(GstRtpSBCPay *sbcpay,
+				GstClockTime timestamp, guint frames)
+{
+	/* The packet is stamped with the time of its first frame */
+	if (sbcpay->frame_count == 0)
+		sbcpay->timestamp = timestamp;
+
+	sbcpay->frame_count += frames;
+	sbcpay->packet_length += frames * sbcpay->frame_length;
+	sbcpay->duration += frames * sbcpay->frame_duration;
+
+	if (gst_rtp_sbc_pay_frame_fits(sbcpay) &&
+				sbcpay->frame_count <= sbcpay->min_frames)
+		return NULL;
+
+	return gst_rtp_sbc_pay_finish_packet(sbcpay);
+}
+
+/* Frames upstream encoded into a buffer from gst_rtp_sbc_pay_buffer_alloc
+ * are already in place in the packet */
+static gboolean gst_rtp_sbc_pay_is_packet_data(GstRtpSBCPay *sbcpay,
+							GstBuffer *buffer)
+{
+	guint size = GST_BUFFER_SIZE(buffer);
+
+	if (!sbcpay->alloc_pending)
+		return FALSE;
+
+	if (sbcpay->packet == NULL || size == 0 ||
+				size % sbcpay->frame_length != 0)
+		return FALSE;
+
+	if (gst_adapter_available(sbcpay->adapter) > 0)
+		return FALSE;
+
+	if (RTP_SBC_HEADER_TOTAL + sbcpay->packet_length + size >
+					GST_BUFFER_SIZE(sbcpay->packet))
+		return FALSE;
+
+	return GST_BUFFER_DATA(buffer) == GST_BUFFER_DATA(sbcpay->packet) +
+				RTP_SBC_HEADER_TOTAL + sbcpay->packet_length;
+}
+
 static GstFlowReturn gst_rtp_sbc_pay_handle_buffer(GstBaseRTPPayload *payload,
 			GstBuffer *buffer)
 {
 	GstRtpSBCPay *sbcpay;
-	guint available;
+	GstFlowReturn res = GST_FLOW_OK;
 
 	/* FIXME check for negotiation */
 
 	sbcpay = GST_RTP_SBC_PAY(payload);
-	sbcpay->timestamp = GST_BUFFER_TIMESTAMP(buffer);
+
+	if (sbcpay->frame_length == 0) {
+		GST_ERROR_OBJECT(sbcpay, "Frame length is 0");
+		gst_buffer_unref(buffer);
+		return GST_FLOW_ERROR;
+	}
+
+	if (RTP_SBC_HEADER_TOTAL + sbcpay->frame_length >
+					GST_BASE_RTP_PAYLOAD_MTU(sbcpay)) {
+		GST_ERROR_OBJECT(sbcpay, "Frame length %d exceeds the MTU",
+							sbcpay->frame_length);
+		gst_buffer_unref(buffer);
+		return GST_FLOW_ERROR;
+	}
+
+	GST_OBJECT_LOCK(sbcpay);
+
+	if (gst_rtp_sbc_pay_is_packet_data(sbcpay, buffer)) {
+		guint frames = GST_BUFFER_SIZE(buffer) / sbcpay->frame_length;
+		GstClockTime timestamp = GST_BUFFER_TIMESTAMP(buffer);
+		GstBuffer *outbuf;
+
+		sbcpay->alloc_pending = FALSE;
+		outbuf = gst_rtp_sbc_pay_add_frames(sbcpay, timestamp, frames);
+
+		GST_OBJECT_UNLOCK(sbcpay);
+
+		gst_buffer_unref(buffer);
+
+		if (outbuf == NULL)
+			return GST_FLOW_OK;
+
+		return gst_basertppayload_push(payload, outbuf);
+	}
 
 	gst_adapter_push(sbcpay->adapter, buffer);
 
-	available = gst_adapter_available(sbcpay->adapter);
-	if (available + RTP_SBC_HEADER_TOTAL >=
-				GST_BASE_RTP_PAYLOAD_MTU(sbcpay) ||
-			(available >
-				(sbcpay->min_frames * sbcpay->frame_length)))
-		return gst_rtp_sbc_pay_flush_buffers(sbcpay);
+	/* A frame that upstream allocated elsewhere arrived while a slot
+	 * of the packet is still out, upstream may write into that slot
+	 * yet. Leave the rest of that packet to it and copy into a new one.
+	 * With data in the adapter no other slot is handed out meanwhile. */
+	if (sbcpay->alloc_pending) {
+		GstBuffer *outbuf = gst_rtp_sbc_pay_finish_packet(sbcpay);
+
+		if (outbuf == NULL && sbcpay->packet != NULL) {
+			gst_buffer_unref(sbcpay->packet);
+			sbcpay->packet = NULL;
+		}
+
+		sbcpay->alloc_pending = FALSE;
+
+		if (outbuf != NULL) {
+			GST_OBJECT_UNLOCK(sbcpay);
+			res = gst_basertppayload_push(payload, outbuf);
+			GST_OBJECT_LOCK(sbcpay);
+		}
+	}
+
+	while (gst_adapter_available(sbcpay->adapter) >=
+				sbcpay->frame_length && res == GST_FLOW_OK) {
+		GstBuffer *outbuf;
+		GstClockTime timestamp;
+		guint64 distance;
+		guint8 *data;
+
+		if (sbcpay->packet != NULL &&
+				!gst_rtp_sbc_pay_frame_fits(sbcpay)) {
+			outbuf = gst_rtp_sbc_pay_finish_packet(sbcpay);
+
+			/* Empty, but allocated for a smaller MTU */
+			if (outbuf == NULL) {
+				gst_buffer_unref(sbcpay->packet);
+				sbcpay->packet = NULL;
+			}
+		} else {
+			if (sbcpay->packet == NULL)
+				sbcpay->packet =
+					gst_rtp_sbc_pay_new_packet(sbcpay);
+
+			timestamp = gst_adapter_prev_timestamp(sbcpay->adapter,
+								&distance);
+			if (GST_CLOCK_TIME_IS_VALID(timestamp))
+				timestamp += distance / sbcpay->frame_length *
+							sbcpay->frame_duration;
+
+			data = GST_BUFFER_DATA(sbcpay->packet) +
+				RTP_SBC_HEADER_TOTAL + sbcpay->packet_length;
+
+			gst_adapter_copy(sbcpay->adapter, data, 0,
+							sbcpay->frame_length);
+			gst_adapter_flush(sbcpay->adapter,
+							sbcpay->frame_length);
+
+			outbuf = gst_rtp_sbc_pay_add_frames(sbcpay, timestamp,
+									1);
+		}
+
+		if (outbuf == NULL)
+			continue;
+
+		/* Not holding the lock while pushing downstream */
+		GST_OBJECT_UNLOCK(sbcpay);
+		res = gst_basertppayload_push(payload, outbuf);
+		GST_OBJECT_LOCK(sbcpay);
+	}
+
+	GST_OBJECT_UNLOCK(sbcpay);
+
+	return res;
+}
+
+/* Hands out the room for the next frame inside the packet being filled,
+ * so that the encoder writes straight into the outgoing RTP packet */
+static GstFlowReturn gst_rtp_sbc_pay_buffer_alloc(GstPad *pad,
+				guint64 offset, guint size, GstCaps *caps,
+				GstBuffer **buf)
+{
+	GstRtpSBCPay *sbcpay = GST_RTP_SBC_PAY(GST_PAD_PARENT(pad));
+
+	/* Falls back to a regular allocation, the frames get copied */
+	*buf = NULL;
+
+	if (caps != NULL && !gst_caps_is_equal(caps, GST_PAD_CAPS(pad)))
+		return GST_FLOW_OK;
+
+	GST_OBJECT_LOCK(sbcpay);
+
+	if (sbcpay->frame_length == 0 || size != sbcpay->frame_length)
+		goto done;
+
+	/* Only one slot is handed out at a time: the next one is where the
+	 * outstanding frame goes until it has come back */
+	if (sbcpay->alloc_pending)
+		goto done;
+
+	if (gst_adapter_available(sbcpay->adapter) > 0)
+		goto done;
+
+	if (RTP_SBC_HEADER_TOTAL + size > GST_BASE_RTP_PAYLOAD_MTU(sbcpay))
+		goto done;
+
+	if (sbcpay->packet != NULL && !gst_rtp_sbc_pay_frame_fits(sbcpay))
+		goto done;
+
+	if (sbcpay->packet == NULL)
+		sbcpay->packet = gst_rtp_sbc_pay_new_packet(sbcpay);
+
+	*buf = gst_buffer_create_sub(sbcpay->packet,
+			RTP_SBC_HEADER_TOTAL + sbcpay->packet_length, size);
+	sbcpay->alloc_pending = TRUE;
+
+done:
+	GST_OBJECT_UNLOCK(sbcpay);
+
+	if (*buf == NULL)
+		return GST_FLOW_OK;
+
+	/* Upstream writes its frame into it */
+	GST_BUFFER_FLAG_UNSET(*buf, GST_BUFFER_FLAG_READONLY);
+	GST_BUFFER_OFFSET(*buf) = offset;
+	gst_buffer_set_caps(*buf, caps);
 
 	return GST_FLOW_OK;
 }
 
+static gboolean gst_rtp_sbc_pay_src_query(GstPad *pad, GstQuery *query)
+{
+	GstRtpSBCPay *sbcpay;
+	gboolean res;
+
+	sbcpay = GST_RTP_SBC_PAY(gst_pad_get_parent(pad));
+	if (sbcpay == NULL)
+		return FALSE;
+
+	switch (GST_QUERY_TYPE(query)) {
+	case GST_QUERY_LATENCY: {
+		GstClockTime min, max, latency;
+		gboolean live;
+
+		res = gst_pad_peer_query(GST_BASE_RTP_PAYLOAD_SINKPAD(sbcpay),
+									query);
+		if (!res)
+			break;
+
+		/* Frames are held back until their packet is complete */
+		gst_query_parse_latency(query, &live, &min, &max);
+
+		latency = gst_rtp_sbc_pay_get_packet_duration(sbcpay);
+		min += latency;
+		if (GST_CLOCK_TIME_IS_VALID(max))
+			max += latency;
+
+		gst_query_set_latency(query, live, min, max);
+		break;
+	}
+	default:
+		res = gst_pad_query_default(pad, query);
+		break;
+	}
+
+	gst_object_unref(sbcpay);
+
+	return res;
+}
+
 static gboolean gst_rtp_sbc_pay_handle_event(GstPad *pad,
 				GstEvent *event)
 {
@@ -241,6 +542,9 @@ static gboolean gst_rtp_sbc_pay_handle_event(GstPad *pad,
 	case GST_EVENT_EOS:
 		gst_rtp_sbc_pay_flush_buffers(sbcpay);
 		break;
+	case GST_EVENT_FLUSH_STOP:
+		gst_rtp_sbc_pay_reset(sbcpay);
+		break;
 	default:
 		break;
 	}
@@ -263,6 +567,10 @@ static void gst_rtp_sbc_pay_base_init(gpointer g_class)
 static void gst_rtp_sbc_pay_finalize(GObject *object)
 {
 	GstRtpSBCPay *sbcpay = GST_RTP_SBC_PAY(object);
+
+	if (sbcpay->packet != NULL)
+		gst_buffer_unref(sbcpay->packet);
+
 	g_object_unref(sbcpay->adapter);
 
 	GST_CALL_PARENT(G_OBJECT_CLASS, finalize, (object));
@@ -339,7 +647,19 @@ static void gst_rtp_sbc_pay_init(GstRtpSBCPay *self, GstRtpSBCPayClass *klass)
 {
 	self->adapter = gst_adapter_new();
 	self->frame_length = 0;
+	self->frame_duration = 0;
 	self->timestamp = 0;
+	self->duration = 0;
+
+	self->packet = NULL;
+	self->packet_length = 0;
+	self->frame_count = 0;
+	self->alloc_pending = FALSE;
+
+	gst_pad_set_bufferalloc_function(GST_BASE_RTP_PAYLOAD_SINKPAD(self),
+			GST_DEBUG_FUNCPTR(gst_rtp_sbc_pay_buffer_alloc));
+	gst_pad_set_query_function(GST_BASE_RTP_PAYLOAD_SRCPAD(self),
+			GST_DEBUG_FUNCPTR(gst_rtp_sbc_pay_src_query));
 
 	self->min_frames = DEFAULT_MIN_FRAMES;
 }
@@ -49,8 +49,19 @@ struct _GstRtpSBCPay {
 
 	GstAdapter *adapter;
 	GstClockTime timestamp;
+	GstClockTime duration;
+
+	/* Packet being filled, frames go after the RTP and SBC headers.
+	 * Protected by the object lock, upstream allocates from another
+	 * thread when there is a queue in between. */
+	GstBuffer *packet;
+	guint packet_length;
+	guint frame_count;
+	/* A sub-buffer for the next frame slot is out with upstream */
+	gboolean alloc_pending;
 
 	guint frame_length;
+	GstClockTime frame_duration;
 
 	guint min_frames;
 };
@@ -368,9 +368,24 @@ static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 	GstSbcEnc *enc = GST_SBC_ENC(gst_pad_get_parent(pad));
 	GstAdapter *adapter = enc->adapter;
 	GstFlowReturn res = GST_FLOW_OK;
+	GstClockTime duration;
+
+	if (GST_BUFFER_TIMESTAMP_IS_VALID(buffer) && enc->rate > 0 &&
+							enc->channels > 0) {
+		GstClockTime timestamp = GST_BUFFER_TIMESTAMP(buffer);
+		GstClockTime pending;
+
+		pending = gst_util_uint64_scale_int(
+				gst_adapter_available(adapter), GST_SECOND,
+				enc->rate * enc->channels * 2);
+
+		enc->timestamp = timestamp > pending ? timestamp - pending : 0;
+	}
 
 	gst_adapter_push(adapter, buffer);
 
+	duration = enc->frame_duration * GST_USECOND;
+
 	while (gst_adapter_available(adapter) >= enc->codesize &&
 							res == GST_FLOW_OK) {
 		GstBuffer *output;
@@ -378,6 +393,8 @@ static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 		const guint8 *data;
 		gint consumed;
 
+		/* The payloader downstream hands out room in its RTP
+		 * packet so the frame is encoded in place */
 		caps = GST_PAD_CAPS(enc->srcpad);
 		res = gst_pad_alloc_buffer_and_set_caps(enc->srcpad,
 						GST_BUFFER_OFFSET_NONE,
@@ -395,13 +412,17 @@ static GstFlowReturn sbc_enc_chain(GstPad *pad, GstBuffer *buffer)
 		if (consumed <= 0) {
 			GST_DEBUG_OBJECT(enc, "comsumed < 0, codesize: %d",
 					enc->codesize);
+			gst_buffer_unref(output);
 			break;
 		}
 		gst_adapter_flush(adapter, consumed);
 
-		GST_BUFFER_TIMESTAMP(output) = GST_BUFFER_TIMESTAMP(buffer);
 		/* we have only 1 frame */
-		GST_BUFFER_DURATION(output) = enc->frame_duration;
+		GST_BUFFER_TIMESTAMP(output) = enc->timestamp;
+		GST_BUFFER_DURATION(output) = duration;
+
+		if (GST_CLOCK_TIME_IS_VALID(enc->timestamp))
+			enc->timestamp += duration;
 
 		res = gst_pad_push(enc->srcpad, output);
 
@@ -424,6 +445,7 @@ static GstStateChangeReturn sbc_enc_change_state(GstElement *element,
 	case GST_STATE_CHANGE_READY_TO_PAUSED:
 		GST_DEBUG("Setup subband codec");
 		sbc_init(&enc->sbc, 0);
+		enc->timestamp = GST_CLOCK_TIME_NONE;
 		break;
 
 	case GST_STATE_CHANGE_PAUSED_TO_READY:
@@ -590,6 +612,7 @@ static void gst_sbc_enc_init(GstSbcEnc *self, GstSbcEncClass *klass)
 
 	self->frame_length = 0;
 	self->frame_duration = 0;
+	self->timestamp = GST_CLOCK_TIME_NONE;
 
 	self->adapter = gst_adapter_new();
 }
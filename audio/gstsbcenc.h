@@ -61,6 +61,9 @@ struct _GstSbcEnc {
 	gint frame_length;
 	gint frame_duration;
 
+	/* Time of the first sample still in the adapter */
+	GstClockTime timestamp;
+
 	sbc_t sbc;
 };
 
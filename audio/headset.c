@@ -53,6 +53,7 @@
 #include "error.h"
 #include "telephony.h"
 #include "headset.h"
+#include "at.h"
 #include "glib-compat.h"
 #include "sdp-client.h"
 #include "btio.h"
@@ -62,6 +63,8 @@
 
 #define DC_TIMEOUT 3
 
+#define BCS_TIMEOUT 3
+
 #define RING_INTERVAL 3
 
 #define BUF_SIZE 1024
@@ -80,6 +83,9 @@ static struct {
 	int number_type;		/* Incoming number type */
 	guint ring_timer;		/* For incoming call indication */
 	const char *chld;		/* Response to AT+CHLD=? */
+	uint32_t changed_ind;		/* Indicators with +CIEV pending */
+	guint ciev_id;			/* Sends the pending +CIEVs */
+	GString *listing;		/* +CLCC, +CNUM or +COPS lines */
 } ag = {
 	.telephony_ready = FALSE,
 	.features = 0,
@@ -93,6 +99,7 @@ static struct {
 
 static gboolean sco_hci = TRUE;
 static gboolean fast_connectable = FALSE;
+static gboolean wideband_speech = FALSE;
 
 static GSList *active_devices = NULL;
 
@@ -133,9 +140,7 @@ struct pending_connect {
 };
 
 struct headset_slc {
-	char buf[BUF_SIZE];
-	int data_start;
-	int data_length;
+	struct at_buf buf;
 
 	gboolean cli_active;
 	gboolean cme_enabled;
@@ -149,6 +154,10 @@ struct headset_slc {
 	int mic_gain;
 
 	unsigned int hf_features;
+
+	gboolean hf_msbc;		/* mSBC listed in AT+BAC */
+	uint8_t codec;			/* Last codec confirmed by AT+BCS */
+	guint bcs_timer;		/* Waiting for AT+BCS */
 };
 
 struct headset {
@@ -161,6 +170,7 @@ struct headset {
 	GIOChannel *tmp_rfcomm;
 	GIOChannel *sco;
 	guint sco_id;
+	uint8_t sco_codec;
 
 	gboolean auto_dc;
 
@@ -228,6 +238,8 @@ static void print_ag_features(uint32_t features)
 		g_string_append(gstr, "\"Enhanced call control\" ");
 	if (features & AG_FEATURE_EXTENDED_ERROR_RESULT_CODES)
 		g_string_append(gstr, "\"Extended Error Result Codes\" ");
+	if (features & AG_FEATURE_CODEC_NEGOTIATION)
+		g_string_append(gstr, "\"Codec negotiation\" ");
 
 	str = g_string_free(gstr, FALSE);
 
@@ -262,6 +274,8 @@ static void print_hf_features(uint32_t features)
 		g_string_append(gstr, "\"Enhanced call status\" ");
 	if (features & HF_FEATURE_ENHANCED_CALL_CONTROL)
 		g_string_append(gstr, "\"Enhanced call control\" ");
+	if (features & HF_FEATURE_CODEC_NEGOTIATION)
+		g_string_append(gstr, "\"Codec negotiation\" ");
 
 	str = g_string_free(gstr, FALSE);
 
@@ -287,17 +301,11 @@ static const char *state2str(headset_state_t state)
 	return NULL;
 }
 
-static int headset_send_valist(struct headset *hs, char *format, va_list ap)
+static int headset_write(struct headset *hs, const char *buf, size_t count)
 {
-	char rsp[BUF_SIZE];
-	ssize_t total_written, count;
+	size_t total_written;
 	int fd;
 
-	count = vsnprintf(rsp, sizeof(rsp), format, ap);
-
-	if (count < 0)
-		return -EINVAL;
-
 	if (!hs->rfcomm) {
 		error("headset_send: the headset is not connected");
 		return -EIO;
@@ -309,7 +317,7 @@ static int headset_send_valist(struct headset *hs, char *format, va_list ap)
 	while (total_written < count) {
 		ssize_t written;
 
-		written = write(fd, rsp + total_written,
+		written = write(fd, buf + total_written,
 				count - total_written);
 		if (written < 0)
 			return -errno;
@@ -320,6 +328,19 @@ static int headset_send_valist(struct headset *hs, char *format, va_list ap)
 	return 0;
 }
 
+static int headset_send_valist(struct headset *hs, char *format, va_list ap)
+{
+	char rsp[BUF_SIZE];
+	ssize_t count;
+
+	count = vsnprintf(rsp, sizeof(rsp), format, ap);
+
+	if (count < 0)
+		return -EINVAL;
+
+	return headset_write(hs, rsp, count);
+}
+
 static int __attribute__((format(printf, 2, 3)))
 			headset_send(struct headset *hs, char *format, ...)
 {
@@ -504,6 +525,8 @@ static unsigned int connect_cb_new(struct headset *hs,
 	return cb->id;
 }
 
+static void send_indicators(void);
+
 static void __attribute__((format(printf, 3, 4)))
 		send_foreach_headset(GSList *devices,
 					int (*cmp) (struct headset *hs),
@@ -512,6 +535,10 @@ static void __attribute__((format(printf, 3, 4)))
 	GSList *l;
 	va_list ap;
 
+	/* Keep the order of the unsolicited results, e.g. +CIEV before
+	 * RING for an incoming call */
+	send_indicators();
+
 	for (l = devices; l != NULL; l = l->next) {
 		struct audio_device *device = l->data;
 		struct headset *hs = device->headset;
@@ -612,19 +639,37 @@ static void sco_connect_cb(GIOChannel *chan, GError *err, gpointer user_data)
 	}
 }
 
-static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
-			void *user_data, unsigned int *cb_id)
+static gboolean codec_negotiation(struct headset *hs)
+{
+	if (!wideband_speech || hs->slc == NULL)
+		return FALSE;
+
+	return hs->slc->hf_features & HF_FEATURE_CODEC_NEGOTIATION ?
+								TRUE : FALSE;
+}
+
+static uint8_t preferred_codec(struct headset *hs)
+{
+	if (codec_negotiation(hs) && hs->slc->hf_msbc)
+		return HFP_CODEC_MSBC;
+
+	return HFP_CODEC_CVSD;
+}
+
+static int sco_open(struct audio_device *dev, uint8_t codec)
 {
 	struct headset *hs = dev->headset;
 	GError *err = NULL;
 	GIOChannel *io;
+	int voice;
 
-	if (hs->state != HEADSET_STATE_CONNECTED)
-		return -EINVAL;
+	/* mSBC frames go over the air as they are */
+	voice = codec == HFP_CODEC_MSBC ? BT_VOICE_TRANSPARENT : 0;
 
 	io = bt_io_connect(BT_IO_SCO, sco_connect_cb, dev, NULL, &err,
 				BT_IO_OPT_SOURCE_BDADDR, &dev->src,
 				BT_IO_OPT_DEST_BDADDR, &dev->dst,
+				BT_IO_OPT_VOICE, voice,
 				BT_IO_OPT_INVALID);
 	if (!io) {
 		error("%s", err->message);
@@ -633,6 +678,82 @@ static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
 	}
 
 	hs->sco = io;
+	hs->sco_codec = codec;
+
+	return 0;
+}
+
+static void codec_setup_failed(struct audio_device *dev, int err)
+{
+	struct headset *hs = dev->headset;
+	struct pending_connect *p = hs->pending;
+
+	if (p != NULL) {
+		p->err = err;
+		if (p->msg)
+			error_connect_failed(dev->conn, p->msg, p->err);
+		pending_connect_finalize(dev);
+	}
+
+	headset_set_state(dev, HEADSET_STATE_CONNECTED);
+}
+
+static gboolean bcs_timeout(gpointer user_data)
+{
+	struct audio_device *dev = user_data;
+	struct headset_slc *slc = dev->headset->slc;
+
+	DBG("No codec confirmation from %s", dev->path);
+
+	slc->bcs_timer = 0;
+
+	codec_setup_failed(dev, -ETIMEDOUT);
+
+	return FALSE;
+}
+
+static int codec_setup(struct audio_device *dev, uint8_t codec)
+{
+	struct headset *hs = dev->headset;
+	int err;
+
+	/* Codec connection setup, the link is opened once AT+BCS confirms
+	 * the codec. Not needed again while the choice stays the same. */
+	if (codec_negotiation(hs) && hs->slc->codec != codec) {
+		err = headset_send(hs, "\r\n+BCS: %u\r\n", codec);
+		if (err < 0)
+			return err;
+
+		hs->slc->bcs_timer = g_timeout_add_seconds(BCS_TIMEOUT,
+							bcs_timeout, dev);
+		return 0;
+	}
+
+	err = sco_open(dev, codec);
+	if (err == 0 || codec != HFP_CODEC_MSBC)
+		return err;
+
+	/* Without transparent SCO support in the kernel mSBC can't work,
+	 * it isn't offered again on this connection and CVSD is agreed
+	 * on instead */
+	error("Unable to open an mSBC link, falling back to CVSD");
+	hs->slc->hf_msbc = FALSE;
+
+	return codec_setup(dev, preferred_codec(hs));
+}
+
+static int sco_connect(struct audio_device *dev, headset_stream_cb_t cb,
+			void *user_data, unsigned int *cb_id)
+{
+	struct headset *hs = dev->headset;
+	int err;
+
+	if (hs->state != HEADSET_STATE_CONNECTED)
+		return -EINVAL;
+
+	err = codec_setup(dev, preferred_codec(hs));
+	if (err < 0)
+		return err;
 
 	headset_set_state(dev, HEADSET_STATE_PLAY_IN_PROGRESS);
 
@@ -731,22 +852,16 @@ int telephony_event_reporting_rsp(void *telephony_device, cme_error_t err)
 
 static int event_reporting(struct audio_device *dev, const char *buf)
 {
-	char **tokens; /* <mode>, <keyp>, <disp>, <ind>, <bfr> */
+	struct at_args args; /* <mode>, <keyp>, <disp>, <ind>, <bfr> */
+	int mode, ind;
 
-	if (strlen(buf) < 13)
+	if (!at_args_init(&args, buf) || !at_args_int(&args, &mode) ||
+			!at_args_skip(&args) || !at_args_skip(&args) ||
+			!at_args_int(&args, &ind))
 		return -EINVAL;
 
-	tokens = g_strsplit(&buf[8], ",", 5);
-	if (g_strv_length(tokens) < 4) {
-		g_strfreev(tokens);
-		return -EINVAL;
-	}
-
-	ag.er_mode = atoi(tokens[0]);
-	ag.er_ind = atoi(tokens[3]);
-
-	g_strfreev(tokens);
-	tokens = NULL;
+	ag.er_mode = mode;
+	ag.er_ind = ind;
 
 	DBG("Event reporting (CMER): mode=%d, ind=%d",
 			ag.er_mode, ag.er_ind);
@@ -892,6 +1007,8 @@ int telephony_response_and_hold_rsp(void *telephony_device, cme_error_t err)
 static int response_and_hold(struct audio_device *device, const char *buf)
 {
 	struct headset *hs = device->headset;
+	struct at_args args;
+	int val;
 
 	if (strlen(buf) < 8)
 		return -EINVAL;
@@ -900,7 +1017,10 @@ static int response_and_hold(struct audio_device *device, const char *buf)
 		return telephony_generic_rsp(device, CME_ERROR_NOT_SUPPORTED);
 
 	if (buf[7] == '=') {
-		telephony_response_and_hold_req(device, atoi(&buf[8]) < 0);
+		if (!at_args_init(&args, buf) || !at_args_int(&args, &val))
+			return -EINVAL;
+
+		telephony_response_and_hold_req(device, val < 0);
 		return 0;
 	}
 
@@ -997,15 +1117,17 @@ static int headset_set_gain(struct audio_device *device, uint16_t gain, char typ
 static int signal_gain_setting(struct audio_device *device, const char *buf)
 {
 	struct headset *hs = device->headset;
-	dbus_uint16_t gain;
-	int err;
+	struct at_args args;
+	int gain, err;
 
 	if (strlen(buf) < 8) {
 		error("Too short string for Gain setting");
 		return -EINVAL;
 	}
 
-	gain = (dbus_uint16_t) strtol(&buf[7], NULL, 10);
+	if (!at_args_init(&args, buf) || !at_args_int(&args, &gain) ||
+								gain < 0)
+		return -EINVAL;
 
 	err = headset_set_gain(device, gain, buf[5]);
 	if (err < 0 && err != -EALREADY)
@@ -1037,9 +1159,50 @@ static int dtmf_tone(struct audio_device *device, const char *buf)
 	return 0;
 }
 
+/* The lines of a listing are only for the headset that asked, and are
+ * sent along with the final result code */
+static void __attribute__((format(printf, 1, 2)))
+		listing_append(const char *format, ...)
+{
+	va_list ap;
+
+	if (ag.listing == NULL)
+		ag.listing = g_string_new(NULL);
+
+	va_start(ap, format);
+	g_string_append_vprintf(ag.listing, format, ap);
+	va_end(ap);
+}
+
+static int telephony_listing_rsp(struct audio_device *device,
+							cme_error_t err)
+{
+	struct headset *hs = device->headset;
+	GString *listing = ag.listing;
+	int ret;
+
+	ag.listing = NULL;
+
+	if (listing == NULL)
+		return telephony_generic_rsp(device, err);
+
+	if (err != CME_ERROR_NONE) {
+		g_string_free(listing, TRUE);
+		return telephony_generic_rsp(device, err);
+	}
+
+	g_string_append(listing, "\r\nOK\r\n");
+
+	ret = headset_write(hs, listing->str, listing->len);
+
+	g_string_free(listing, TRUE);
+
+	return ret;
+}
+
 int telephony_subscriber_number_rsp(void *telephony_device, cme_error_t err)
 {
-	return telephony_generic_rsp(telephony_device, err);
+	return telephony_listing_rsp(telephony_device, err);
 }
 
 static int subscriber_number(struct audio_device *device, const char *buf)
@@ -1051,7 +1214,7 @@ static int subscriber_number(struct audio_device *device, const char *buf)
 
 int telephony_list_current_calls_rsp(void *telephony_device, cme_error_t err)
 {
-	return telephony_generic_rsp(telephony_device, err);
+	return telephony_listing_rsp(telephony_device, err);
 }
 
 static int list_current_calls(struct audio_device *device, const char *buf)
@@ -1101,7 +1264,7 @@ static int call_waiting_notify(struct audio_device *device, const char *buf)
 
 int telephony_operator_selection_rsp(void *telephony_device, cme_error_t err)
 {
-	return telephony_generic_rsp(telephony_device, err);
+	return telephony_listing_rsp(telephony_device, err);
 }
 
 int telephony_call_hold_rsp(void *telephony_device, cme_error_t err)
@@ -1140,9 +1303,8 @@ int telephony_operator_selection_ind(int mode, const char *oper)
 	if (!active_devices)
 		return -ENODEV;
 
-	send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+COPS: %d,0,\"%s\"\r\n",
-				mode, oper);
+	listing_append("\r\n+COPS: %d,0,\"%s\"\r\n", mode, oper);
+
 	return 0;
 }
 
@@ -1208,6 +1370,82 @@ static int apple_command(struct audio_device *device, const char *buf)
 	return telephony_generic_rsp(device, CME_ERROR_NONE);
 }
 
+static int available_codecs(struct audio_device *dev, const char *buf)
+{
+	struct headset *hs = dev->headset;
+	struct headset_slc *slc = hs->slc;
+	struct at_args args;
+	int codec;
+
+	if (!at_args_init(&args, buf))
+		return -EINVAL;
+
+	slc->hf_msbc = FALSE;
+
+	while (at_args_int(&args, &codec)) {
+		if (codec == HFP_CODEC_MSBC)
+			slc->hf_msbc = TRUE;
+	}
+
+	/* The list changed, whatever was agreed before is stale */
+	slc->codec = 0;
+
+	DBG("HF codecs: CVSD%s", slc->hf_msbc ? " mSBC" : "");
+
+	return headset_send(hs, "\r\nOK\r\n");
+}
+
+static int codec_selection(struct audio_device *dev, const char *buf)
+{
+	struct headset *hs = dev->headset;
+	struct headset_slc *slc = hs->slc;
+	struct at_args args;
+	int codec, err;
+
+	if (!at_args_init(&args, buf) || !at_args_int(&args, &codec))
+		return -EINVAL;
+
+	if (slc->bcs_timer == 0)
+		return -EINVAL;
+
+	g_source_remove(slc->bcs_timer);
+	slc->bcs_timer = 0;
+
+	if (codec != preferred_codec(hs)) {
+		/* Don't offer mSBC again to a headset refusing it */
+		slc->hf_msbc = FALSE;
+		codec_setup_failed(dev, -EPROTO);
+		return -EINVAL;
+	}
+
+	err = headset_send(hs, "\r\nOK\r\n");
+	if (err < 0)
+		return err;
+
+	slc->codec = codec;
+
+	err = codec_setup(dev, codec);
+	if (err < 0)
+		codec_setup_failed(dev, err);
+
+	return 0;
+}
+
+static int codec_connection(struct audio_device *dev, const char *buf)
+{
+	struct headset *hs = dev->headset;
+	int err;
+
+	err = headset_send(hs, "\r\nOK\r\n");
+	if (err < 0)
+		return err;
+
+	if (hs->state != HEADSET_STATE_CONNECTED)
+		return 0;
+
+	return sco_connect(dev, NULL, NULL, NULL);
+}
+
 static struct event event_callbacks[] = {
 	{ "ATA", answer_call },
 	{ "ATD", dial_number },
@@ -1229,23 +1467,38 @@ static struct event event_callbacks[] = {
 	{ "AT+COPS", operator_selection },
 	{ "AT+NREC", nr_and_ec },
 	{ "AT+BVRA", voice_dial },
+	{ "AT+BAC", available_codecs },
+	{ "AT+BCS", codec_selection },
+	{ "AT+BCC", codec_connection },
 	{ "AT+XAPL", apple_command },
 	{ "AT+IPHONEACCEV", apple_command },
 	{ 0 }
 };
 
+/* Built from event_callbacks once, shared by all connections */
+static struct at_trie *event_trie = NULL;
+
+static void init_event_trie(void)
+{
+	unsigned int i;
+
+	event_trie = at_trie_new();
+
+	for (i = 0; event_callbacks[i].cmd; i++)
+		at_trie_add(event_trie, event_callbacks[i].cmd, i);
+}
+
 static int handle_event(struct audio_device *device, const char *buf)
 {
-	struct event *ev;
+	int id;
 
 	DBG("Received %s", buf);
 
-	for (ev = event_callbacks; ev->cmd; ev++) {
-		if (!strncmp(buf, ev->cmd, strlen(ev->cmd)))
-			return ev->callback(device, buf);
-	}
+	id = at_trie_lookup(event_trie, buf);
+	if (id < 0)
+		return -EINVAL;
 
-	return -EINVAL;
+	return event_callbacks[id].callback(device, buf);
 }
 
 static void close_sco(struct audio_device *device)
@@ -1264,6 +1517,10 @@ static void close_sco(struct audio_device *device)
 		g_source_remove(hs->sco_id);
 		hs->sco_id = 0;
 	}
+	if (hs->slc && hs->slc->bcs_timer) {
+		g_source_remove(hs->slc->bcs_timer);
+		hs->slc->bcs_timer = 0;
+	}
 }
 
 static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond,
@@ -1271,9 +1528,8 @@ static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond,
 {
 	struct headset *hs;
 	struct headset_slc *slc;
-	unsigned char buf[BUF_SIZE];
 	ssize_t bytes_read;
-	size_t free_space;
+	char *line;
 	int fd;
 
 	if (cond & G_IO_NVAL)
@@ -1289,62 +1545,32 @@ static gboolean rfcomm_io_cb(GIOChannel *chan, GIOCondition cond,
 
 	fd = g_io_channel_unix_get_fd(chan);
 
-	bytes_read = read(fd, buf, sizeof(buf) - 1);
-	if (bytes_read < 0)
-		return TRUE;
-
-	free_space = sizeof(slc->buf) - slc->data_start -
-			slc->data_length - 1;
-
-	if (free_space < (size_t) bytes_read) {
+	bytes_read = at_buf_read(&slc->buf, fd);
+	if (bytes_read == -ENOBUFS) {
 		/* Very likely that the HS is sending us garbage so
 		 * just ignore the data and disconnect */
 		error("Too much data to fit incomming buffer");
 		goto failed;
 	}
 
-	memcpy(&slc->buf[slc->data_start], buf, bytes_read);
-	slc->data_length += bytes_read;
-
-	/* Make sure the data is null terminated so we can use string
-	 * functions */
-	slc->buf[slc->data_start + slc->data_length] = '\0';
+	if (bytes_read < 0)
+		return TRUE;
 
-	while (slc->data_length > 0) {
-		char *cr;
+	/* Empty commands are silently skipped by the line splitter */
+	while ((line = at_buf_get_line(&slc->buf)) != NULL) {
 		int err;
-		off_t cmd_len;
-
-		cr = strchr(&slc->buf[slc->data_start], '\r');
-		if (!cr)
-			break;
-
-		cmd_len = 1 + (off_t) cr - (off_t) &slc->buf[slc->data_start];
-		*cr = '\0';
-
-		if (cmd_len > 1)
-			err = handle_event(device, &slc->buf[slc->data_start]);
-		else
-			/* Silently skip empty commands */
-			err = 0;
 
+		err = handle_event(device, line);
 		if (err == -EINVAL) {
 			error("Badly formated or unrecognized command: %s",
-					&slc->buf[slc->data_start]);
+									line);
 			err = telephony_generic_rsp(device,
 						CME_ERROR_NOT_SUPPORTED);
 			if (err < 0)
 				goto failed;
 		} else if (err < 0)
-			error("Error handling command %s: %s (%d)",
-						&slc->buf[slc->data_start],
+			error("Error handling command %s: %s (%d)", line,
 						strerror(-err), -err);
-
-		slc->data_start += cmd_len;
-		slc->data_length -= cmd_len;
-
-		if (!slc->data_length)
-			slc->data_start = 0;
 	}
 
 	return TRUE;
@@ -2245,6 +2471,9 @@ uint32_t headset_config_init(GKeyFile *config)
 	GError *err = NULL;
 	char *str;
 
+	if (event_trie == NULL)
+		init_event_trie();
+
 	/* Use the default values if there is no config file */
 	if (config == NULL)
 		return ag.features;
@@ -2277,9 +2506,29 @@ uint32_t headset_config_init(GKeyFile *config)
 		g_free(str);
 	}
 
+	/* mSBC frames can only be carried over transparent HCI SCO */
+	str = g_key_file_get_string(config, "Headset", "WidebandSpeech",
+					&err);
+	if (err) {
+		DBG("audio.conf: %s", err->message);
+		g_clear_error(&err);
+	} else {
+		wideband_speech = strcmp(str, "true") == 0 && sco_hci;
+		g_free(str);
+	}
+
+	if (wideband_speech)
+		ag.features |= AG_FEATURE_CODEC_NEGOTIATION;
+
 	return ag.features;
 }
 
+void headset_config_exit(void)
+{
+	at_trie_free(event_trie);
+	event_trie = NULL;
+}
+
 static gboolean hs_dc_timeout(struct audio_device *dev)
 {
 	headset_set_state(dev, HEADSET_STATE_DISCONNECTED);
@@ -2491,6 +2740,14 @@ int headset_connect_sco(struct audio_device *dev, GIOChannel *io)
 
 	hs->sco = g_io_channel_ref(io);
 
+	/* The listening socket only accepts the CVSD air mode, any codec
+	 * connection setup still in progress is overtaken by this link */
+	hs->sco_codec = HFP_CODEC_CVSD;
+	if (slc->bcs_timer) {
+		g_source_remove(slc->bcs_timer);
+		slc->bcs_timer = 0;
+	}
+
 	if (slc->pending_ring) {
 		ring_timer_cb(NULL);
 		ag.ring_timer = g_timeout_add_seconds(RING_INTERVAL,
@@ -2763,6 +3020,16 @@ gboolean headset_get_sco_hci(struct audio_device *dev)
 	return sco_hci;
 }
 
+uint8_t headset_get_codec(struct audio_device *dev)
+{
+	struct headset *hs = dev->headset;
+
+	if (hs->sco)
+		return hs->sco_codec;
+
+	return preferred_codec(hs);
+}
+
 void headset_shutdown(struct audio_device *dev)
 {
 	struct pending_connect *p = dev->headset->pending;
@@ -2774,6 +3041,59 @@ void headset_shutdown(struct audio_device *dev)
 	headset_set_state(dev, HEADSET_STATE_DISCONNECTED);
 }
 
+/* Sends the indicators changed since the last call, each once with its
+ * current value and all of them in a single write per headset */
+static void send_indicators(void)
+{
+	uint32_t changed = ag.changed_ind;
+	GString *str;
+	int i;
+
+	if (ag.ciev_id) {
+		g_source_remove(ag.ciev_id);
+		ag.ciev_id = 0;
+	}
+
+	if (changed == 0)
+		return;
+
+	ag.changed_ind = 0;
+
+	if (!active_devices || !ag.er_ind)
+		return;
+
+	str = g_string_new(NULL);
+
+	for (i = 0; ag.indicators[i].desc != NULL; i++) {
+		if (changed & (1 << i))
+			g_string_append_printf(str, "\r\n+CIEV: %d,%d\r\n",
+						i + 1, ag.indicators[i].val);
+	}
+
+	send_foreach_headset(active_devices, hfp_cmp, "%s", str->str);
+
+	g_string_free(str, TRUE);
+}
+
+static gboolean send_indicators_cb(gpointer user_data)
+{
+	ag.ciev_id = 0;
+
+	send_indicators();
+
+	return FALSE;
+}
+
+/* Every step of a call state transition matters to the headset, these
+ * can't be collapsed into the latest value */
+static gboolean call_indicator(int index)
+{
+	const char *desc = ag.indicators[index].desc;
+
+	return g_str_equal(desc, "call") || g_str_equal(desc, "callsetup") ||
+					g_str_equal(desc, "callheld");
+}
+
 int telephony_event_ind(int index)
 {
 	if (!active_devices)
@@ -2784,9 +3104,19 @@ int telephony_event_ind(int index)
 		return -EINVAL;
 	}
 
-	send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+CIEV: %d,%d\r\n", index + 1,
-				ag.indicators[index].val);
+	if (index >= 32)
+		return -EINVAL;
+
+	/* The value not sent yet goes out before it's overwritten */
+	if ((ag.changed_ind & (1 << index)) && call_indicator(index))
+		send_indicators();
+
+	/* A burst of changes from the telephony backend goes out from the
+	 * main loop, unless another result has to be sent before */
+	ag.changed_ind |= 1 << index;
+
+	if (ag.ciev_id == 0)
+		ag.ciev_id = g_idle_add(send_indicators_cb, NULL);
 
 	return 0;
 }
@@ -2884,6 +3214,8 @@ int telephony_ready_ind(uint32_t features,
 {
 	ag.telephony_ready = TRUE;
 	ag.features = features;
+	if (wideband_speech)
+		ag.features |= AG_FEATURE_CODEC_NEGOTIATION;
 	ag.indicators = indicators;
 	ag.rh = rh;
 	ag.chld = chld;
@@ -2899,6 +3231,12 @@ int telephony_deinit(void)
 {
 	g_free(ag.number);
 
+	if (ag.ciev_id)
+		g_source_remove(ag.ciev_id);
+
+	if (ag.listing)
+		g_string_free(ag.listing, TRUE);
+
 	memset(&ag, 0, sizeof(ag));
 
 	ag.er_mode = 3;
@@ -2917,12 +3255,10 @@ int telephony_list_current_call_ind(int idx, int dir, int status, int mode,
 		return -ENODEV;
 
 	if (number && strlen(number) > 0)
-		send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+CLCC: %d,%d,%d,%d,%d,\"%s\",%d\r\n",
+		listing_append("\r\n+CLCC: %d,%d,%d,%d,%d,\"%s\",%d\r\n",
 				idx, dir, status, mode, mprty, number, type);
 	else
-		send_foreach_headset(active_devices, hfp_cmp,
-					"\r\n+CLCC: %d,%d,%d,%d,%d\r\n",
+		listing_append("\r\n+CLCC: %d,%d,%d,%d,%d\r\n",
 					idx, dir, status, mode, mprty);
 
 	return 0;
@@ -2933,9 +3269,7 @@ int telephony_subscriber_number_ind(const char *number, int type, int service)
 	if (!active_devices)
 		return -ENODEV;
 
-	send_foreach_headset(active_devices, hfp_cmp,
-				"\r\n+CNUM: ,%s,%d,,%d\r\n",
-				number, type, service);
+	listing_append("\r\n+CNUM: ,%s,%d,,%d\r\n", number, type, service);
 
 	return 0;
 }
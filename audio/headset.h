@@ -63,6 +63,7 @@ struct headset *headset_init(struct audio_device *dev, uint16_t svc,
 void headset_unregister(struct audio_device *dev);
 
 uint32_t headset_config_init(GKeyFile *config);
+void headset_config_exit(void);
 
 void headset_update(struct audio_device *dev, uint16_t svc,
 			const char *uuidstr);
@@ -102,6 +103,7 @@ unsigned int headset_add_nrec_cb(struct audio_device *dev,
 gboolean headset_remove_nrec_cb(struct audio_device *dev, unsigned int id);
 gboolean headset_get_inband(struct audio_device *dev);
 gboolean headset_get_sco_hci(struct audio_device *dev);
+uint8_t headset_get_codec(struct audio_device *dev);
 
 gboolean headset_is_active(struct audio_device *dev);
 
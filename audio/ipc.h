@@ -113,6 +113,7 @@ typedef struct {
 #define BT_CAPABILITIES_ACCESS_MODE_READWRITE	3
 
 #define BT_FLAG_AUTOCONNECT	1
+#define BT_FLAG_LOW_LATENCY	2
 
 struct bt_get_capabilities_req {
 	bt_audio_msg_header_t	h;
@@ -175,6 +176,7 @@ struct bt_get_capabilities_req {
 #define BT_MPEG_LAYER_3				1
 
 #define BT_HFP_CODEC_PCM			0x00
+#define BT_HFP_CODEC_MSBC			0x01
 
 #define BT_PCM_FLAG_NREC			0x01
 #define BT_PCM_FLAG_PCM_ROUTING			0x02
@@ -234,6 +236,7 @@ struct bt_open_req {
 	char			object[128];	/* DBus object path */
 	uint8_t			seid;		/* Requested capability configuration to lock */
 	uint8_t			lock;		/* Requested lock */
+	uint8_t			flags;		/* Requested flags */
 } __attribute__ ((packed));
 
 struct bt_open_rsp {
@@ -378,7 +378,11 @@ static sdp_record_t *hfp_ag_record(uint8_t ch, uint32_t feat)
 	sdp_set_service_classes(record, svclass_id);
 
 	sdp_uuid16_create(&profile.uuid, HANDSFREE_PROFILE_ID);
-	profile.version = 0x0105;
+	/* Wide band speech needs the 1.6 codec negotiation */
+	if (feat & AG_FEATURE_CODEC_NEGOTIATION)
+		profile.version = 0x0106;
+	else
+		profile.version = 0x0105;
 	pfseq = sdp_list_append(0, &profile);
 	sdp_set_profile_descs(record, pfseq);
 
@@ -393,6 +397,8 @@ static sdp_record_t *hfp_ag_record(uint8_t ch, uint32_t feat)
 	apseq = sdp_list_append(apseq, proto[1]);
 
 	sdpfeat = (uint16_t) feat & 0xF;
+	if (feat & AG_FEATURE_CODEC_NEGOTIATION)
+		sdpfeat |= 0x20;	/* Wide band speech */
 	features = sdp_data_alloc(SDP_UINT16, &sdpfeat);
 	sdp_attr_add(record, SDP_ATTR_SUPPORTED_FEATURES, features);
 
@@ -1285,8 +1291,10 @@ void audio_manager_exit(void)
 	if (enabled.media)
 		btd_unregister_adapter_driver(&media_server_driver);
 
-	if (enabled.headset)
+	if (enabled.headset) {
 		btd_unregister_adapter_driver(&headset_server_driver);
+		headset_config_exit();
+	}
 
 	if (enabled.gateway)
 		btd_unregister_adapter_driver(&gateway_server_driver);
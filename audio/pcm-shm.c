@@ -0,0 +1,625 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2007  Nokia Corporation
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "rtp.h"
+#include "rtp-sbc.h"
+#include "a2dp-codecs.h"
+#include "codec.h"
+#include "pcm-shm.h"
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_SEAL_SEAL 0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+
+/* Roughly 200 ms of 48 kHz stereo per client */
+#define PCM_SHM_RING_SIZE	(1 << 16)
+
+/* Packets without any client data before the encoder goes to sleep */
+#define PCM_SHM_IDLE_PACKETS	8
+
+/* Never send more than this many late packets in a single burst */
+#define PCM_SHM_MAX_CATCHUP	4
+
+/* Packets kept around while the socket is full */
+#define PCM_SHM_PACKETS		4
+
+struct pcm_shm_client {
+	struct pcm_shm *shm;
+	unsigned int id;
+	struct pcm_shm_ring *ring;
+	size_t map_size;
+	uint32_t mask;			/* Ring size - 1, never read back */
+	uint32_t head;			/* Private copy of ring->head */
+	int doorbell;
+	guint watch;
+};
+
+/* Every sink gets its own packets and send queue so that one that can't
+ * keep up only loses its own oldest packets */
+struct pcm_shm_sink {
+	int fd;				/* Stream transport */
+	uint16_t omtu;
+	struct rtp_sbc_payloader pay;
+	unsigned int dropped;		/* Last reported drop count */
+};
+
+struct pcm_shm {
+	GSList *sinks;
+	uint8_t *configuration;
+	size_t size;
+	const struct a2dp_codec *codec;
+	void *codec_data;
+	unsigned int rate;
+	unsigned int channels;
+	unsigned int codesize;
+	unsigned int frame_samples;
+	size_t frame_length;
+	unsigned int frames_per_packet;
+	uint64_t packet_nsec;
+	int16_t *mix;
+	uint8_t *frame;			/* Encoded once for all sinks */
+	int timer;
+	guint timer_watch;
+	gboolean running;
+	unsigned int idle;
+	unsigned int next_id;
+	GSList *clients;
+};
+
+static void timer_set(struct pcm_shm *shm, gboolean enable)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+
+	if (enable) {
+		its.it_interval.tv_sec = shm->packet_nsec / 1000000000;
+		its.it_interval.tv_nsec = shm->packet_nsec % 1000000000;
+		its.it_value = its.it_interval;
+	}
+
+	if (timerfd_settime(shm->timer, 0, &its, NULL) < 0)
+		error("timerfd_settime: %s (%d)", strerror(errno), errno);
+
+	shm->running = enable;
+	shm->idle = 0;
+}
+
+static inline int16_t mix_sample(int16_t a, int16_t b)
+{
+	int32_t s = a + b;
+
+	if (s > INT16_MAX)
+		return INT16_MAX;
+
+	if (s < INT16_MIN)
+		return INT16_MIN;
+
+	return s;
+}
+
+/* Add one codesize worth of samples from the ring into the mix buffer,
+ * clients that are short of a full frame contribute silence */
+static gboolean mix_client(struct pcm_shm *shm, struct pcm_shm_client *client)
+{
+	struct pcm_shm_ring *ring = client->ring;
+	uint32_t head = client->head;
+	unsigned int i, n = shm->codesize / sizeof(int16_t);
+
+	/* Only tail is taken from the client, everything that decides
+	 * where samples are read from is kept on this side */
+	if (ring->tail - head < shm->codesize)
+		return FALSE;
+
+	/* Don't read samples before the tail that published them */
+	__sync_synchronize();
+
+	for (i = 0; i < n; i++) {
+		uint32_t pos = (head + i * sizeof(int16_t)) & client->mask;
+		int16_t *sample = (void *) (ring->data + pos);
+
+		shm->mix[i] = mix_sample(shm->mix[i], *sample);
+	}
+
+	client->head = head + shm->codesize;
+
+	__sync_synchronize();
+	ring->head = client->head;
+
+	return TRUE;
+}
+
+static gboolean mix_frame(struct pcm_shm *shm)
+{
+	gboolean found = FALSE;
+	GSList *l;
+
+	memset(shm->mix, 0, shm->codesize);
+
+	for (l = shm->clients; l; l = l->next) {
+		if (mix_client(shm, l->data))
+			found = TRUE;
+	}
+
+	return found;
+}
+
+static void sink_add_frame(struct pcm_shm *shm, struct pcm_shm_sink *sink,
+								size_t len)
+{
+	size_t room;
+	uint8_t *dst;
+
+	dst = rtp_sbc_payloader_get_frame(&sink->pay, &room);
+	if (len > room) {
+		rtp_sbc_payloader_complete(&sink->pay);
+		dst = rtp_sbc_payloader_get_frame(&sink->pay, &room);
+	}
+
+	memcpy(dst, shm->frame, len);
+	rtp_sbc_payloader_commit(&sink->pay, len, shm->frame_samples);
+}
+
+static void sink_send(struct pcm_shm_sink *sink)
+{
+	int err;
+
+	/* Short of data, send what there is rather than hold it back */
+	rtp_sbc_payloader_complete(&sink->pay);
+
+	err = rtp_sbc_payloader_send(&sink->pay, sink->fd);
+	if (err < 0 && err != -EAGAIN)
+		DBG("fd %d send: %s (%d)", sink->fd, strerror(-err), -err);
+
+	if (sink->pay.dropped != sink->dropped) {
+		DBG("fd %d too slow, %u packets dropped", sink->fd,
+						sink->pay.dropped);
+		sink->dropped = sink->pay.dropped;
+	}
+}
+
+static gboolean encode_packet(struct pcm_shm *shm)
+{
+	unsigned int frames;
+	GSList *l;
+
+	for (frames = 0; frames < shm->frames_per_packet; frames++) {
+		ssize_t encoded;
+		size_t written;
+
+		if (!mix_frame(shm))
+			break;
+
+		encoded = shm->codec->encode(shm->codec_data, shm->mix,
+						shm->codesize, shm->frame,
+						shm->frame_length, &written);
+		if (encoded <= 0) {
+			error("%s encoding failed: %zd", shm->codec->name,
+								encoded);
+			break;
+		}
+
+		for (l = shm->sinks; l; l = l->next)
+			sink_add_frame(shm, l->data, written);
+	}
+
+	if (frames == 0)
+		return FALSE;
+
+	for (l = shm->sinks; l; l = l->next)
+		sink_send(l->data);
+
+	return TRUE;
+}
+
+static gboolean timer_cb(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct pcm_shm *shm = data;
+	uint64_t expired;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		shm->timer_watch = 0;
+		return FALSE;
+	}
+
+	if (read(shm->timer, &expired, sizeof(expired)) != sizeof(expired))
+		return TRUE;
+
+	/* Being late by more than a few packets means the data is stale
+	 * already, don't flood the link trying to make up for it */
+	if (expired > PCM_SHM_MAX_CATCHUP)
+		expired = PCM_SHM_MAX_CATCHUP;
+
+	while (expired--) {
+		if (encode_packet(shm)) {
+			shm->idle = 0;
+			continue;
+		}
+
+		if (++shm->idle >= PCM_SHM_IDLE_PACKETS) {
+			DBG("No PCM data, stopping encoder");
+			timer_set(shm, FALSE);
+			break;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean doorbell_cb(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct pcm_shm_client *client = data;
+	struct pcm_shm *shm = client->shm;
+	uint64_t value;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		client->watch = 0;
+		return FALSE;
+	}
+
+	if (read(client->doorbell, &value, sizeof(value)) != sizeof(value))
+		return TRUE;
+
+	if (!shm->running)
+		timer_set(shm, TRUE);
+
+	return TRUE;
+}
+
+static guint add_watch(int fd, GIOFunc func, gpointer user_data)
+{
+	GIOChannel *io;
+	guint id;
+
+	io = g_io_channel_unix_new(fd);
+	id = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP | G_IO_NVAL,
+							func, user_data);
+	g_io_channel_unref(io);
+
+	return id;
+}
+
+static void sink_free(struct pcm_shm_sink *sink)
+{
+	if (sink->pay.packets)
+		rtp_sbc_payloader_free(&sink->pay);
+
+	g_free(sink);
+}
+
+/* The encoder runs at the pace of the smallest MTU, sinks with room for
+ * more frames just get shorter packets */
+static void update_packet_size(struct pcm_shm *shm)
+{
+	unsigned int frames = RTP_SBC_MAX_FRAMES;
+	GSList *l;
+
+	for (l = shm->sinks; l; l = l->next) {
+		struct pcm_shm_sink *sink = l->data;
+
+		frames = MIN(frames, (sink->omtu - RTP_SBC_HEADER_SIZE) /
+							shm->frame_length);
+	}
+
+	if (frames == shm->frames_per_packet)
+		return;
+
+	shm->frames_per_packet = frames;
+	shm->packet_nsec = (uint64_t) shm->frames_per_packet *
+				shm->frame_samples * 1000000000 / shm->rate;
+
+	DBG("%u frames per packet, period %llu ns", shm->frames_per_packet,
+				(unsigned long long) shm->packet_nsec);
+
+	if (shm->running)
+		timer_set(shm, TRUE);
+}
+
+struct pcm_shm *pcm_shm_new(int fd, uint16_t omtu,
+				const uint8_t *configuration, size_t size)
+{
+	const struct a2dp_codec *codec;
+	struct pcm_shm *shm;
+
+	/* Mixed PCM is encoded here and carried as RTP SBC payload */
+	codec = a2dp_codec_find(A2DP_CODEC_SBC);
+	if (codec == NULL || codec->init == NULL || codec->encode == NULL ||
+						size != codec->caps_size)
+		return NULL;
+
+	shm = g_new0(struct pcm_shm, 1);
+	shm->timer = -1;
+
+	if (codec->get_pcm_format(configuration, &shm->rate,
+						&shm->channels) < 0 ||
+			codec->init(&shm->codec_data, configuration) < 0) {
+		error("Invalid %s configuration", codec->name);
+		goto fail;
+	}
+
+	shm->codec = codec;
+	shm->configuration = g_memdup(configuration, size);
+	shm->size = size;
+	shm->codesize = codec->get_codesize(shm->codec_data);
+	shm->frame_samples = shm->codesize / (shm->channels * sizeof(int16_t));
+	shm->frame_length = codec->get_frame_length(shm->codec_data);
+
+	shm->mix = g_malloc(shm->codesize);
+	shm->frame = g_malloc(shm->frame_length);
+
+	shm->timer = timerfd_create(CLOCK_MONOTONIC,
+					TFD_NONBLOCK | TFD_CLOEXEC);
+	if (shm->timer < 0) {
+		error("timerfd_create: %s (%d)", strerror(errno), errno);
+		goto fail;
+	}
+
+	shm->timer_watch = add_watch(shm->timer, timer_cb, shm);
+
+	if (pcm_shm_add_sink(shm, fd, omtu) < 0)
+		goto fail;
+
+	DBG("codesize %u, frame length %zu", shm->codesize,
+							shm->frame_length);
+
+	return shm;
+
+fail:
+	pcm_shm_free(shm);
+	return NULL;
+}
+
+gboolean pcm_shm_match(struct pcm_shm *shm, const uint8_t *configuration,
+								size_t size)
+{
+	if (size != shm->size)
+		return FALSE;
+
+	return memcmp(configuration, shm->configuration, size) == 0;
+}
+
+int pcm_shm_add_sink(struct pcm_shm *shm, int fd, uint16_t omtu)
+{
+	struct pcm_shm_sink *sink;
+	int err;
+
+	if (omtu < RTP_SBC_HEADER_SIZE + shm->frame_length) {
+		error("MTU %u too small for %s frames", omtu,
+							shm->codec->name);
+		return -EMSGSIZE;
+	}
+
+	sink = g_new0(struct pcm_shm_sink, 1);
+	sink->fd = fd;
+	sink->omtu = omtu;
+
+	err = rtp_sbc_payloader_init(&sink->pay, PCM_SHM_PACKETS, omtu);
+	if (err < 0) {
+		error("Unable to allocate packets: %s (%d)", strerror(-err),
+									-err);
+		g_free(sink);
+		return err;
+	}
+
+	shm->sinks = g_slist_append(shm->sinks, sink);
+
+	DBG("sink fd %d, omtu %u", fd, omtu);
+
+	update_packet_size(shm);
+
+	return 0;
+}
+
+unsigned int pcm_shm_remove_sink(struct pcm_shm *shm, int fd)
+{
+	GSList *l;
+
+	for (l = shm->sinks; l; l = l->next) {
+		struct pcm_shm_sink *sink = l->data;
+
+		if (sink->fd != fd)
+			continue;
+
+		DBG("sink fd %d", fd);
+
+		shm->sinks = g_slist_remove(shm->sinks, sink);
+		sink_free(sink);
+
+		if (shm->sinks != NULL)
+			update_packet_size(shm);
+
+		break;
+	}
+
+	return g_slist_length(shm->sinks);
+}
+
+static void client_free(struct pcm_shm_client *client)
+{
+	if (client->watch > 0)
+		g_source_remove(client->watch);
+
+	if (client->ring)
+		munmap(client->ring, client->map_size);
+
+	if (client->doorbell >= 0)
+		close(client->doorbell);
+
+	g_free(client);
+}
+
+void pcm_shm_free(struct pcm_shm *shm)
+{
+	g_slist_free_full(shm->clients, (GDestroyNotify) client_free);
+
+	if (shm->timer_watch > 0)
+		g_source_remove(shm->timer_watch);
+
+	if (shm->timer >= 0)
+		close(shm->timer);
+
+	if (shm->codec_data)
+		shm->codec->free(shm->codec_data);
+
+	g_slist_free_full(shm->sinks, (GDestroyNotify) sink_free);
+
+	g_free(shm->configuration);
+	g_free(shm->frame);
+	g_free(shm->mix);
+	g_free(shm);
+}
+
+/* The ring is mapped by bluetoothd too, the client must not be able to
+ * resize it underneath, so sealing is required */
+static int create_memfd(size_t size)
+{
+	int fd = -1, err;
+
+	errno = ENOSYS;
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, "bluez-pcm",
+					MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+	if (fd < 0)
+		return -errno;
+
+	if (ftruncate(fd, size) < 0)
+		goto fail;
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+							F_SEAL_SEAL) < 0)
+		goto fail;
+
+	return fd;
+
+fail:
+	err = -errno;
+	close(fd);
+	return err;
+}
+
+int pcm_shm_add_client(struct pcm_shm *shm, int *memfd, int *doorbell)
+{
+	struct pcm_shm_client *client;
+	int fd, err;
+
+	client = g_new0(struct pcm_shm_client, 1);
+	client->shm = shm;
+	client->doorbell = -1;
+	client->map_size = sizeof(struct pcm_shm_ring) + PCM_SHM_RING_SIZE;
+	client->mask = PCM_SHM_RING_SIZE - 1;
+
+	fd = create_memfd(client->map_size);
+	if (fd < 0) {
+		err = fd;
+		goto fail;
+	}
+
+	client->ring = mmap(NULL, client->map_size, PROT_READ | PROT_WRITE,
+							MAP_SHARED, fd, 0);
+	if (client->ring == MAP_FAILED) {
+		err = -errno;
+		client->ring = NULL;
+		close(fd);
+		goto fail;
+	}
+
+	client->ring->magic = PCM_SHM_MAGIC;
+	client->ring->size = PCM_SHM_RING_SIZE;
+	client->ring->rate = shm->rate;
+	client->ring->channels = shm->channels;
+
+	client->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (client->doorbell < 0) {
+		err = -errno;
+		close(fd);
+		goto fail;
+	}
+
+	client->watch = add_watch(client->doorbell, doorbell_cb, client);
+	client->id = ++shm->next_id;
+
+	shm->clients = g_slist_append(shm->clients, client);
+
+	DBG("client %u, ring %u bytes", client->id, PCM_SHM_RING_SIZE);
+
+	*memfd = fd;
+	*doorbell = client->doorbell;
+
+	return client->id;
+
+fail:
+	error("Unable to create PCM ring: %s (%d)", strerror(-err), -err);
+	client_free(client);
+	return err;
+}
+
+void pcm_shm_remove_client(struct pcm_shm *shm, unsigned int id)
+{
+	GSList *l;
+
+	for (l = shm->clients; l; l = l->next) {
+		struct pcm_shm_client *client = l->data;
+
+		if (client->id != id)
+			continue;
+
+		DBG("client %u", id);
+
+		shm->clients = g_slist_remove(shm->clients, client);
+		client_free(client);
+		return;
+	}
+}
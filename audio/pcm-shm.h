@@ -0,0 +1,52 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2007  Nokia Corporation
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define PCM_SHM_MAGIC		0x424c5a50	/* "PZLB" */
+
+/* Layout of the shared memory handed out by MediaTransport.AcquireShared.
+ * Samples are signed 16 bit, host endian and interleaved. Positions are
+ * free running byte counters, the offset in data is position % size. */
+struct pcm_shm_ring {
+	uint32_t magic;
+	uint32_t size;			/* Bytes of PCM data, power of two */
+	uint32_t rate;
+	uint32_t channels;
+	volatile uint32_t head;		/* Advanced by bluetoothd only */
+	volatile uint32_t tail;		/* Advanced by the client only */
+	uint8_t data[0];
+};
+
+struct pcm_shm;
+
+struct pcm_shm *pcm_shm_new(int fd, uint16_t omtu,
+				const uint8_t *configuration, size_t size);
+void pcm_shm_free(struct pcm_shm *shm);
+
+gboolean pcm_shm_match(struct pcm_shm *shm, const uint8_t *configuration,
+								size_t size);
+int pcm_shm_add_sink(struct pcm_shm *shm, int fd, uint16_t omtu);
+unsigned int pcm_shm_remove_sink(struct pcm_shm *shm, int fd);
+
+int pcm_shm_add_client(struct pcm_shm *shm, int *memfd, int *doorbell);
+void pcm_shm_remove_client(struct pcm_shm *shm, unsigned int id);
@@ -28,14 +28,20 @@
 
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
 #include <sys/un.h>
 #include <time.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <limits.h>
 
 #include <netinet/in.h>
+#include <linux/sockios.h>
 
 #include <alsa/asoundlib.h>
 #include <alsa/pcm_external.h>
@@ -43,6 +49,8 @@
 #include "ipc.h"
 #include "sbc.h"
 #include "rtp.h"
+#include "rtp-sbc.h"
+#include "sco-pcm.h"
 
 /* #define ENABLE_DEBUG */
 
@@ -52,6 +60,24 @@
 
 #define BUFFER_SIZE 2048
 
+/* Number of RTP packets which can be queued for a single send call */
+#define A2DP_PACKETS 8
+
+/* Received packets waiting for a missing one before it is skipped */
+#define A2DP_JITTER_DEPTH 3
+
+/* SCHED_FIFO priority of the encoder thread above the minimum */
+#define A2DP_ENCODER_PRIORITY 10
+
+/* SBC frames per packet in low latency mode, about 12 ms at 44.1 kHz */
+#define A2DP_LOW_LATENCY_FRAMES 4
+
+/* SCO packets the capture jitter buffer holds, about 100 ms */
+#define SCO_RX_PACKETS 32
+
+/* SCO packets kept queued in the kernel for playback */
+#define SCO_TX_TARGET 4
+
 #ifdef ENABLE_DEBUG
 #define DBG(fmt, arg...)  printf("DEBUG: %s: " fmt "\n" , __FUNCTION__ , ## arg)
 #else
@@ -81,6 +107,11 @@
 #define MAX_BITPOOL 64
 #define MIN_BITPOOL 2
 
+/* Socket backlog, in packets, above which the link is congested */
+#define BITPOOL_CONGESTION 2
+/* Consecutive uncongested flushes before the bitpool is raised again */
+#define BITPOOL_RECOVERY 64
+
 /* adapted from glibc sys/time.h timersub() macro */
 #define priv_timespecsub(a, b, result)					\
 	do {								\
@@ -97,13 +128,18 @@ struct bluetooth_a2dp {
 	sbc_t sbc;				/* Codec data */
 	int sbc_initialized;			/* Keep track if the encoder is initialized */
 	unsigned int codesize;			/* SBC codesize */
-	int samples;				/* Number of encoded samples */
-	uint8_t buffer[BUFFER_SIZE];		/* Codec transfer buffer */
-	unsigned int count;			/* Codec transfer buffer counter */
-
-	int nsamples;				/* Cumulative number of codec samples */
-	uint16_t seq_num;			/* Cumulative packet sequence */
-	int frame_count;			/* Current frames in buffer*/
+	struct rtp_sbc_payloader pay;		/* Outgoing RTP packets */
+	struct rtp_sbc_depayloader depay;	/* Incoming RTP packets */
+	uint8_t frames[BUFFER_SIZE];		/* Received frames to decode */
+	unsigned int frames_len;
+	unsigned int frames_pos;
+	int backlog;				/* Bytes queued in the socket */
+	unsigned int uncongested;		/* Flushes without congestion */
+	volatile uint16_t remote_delay;		/* Sink delay report, 1/10 ms */
+	unsigned int latency_min;		/* Queued locally after each */
+	unsigned int latency_max;		/* send, in usec */
+	unsigned long long latency_sum;
+	unsigned int latency_count;
 };
 
 struct bluetooth_alsa_config {
@@ -124,6 +160,24 @@ struct bluetooth_alsa_config {
 	uint8_t bitpool;		/* A2DP only */
 	int has_bitpool;
 	int autoconnect;
+	int realtime;			/* A2DP only */
+	int low_latency;		/* A2DP only */
+};
+
+struct bluetooth_sco {
+	struct sco_pcm_rx rx;			/* Capture jitter buffer */
+	struct sco_pcm_queue queue;		/* Playback queue in the kernel */
+	struct sco_pcm_resampler resampler;	/* Playback clock drift */
+	int queue_valid;
+
+	int msbc;				/* Wideband speech */
+	sbc_t sbc;
+	int sbc_initialized;
+	unsigned int seq;			/* Next H2 sequence number */
+	struct sco_msbc_deframer deframer;
+	uint8_t pcm[SCO_MSBC_CODESIZE];		/* One mSBC frame worth */
+	unsigned int pcm_pos;
+	unsigned int pcm_len;
 };
 
 struct bluetooth_data {
@@ -137,16 +191,63 @@ struct bluetooth_data {
 	uint8_t buffer[BUFFER_SIZE];		/* Encoded transfer buffer */
 	unsigned int count;				/* Transfer buffer counter */
 	struct bluetooth_a2dp a2dp;			/* A2DP data */
+	struct bluetooth_sco sco;			/* SCO data */
 
 	pthread_t hw_thread;				/* Makes virtual hw pointer move */
-	int pipefd[2];					/* Inter thread communication */
+	int event_fd;					/* Periods the hw pointer moved */
 	int stopped;
 	sig_atomic_t reset;				/* Request XRUN handling */
+
+	pthread_t encoder_thread;			/* Real-time A2DP encoder */
+	volatile int encoder_quit;
+	uint8_t *pcm_ring;				/* PCM waiting to be encoded */
+	unsigned int pcm_ring_size;			/* Power of two, in bytes */
+	volatile unsigned int pcm_head;			/* Advanced by encoder only */
+	volatile unsigned int pcm_tail;			/* Advanced by transfer only */
 };
 
 static int audioservice_send(int sk, const bt_audio_msg_header_t *msg);
-static int audioservice_expect(int sk, bt_audio_msg_header_t *outmsg,
-							int expected_type);
+static int audioservice_recv(int sk, bt_audio_msg_header_t *inmsg);
+static int audioservice_expect(struct bluetooth_data *data,
+					bt_audio_msg_header_t *outmsg,
+					int expected_type);
+static int a2dp_encoder_start(struct bluetooth_data *data);
+static void a2dp_encoder_stop(struct bluetooth_data *data);
+static void a2dp_report_delay(struct bluetooth_data *data);
+static snd_pcm_sframes_t a2dp_local_delay(struct bluetooth_data *data);
+
+/* The only indication bluetoothd sends unsolicited is the delay the
+ * remote sink reported, it can arrive at any time while streaming */
+static void bluetooth_handle_indication(struct bluetooth_data *data,
+					const bt_audio_msg_header_t *msg)
+{
+	const struct bt_delay_report_ind *ind = (const void *) msg;
+
+	if (msg->name != BT_DELAY_REPORT || msg->length < sizeof(*ind))
+		return;
+
+	DBG("Remote delay %u.%u ms", ind->delay / 10, ind->delay % 10);
+
+	data->a2dp.remote_delay = ind->delay;
+}
+
+static int bluetooth_recv_indication(struct bluetooth_data *data)
+{
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	bt_audio_msg_header_t *msg = (void *) buf;
+	int err;
+
+	msg->length = sizeof(buf);
+
+	err = audioservice_recv(data->server.fd, msg);
+	if (err < 0)
+		return err;
+
+	if (msg->type == BT_INDICATION)
+		bluetooth_handle_indication(data, msg);
+
+	return 0;
+}
 
 static int bluetooth_start(snd_pcm_ioplug_t *io)
 {
@@ -209,18 +310,15 @@ static void *playback_hw_thread(void *param)
 		periods = 1.0 * dtime / period_time;
 
 		if (periods > prev_periods) {
-			char c = 'w';
-			int frags = periods - prev_periods, n;
+			uint64_t frags = periods - prev_periods;
 
 			data->hw_ptr += frags *	data->io.period_size;
 			data->hw_ptr %= data->io.buffer_size;
 
-			for (n = 0; n < frags; n++) {
-				/* Notify user that hardware pointer
-				 * has moved * */
-				if (write(data->pipefd[1], &c, 1) < 0)
-					pthread_testcancel();
-			}
+			/* Notify user that hardware pointer has moved, all
+			 * periods are signalled with a single write */
+			if (write(data->event_fd, &frags, sizeof(frags)) < 0)
+				pthread_testcancel();
 
 			/* Reset point of reference to avoid too big values
 			 * that wont fit an unsigned int */
@@ -243,20 +341,41 @@ iter_sleep:
 				break;
 			}
 		} else if (ret > 0) {
-			ret = (fds[0].revents) ? 0 : 1;
-			SNDERR("poll fd %d revents %d", ret, fds[ret].revents);
-			if (fds[ret].revents & (POLLERR | POLLHUP | POLLNVAL))
+			if ((fds[0].revents & POLLIN) &&
+					bluetooth_recv_indication(data) < 0)
 				break;
+
+			fds[0].revents &= ~POLLIN;
+			if (fds[0].revents || fds[1].revents) {
+				ret = (fds[0].revents) ? 0 : 1;
+				SNDERR("poll fd %d revents %d", ret,
+							fds[ret].revents);
+				if (fds[ret].revents &
+						(POLLERR | POLLHUP | POLLNVAL))
+					break;
+			}
 		}
 
 		/* Offer opportunity to be canceled by main thread */
 		pthread_testcancel();
 	}
 
-	data->hw_thread = 0;
+	/* hw_thread stays set, the main thread joins it when stopping */
 	pthread_exit(NULL);
 }
 
+/* The hw thread reads indications from the server socket, so it has to
+ * be gone before the main thread exchanges messages on it */
+static void playback_hw_thread_stop(struct bluetooth_data *data)
+{
+	if (!data->hw_thread)
+		return;
+
+	pthread_cancel(data->hw_thread);
+	pthread_join(data->hw_thread, 0);
+	data->hw_thread = 0;
+}
+
 static int bluetooth_playback_start(snd_pcm_ioplug_t *io)
 {
 	struct bluetooth_data *data = io->private_data;
@@ -270,8 +389,14 @@ static int bluetooth_playback_start(snd_pcm_ioplug_t *io)
 		return 0;
 
 	err = pthread_create(&data->hw_thread, 0, playback_hw_thread, data);
+	if (err != 0)
+		return -err;
 
-	return -err;
+	if (data->transport == BT_CAPABILITIES_TRANSPORT_A2DP &&
+						data->alsa_config.realtime)
+		return a2dp_encoder_start(data);
+
+	return 0;
 }
 
 static int bluetooth_playback_stop(snd_pcm_ioplug_t *io)
@@ -296,25 +421,36 @@ static void bluetooth_exit(struct bluetooth_data *data)
 {
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
 
+	playback_hw_thread_stop(data);
+
 	if (data->server.fd >= 0)
 		bt_audio_service_close(data->server.fd);
 
 	if (data->stream.fd >= 0)
 		close(data->stream.fd);
 
-	if (data->hw_thread) {
-		pthread_cancel(data->hw_thread);
-		pthread_join(data->hw_thread, 0);
-	}
+	a2dp_encoder_stop(data);
+
+	if (data->pcm_ring)
+		munmap(data->pcm_ring, data->pcm_ring_size);
 
 	if (a2dp->sbc_initialized)
 		sbc_finish(&a2dp->sbc);
 
-	if (data->pipefd[0] > 0)
-		close(data->pipefd[0]);
+	if (a2dp->pay.packets)
+		rtp_sbc_payloader_free(&a2dp->pay);
 
-	if (data->pipefd[1] > 0)
-		close(data->pipefd[1]);
+	if (a2dp->depay.slots)
+		rtp_sbc_depayloader_free(&a2dp->depay);
+
+	if (data->sco.rx.ring)
+		sco_pcm_rx_free(&data->sco.rx);
+
+	if (data->sco.sbc_initialized)
+		sbc_finish(&data->sco.sbc);
+
+	if (data->event_fd > 0)
+		close(data->event_fd);
 
 	free(data);
 }
@@ -333,7 +469,7 @@ static int bluetooth_close(snd_pcm_ioplug_t *io)
 static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 {
 	struct bluetooth_data *data = io->private_data;
-	char c = 'w';
+	uint64_t one = 1;
 	char buf[BT_SUGGESTED_BUFFER_SIZE];
 	struct bt_start_stream_req *req = (void *) buf;
 	struct bt_start_stream_rsp *rsp = (void *) buf;
@@ -349,11 +485,12 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 
 	/* As we're gonna receive messages on the server socket, we have to stop the
 	   hw thread that is polling on it, if any */
-	if (data->hw_thread) {
-		pthread_cancel(data->hw_thread);
-		pthread_join(data->hw_thread, 0);
-		data->hw_thread = 0;
-	}
+	playback_hw_thread_stop(data);
+
+	/* The encoder owns the packet ring, it must be idle to reset it */
+	a2dp_encoder_stop(data);
+	data->pcm_head = 0;
+	data->pcm_tail = 0;
 
 	if (io->stream == SND_PCM_STREAM_PLAYBACK)
 		/* If not null for playback, xmms doesn't display time
@@ -375,13 +512,13 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 		return err;
 
 	rsp->h.length = sizeof(*rsp);
-	err = audioservice_expect(data->server.fd, &rsp->h,
+	err = audioservice_expect(data, &rsp->h,
 					BT_START_STREAM);
 	if (err < 0)
 		return err;
 
 	ind->h.length = sizeof(*ind);
-	err = audioservice_expect(data->server.fd, &ind->h,
+	err = audioservice_expect(data, &ind->h,
 					BT_NEW_STREAM);
 	if (err < 0)
 		return err;
@@ -389,6 +526,24 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	if (data->stream.fd >= 0)
 		close(data->stream.fd);
 
+	/* Packets queued for the previous stream are stale now */
+	if (data->transport == BT_CAPABILITIES_TRANSPORT_A2DP) {
+		if (data->a2dp.pay.packets)
+			rtp_sbc_payloader_reset(&data->a2dp.pay,
+							data->link_mtu);
+		if (data->a2dp.depay.slots)
+			rtp_sbc_depayloader_reset(&data->a2dp.depay);
+
+		data->a2dp.frames_len = 0;
+		data->a2dp.backlog = 0;
+		data->count = 0;
+
+		data->a2dp.latency_min = UINT_MAX;
+		data->a2dp.latency_max = 0;
+		data->a2dp.latency_sum = 0;
+		data->a2dp.latency_count = 0;
+	}
+
 	data->stream.fd = bt_audio_service_get_data_fd(data->server.fd);
 	if (data->stream.fd < 0) {
 		return -errno;
@@ -401,7 +556,27 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 		if (setsockopt(data->stream.fd, SOL_SOCKET, opt_name, &t,
 							sizeof(t)) < 0)
 			return -errno;
+
+		if (io->stream == SND_PCM_STREAM_CAPTURE)
+			a2dp_report_delay(data);
 	} else {
+		data->count = 0;
+
+		if (data->sco.rx.ring)
+			sco_pcm_rx_reset(&data->sco.rx);
+
+		sco_pcm_resampler_init(&data->sco.resampler);
+		data->sco.queue_valid = sco_pcm_queue_init(&data->sco.queue,
+						data->stream.fd) == 0;
+
+		if (data->sco.msbc) {
+			sbc_reinit(&data->sco.sbc, SBC_MSBC);
+			sco_msbc_deframer_reset(&data->sco.deframer);
+			data->sco.seq = 0;
+			data->sco.pcm_pos = 0;
+			data->sco.pcm_len = 0;
+		}
+
 		opt_name = (io->stream == SND_PCM_STREAM_PLAYBACK) ?
 						SCO_TXBUFS : SCO_RXBUFS;
 
@@ -420,7 +595,7 @@ static int bluetooth_prepare(snd_pcm_ioplug_t *io)
 	}
 
 	/* wake up any client polling at us */
-	if (write(data->pipefd[1], &c, 1) < 0) {
+	if (write(data->event_fd, &one, sizeof(one)) < 0) {
 		err = -errno;
 		return err;
 	}
@@ -442,6 +617,8 @@ static int bluetooth_hsp_hw_params(snd_pcm_ioplug_t *io,
 	DBG("Preparing with io->period_size=%lu io->buffer_size=%lu",
 					io->period_size, io->buffer_size);
 
+	playback_hw_thread_stop(data);
+
 	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	open_req->h.type = BT_REQUEST;
 	open_req->h.name = BT_OPEN;
@@ -457,7 +634,7 @@ static int bluetooth_hsp_hw_params(snd_pcm_ioplug_t *io,
 		return err;
 
 	open_rsp->h.length = sizeof(*open_rsp);
-	err = audioservice_expect(data->server.fd, &open_rsp->h,
+	err = audioservice_expect(data, &open_rsp->h,
 					BT_OPEN);
 	if (err < 0)
 		return err;
@@ -469,6 +646,8 @@ static int bluetooth_hsp_hw_params(snd_pcm_ioplug_t *io,
 
 	req->codec.transport = BT_CAPABILITIES_TRANSPORT_SCO;
 	req->codec.seid = BT_A2DP_SEID_RANGE + 1;
+	req->codec.type = data->sco.msbc ? BT_HFP_CODEC_MSBC :
+							BT_HFP_CODEC_PCM;
 	req->codec.length = sizeof(pcm_capabilities_t);
 
 	req->h.length += req->codec.length - sizeof(req->codec);
@@ -477,7 +656,7 @@ static int bluetooth_hsp_hw_params(snd_pcm_ioplug_t *io,
 		return err;
 
 	rsp->h.length = sizeof(*rsp);
-	err = audioservice_expect(data->server.fd, &rsp->h,
+	err = audioservice_expect(data, &rsp->h,
 					BT_SET_CONFIGURATION);
 	if (err < 0)
 		return err;
@@ -485,6 +664,34 @@ static int bluetooth_hsp_hw_params(snd_pcm_ioplug_t *io,
 	data->transport = BT_CAPABILITIES_TRANSPORT_SCO;
 	data->link_mtu = rsp->link_mtu;
 
+	if (data->link_mtu < SCO_PCM_FRAME_SIZE ||
+					data->link_mtu > BUFFER_SIZE)
+		return -EINVAL;
+
+	/* An mSBC packet is encoded behind up to link_mtu - 1 bytes still
+	 * waiting to be sent */
+	if (data->sco.msbc &&
+			data->link_mtu + SCO_MSBC_PACKET_LEN > BUFFER_SIZE)
+		return -EINVAL;
+
+	if (io->stream == SND_PCM_STREAM_CAPTURE) {
+		if (data->sco.rx.ring)
+			sco_pcm_rx_free(&data->sco.rx);
+
+		err = sco_pcm_rx_init(&data->sco.rx, data->link_mtu,
+							SCO_RX_PACKETS);
+		if (err < 0)
+			return err;
+	}
+
+	if (data->sco.msbc && !data->sco.sbc_initialized) {
+		err = sbc_init(&data->sco.sbc, SBC_MSBC);
+		if (err < 0)
+			return err;
+
+		data->sco.sbc_initialized = 1;
+	}
+
 	return 0;
 }
 
@@ -684,7 +891,57 @@ static void bluetooth_a2dp_setup(struct bluetooth_a2dp *a2dp)
 
 	a2dp->sbc.bitpool = active_capabilities.max_bitpool;
 	a2dp->codesize = sbc_get_codesize(&a2dp->sbc);
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
+	a2dp->uncongested = 0;
+}
+
+static int bluetooth_a2dp_alloc_packets(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+
+	if (data->io.stream == SND_PCM_STREAM_CAPTURE) {
+		if (a2dp->depay.slots)
+			return 0;
+
+		return rtp_sbc_depayloader_init(&a2dp->depay, A2DP_PACKETS,
+						BUFFER_SIZE, A2DP_JITTER_DEPTH);
+	}
+
+	if (a2dp->pay.packets)
+		return 0;
+
+	return rtp_sbc_payloader_init(&a2dp->pay, A2DP_PACKETS, BUFFER_SIZE);
+}
+
+static int bluetooth_a2dp_alloc_ring(struct bluetooth_data *data)
+{
+	snd_pcm_ioplug_t *io = &data->io;
+	unsigned int size = 1;
+
+	while (size < (unsigned int) snd_pcm_frames_to_bytes(io->pcm,
+							io->buffer_size))
+		size <<= 1;
+
+	if (data->pcm_ring) {
+		if (data->pcm_ring_size == size)
+			return 0;
+
+		munmap(data->pcm_ring, data->pcm_ring_size);
+		data->pcm_ring = NULL;
+	}
+
+	data->pcm_ring = mmap(NULL, size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+				-1, 0);
+	if (data->pcm_ring == MAP_FAILED) {
+		data->pcm_ring = NULL;
+		return -errno;
+	}
+
+	data->pcm_ring_size = size;
+	data->pcm_head = 0;
+	data->pcm_tail = 0;
+
+	return 0;
 }
 
 static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
@@ -702,6 +959,8 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	DBG("Preparing with io->period_size=%lu io->buffer_size=%lu",
 					io->period_size, io->buffer_size);
 
+	playback_hw_thread_stop(data);
+
 	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	open_req->h.type = BT_REQUEST;
 	open_req->h.name = BT_OPEN;
@@ -711,13 +970,15 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	open_req->seid = a2dp->sbc_capabilities.capability.seid;
 	open_req->lock = (io->stream == SND_PCM_STREAM_PLAYBACK ?
 			BT_WRITE_LOCK : BT_READ_LOCK);
+	if (data->alsa_config.low_latency)
+		open_req->flags |= BT_FLAG_LOW_LATENCY;
 
 	err = audioservice_send(data->server.fd, &open_req->h);
 	if (err < 0)
 		return err;
 
 	open_rsp->h.length = sizeof(*open_rsp);
-	err = audioservice_expect(data->server.fd, &open_rsp->h,
+	err = audioservice_expect(data, &open_rsp->h,
 					BT_OPEN);
 	if (err < 0)
 		return err;
@@ -726,6 +987,23 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	if (err < 0)
 		return err;
 
+	err = bluetooth_a2dp_alloc_packets(data);
+	if (err < 0)
+		return err;
+
+	if (a2dp->pay.packets)
+		a2dp->pay.max_frames = data->alsa_config.low_latency ?
+				A2DP_LOW_LATENCY_FRAMES : RTP_SBC_MAX_FRAMES;
+
+	if (io->stream == SND_PCM_STREAM_PLAYBACK &&
+					data->alsa_config.realtime) {
+		a2dp_encoder_stop(data);
+
+		err = bluetooth_a2dp_alloc_ring(data);
+		if (err < 0)
+			return err;
+	}
+
 	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
 	req->h.type = BT_REQUEST;
 	req->h.name = BT_SET_CONFIGURATION;
@@ -743,7 +1021,7 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 		return err;
 
 	rsp->h.length = sizeof(*rsp);
-	err = audioservice_expect(data->server.fd, &rsp->h,
+	err = audioservice_expect(data, &rsp->h,
 					BT_SET_CONFIGURATION);
 	if (err < 0)
 		return err;
@@ -754,6 +1032,9 @@ static int bluetooth_a2dp_hw_params(snd_pcm_ioplug_t *io,
 	/* Setup SBC encoder now we agree on parameters */
 	bluetooth_a2dp_setup(a2dp);
 
+	if (a2dp->pay.packets)
+		rtp_sbc_payloader_reset(&a2dp->pay, data->link_mtu);
+
 	DBG("\tallocation=%u\n\tsubbands=%u\n\tblocks=%u\n\tbitpool=%u\n",
 		a2dp->sbc.allocation, a2dp->sbc.subbands, a2dp->sbc.blocks,
 		a2dp->sbc.bitpool);
@@ -801,12 +1082,12 @@ static int bluetooth_playback_poll_descriptors(snd_pcm_ioplug_t *io,
 
 	DBG("");
 
-	assert(data->pipefd[0] >= 0);
+	assert(data->event_fd >= 0);
 
 	if (space < 2)
 		return 0;
 
-	pfd[0].fd = data->pipefd[0];
+	pfd[0].fd = data->event_fd;
 	pfd[0].events = POLLIN;
 	pfd[0].revents = 0;
 	pfd[1].fd = data->stream.fd;
@@ -820,7 +1101,7 @@ static int bluetooth_playback_poll_revents(snd_pcm_ioplug_t *io,
 					struct pollfd *pfds, unsigned int nfds,
 					unsigned short *revents)
 {
-	static char buf[1];
+	uint64_t periods;
 
 	DBG("");
 
@@ -831,7 +1112,7 @@ static int bluetooth_playback_poll_revents(snd_pcm_ioplug_t *io,
 	assert(pfds[1].fd >= 0);
 
 	if (io->state != SND_PCM_STATE_PREPARED)
-		if (read(pfds[0].fd, buf, 1) < 0)
+		if (read(pfds[0].fd, &periods, sizeof(periods)) < 0)
 			SYSERR("read error: %s (%d)", strerror(errno), errno);
 
 	if (pfds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
@@ -843,15 +1124,88 @@ static int bluetooth_playback_poll_revents(snd_pcm_ioplug_t *io,
 }
 
 
+/* Decodes the next received frame into the PCM buffer. Frames that
+ * fail to decode are replaced with silence to keep the timing. */
+static int msbc_decode_next(struct bluetooth_sco *sco)
+{
+	const uint8_t *frame;
+	size_t written = 0;
+
+	frame = sco_msbc_deframe(&sco->deframer, &sco->rx);
+	if (frame == NULL)
+		return 0;
+
+	if (sbc_decode(&sco->sbc, frame, SCO_MSBC_FRAME_LEN, sco->pcm,
+					sizeof(sco->pcm), &written) < 0 ||
+					written != sizeof(sco->pcm))
+		memset(sco->pcm, 0, sizeof(sco->pcm));
+
+	sco->pcm_pos = 0;
+	sco->pcm_len = sizeof(sco->pcm);
+
+	return 1;
+}
+
+static snd_pcm_sframes_t msbc_read(struct bluetooth_data *data,
+				const snd_pcm_channel_area_t *areas,
+				snd_pcm_uframes_t offset,
+				snd_pcm_uframes_t size)
+{
+	snd_pcm_ioplug_t *io = &data->io;
+	struct bluetooth_sco *sco = &data->sco;
+	unsigned int frame_size = areas->step / 8;
+	size_t len = 0, want = size * frame_size;
+	unsigned char *buff;
+	int nrecv;
+
+	nrecv = sco_pcm_rx_fill(&sco->rx, data->stream.fd,
+				sco->pcm_len == 0 &&
+				sco->rx.len < SCO_MSBC_PACKET_LEN &&
+				!io->nonblock);
+	if (nrecv < 0 && nrecv != -EAGAIN)
+		return (nrecv == -EPIPE) ? -EIO : nrecv;
+
+	/* Every received byte stands for a fixed amount of audio, even
+	 * before the frame it belongs to is complete */
+	if (nrecv > 0)
+		data->hw_ptr = (data->hw_ptr + nrecv *
+				(SCO_MSBC_CODESIZE / SCO_MSBC_PACKET_LEN) /
+					frame_size) % io->buffer_size;
+
+	buff = (unsigned char *) areas->addr +
+			(areas->first + areas->step * offset) / 8;
+
+	while (len < want) {
+		size_t n;
+
+		if (sco->pcm_len == 0 && !msbc_decode_next(sco))
+			break;
+
+		n = MIN(want - len, sco->pcm_len);
+		memcpy(buff + len, sco->pcm + sco->pcm_pos, n);
+
+		sco->pcm_pos += n;
+		sco->pcm_len -= n;
+		len += n;
+	}
+
+	if (len == 0)
+		return -EAGAIN;
+
+	return len / frame_size;
+}
+
 static snd_pcm_sframes_t bluetooth_hsp_read(snd_pcm_ioplug_t *io,
 				const snd_pcm_channel_area_t *areas,
 				snd_pcm_uframes_t offset,
 				snd_pcm_uframes_t size)
 {
 	struct bluetooth_data *data = io->private_data;
-	snd_pcm_uframes_t frames_to_write, ret;
+	struct sco_pcm_rx *rx = &data->sco.rx;
+	snd_pcm_sframes_t ret;
 	unsigned char *buff;
-	unsigned int frame_size = 0;
+	unsigned int frame_size;
+	size_t len;
 	int nrecv;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu io->nonblock=%u",
@@ -859,48 +1213,151 @@ static snd_pcm_sframes_t bluetooth_hsp_read(snd_pcm_ioplug_t *io,
 
 	frame_size = areas->step / 8;
 
-	if (data->count > 0)
-		goto proceed;
+	if (data->sco.msbc)
+		return msbc_read(data, areas, offset, size);
 
-	nrecv = recv(data->stream.fd, data->buffer, data->link_mtu,
-					io->nonblock ? MSG_DONTWAIT : 0);
-
-	if (nrecv < 0) {
-		ret = (errno == EPIPE) ? -EIO : -errno;
+	/* Take everything the socket has queued in one go, only blocking
+	 * when there is nothing buffered at all */
+	nrecv = sco_pcm_rx_fill(rx, data->stream.fd,
+					rx->len < frame_size && !io->nonblock);
+	if (nrecv < 0 && nrecv != -EAGAIN) {
+		ret = (nrecv == -EPIPE) ? -EIO : nrecv;
 		goto done;
 	}
 
-	if ((unsigned int) nrecv != data->link_mtu) {
-		ret = -EIO;
-		SNDERR(strerror(-ret));
+	if (nrecv > 0)
+		/* Increment hardware transmition pointer */
+		data->hw_ptr = (data->hw_ptr + nrecv / frame_size) %
+							io->buffer_size;
+
+	if (rx->len < frame_size) {
+		ret = -EAGAIN;
 		goto done;
 	}
 
-	/* Increment hardware transmition pointer */
-	data->hw_ptr = (data->hw_ptr + data->link_mtu / frame_size) %
-				io->buffer_size;
-
-proceed:
 	buff = (unsigned char *) areas->addr +
 			(areas->first + areas->step * offset) / 8;
 
-	if ((data->count + size * frame_size) <= data->link_mtu)
-		frames_to_write = size;
-	else
-		frames_to_write = (data->link_mtu - data->count) / frame_size;
+	len = MIN(size * frame_size, rx->len);
+	len -= len % frame_size;
 
-	memcpy(buff, data->buffer + data->count, frame_size * frames_to_write);
-	data->count += (frame_size * frames_to_write);
-	data->count %= data->link_mtu;
+	sco_pcm_rx_read(rx, buff, len);
 
 	/* Return written frames count */
-	ret = frames_to_write;
+	ret = len / frame_size;
 
 done:
-	DBG("returning %lu", ret);
+	DBG("returning %ld", ret);
 	return ret;
 }
 
+/* Encodes the PCM buffer into an H2 framed packet at the end of the
+ * transfer buffer */
+static int msbc_encode(struct bluetooth_data *data)
+{
+	struct bluetooth_sco *sco = &data->sco;
+	uint8_t *packet = data->buffer + data->count;
+	ssize_t written = 0;
+
+	sco_msbc_h2_header(packet, sco->seq++);
+
+	if (sbc_encode(&sco->sbc, sco->pcm, sizeof(sco->pcm), packet + 2,
+				SCO_MSBC_FRAME_LEN, &written) < 0 ||
+				written != SCO_MSBC_FRAME_LEN)
+		return -EIO;
+
+	packet[SCO_MSBC_PACKET_LEN - 1] = 0;
+
+	data->count += SCO_MSBC_PACKET_LEN;
+	sco->pcm_len = 0;
+
+	return 0;
+}
+
+/* Sends the packet in the transfer buffer and steers the resampler
+ * with the amount of audio still queued for the link */
+static int sco_send_packet(struct bluetooth_data *data, int nonblock)
+{
+	struct bluetooth_sco *sco = &data->sco;
+	int rsend, queued;
+
+	rsend = send(data->stream.fd, data->buffer, data->link_mtu,
+					nonblock ? MSG_DONTWAIT : 0);
+	if (rsend < 0)
+		return (errno == EPIPE) ? -EIO : -errno;
+
+	if (rsend == 0)
+		return -EIO;
+
+	/* mSBC packets don't line up with the link packets, whatever is
+	 * left over goes into the next one */
+	if (data->count > data->link_mtu) {
+		data->count -= data->link_mtu;
+		memmove(data->buffer, data->buffer + data->link_mtu,
+								data->count);
+	} else
+		data->count = 0;
+
+	if (!sco->queue_valid)
+		return 0;
+
+	queued = sco_pcm_queue_get(&sco->queue, data->stream.fd);
+	if (queued < 0) {
+		sco->queue_valid = 0;
+		return 0;
+	}
+
+	sco_pcm_resampler_adjust(&sco->resampler, queued, SCO_TX_TARGET);
+
+	return 0;
+}
+
+/* Like the CVSD path, only that the resampler fills the PCM buffer of
+ * the encoder instead of the packet */
+static snd_pcm_sframes_t msbc_write(struct bluetooth_data *data,
+				const int16_t *buff, snd_pcm_uframes_t size)
+{
+	struct bluetooth_sco *sco = &data->sco;
+	snd_pcm_uframes_t frames = 0;
+	int err;
+
+	while (frames < size) {
+		size_t consumed, produced;
+
+		if (data->count >= data->link_mtu) {
+			err = sco_send_packet(data, data->io.nonblock);
+			if (err == -EAGAIN)
+				break;
+
+			if (err < 0)
+				return err;
+
+			continue;
+		}
+
+		if (sco->pcm_len == sizeof(sco->pcm)) {
+			err = msbc_encode(data);
+			if (err < 0)
+				return err;
+
+			continue;
+		}
+
+		produced = sco_pcm_resample(&sco->resampler,
+				buff + frames, size - frames, &consumed,
+				(int16_t *) (sco->pcm + sco->pcm_len),
+				(sizeof(sco->pcm) - sco->pcm_len) /
+							SCO_PCM_FRAME_SIZE);
+
+		sco->pcm_len += produced * SCO_PCM_FRAME_SIZE;
+		frames += consumed;
+	}
+
+	DBG("count=%d frames=%lu", data->count, frames);
+
+	return frames > 0 ? (snd_pcm_sframes_t) frames : -EAGAIN;
+}
+
 static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 				const snd_pcm_channel_area_t *areas,
 				snd_pcm_uframes_t offset,
@@ -908,9 +1365,9 @@ static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 {
 	struct bluetooth_data *data = io->private_data;
 	snd_pcm_sframes_t ret = 0;
-	snd_pcm_uframes_t frames_to_read;
-	uint8_t *buff;
-	int rsend, frame_size;
+	snd_pcm_uframes_t frames = 0;
+	const int16_t *buff;
+	int err;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu, size=%lu io->nonblock=%u",
 			areas->step, areas->first, offset, size, io->nonblock);
@@ -922,83 +1379,292 @@ static snd_pcm_sframes_t bluetooth_hsp_write(snd_pcm_ioplug_t *io,
 		goto done;
 	}
 
-	frame_size = areas->step / 8;
-	if ((data->count + size * frame_size) <= data->link_mtu)
-		frames_to_read = size;
-	else
-		frames_to_read = (data->link_mtu - data->count) / frame_size;
+	buff = (const int16_t *) ((uint8_t *) areas->addr +
+				(areas->first + areas->step * offset) / 8);
 
-	DBG("count=%d frames_to_read=%lu", data->count, frames_to_read);
+	if (data->sco.msbc)
+		return msbc_write(data, buff, size);
 
-	/* Ready for more data */
-	buff = (uint8_t *) areas->addr +
-			(areas->first + areas->step * offset) / 8;
-	memcpy(data->buffer + data->count, buff, frame_size * frames_to_read);
+	/* Frames are resampled straight into the packet, whole packets
+	 * are sent as soon as they are complete */
+	while (frames < size) {
+		size_t consumed, produced;
 
-	/* Remember we have some frames in the pipe now */
-	data->count += frames_to_read * frame_size;
-	if (data->count != data->link_mtu) {
-		ret = frames_to_read;
-		goto done;
+		if (data->count + SCO_PCM_FRAME_SIZE > data->link_mtu) {
+			err = sco_send_packet(data, io->nonblock);
+			if (err == -EAGAIN)
+				break;
+
+			if (err < 0) {
+				ret = err;
+				goto done;
+			}
+		}
+
+		produced = sco_pcm_resample(&data->sco.resampler,
+				buff + frames, size - frames, &consumed,
+				(int16_t *) (data->buffer + data->count),
+				(data->link_mtu - data->count) /
+							SCO_PCM_FRAME_SIZE);
+
+		data->count += produced * SCO_PCM_FRAME_SIZE;
+		frames += consumed;
 	}
 
-	rsend = send(data->stream.fd, data->buffer, data->link_mtu,
-			io->nonblock ? MSG_DONTWAIT : 0);
-	if (rsend > 0) {
-		/* Reset count pointer */
-		data->count = 0;
+	DBG("count=%d frames=%lu", data->count, frames);
 
-		ret = frames_to_read;
-	} else if (rsend < 0)
-		ret = (errno == EPIPE) ? -EIO : -errno;
-	else
-		ret = -EIO;
+	ret = frames > 0 ? (snd_pcm_sframes_t) frames : -EAGAIN;
 
 done:
 	DBG("returning %ld", ret);
 	return ret;
 }
 
+/* Queues every packet already received, waiting for the first one
+ * unless the application asked for non-blocking access */
+static int a2dp_receive(struct bluetooth_data *data, int block)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	uint8_t buf[BUFFER_SIZE];
+	int flags = block ? 0 : MSG_DONTWAIT;
+	unsigned int received = 0;
+	ssize_t nrecv;
+
+	while ((nrecv = recv(data->stream.fd, buf, sizeof(buf), flags)) > 0) {
+		/* Malformed, late and duplicate packets are just dropped */
+		rtp_sbc_depayloader_push(&a2dp->depay, buf, nrecv);
+
+		flags = MSG_DONTWAIT;
+		received++;
+	}
+
+	if (nrecv == 0)
+		return -EIO;
+
+	if (errno == EAGAIN && received > 0)
+		return 0;
+
+	return errno == EPIPE ? -EIO : -errno;
+}
+
 static snd_pcm_sframes_t bluetooth_a2dp_read(snd_pcm_ioplug_t *io,
 				const snd_pcm_channel_area_t *areas,
 				snd_pcm_uframes_t offset, snd_pcm_uframes_t size)
 {
-	snd_pcm_uframes_t ret = 0;
-	return ret;
+	struct bluetooth_data *data = io->private_data;
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	unsigned int frame_size, bytes_left, frames;
+	uint8_t *buff;
+	int err;
+
+	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu",
+				areas->step, areas->first, offset, size);
+
+	frame_size = areas->step / 8;
+	bytes_left = size * frame_size;
+	buff = (uint8_t *) areas->addr +
+				(areas->first + areas->step * offset) / 8;
+
+	while (bytes_left > 0) {
+		size_t written;
+		int len;
+
+		/* Hand out what was decoded but didn't fit last time */
+		if (data->count > 0) {
+			unsigned int n = MIN(data->count, bytes_left);
+
+			memcpy(buff, data->buffer, n);
+			memmove(data->buffer, data->buffer + n,
+							data->count - n);
+			data->count -= n;
+			buff += n;
+			bytes_left -= n;
+			continue;
+		}
+
+		if (a2dp->frames_pos < a2dp->frames_len) {
+			len = sbc_decode(&a2dp->sbc,
+					a2dp->frames + a2dp->frames_pos,
+					a2dp->frames_len - a2dp->frames_pos,
+					data->buffer, BUFFER_SIZE, &written);
+			if (len <= 0) {
+				DBG("Decoding error %d", len);
+				a2dp->frames_len = 0;
+				continue;
+			}
+
+			a2dp->frames_pos += len;
+			data->count = written;
+			continue;
+		}
+
+		len = rtp_sbc_depayloader_pop(&a2dp->depay, a2dp->frames,
+					sizeof(a2dp->frames), &frames);
+		if (len > 0) {
+			a2dp->frames_pos = 0;
+			a2dp->frames_len = len;
+			continue;
+		}
+
+		/* Only block until the first frames of this call arrive */
+		err = a2dp_receive(data, !io->nonblock &&
+					bytes_left == size * frame_size);
+		if (err == 0)
+			continue;
+
+		if (bytes_left == size * frame_size)
+			return err == -EAGAIN && !io->nonblock ? 0 : err;
+
+		break;
+	}
+
+	frames = size - bytes_left / frame_size;
+
+	/* Increment hardware transmition pointer */
+	data->hw_ptr = (data->hw_ptr + frames) % io->buffer_size;
+
+	DBG("returning %u", frames);
+
+	return frames;
 }
 
+/* Trade quality for throughput while the link can't keep up: the
+ * bitpool drops by a quarter of the headroom on each congested flush
+ * and only creeps back up after a long run of clear ones. The codesize
+ * doesn't depend on the bitpool so the encoder picks the new value up
+ * on the next frame without being reset. */
+static void a2dp_adapt_bitpool(struct bluetooth_data *data, int congested)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	sbc_capabilities_t *cap = &a2dp->sbc_capabilities;
+	uint8_t bitpool = a2dp->sbc.bitpool;
+
+	if (congested) {
+		a2dp->uncongested = 0;
+
+		if (bitpool <= cap->min_bitpool)
+			return;
+
+		bitpool -= MAX(1, (bitpool - cap->min_bitpool) / 4);
+	} else {
+		if (++a2dp->uncongested < BITPOOL_RECOVERY)
+			return;
+
+		a2dp->uncongested = 0;
+
+		if (bitpool >= cap->max_bitpool)
+			return;
+
+		bitpool++;
+	}
+
+	DBG("bitpool %u -> %u, backlog %d bytes", a2dp->sbc.bitpool, bitpool,
+								a2dp->backlog);
+
+	a2dp->sbc.bitpool = bitpool;
+}
+
+static void a2dp_account_latency(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	unsigned int usec;
+
+	usec = (unsigned long long) a2dp_local_delay(data) * 1000000 /
+							data->io.rate;
+
+	a2dp->latency_min = MIN(a2dp->latency_min, usec);
+	a2dp->latency_max = MAX(a2dp->latency_max, usec);
+	a2dp->latency_sum += usec;
+	a2dp->latency_count++;
+}
+
+/* Send all completed packets with as few system calls as possible */
 static int avdtp_write(struct bluetooth_data *data)
 {
-	int err;
-	struct rtp_header *header;
-	struct rtp_payload *payload;
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	int sent;
 
-	header = (void *) a2dp->buffer;
-	payload = (void *) (a2dp->buffer + sizeof(*header));
+	sent = rtp_sbc_payloader_send(&a2dp->pay, data->stream.fd);
 
-	memset(a2dp->buffer, 0, sizeof(*header) + sizeof(*payload));
+	if (ioctl(data->stream.fd, SIOCOUTQ, &a2dp->backlog) < 0)
+		a2dp->backlog = 0;
 
-	payload->frame_count = a2dp->frame_count;
-	header->v = 2;
-	header->pt = 1;
-	header->sequence_number = htons(a2dp->seq_num);
-	header->timestamp = htonl(a2dp->nsamples);
-	header->ssrc = htonl(1);
+	DBG("sent %d, %u queued, backlog %d bytes", sent, a2dp->pay.queued,
+								a2dp->backlog);
 
-	err = send(data->stream.fd, a2dp->buffer, a2dp->count, MSG_DONTWAIT);
-	if (err < 0) {
-		err = -errno;
-		DBG("send failed: %s (%d)", strerror(-err), -err);
+	if (sent > 0)
+		a2dp_account_latency(data);
+
+	if (sent == -EAGAIN || a2dp->backlog >
+			(int) (BITPOOL_CONGESTION * data->link_mtu))
+		a2dp_adapt_bitpool(data, 1);
+	else if (sent > 0 && a2dp->backlog <= (int) data->link_mtu)
+		a2dp_adapt_bitpool(data, 0);
+
+	return sent < 0 ? sent : 0;
+}
+
+/* Encodes one codesize block into the packet ring, returns 1 when that
+ * completed a packet */
+static int a2dp_encode(struct bluetooth_data *data, const uint8_t *src,
+							int frame_size)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	ssize_t written;
+	int encoded;
+	uint8_t *dst;
+	size_t len;
+
+	dst = rtp_sbc_payloader_get_frame(&a2dp->pay, &len);
+
+	/* A raised bitpool may not fit where the previous frame did */
+	if (len < sbc_get_frame_length(&a2dp->sbc)) {
+		rtp_sbc_payloader_complete(&a2dp->pay);
+		dst = rtp_sbc_payloader_get_frame(&a2dp->pay, &len);
 	}
 
-	/* Reset buffer of data to send */
-	a2dp->count = sizeof(struct rtp_header) + sizeof(struct rtp_payload);
-	a2dp->frame_count = 0;
-	a2dp->samples = 0;
-	a2dp->seq_num++;
+	encoded = sbc_encode(&a2dp->sbc, src, a2dp->codesize, dst, len,
+								&written);
+	if (encoded <= 0) {
+		DBG("Encoding error %d", encoded);
+		return -EIO;
+	}
 
-	return err;
+	if (!rtp_sbc_payloader_commit(&a2dp->pay, written,
+						encoded / frame_size))
+		return 0;
+
+	/* Ring is full, make room before the oldest packet gets dropped */
+	if (a2dp->pay.queued == a2dp->pay.n_packets)
+		avdtp_write(data);
+
+	return 1;
+}
+
+static snd_pcm_sframes_t a2dp_ring_write(struct bluetooth_data *data,
+				const uint8_t *buff, snd_pcm_uframes_t size,
+				int frame_size)
+{
+	unsigned int mask = data->pcm_ring_size - 1;
+	unsigned int tail = data->pcm_tail;
+	unsigned int pos = tail & mask;
+	unsigned int bytes, first;
+
+	bytes = data->pcm_ring_size - (tail - data->pcm_head);
+	bytes = MIN(bytes, size * frame_size);
+	bytes -= bytes % frame_size;
+
+	first = MIN(bytes, data->pcm_ring_size - pos);
+	memcpy(data->pcm_ring + pos, buff, first);
+	memcpy(data->pcm_ring, buff + first, bytes - first);
+
+	/* Make the samples visible before publishing the new tail */
+	__sync_synchronize();
+	data->pcm_tail = tail + bytes;
+
+	DBG("queued %u bytes, %u in ring", bytes, tail + bytes - data->pcm_head);
+
+	return bytes / frame_size;
 }
 
 static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
@@ -1009,8 +1675,7 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	struct bluetooth_a2dp *a2dp = &data->a2dp;
 	snd_pcm_sframes_t ret = 0;
 	unsigned int bytes_left;
-	int frame_size, encoded;
-	ssize_t written;
+	int frame_size;
 	uint8_t *buff;
 
 	DBG("areas->step=%u areas->first=%u offset=%lu size=%lu",
@@ -1052,6 +1717,10 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 		snd_pcm_sw_params_free(swparams);
 	}
 
+	/* Encoding is left to the real-time thread */
+	if (data->pcm_ring)
+		return a2dp_ring_write(data, buff, size, frame_size);
+
 	/* Check if we have any left over data from the last write */
 	if (data->count > 0) {
 		unsigned int additional_bytes_needed =
@@ -1063,28 +1732,8 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 						additional_bytes_needed);
 
 		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, data->buffer, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
-		if (encoded <= 0) {
-			DBG("Encoding error %d", encoded);
+		if (a2dp_encode(data, data->buffer, frame_size) < 0)
 			goto done;
-		}
-
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-					a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
@@ -1099,33 +1748,13 @@ static snd_pcm_sframes_t bluetooth_a2dp_write(snd_pcm_ioplug_t *io,
 	/* Process this buffer in full chunks */
 	while (bytes_left >= a2dp->codesize) {
 		/* Enough data to encode (sbc wants 1k blocks) */
-		encoded = sbc_encode(&a2dp->sbc, buff, a2dp->codesize,
-					a2dp->buffer + a2dp->count,
-					sizeof(a2dp->buffer) - a2dp->count,
-								&written);
-		if (encoded <= 0) {
-			DBG("Encoding error %d", encoded);
+		if (a2dp_encode(data, buff, frame_size) < 0)
 			goto done;
-		}
 
 		/* Increment up buff pointer to take into account
 		 * the data processed */
 		buff += a2dp->codesize;
 		bytes_left -= a2dp->codesize;
-
-		/* Increment a2dp buffers */
-		a2dp->count += written;
-		a2dp->frame_count++;
-		a2dp->samples += encoded / frame_size;
-		a2dp->nsamples += encoded / frame_size;
-
-		/* No space left for another frame then send */
-		if (a2dp->count + written >= data->link_mtu) {
-			avdtp_write(data);
-			DBG("sending packet %d, count %d, link_mtu %u",
-						a2dp->seq_num, a2dp->count,
-							data->link_mtu);
-		}
 	}
 
 out:
@@ -1137,14 +1766,235 @@ out:
 	}
 
 done:
+	/* Send everything completed during this call in one go */
+	avdtp_write(data);
+
 	DBG("returning %ld", size - bytes_left / frame_size);
 
 	return size - bytes_left / frame_size;
 }
 
+/* Consumer side of the PCM ring, encodes a single SBC frame */
+static int a2dp_ring_encode(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	unsigned int mask = data->pcm_ring_size - 1;
+	unsigned int head = data->pcm_head;
+	unsigned int pos = head & mask;
+	int frame_size, err;
+	uint8_t *src;
+
+	if (data->pcm_tail - head < a2dp->codesize)
+		return -EAGAIN;
+
+	/* Don't read samples before the tail that published them */
+	__sync_synchronize();
+
+	if (pos + a2dp->codesize <= data->pcm_ring_size)
+		src = data->pcm_ring + pos;
+	else {
+		unsigned int first = data->pcm_ring_size - pos;
+
+		memcpy(data->buffer, data->pcm_ring + pos, first);
+		memcpy(data->buffer + first, data->pcm_ring,
+						a2dp->codesize - first);
+		src = data->buffer;
+	}
+
+	frame_size = snd_pcm_frames_to_bytes(data->io.pcm, 1);
+	err = a2dp_encode(data, src, frame_size);
+
+	/* Samples are consumed even on failure, the stream must go on */
+	__sync_synchronize();
+	data->pcm_head = head + a2dp->codesize;
+
+	/* Send each packet as soon as it is complete */
+	if (err > 0)
+		avdtp_write(data);
+
+	return err < 0 ? err : 0;
+}
+
+static void timespec_add_usec(struct timespec *ts, unsigned int usec)
+{
+	ts->tv_nsec += usec * 1000;
+	while (ts->tv_nsec >= 1000000000) {
+		ts->tv_nsec -= 1000000000;
+		ts->tv_sec++;
+	}
+}
+
+static void *a2dp_encoder_thread(void *param)
+{
+	struct bluetooth_data *data = param;
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	unsigned int frame_duration, max_lag;
+	struct timespec next;
+
+	/* One SBC frame per tick keeps the air interface paced by the
+	 * codec itself rather than by when the application writes */
+	frame_duration = sbc_get_frame_duration(&a2dp->sbc);
+	max_lag = A2DP_PACKETS * frame_duration;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!data->encoder_quit) {
+		struct timespec now, delta;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (data->stopped) {
+			next = now;
+			goto next_frame;
+		}
+
+		/* After a long preemption don't try to catch up with a
+		 * burst that the remote could not absorb anyway */
+		priv_timespecsub(&now, &next, &delta);
+		if (delta.tv_sec > 0 || (delta.tv_sec == 0 &&
+					delta.tv_nsec / 1000 > max_lag)) {
+			DBG("encoder late by %ld.%09lds, resyncing",
+					(long) delta.tv_sec, delta.tv_nsec);
+			next = now;
+		}
+
+		a2dp_ring_encode(data);
+
+next_frame:
+		timespec_add_usec(&next, frame_duration);
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	return NULL;
+}
+
+static int a2dp_encoder_start(struct bluetooth_data *data)
+{
+	pthread_attr_t attr;
+	struct sched_param param;
+	int err;
+
+	if (data->encoder_thread || !data->pcm_ring)
+		return 0;
+
+	data->encoder_quit = 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	param.sched_priority = sched_get_priority_min(SCHED_FIFO) +
+						A2DP_ENCODER_PRIORITY;
+	pthread_attr_setschedparam(&attr, &param);
+
+	err = pthread_create(&data->encoder_thread, &attr,
+						a2dp_encoder_thread, data);
+	if (err == EPERM) {
+		DBG("SCHED_FIFO not permitted, using default scheduling");
+		err = pthread_create(&data->encoder_thread, NULL,
+						a2dp_encoder_thread, data);
+	}
+
+	pthread_attr_destroy(&attr);
+
+	if (err != 0) {
+		data->encoder_thread = 0;
+		return -err;
+	}
+
+	return 0;
+}
+
+static void a2dp_encoder_stop(struct bluetooth_data *data)
+{
+	if (!data->encoder_thread)
+		return;
+
+	data->encoder_quit = 1;
+	pthread_join(data->encoder_thread, NULL);
+	data->encoder_thread = 0;
+}
+
+/* Frames accepted from the application that are still on this side of
+ * the link: PCM short of a codesize or not yet taken by the encoder
+ * thread, frames in unsent packets and bytes queued in the socket */
+static snd_pcm_sframes_t a2dp_local_delay(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	snd_pcm_ioplug_t *io = &data->io;
+	unsigned int frame_size = snd_pcm_frames_to_bytes(io->pcm, 1);
+	size_t frame_length, encoded;
+	snd_pcm_sframes_t frames;
+
+	if (!a2dp->sbc_initialized || frame_size == 0)
+		return 0;
+
+	frame_length = sbc_get_frame_length(&a2dp->sbc);
+	if (frame_length == 0)
+		return 0;
+
+	frames = data->count / frame_size;
+
+	if (data->pcm_ring)
+		frames += (data->pcm_tail - data->pcm_head) / frame_size;
+
+	frames += a2dp->pay.samples;
+
+	/* Packet and RTP headers are counted as frames, close enough */
+	encoded = a2dp->pay.queued * (a2dp->pay.mtu - RTP_SBC_HEADER_SIZE) +
+							a2dp->backlog;
+	frames += encoded / frame_length * (a2dp->codesize / frame_size);
+
+	return frames;
+}
+
+/* As a sink, tell the remote source how long received audio is held
+ * here before it's played so it can hold back its video to match */
+static void a2dp_report_delay(struct bluetooth_data *data)
+{
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	snd_pcm_ioplug_t *io = &data->io;
+	char buf[BT_SUGGESTED_BUFFER_SIZE];
+	struct bt_delay_report_req *req = (void *) buf;
+	bt_audio_msg_header_t *rsp = (void *) buf;
+	unsigned int frame_size = snd_pcm_frames_to_bytes(io->pcm, 1);
+	size_t frame_length = sbc_get_frame_length(&a2dp->sbc);
+	snd_pcm_uframes_t frames;
+	unsigned int delay;
+
+	/* The ALSA buffer plus the packets the jitter buffer holds back */
+	frames = io->buffer_size;
+	if (frame_length > 0 && frame_size > 0)
+		frames += A2DP_JITTER_DEPTH *
+				((data->link_mtu - RTP_SBC_HEADER_SIZE) /
+				frame_length) * (a2dp->codesize / frame_size);
+
+	delay = frames * 10000 / io->rate;
+	if (delay > UINT16_MAX)
+		delay = UINT16_MAX;
+
+	DBG("Reporting delay %u.%u ms", delay / 10, delay % 10);
+
+	memset(req, 0, BT_SUGGESTED_BUFFER_SIZE);
+	req->h.type = BT_REQUEST;
+	req->h.name = BT_DELAY_REPORT;
+	req->h.length = sizeof(*req);
+	req->delay = delay;
+
+	if (audioservice_send(data->server.fd, &req->h) < 0)
+		return;
+
+	/* Sources without delay reporting refuse it, which is harmless */
+	rsp->length = sizeof(buf);
+	audioservice_recv(data->server.fd, rsp);
+}
+
 static int bluetooth_playback_delay(snd_pcm_ioplug_t *io,
 					snd_pcm_sframes_t *delayp)
 {
+	struct bluetooth_data *data = io->private_data;
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+	snd_pcm_sframes_t local;
+
 	DBG("");
 
 	/* This updates io->hw_ptr value using pointer() function */
@@ -1155,8 +2005,20 @@ static int bluetooth_playback_delay(snd_pcm_ioplug_t *io,
 		io->callback->stop(io);
 		io->state = SND_PCM_STATE_XRUN;
 		*delayp = 0;
+		return 0;
 	}
 
+	if (data->transport != BT_CAPABILITIES_TRANSPORT_A2DP)
+		return 0;
+
+	/* The virtual hw pointer follows the clock rather than the link,
+	 * when the link is congested more is still queued locally */
+	local = a2dp_local_delay(data);
+	if (local > *delayp)
+		*delayp = local;
+
+	*delayp += (snd_pcm_sframes_t) io->rate * a2dp->remote_delay / 10000;
+
 	/* This should never fail, ALSA API is really not
 	prepared to handle a non zero return value */
 	return 0;
@@ -1188,6 +2050,30 @@ static snd_pcm_ioplug_callback_t bluetooth_hsp_capture = {
 	.poll_revents		= bluetooth_poll_revents,
 };
 
+static void bluetooth_a2dp_dump(snd_pcm_ioplug_t *io, snd_output_t *out)
+{
+	struct bluetooth_data *data = io->private_data;
+	struct bluetooth_a2dp *a2dp = &data->a2dp;
+
+	snd_output_printf(out, "Bluetooth A2DP PCM%s\n",
+			data->alsa_config.low_latency ? " (low latency)" : "");
+	snd_output_printf(out, "  bitpool %u, %u frames per packet at most\n",
+				a2dp->sbc.bitpool, a2dp->pay.max_frames);
+
+	if (a2dp->latency_count > 0)
+		snd_output_printf(out, "  queued locally after each send: "
+				"min %u avg %llu max %u usec over %u sends\n",
+				a2dp->latency_min,
+				a2dp->latency_sum / a2dp->latency_count,
+				a2dp->latency_max, a2dp->latency_count);
+
+	snd_output_printf(out, "  remote delay %u usec, %u packets dropped\n",
+				a2dp->remote_delay * 100, a2dp->pay.dropped);
+
+	snd_output_printf(out, "Its setup is:\n");
+	snd_pcm_dump_setup(io->pcm, out);
+}
+
 static snd_pcm_ioplug_callback_t bluetooth_a2dp_playback = {
 	.start			= bluetooth_playback_start,
 	.stop			= bluetooth_playback_stop,
@@ -1200,6 +2086,7 @@ static snd_pcm_ioplug_callback_t bluetooth_a2dp_playback = {
 	.poll_descriptors	= bluetooth_playback_poll_descriptors,
 	.poll_revents		= bluetooth_playback_poll_revents,
 	.delay			= bluetooth_playback_delay,
+	.dump			= bluetooth_a2dp_dump,
 };
 
 static snd_pcm_ioplug_callback_t bluetooth_a2dp_capture = {
@@ -1229,6 +2116,7 @@ static int bluetooth_hsp_hw_constraint(snd_pcm_ioplug_t *io)
 	unsigned int format_list[] = {
 		SND_PCM_FORMAT_S16
 	};
+	unsigned int rate;
 	int err;
 
 	/* access type */
@@ -1250,8 +2138,9 @@ static int bluetooth_hsp_hw_constraint(snd_pcm_ioplug_t *io)
 		return err;
 
 	/* supported rate */
+	rate = data->sco.msbc ? SCO_MSBC_RATE : SCO_PCM_RATE;
 	err = snd_pcm_ioplug_set_param_minmax(io, SND_PCM_IOPLUG_HW_RATE,
-							8000, 8000);
+							rate, rate);
 	if (err < 0)
 		return err;
 
@@ -1292,6 +2181,11 @@ static int bluetooth_a2dp_hw_constraint(snd_pcm_ioplug_t *io)
 		4096, /* e.g. 23.2msec/period (stereo 16bit at 44.1kHz) */
 		8192
 	};
+	unsigned int low_latency_period_list[] = {
+		512, /* e.g. 2.9msec/period (stereo 16bit at 44.1kHz) */
+		1024,
+		2048
+	};
 
 	/* access type */
 	err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_ACCESS,
@@ -1326,19 +2220,36 @@ static int bluetooth_a2dp_hw_constraint(snd_pcm_ioplug_t *io)
 	if (err < 0)
 		return err;
 
-	/* supported buffer sizes
-	 * (can be used as 3*8192, 6*4096, 12*2048, ...) */
-	err = snd_pcm_ioplug_set_param_minmax(io,
+	if (cfg->low_latency) {
+		/* down to 4*512, the encoder thread keeps the pace */
+		err = snd_pcm_ioplug_set_param_minmax(io,
+						SND_PCM_IOPLUG_HW_BUFFER_BYTES,
+						512*4, 8192*3);
+		if (err < 0)
+			return err;
+
+		err = snd_pcm_ioplug_set_param_list(io,
+					SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+					ARRAY_NELEMS(low_latency_period_list),
+					low_latency_period_list);
+		if (err < 0)
+			return err;
+	} else {
+		/* supported buffer sizes
+		 * (can be used as 3*8192, 6*4096, 12*2048, ...) */
+		err = snd_pcm_ioplug_set_param_minmax(io,
 						SND_PCM_IOPLUG_HW_BUFFER_BYTES,
 						8192*3, 8192*3);
-	if (err < 0)
-		return err;
-
-	/* supported block sizes: */
-	err = snd_pcm_ioplug_set_param_list(io, SND_PCM_IOPLUG_HW_PERIOD_BYTES,
-				ARRAY_NELEMS(period_list), period_list);
-	if (err < 0)
-		return err;
+		if (err < 0)
+			return err;
+
+		/* supported block sizes: */
+		err = snd_pcm_ioplug_set_param_list(io,
+					SND_PCM_IOPLUG_HW_PERIOD_BYTES,
+					ARRAY_NELEMS(period_list), period_list);
+		if (err < 0)
+			return err;
+	}
 
 	/* supported rates */
 	rate_count = 0;
@@ -1412,6 +2323,32 @@ static int bluetooth_parse_config(snd_config_t *conf,
 			continue;
 		}
 
+		if (strcmp(id, "realtime") == 0) {
+			int b;
+
+			b = snd_config_get_bool(n);
+			if (b < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			bt_config->realtime = b;
+			continue;
+		}
+
+		if (strcmp(id, "lowlatency") == 0) {
+			int b;
+
+			b = snd_config_get_bool(n);
+			if (b < 0) {
+				SNDERR("Invalid type for %s", id);
+				return -EINVAL;
+			}
+
+			bt_config->low_latency = b;
+			continue;
+		}
+
 		if (strcmp(id, "device") == 0 || strcmp(id, "bdaddr") == 0) {
 			if (snd_config_get_string(n, &value) < 0) {
 				SNDERR("Invalid type for %s", id);
@@ -1530,6 +2467,10 @@ static int bluetooth_parse_config(snd_config_t *conf,
 		return -EINVAL;
 	}
 
+	/* Small packets only help if they leave on time */
+	if (bt_config->low_latency)
+		bt_config->realtime = 1;
+
 	return 0;
 }
 
@@ -1590,14 +2531,26 @@ static int audioservice_recv(int sk, bt_audio_msg_header_t *inmsg)
 	return err;
 }
 
-static int audioservice_expect(int sk, bt_audio_msg_header_t *rsp,
-							int expected_name)
+static int audioservice_expect(struct bluetooth_data *data,
+					bt_audio_msg_header_t *rsp,
+					int expected_name)
 {
 	bt_audio_error_t *error;
-	int err = audioservice_recv(sk, rsp);
+	uint16_t length = rsp->length;
+	int err;
 
-	if (err != 0)
-		return err;
+	/* Unsolicited indications may be queued ahead of the response */
+	while (1) {
+		err = audioservice_recv(data->server.fd, rsp);
+		if (err != 0)
+			return err;
+
+		if (rsp->type != BT_INDICATION || rsp->name == expected_name)
+			break;
+
+		bluetooth_handle_indication(data, rsp);
+		rsp->length = length;
+	}
 
 	if (rsp->name != expected_name) {
 		err = -EINVAL;
@@ -1626,6 +2579,11 @@ static int bluetooth_parse_capabilities(struct bluetooth_data *data,
 
 	data->transport = codec->transport;
 
+	if (codec->transport == BT_CAPABILITIES_TRANSPORT_SCO) {
+		data->sco.msbc = codec->type == BT_HFP_CODEC_MSBC;
+		return 0;
+	}
+
 	if (codec->transport != BT_CAPABILITIES_TRANSPORT_A2DP)
 		return 0;
 
@@ -1674,18 +2632,8 @@ static int bluetooth_init(struct bluetooth_data *data,
 	data->server.fd = sk;
 	data->server.events = POLLIN;
 
-	data->pipefd[0] = -1;
-	data->pipefd[1] = -1;
-
-	if (pipe(data->pipefd) < 0) {
-		err = -errno;
-		goto failed;
-	}
-	if (fcntl(data->pipefd[0], F_SETFL, O_NONBLOCK) < 0) {
-		err = -errno;
-		goto failed;
-	}
-	if (fcntl(data->pipefd[1], F_SETFL, O_NONBLOCK) < 0) {
+	data->event_fd = eventfd(0, EFD_NONBLOCK);
+	if (data->event_fd < 0) {
 		err = -errno;
 		goto failed;
 	}
@@ -1708,7 +2656,7 @@ static int bluetooth_init(struct bluetooth_data *data,
 		goto failed;
 
 	rsp->h.length = 0;
-	err = audioservice_expect(data->server.fd, &rsp->h,
+	err = audioservice_expect(data, &rsp->h,
 					BT_GET_CAPABILITIES);
 	if (err < 0)
 		goto failed;
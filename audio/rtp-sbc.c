@@ -0,0 +1,359 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "rtp.h"
+#include "rtp-sbc.h"
+
+/* Packets handed to the kernel per system call */
+#define RTP_SBC_SEND_BATCH	16
+
+/* struct mmsghdr came with recvmmsg(), before sendmmsg() */
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+#endif
+
+#ifndef HAVE_SENDMMSG
+static int sendmmsg(int sk, struct mmsghdr *msgvec, unsigned int vlen,
+								int flags)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t ret = sendmsg(sk, &msgvec[i].msg_hdr, flags);
+
+		if (ret < 0)
+			return i > 0 ? (int) i : -1;
+
+		msgvec[i].msg_len = ret;
+	}
+
+	return i;
+}
+#endif
+
+int rtp_sbc_payloader_init(struct rtp_sbc_payloader *pay,
+				unsigned int n_packets, size_t packet_size)
+{
+	unsigned int i;
+
+	memset(pay, 0, sizeof(*pay));
+
+	/* Frames are encoded straight into these buffers, map them upfront
+	 * so that no page faults happen in the streaming path */
+	pay->packets = mmap(NULL, n_packets * packet_size,
+				PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE,
+				-1, 0);
+	if (pay->packets == MAP_FAILED) {
+		pay->packets = NULL;
+		return -errno;
+	}
+
+	pay->iov = calloc(n_packets, sizeof(struct iovec));
+	if (pay->iov == NULL) {
+		munmap(pay->packets, n_packets * packet_size);
+		pay->packets = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < n_packets; i++)
+		pay->iov[i].iov_base = pay->packets + i * packet_size;
+
+	pay->n_packets = n_packets;
+	pay->packet_size = packet_size;
+	pay->max_frames = RTP_SBC_MAX_FRAMES;
+
+	rtp_sbc_payloader_reset(pay, packet_size);
+
+	return 0;
+}
+
+void rtp_sbc_payloader_free(struct rtp_sbc_payloader *pay)
+{
+	if (pay->packets)
+		munmap(pay->packets, pay->n_packets * pay->packet_size);
+
+	free(pay->iov);
+
+	memset(pay, 0, sizeof(*pay));
+}
+
+void rtp_sbc_payloader_reset(struct rtp_sbc_payloader *pay, uint16_t mtu)
+{
+	pay->mtu = mtu < pay->packet_size ? mtu : pay->packet_size;
+	pay->head = 0;
+	pay->queued = 0;
+	pay->count = RTP_SBC_HEADER_SIZE;
+	pay->last_frame = 0;
+	pay->frames = 0;
+	pay->samples = 0;
+}
+
+/* Returns where the next frame is to be encoded and how much room is
+ * left. If every packet is still waiting to be sent the oldest one is
+ * dropped, as it would have been by the socket without the ring. */
+uint8_t *rtp_sbc_payloader_get_frame(struct rtp_sbc_payloader *pay,
+								size_t *len)
+{
+	unsigned int i;
+
+	if (pay->queued == pay->n_packets) {
+		pay->head = (pay->head + 1) % pay->n_packets;
+		pay->queued--;
+		pay->dropped++;
+	}
+
+	i = (pay->head + pay->queued) % pay->n_packets;
+
+	*len = pay->mtu - pay->count;
+
+	return (uint8_t *) pay->iov[i].iov_base + pay->count;
+}
+
+void rtp_sbc_payloader_complete(struct rtp_sbc_payloader *pay)
+{
+	unsigned int i = (pay->head + pay->queued) % pay->n_packets;
+	struct rtp_header *header = pay->iov[i].iov_base;
+	struct rtp_payload *payload = (void *) (header + 1);
+
+	if (pay->frames == 0)
+		return;
+
+	memset(header, 0, RTP_SBC_HEADER_SIZE);
+	header->v = 2;
+	header->pt = 1;
+	header->sequence_number = htons(pay->seq_num);
+	header->timestamp = htonl(pay->timestamp);
+	header->ssrc = htonl(1);
+	payload->frame_count = pay->frames;
+
+	pay->iov[i].iov_len = pay->count;
+	pay->queued++;
+
+	pay->seq_num++;
+	pay->timestamp += pay->samples;
+	pay->count = RTP_SBC_HEADER_SIZE;
+	pay->frames = 0;
+	pay->samples = 0;
+}
+
+/* Accounts a frame encoded at rtp_sbc_payloader_get_frame(), returns 1
+ * when that closed the packet because no other frame would fit */
+int rtp_sbc_payloader_commit(struct rtp_sbc_payloader *pay, size_t written,
+							uint32_t samples)
+{
+	pay->count += written;
+	pay->last_frame = written;
+	pay->frames++;
+	pay->samples += samples;
+
+	if (pay->count + written <= pay->mtu &&
+					pay->frames < pay->max_frames)
+		return 0;
+
+	rtp_sbc_payloader_complete(pay);
+
+	return 1;
+}
+
+/* Sends all completed packets with as few system calls as possible,
+ * packets that hit EAGAIN stay queued for the next call */
+int rtp_sbc_payloader_send(struct rtp_sbc_payloader *pay, int sk)
+{
+	struct mmsghdr msgs[RTP_SBC_SEND_BATCH];
+	unsigned int i, n_msgs;
+	int err = 0, sent;
+
+	if (pay->queued == 0)
+		return 0;
+
+	n_msgs = pay->queued < RTP_SBC_SEND_BATCH ?
+					pay->queued : RTP_SBC_SEND_BATCH;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < n_msgs; i++) {
+		unsigned int n = (pay->head + i) % pay->n_packets;
+
+		msgs[i].msg_hdr.msg_iov = &pay->iov[n];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	sent = sendmmsg(sk, msgs, n_msgs, MSG_DONTWAIT);
+	if (sent < 0) {
+		err = -errno;
+
+		/* Any other error means they can't be delivered at all */
+		sent = err == -EAGAIN ? 0 : (int) n_msgs;
+	}
+
+	pay->head = (pay->head + sent) % pay->n_packets;
+	pay->queued -= sent;
+
+	return err < 0 ? err : sent;
+}
+
+int rtp_sbc_depayloader_init(struct rtp_sbc_depayloader *depay,
+				unsigned int n_slots, size_t slot_size,
+				unsigned int depth)
+{
+	memset(depay, 0, sizeof(*depay));
+
+	depay->slots = malloc(n_slots * slot_size);
+	depay->len = calloc(n_slots, sizeof(uint16_t));
+	depay->seq = calloc(n_slots, sizeof(uint16_t));
+
+	if (!depay->slots || !depay->len || !depay->seq) {
+		rtp_sbc_depayloader_free(depay);
+		return -ENOMEM;
+	}
+
+	depay->n_slots = n_slots;
+	depay->slot_size = slot_size;
+	depay->depth = depth < n_slots ? depth : n_slots - 1;
+
+	return 0;
+}
+
+void rtp_sbc_depayloader_free(struct rtp_sbc_depayloader *depay)
+{
+	free(depay->slots);
+	free(depay->len);
+	free(depay->seq);
+
+	memset(depay, 0, sizeof(*depay));
+}
+
+void rtp_sbc_depayloader_reset(struct rtp_sbc_depayloader *depay)
+{
+	memset(depay->len, 0, depay->n_slots * sizeof(uint16_t));
+	depay->pending = 0;
+	depay->started = 0;
+}
+
+int rtp_sbc_depayloader_push(struct rtp_sbc_depayloader *depay,
+					const uint8_t *buf, size_t len)
+{
+	const struct rtp_header *header = (const void *) buf;
+	unsigned int i;
+	uint16_t seq;
+	int16_t diff;
+
+	if (len <= RTP_SBC_HEADER_SIZE || len > depay->slot_size)
+		return -EINVAL;
+
+	if (header->v != 2 || header->cc != 0)
+		return -EINVAL;
+
+	seq = ntohs(header->sequence_number);
+
+	if (!depay->started) {
+		depay->next_seq = seq;
+		depay->started = 1;
+	}
+
+	diff = seq - depay->next_seq;
+
+	/* Already played or skipped over */
+	if (diff < 0)
+		return -EALREADY;
+
+	/* Too far ahead to be reordering, the sender restarted */
+	if ((unsigned int) diff >= depay->n_slots) {
+		depay->lost += depay->pending;
+		rtp_sbc_depayloader_reset(depay);
+		depay->next_seq = seq;
+		depay->started = 1;
+	}
+
+	i = seq % depay->n_slots;
+	if (depay->len[i] > 0)
+		return -EALREADY;
+
+	memcpy(depay->slots + i * depay->slot_size, buf, len);
+	depay->len[i] = len;
+	depay->seq[i] = seq;
+	depay->pending++;
+
+	return 0;
+}
+
+/* Copies the SBC frames of the next packet in sequence into buf. When
+ * the next packet is missing but depth others are already waiting it
+ * is given up on, otherwise 0 is returned until it arrives. */
+int rtp_sbc_depayloader_pop(struct rtp_sbc_depayloader *depay,
+				uint8_t *buf, size_t len, unsigned int *frames)
+{
+	const struct rtp_payload *payload;
+	unsigned int i = depay->next_seq % depay->n_slots;
+	size_t size;
+
+	if (depay->pending == 0)
+		return 0;
+
+	if (depay->len[i] == 0 || depay->seq[i] != depay->next_seq) {
+		if (depay->pending < depay->depth)
+			return 0;
+
+		/* Skip to the oldest packet that did arrive */
+		do {
+			depay->next_seq++;
+			depay->lost++;
+			i = depay->next_seq % depay->n_slots;
+		} while (depay->len[i] == 0);
+	}
+
+	payload = (const void *) (depay->slots + i * depay->slot_size +
+						sizeof(struct rtp_header));
+	size = depay->len[i] - RTP_SBC_HEADER_SIZE;
+
+	depay->len[i] = 0;
+	depay->pending--;
+	depay->next_seq++;
+
+	if (size > len)
+		return -ENOSPC;
+
+	memcpy(buf, payload + 1, size);
+	*frames = payload->frame_count;
+
+	return size;
+}
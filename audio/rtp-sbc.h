@@ -0,0 +1,86 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#define RTP_SBC_HEADER_SIZE	(sizeof(struct rtp_header) + \
+					sizeof(struct rtp_payload))
+
+/* Limit of the 4 bit frame counter in the payload header */
+#define RTP_SBC_MAX_FRAMES	15
+
+/* Packs SBC frames into a ring of MTU sized RTP packets. Frames are
+ * encoded in place, completed packets are sent with one sendmmsg(). */
+struct rtp_sbc_payloader {
+	uint8_t *packets;
+	struct iovec *iov;
+	unsigned int n_packets;
+	size_t packet_size;
+	uint16_t mtu;
+	unsigned int head;		/* Oldest packet not yet sent */
+	unsigned int queued;		/* Completed packets not yet sent */
+	size_t count;			/* Bytes in the packet being filled */
+	size_t last_frame;		/* Length of the previous frame */
+	unsigned int frames;		/* Frames in the packet being filled */
+	unsigned int max_frames;	/* Frames per packet at most */
+	uint32_t samples;		/* Samples in the packet being filled */
+	uint16_t seq_num;
+	uint32_t timestamp;
+	unsigned int dropped;		/* Packets dropped on ring overflow */
+};
+
+int rtp_sbc_payloader_init(struct rtp_sbc_payloader *pay,
+				unsigned int n_packets, size_t packet_size);
+void rtp_sbc_payloader_free(struct rtp_sbc_payloader *pay);
+void rtp_sbc_payloader_reset(struct rtp_sbc_payloader *pay, uint16_t mtu);
+
+uint8_t *rtp_sbc_payloader_get_frame(struct rtp_sbc_payloader *pay,
+								size_t *len);
+int rtp_sbc_payloader_commit(struct rtp_sbc_payloader *pay, size_t written,
+							uint32_t samples);
+void rtp_sbc_payloader_complete(struct rtp_sbc_payloader *pay);
+int rtp_sbc_payloader_send(struct rtp_sbc_payloader *pay, int sk);
+
+/* Reorders received packets and hides short gaps from the decoder */
+struct rtp_sbc_depayloader {
+	uint8_t *slots;
+	uint16_t *len;
+	uint16_t *seq;
+	unsigned int n_slots;
+	size_t slot_size;
+	unsigned int depth;		/* Packets held back before skipping */
+	unsigned int pending;		/* Packets waiting in the slots */
+	uint16_t next_seq;
+	int started;
+	unsigned int lost;
+};
+
+int rtp_sbc_depayloader_init(struct rtp_sbc_depayloader *depay,
+				unsigned int n_slots, size_t slot_size,
+				unsigned int depth);
+void rtp_sbc_depayloader_free(struct rtp_sbc_depayloader *depay);
+void rtp_sbc_depayloader_reset(struct rtp_sbc_depayloader *depay);
+
+int rtp_sbc_depayloader_push(struct rtp_sbc_depayloader *depay,
+					const uint8_t *buf, size_t len);
+int rtp_sbc_depayloader_pop(struct rtp_sbc_depayloader *depay,
+				uint8_t *buf, size_t len, unsigned int *frames);
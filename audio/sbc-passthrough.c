@@ -0,0 +1,324 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2007  Nokia Corporation
+ *  Copyright (C) 2004-2009  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <glib.h>
+
+#include "log.h"
+#include "sbc.h"
+#include "rtp.h"
+#include "rtp-sbc.h"
+#include "a2dp-codecs.h"
+#include "sbc-passthrough.h"
+
+#define SBC_SYNCWORD		0x9c
+
+/* Packets kept around while the socket is full, also the most a single
+ * client write can turn into */
+#define SBC_PASSTHROUGH_PACKETS	4
+
+struct sbc_passthrough {
+	int fd;				/* Stream transport */
+	int client;			/* Our end of the client socket */
+	guint watch;
+	sbc_t sbc;			/* Only used to parse frames */
+	uint8_t header;			/* Expected second header byte */
+	uint8_t min_bitpool;
+	uint8_t max_bitpool;
+	uint32_t frame_samples;
+	uint8_t *buf;
+	size_t buf_size;
+	unsigned int invalid;		/* Writes dropped */
+	struct rtp_sbc_payloader pay;
+};
+
+/* Frames have to match the negotiated configuration bit by bit, apart
+ * from the bitpool that may vary inside the negotiated range */
+static int sbc_header(const a2dp_sbc_t *config, uint8_t *header)
+{
+	uint8_t freq, blocks, mode, alloc, subbands;
+
+	switch (config->frequency) {
+	case SBC_SAMPLING_FREQ_16000:
+		freq = SBC_FREQ_16000;
+		break;
+	case SBC_SAMPLING_FREQ_32000:
+		freq = SBC_FREQ_32000;
+		break;
+	case SBC_SAMPLING_FREQ_44100:
+		freq = SBC_FREQ_44100;
+		break;
+	case SBC_SAMPLING_FREQ_48000:
+		freq = SBC_FREQ_48000;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (config->block_length) {
+	case SBC_BLOCK_LENGTH_4:
+		blocks = SBC_BLK_4;
+		break;
+	case SBC_BLOCK_LENGTH_8:
+		blocks = SBC_BLK_8;
+		break;
+	case SBC_BLOCK_LENGTH_12:
+		blocks = SBC_BLK_12;
+		break;
+	case SBC_BLOCK_LENGTH_16:
+		blocks = SBC_BLK_16;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (config->channel_mode) {
+	case SBC_CHANNEL_MODE_MONO:
+		mode = SBC_MODE_MONO;
+		break;
+	case SBC_CHANNEL_MODE_DUAL_CHANNEL:
+		mode = SBC_MODE_DUAL_CHANNEL;
+		break;
+	case SBC_CHANNEL_MODE_STEREO:
+		mode = SBC_MODE_STEREO;
+		break;
+	case SBC_CHANNEL_MODE_JOINT_STEREO:
+		mode = SBC_MODE_JOINT_STEREO;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	switch (config->subbands) {
+	case SBC_SUBBANDS_4:
+		subbands = SBC_SB_4;
+		break;
+	case SBC_SUBBANDS_8:
+		subbands = SBC_SB_8;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	alloc = config->allocation_method == SBC_ALLOCATION_SNR ?
+						SBC_AM_SNR : SBC_AM_LOUDNESS;
+
+	*header = freq << 6 | blocks << 4 | mode << 2 | alloc << 1 | subbands;
+
+	return 0;
+}
+
+static ssize_t check_frame(struct sbc_passthrough *pass, const uint8_t *buf,
+								size_t len)
+{
+	if (len < 4 || buf[0] != SBC_SYNCWORD || buf[1] != pass->header)
+		return -EINVAL;
+
+	if (buf[2] < pass->min_bitpool || buf[2] > pass->max_bitpool)
+		return -EINVAL;
+
+	/* Checks the CRC and that the frame is complete */
+	return sbc_parse(&pass->sbc, buf, len);
+}
+
+/* Packs the frames of one client write, anything after an invalid
+ * frame is dropped */
+static int packetise(struct sbc_passthrough *pass, const uint8_t *buf,
+								size_t len)
+{
+	size_t offset;
+	ssize_t frame;
+	int err = 0;
+
+	for (offset = 0; offset < len; offset += frame) {
+		uint8_t *dst;
+		size_t room;
+
+		frame = check_frame(pass, buf + offset, len - offset);
+		if (frame <= 0) {
+			err = -EINVAL;
+			break;
+		}
+
+		dst = rtp_sbc_payloader_get_frame(&pass->pay, &room);
+		if ((size_t) frame > room) {
+			rtp_sbc_payloader_complete(&pass->pay);
+			dst = rtp_sbc_payloader_get_frame(&pass->pay, &room);
+		}
+
+		/* Larger than an empty packet, bitpool too high for the MTU */
+		if ((size_t) frame > room) {
+			err = -EMSGSIZE;
+			break;
+		}
+
+		memcpy(dst, buf + offset, frame);
+		rtp_sbc_payloader_commit(&pass->pay, frame,
+							pass->frame_samples);
+	}
+
+	/* Don't hold frames back waiting for the next write */
+	rtp_sbc_payloader_complete(&pass->pay);
+
+	return err;
+}
+
+static gboolean client_cb(GIOChannel *io, GIOCondition cond, gpointer data)
+{
+	struct sbc_passthrough *pass = data;
+	ssize_t len;
+	int err;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		pass->watch = 0;
+		return FALSE;
+	}
+
+	len = recv(pass->client, pass->buf, pass->buf_size,
+						MSG_DONTWAIT | MSG_TRUNC);
+	if (len < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return TRUE;
+
+		error("recv: %s (%d)", strerror(errno), errno);
+		pass->watch = 0;
+		return FALSE;
+	}
+
+	if ((size_t) len > pass->buf_size)
+		err = -EMSGSIZE;
+	else
+		err = packetise(pass, pass->buf, len);
+
+	if (err < 0 && pass->invalid++ == 0)
+		error("Dropping SBC frames: %s (%d)", strerror(-err), -err);
+
+	err = rtp_sbc_payloader_send(&pass->pay, pass->fd);
+	if (err < 0)
+		DBG("send: %s (%d)", strerror(-err), -err);
+
+	return TRUE;
+}
+
+struct sbc_passthrough *sbc_passthrough_new(int fd, uint16_t omtu,
+					const uint8_t *configuration,
+					size_t size, int *client)
+{
+	const a2dp_sbc_t *config = (const void *) configuration;
+	struct sbc_passthrough *pass;
+	GIOChannel *io;
+	int sv[2], err;
+
+	if (size != sizeof(a2dp_sbc_t))
+		return NULL;
+
+	pass = g_new0(struct sbc_passthrough, 1);
+	pass->fd = fd;
+	pass->client = -1;
+
+	sbc_init(&pass->sbc, 0);
+
+	if (sbc_header(config, &pass->header) < 0) {
+		error("Invalid SBC configuration");
+		goto fail;
+	}
+
+	pass->min_bitpool = config->min_bitpool;
+	pass->max_bitpool = config->max_bitpool;
+	pass->frame_samples = 4 * (((pass->header >> 4) & 0x03) + 1) *
+					(pass->header & 0x01 ? 8 : 4);
+
+	err = rtp_sbc_payloader_init(&pass->pay, SBC_PASSTHROUGH_PACKETS,
+									omtu);
+	if (err < 0) {
+		error("Unable to allocate packets: %s (%d)", strerror(-err),
+									-err);
+		goto fail;
+	}
+
+	/* A single write never needs more than the packet ring */
+	pass->buf_size = SBC_PASSTHROUGH_PACKETS *
+					(omtu - RTP_SBC_HEADER_SIZE);
+	pass->buf = g_malloc(pass->buf_size);
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		error("socketpair: %s (%d)", strerror(errno), errno);
+		goto fail;
+	}
+
+	pass->client = sv[0];
+
+	io = g_io_channel_unix_new(pass->client);
+	pass->watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+						G_IO_NVAL, client_cb, pass);
+	g_io_channel_unref(io);
+
+	DBG("header 0x%02x, bitpool %u-%u, writes up to %zu bytes",
+				pass->header, pass->min_bitpool,
+				pass->max_bitpool, pass->buf_size);
+
+	*client = sv[1];
+
+	return pass;
+
+fail:
+	sbc_passthrough_free(pass);
+	return NULL;
+}
+
+size_t sbc_passthrough_get_write_size(struct sbc_passthrough *pass)
+{
+	return pass->buf_size;
+}
+
+void sbc_passthrough_free(struct sbc_passthrough *pass)
+{
+	if (pass->watch > 0)
+		g_source_remove(pass->watch);
+
+	if (pass->client >= 0)
+		close(pass->client);
+
+	if (pass->pay.packets)
+		rtp_sbc_payloader_free(&pass->pay);
+
+	if (pass->invalid > 0)
+		DBG("%u writes with invalid frames", pass->invalid);
+
+	sbc_finish(&pass->sbc);
+	g_free(pass->buf);
+	g_free(pass);
+}
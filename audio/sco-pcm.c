@@ -0,0 +1,358 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sco-pcm.h"
+
+/* Packets received per system call at most */
+#define SCO_PCM_RECV_BATCH	16
+
+/* The ratio is never moved further than 0.5% away from 1:1, enough for
+ * any crystal but not audible as a pitch change on voice */
+#define SCO_PCM_MAX_ADJUST	328
+#define SCO_PCM_MAX_INTEGRAL	65536
+
+#ifndef MSG_WAITFORONE
+#define MSG_WAITFORONE		0x10000
+#endif
+
+#ifndef HAVE_RECVMMSG
+struct mmsghdr {
+	struct msghdr msg_hdr;
+	unsigned int msg_len;
+};
+
+static int recvmmsg(int sk, struct mmsghdr *msgvec, unsigned int vlen,
+					int flags, struct timespec *timeout)
+{
+	unsigned int i;
+
+	for (i = 0; i < vlen; i++) {
+		ssize_t ret = recvmsg(sk, &msgvec[i].msg_hdr,
+						flags & ~MSG_WAITFORONE);
+
+		if (ret < 0)
+			return i > 0 ? (int) i : -1;
+
+		msgvec[i].msg_len = ret;
+
+		if (flags & MSG_WAITFORONE)
+			flags |= MSG_DONTWAIT;
+	}
+
+	return i;
+}
+#endif
+
+int sco_pcm_rx_init(struct sco_pcm_rx *rx, uint16_t mtu,
+						unsigned int n_packets)
+{
+	memset(rx, 0, sizeof(*rx));
+
+	rx->ring = malloc(n_packets * mtu);
+	if (rx->ring == NULL)
+		return -ENOMEM;
+
+	rx->size = n_packets * mtu;
+	rx->mtu = mtu;
+
+	return 0;
+}
+
+void sco_pcm_rx_free(struct sco_pcm_rx *rx)
+{
+	free(rx->ring);
+
+	memset(rx, 0, sizeof(*rx));
+}
+
+void sco_pcm_rx_reset(struct sco_pcm_rx *rx)
+{
+	rx->head = 0;
+	rx->len = 0;
+}
+
+/* Receives every packet already queued, with block set waiting for the
+ * first one. Returns the bytes received. */
+int sco_pcm_rx_fill(struct sco_pcm_rx *rx, int sk, int block)
+{
+	struct mmsghdr msgs[SCO_PCM_RECV_BATCH];
+	struct iovec iov[SCO_PCM_RECV_BATCH][2];
+	size_t tail, space;
+	unsigned int i, n_msgs;
+	int ret, received = 0;
+
+	/* Make room for at least one packet by dropping the oldest */
+	if (rx->size - rx->len < rx->mtu) {
+		rx->head = (rx->head + rx->mtu) % rx->size;
+		rx->len -= rx->mtu;
+		rx->overruns++;
+	}
+
+	space = rx->size - rx->len;
+	tail = (rx->head + rx->len) % rx->size;
+
+	n_msgs = space / rx->mtu;
+	if (n_msgs > SCO_PCM_RECV_BATCH)
+		n_msgs = SCO_PCM_RECV_BATCH;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < n_msgs; i++) {
+		size_t first = rx->size - tail;
+
+		iov[i][0].iov_base = rx->ring + tail;
+		msgs[i].msg_hdr.msg_iov = iov[i];
+
+		if (first >= rx->mtu) {
+			iov[i][0].iov_len = rx->mtu;
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		} else {
+			iov[i][0].iov_len = first;
+			iov[i][1].iov_base = rx->ring;
+			iov[i][1].iov_len = rx->mtu - first;
+			msgs[i].msg_hdr.msg_iovlen = 2;
+		}
+
+		tail = (tail + rx->mtu) % rx->size;
+	}
+
+	ret = recvmmsg(sk, msgs, n_msgs,
+			block ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+	if (ret < 0)
+		return -errno;
+
+	/* Packets shorter than the MTU leave a gap to close up, which
+	 * only happens with controllers that change the packet size */
+	tail = (rx->head + rx->len) % rx->size;
+
+	for (i = 0; i < (unsigned int) ret; i++) {
+		size_t len = msgs[i].msg_len & ~(SCO_PCM_FRAME_SIZE - 1);
+		size_t slot = (rx->head + rx->len + i * rx->mtu) % rx->size;
+		size_t j;
+
+		for (j = 0; slot != tail && j < len; j++)
+			rx->ring[(tail + j) % rx->size] =
+					rx->ring[(slot + j) % rx->size];
+
+		tail = (tail + len) % rx->size;
+		received += len;
+	}
+
+	rx->len += received;
+
+	return received;
+}
+
+size_t sco_pcm_rx_read(struct sco_pcm_rx *rx, void *buf, size_t len)
+{
+	size_t first;
+
+	if (len > rx->len)
+		len = rx->len;
+
+	first = rx->size - rx->head;
+	if (first > len)
+		first = len;
+
+	memcpy(buf, rx->ring + rx->head, first);
+	memcpy((uint8_t *) buf + first, rx->ring, len - first);
+
+	rx->head = (rx->head + len) % rx->size;
+	rx->len -= len;
+
+	return len;
+}
+
+int sco_pcm_queue_init(struct sco_pcm_queue *queue, int sk)
+{
+	socklen_t len = sizeof(queue->sndbuf);
+
+	queue->unit = 0;
+
+	if (getsockopt(sk, SOL_SOCKET, SO_SNDBUF, &queue->sndbuf, &len) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Returns the packets still queued on the socket */
+int sco_pcm_queue_get(struct sco_pcm_queue *queue, int sk)
+{
+	int space, used;
+
+	if (ioctl(sk, TIOCOUTQ, &space) < 0)
+		return -errno;
+
+	used = queue->sndbuf - space;
+	if (used <= 0)
+		return 0;
+
+	if (queue->unit == 0 || used < queue->unit)
+		queue->unit = used;
+
+	return used / queue->unit;
+}
+
+void sco_pcm_resampler_init(struct sco_pcm_resampler *rs)
+{
+	rs->step = 1 << 16;
+	rs->phase = 0;
+	rs->last = 0;
+	rs->integral = 0;
+}
+
+/* Proportional-integral control of the ratio, a queue above the target
+ * means the link consumes slower than the application writes */
+void sco_pcm_resampler_adjust(struct sco_pcm_resampler *rs, int queued,
+								int target)
+{
+	int err = queued - target;
+	int adjust;
+
+	rs->integral += err;
+	if (rs->integral > SCO_PCM_MAX_INTEGRAL)
+		rs->integral = SCO_PCM_MAX_INTEGRAL;
+	else if (rs->integral < -SCO_PCM_MAX_INTEGRAL)
+		rs->integral = -SCO_PCM_MAX_INTEGRAL;
+
+	adjust = err * 8 + rs->integral / 256;
+	if (adjust > SCO_PCM_MAX_ADJUST)
+		adjust = SCO_PCM_MAX_ADJUST;
+	else if (adjust < -SCO_PCM_MAX_ADJUST)
+		adjust = -SCO_PCM_MAX_ADJUST;
+
+	rs->step = (1 << 16) + adjust;
+}
+
+/* Produces up to out_len samples, consumed is set to the input samples
+ * that are no longer needed */
+size_t sco_pcm_resample(struct sco_pcm_resampler *rs, const int16_t *in,
+				size_t in_len, size_t *consumed,
+				int16_t *out, size_t out_len)
+{
+	size_t n = 0, used;
+
+	while (n < out_len) {
+		size_t i = rs->phase >> 16;
+		int32_t a, b, frac;
+
+		if (i >= in_len)
+			break;
+
+		a = i == 0 ? rs->last : in[i - 1];
+		b = in[i];
+		frac = rs->phase & 0xffff;
+
+		out[n++] = a + (int32_t) (((int64_t) (b - a) * frac) >> 16);
+		rs->phase += rs->step;
+	}
+
+	used = rs->phase >> 16;
+	if (used > in_len)
+		used = in_len;
+
+	if (used > 0) {
+		rs->last = in[used - 1];
+		rs->phase -= used << 16;
+	}
+
+	*consumed = used;
+
+	return n;
+}
+
+/* The two sequence number bits are sent twice each */
+static const uint8_t h2_seq[4] = { 0x08, 0x38, 0xc8, 0xf8 };
+
+void sco_msbc_h2_header(uint8_t *buf, unsigned int seq)
+{
+	buf[0] = 0x01;
+	buf[1] = h2_seq[seq % 4];
+}
+
+static int h2_header_valid(const uint8_t *buf, size_t len)
+{
+	if (len > 0 && buf[0] != 0x01)
+		return 0;
+
+	if (len > 1 && buf[1] != h2_seq[0] && buf[1] != h2_seq[1] &&
+				buf[1] != h2_seq[2] && buf[1] != h2_seq[3])
+		return 0;
+
+	/* The frame itself has to start with the mSBC sync word */
+	if (len > 2 && buf[2] != 0xad)
+		return 0;
+
+	return 1;
+}
+
+void sco_msbc_deframer_reset(struct sco_msbc_deframer *d)
+{
+	d->len = 0;
+}
+
+/* Returns the next complete mSBC frame, or NULL once the received data
+ * runs out. The frame stays valid until the next call. */
+const uint8_t *sco_msbc_deframe(struct sco_msbc_deframer *d,
+						struct sco_pcm_rx *rx)
+{
+	if (d->len == SCO_MSBC_PACKET_LEN)
+		d->len = 0;
+
+	while (rx->len > 0 || d->len == SCO_MSBC_PACKET_LEN) {
+		size_t want;
+
+		/* Slide past bytes that can't start a packet */
+		while (d->len > 0 && !h2_header_valid(d->packet, d->len)) {
+			memmove(d->packet, d->packet + 1, d->len - 1);
+			d->len--;
+			d->resyncs++;
+		}
+
+		if (d->len == SCO_MSBC_PACKET_LEN)
+			return d->packet + 2;
+
+		/* Read byte by byte until the header is complete, then the
+		 * rest of the packet at once */
+		want = d->len < 3 ? 1 : SCO_MSBC_PACKET_LEN - d->len;
+
+		d->len += sco_pcm_rx_read(rx, d->packet + d->len, want);
+	}
+
+	return NULL;
+}
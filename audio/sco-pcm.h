@@ -0,0 +1,96 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* Voice over SCO is 8 kHz, 16 bit, mono */
+#define SCO_PCM_RATE		8000
+#define SCO_PCM_FRAME_SIZE	2
+
+/* Receive side jitter buffer. All packets queued on the socket are
+ * received with one system call straight into the ring. */
+struct sco_pcm_rx {
+	uint8_t *ring;
+	size_t size;			/* Whole packets */
+	size_t head;
+	size_t len;
+	uint16_t mtu;
+	unsigned long overruns;		/* Packets lost to a full ring */
+};
+
+int sco_pcm_rx_init(struct sco_pcm_rx *rx, uint16_t mtu,
+						unsigned int n_packets);
+void sco_pcm_rx_free(struct sco_pcm_rx *rx);
+void sco_pcm_rx_reset(struct sco_pcm_rx *rx);
+int sco_pcm_rx_fill(struct sco_pcm_rx *rx, int sk, int block);
+size_t sco_pcm_rx_read(struct sco_pcm_rx *rx, void *buf, size_t len);
+
+/* Amount of voice data the kernel still holds for a SCO socket, in
+ * packets. The socket only reports its send buffer usage in its own
+ * accounting units, the charge of a single packet is learned from the
+ * smallest non-zero usage seen. */
+struct sco_pcm_queue {
+	int sndbuf;
+	int unit;
+};
+
+int sco_pcm_queue_init(struct sco_pcm_queue *queue, int sk);
+int sco_pcm_queue_get(struct sco_pcm_queue *queue, int sk);
+
+/* Linear interpolating resampler with a ratio close to 1:1 that bridges
+ * the clock the application writes with and the SCO link clock. The
+ * ratio follows the queue fill level so that it stays at the target. */
+struct sco_pcm_resampler {
+	uint32_t step;			/* Input samples per output, Q16 */
+	uint32_t phase;			/* Next output position, Q16 */
+	int16_t last;			/* Input sample before position 0 */
+	int32_t integral;
+};
+
+void sco_pcm_resampler_init(struct sco_pcm_resampler *rs);
+void sco_pcm_resampler_adjust(struct sco_pcm_resampler *rs, int queued,
+								int target);
+size_t sco_pcm_resample(struct sco_pcm_resampler *rs, const int16_t *in,
+				size_t in_len, size_t *consumed,
+				int16_t *out, size_t out_len);
+
+/* Wideband speech, mSBC frames over a transparent SCO link. Each 57
+ * byte frame goes out behind a 2 byte H2 synchronization header and is
+ * padded to 60 bytes, one frame every 7.5 ms. */
+#define SCO_MSBC_RATE		16000
+#define SCO_MSBC_FRAME_LEN	57
+#define SCO_MSBC_PACKET_LEN	60
+#define SCO_MSBC_CODESIZE	240	/* PCM bytes per frame */
+
+void sco_msbc_h2_header(uint8_t *buf, unsigned int seq);
+
+/* Finds the H2 framed packets again in the received byte stream, link
+ * packets don't need to line up with them */
+struct sco_msbc_deframer {
+	uint8_t packet[SCO_MSBC_PACKET_LEN];
+	size_t len;
+	unsigned long resyncs;		/* Bytes skipped looking for a header */
+};
+
+void sco_msbc_deframer_reset(struct sco_msbc_deframer *d);
+const uint8_t *sco_msbc_deframe(struct sco_msbc_deframer *d,
+						struct sco_pcm_rx *rx);
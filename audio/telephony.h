@@ -43,6 +43,7 @@
 #define AG_FEATURE_ENHANCED_CALL_STATUS		0x0040
 #define AG_FEATURE_ENHANCED_CALL_CONTROL	0x0080
 #define AG_FEATURE_EXTENDED_ERROR_RESULT_CODES	0x0100
+#define AG_FEATURE_CODEC_NEGOTIATION		0x0200
 
 #define HF_FEATURE_EC_ANDOR_NR			0x0001
 #define HF_FEATURE_CALL_WAITING_AND_3WAY	0x0002
@@ -51,6 +52,11 @@
 #define HF_FEATURE_REMOTE_VOLUME_CONTROL	0x0010
 #define HF_FEATURE_ENHANCED_CALL_STATUS		0x0020
 #define HF_FEATURE_ENHANCED_CALL_CONTROL	0x0040
+#define HF_FEATURE_CODEC_NEGOTIATION		0x0080
+
+/* HFP codec IDs, AT+BAC and +BCS */
+#define HFP_CODEC_CVSD				0x01
+#define HFP_CODEC_MSBC				0x02
 
 /* Indicator event values */
 #define EV_SERVICE_NONE			0
@@ -202,7 +208,7 @@ static inline int telephony_update_indicator(struct indicator *indicators,
 						const char *desc,
 						int new_val)
 {
-	int i;
+	int i, err;
 	struct indicator *ind = NULL;
 
 	for (i = 0; indicators[i].desc != NULL; i++) {
@@ -222,9 +228,13 @@ static inline int telephony_update_indicator(struct indicator *indicators,
 		return 0;
 	}
 
+	/* Notified before the new value is stored, a pending call state
+	 * change may have to be sent with the old one first */
+	err = telephony_event_ind(i);
+
 	ind->val = new_val;
 
-	return telephony_event_ind(i);
+	return err;
 }
 
 static inline int telephony_get_indicator(const struct indicator *indicators,
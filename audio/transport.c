@@ -27,6 +27,7 @@
 #endif
 
 #include <errno.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <gdbus.h>
@@ -43,6 +44,9 @@
 #include "a2dp.h"
 #include "headset.h"
 #include "gateway.h"
+#include "a2dp-codecs.h"
+#include "pcm-shm.h"
+#include "sbc-passthrough.h"
 
 #ifndef DBUS_TYPE_UNIX_FD
 #define DBUS_TYPE_UNIX_FD -1
@@ -61,6 +65,17 @@ struct media_owner {
 	char			*name;
 	char			*accesstype;
 	guint			watch;
+	gboolean		shared;		/* Writes via the PCM ring */
+	gboolean		encoded;	/* Writes SBC frames */
+	unsigned int		shm_id;
+};
+
+/* Transports of a broadcast group share one encoder, the same PCM is
+ * encoded once and sent to each of them */
+struct media_broadcast {
+	char			*name;
+	struct pcm_shm		*shm;
+	unsigned int		refs;		/* Transports in the group */
 };
 
 struct media_transport {
@@ -76,6 +91,9 @@ struct media_transport {
 	uint16_t		imtu;		/* Transport input mtu */
 	uint16_t		omtu;		/* Transport output mtu */
 	uint16_t		delay;		/* Transport delay (a2dp only) */
+	struct pcm_shm		*shm;		/* Daemon side encoder */
+	char			*group;		/* Broadcast group of shm */
+	struct sbc_passthrough	*passthrough;	/* Daemon side packetiser */
 	unsigned int		nrec_id;	/* Transport nrec watch (headset only) */
 	gboolean		read_lock;
 	gboolean		write_lock;
@@ -95,6 +113,8 @@ struct media_transport {
 					DBusMessageIter *value);
 };
 
+static GSList *broadcasts = NULL;
+
 void media_transport_destroy(struct media_transport *transport)
 {
 	char *path;
@@ -186,12 +206,142 @@ static void media_owner_free(struct media_owner *owner)
 	g_free(owner);
 }
 
+static gboolean media_transport_has_shared(struct media_transport *transport,
+						struct media_owner *exclude)
+{
+	GSList *l;
+
+	for (l = transport->owners; l; l = l->next) {
+		struct media_owner *owner = l->data;
+
+		if (owner != exclude && owner->shared)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+static struct media_broadcast *find_broadcast(const char *name)
+{
+	GSList *l;
+
+	for (l = broadcasts; l; l = l->next) {
+		struct media_broadcast *broadcast = l->data;
+
+		if (g_str_equal(broadcast->name, name))
+			return broadcast;
+	}
+
+	return NULL;
+}
+
+static gboolean media_transport_get_encoder(struct media_transport *transport)
+{
+	struct media_broadcast *broadcast = NULL;
+
+	if (transport->group)
+		broadcast = find_broadcast(transport->group);
+
+	if (broadcast) {
+		if (!pcm_shm_match(broadcast->shm, transport->configuration,
+							transport->size)) {
+			error("%s: configuration differs from group %s",
+					transport->path, broadcast->name);
+			return FALSE;
+		}
+
+		if (pcm_shm_add_sink(broadcast->shm, transport->fd,
+							transport->omtu) < 0)
+			return FALSE;
+
+		broadcast->refs++;
+		transport->shm = broadcast->shm;
+
+		DBG("%s joined group %s (%u)", transport->path,
+						broadcast->name, broadcast->refs);
+
+		return TRUE;
+	}
+
+	transport->shm = pcm_shm_new(transport->fd, transport->omtu,
+						transport->configuration,
+						transport->size);
+	if (transport->shm == NULL)
+		return FALSE;
+
+	if (transport->group) {
+		broadcast = g_new0(struct media_broadcast, 1);
+		broadcast->name = g_strdup(transport->group);
+		broadcast->shm = transport->shm;
+		broadcast->refs = 1;
+
+		broadcasts = g_slist_append(broadcasts, broadcast);
+	}
+
+	return TRUE;
+}
+
+static void media_transport_put_encoder(struct media_transport *transport)
+{
+	struct media_broadcast *broadcast = NULL;
+
+	if (transport->group)
+		broadcast = find_broadcast(transport->group);
+
+	if (broadcast == NULL) {
+		pcm_shm_free(transport->shm);
+		transport->shm = NULL;
+		return;
+	}
+
+	pcm_shm_remove_sink(broadcast->shm, transport->fd);
+	transport->shm = NULL;
+
+	DBG("%s left group %s", transport->path, broadcast->name);
+
+	if (--broadcast->refs > 0)
+		return;
+
+	broadcasts = g_slist_remove(broadcasts, broadcast);
+	pcm_shm_free(broadcast->shm);
+	g_free(broadcast->name);
+	g_free(broadcast);
+}
+
+static void media_transport_remove_shared(struct media_transport *transport,
+						struct media_owner *owner)
+{
+	if (transport->shm && owner->shm_id)
+		pcm_shm_remove_client(transport->shm, owner->shm_id);
+
+	/* The write lock belongs to the encoder until the last client is
+	 * gone */
+	if (media_transport_has_shared(transport, owner))
+		return;
+
+	if (transport->shm)
+		media_transport_put_encoder(transport);
+
+	g_free(transport->group);
+	transport->group = NULL;
+
+	media_transport_release(transport, owner->accesstype);
+}
+
 static void media_transport_remove(struct media_transport *transport,
 						struct media_owner *owner)
 {
 	DBG("Transport %s Owner %s", transport->path, owner->name);
 
-	media_transport_release(transport, owner->accesstype);
+	if (owner->shared)
+		media_transport_remove_shared(transport, owner);
+	else
+		media_transport_release(transport, owner->accesstype);
+
+	if (owner->encoded && transport->passthrough) {
+		sbc_passthrough_free(transport->passthrough);
+		transport->passthrough = NULL;
+	}
 
 	/* Reply if owner has a pending request */
 	if (owner->pending)
@@ -224,6 +374,64 @@ static gboolean media_transport_set_fd(struct media_transport *transport,
 	return TRUE;
 }
 
+static gboolean media_transport_reply_shared(struct media_transport *transport,
+						struct media_owner *owner,
+						DBusMessage *msg)
+{
+	int memfd, doorbell, id;
+	gboolean ret;
+
+	if (transport->shm == NULL &&
+			!media_transport_get_encoder(transport))
+		return FALSE;
+
+	id = pcm_shm_add_client(transport->shm, &memfd, &doorbell);
+	if (id < 0)
+		return FALSE;
+
+	owner->shm_id = id;
+
+	ret = g_dbus_send_reply(transport->conn, msg,
+						DBUS_TYPE_UNIX_FD, &memfd,
+						DBUS_TYPE_UNIX_FD, &doorbell,
+						DBUS_TYPE_INVALID);
+
+	/* The message holds its own copy, the ring stays mapped */
+	close(memfd);
+
+	return ret;
+}
+
+static gboolean media_transport_reply_encoded(
+					struct media_transport *transport,
+					DBusMessage *msg)
+{
+	uint16_t size;
+	gboolean ret;
+	int fd;
+
+	transport->passthrough = sbc_passthrough_new(transport->fd,
+						transport->omtu,
+						transport->configuration,
+						transport->size, &fd);
+	if (transport->passthrough == NULL)
+		return FALSE;
+
+	/* The reply carries it as UINT16, writing less is always fine */
+	size = MIN(sbc_passthrough_get_write_size(transport->passthrough),
+								UINT16_MAX);
+
+	ret = g_dbus_send_reply(transport->conn, msg,
+						DBUS_TYPE_UNIX_FD, &fd,
+						DBUS_TYPE_UINT16, &size,
+						DBUS_TYPE_INVALID);
+
+	/* The message holds its own copy */
+	close(fd);
+
+	return ret;
+}
+
 static void a2dp_resume_complete(struct avdtp *session,
 				struct avdtp_error *err, void *user_data)
 {
@@ -251,6 +459,26 @@ static void a2dp_resume_complete(struct avdtp *session,
 
 	media_transport_set_fd(transport, fd, imtu, omtu);
 
+	if (owner->shared) {
+		ret = media_transport_reply_shared(transport, owner, req->msg);
+		if (ret == FALSE)
+			goto fail;
+
+		media_owner_remove(owner);
+
+		return;
+	}
+
+	if (owner->encoded) {
+		ret = media_transport_reply_encoded(transport, req->msg);
+		if (ret == FALSE)
+			goto fail;
+
+		media_owner_remove(owner);
+
+		return;
+	}
+
 	if (g_strstr_len(owner->accesstype, -1, "r") == NULL)
 		imtu = 0;
 
@@ -683,6 +911,140 @@ static DBusMessage *acquire(DBusConnection *conn, DBusMessage *msg,
 	return NULL;
 }
 
+static gboolean media_transport_can_share(struct media_transport *transport)
+{
+	struct media_endpoint *endpoint = transport->endpoint;
+
+	if (strcasecmp(media_endpoint_get_uuid(endpoint),
+						A2DP_SOURCE_UUID) != 0)
+		return FALSE;
+
+	return media_endpoint_get_codec(endpoint) == A2DP_CODEC_SBC;
+}
+
+static DBusMessage *media_transport_acquire_shared(DBusConnection *conn,
+					DBusMessage *msg,
+					struct media_transport *transport,
+					const char *group)
+{
+	struct media_owner *owner;
+	struct media_request *req;
+	const char *sender;
+	guint id;
+
+	if (!media_transport_can_share(transport))
+		return btd_error_not_supported(msg);
+
+	sender = dbus_message_get_sender(msg);
+
+	owner = media_transport_find_owner(transport, sender);
+	if (owner != NULL)
+		return btd_error_not_authorized(msg);
+
+	/* All owners of a transport feed the same encoder */
+	if (transport->shm != NULL && g_strcmp0(transport->group, group) != 0)
+		return btd_error_not_authorized(msg);
+
+	owner = media_owner_create(conn, msg, "w");
+	owner->shared = TRUE;
+
+	/* Already streaming, just hand out another ring to mix in */
+	if (transport->shm != NULL) {
+		media_transport_add(transport, owner);
+
+		if (!media_transport_reply_shared(transport, owner, msg)) {
+			media_transport_remove(transport, owner);
+			return btd_error_failed(msg,
+					"Unable to create PCM ring");
+		}
+
+		return NULL;
+	}
+
+	if (media_transport_acquire(transport, "w") == FALSE) {
+		media_owner_free(owner);
+		return btd_error_not_authorized(msg);
+	}
+
+	/* Needed when the resume completes to find the group's encoder */
+	transport->group = g_strdup(group);
+
+	id = transport->resume(transport, owner);
+	if (id == 0) {
+		g_free(transport->group);
+		transport->group = NULL;
+		media_transport_release(transport, "w");
+		media_owner_free(owner);
+		return btd_error_not_authorized(msg);
+	}
+
+	req = media_request_create(msg, id);
+	media_owner_add(owner, req);
+	media_transport_add(transport, owner);
+
+	return NULL;
+}
+
+static DBusMessage *acquire_shared(DBusConnection *conn, DBusMessage *msg,
+					void *data)
+{
+	return media_transport_acquire_shared(conn, msg, data, NULL);
+}
+
+static DBusMessage *acquire_broadcast(DBusConnection *conn, DBusMessage *msg,
+					void *data)
+{
+	const char *group;
+
+	if (!dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_STRING, &group,
+				DBUS_TYPE_INVALID))
+		return NULL;
+
+	if (*group == '\0')
+		return btd_error_invalid_args(msg);
+
+	return media_transport_acquire_shared(conn, msg, data, group);
+}
+
+static DBusMessage *acquire_encoded(DBusConnection *conn, DBusMessage *msg,
+					void *data)
+{
+	struct media_transport *transport = data;
+	struct media_owner *owner;
+	struct media_request *req;
+	const char *sender;
+	guint id;
+
+	if (!media_transport_can_share(transport))
+		return btd_error_not_supported(msg);
+
+	sender = dbus_message_get_sender(msg);
+
+	owner = media_transport_find_owner(transport, sender);
+	if (owner != NULL)
+		return btd_error_not_authorized(msg);
+
+	if (media_transport_acquire(transport, "w") == FALSE)
+		return btd_error_not_authorized(msg);
+
+	owner = media_owner_create(conn, msg, "w");
+	owner->encoded = TRUE;
+
+	id = transport->resume(transport, owner);
+	if (id == 0) {
+		media_transport_release(transport, "w");
+		media_owner_free(owner);
+		return btd_error_not_authorized(msg);
+	}
+
+	req = media_request_create(msg, id);
+	media_owner_add(owner, req);
+	media_transport_add(transport, owner);
+
+	return NULL;
+}
+
 static DBusMessage *release(DBusConnection *conn, DBusMessage *msg,
 					void *data)
 {
@@ -715,8 +1077,8 @@ static DBusMessage *release(DBusConnection *conn, DBusMessage *msg,
 			const char *member;
 
 			member = dbus_message_get_member(owner->pending->msg);
-			/* Cancel Acquire request if that exist */
-			if (g_str_equal(member, "Acquire"))
+			/* Cancel any of the Acquire* requests if that exist */
+			if (g_str_has_prefix(member, "Acquire"))
 				media_owner_remove(owner);
 			else
 				return btd_error_in_progress(msg);
@@ -746,11 +1108,33 @@ static int set_property_a2dp(struct media_transport *transport,
 						DBusMessageIter *value)
 {
 	if (g_strcmp0(property, "Delay") == 0) {
+		struct a2dp_sep *sep;
+		struct avdtp_stream *stream;
+		uint16_t delay;
+		int err;
+
 		if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT16)
 			return -EINVAL;
-		dbus_message_iter_get_basic(value, &transport->delay);
+		dbus_message_iter_get_basic(value, &delay);
 
-		/* FIXME: send new delay */
+		/* Only a sink reports its delay, the source learns it */
+		if (strcasecmp(media_endpoint_get_uuid(transport->endpoint),
+							A2DP_SINK_UUID) != 0)
+			return -EINVAL;
+
+		if (transport->session == NULL)
+			return -ENOTCONN;
+
+		sep = media_endpoint_get_sep(transport->endpoint);
+		stream = a2dp_sep_get_stream(sep);
+		if (stream == NULL)
+			return -ENOTCONN;
+
+		err = avdtp_delay_report(transport->session, stream, delay);
+		if (err < 0)
+			return err;
+
+		media_transport_update_delay(transport, delay);
 		return 0;
 	}
 
@@ -918,6 +1302,12 @@ static GDBusMethodTable transport_methods[] = {
 	{ "GetProperties",	"",	"a{sv}",	get_properties },
 	{ "Acquire",		"s",	"hqq",		acquire,
 						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "AcquireShared",	"",	"hh",		acquire_shared,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "AcquireBroadcast",	"s",	"hh",		acquire_broadcast,
+						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "AcquireEncoded",	"",	"hq",		acquire_encoded,
+						G_DBUS_METHOD_FLAG_ASYNC},
 	{ "Release",		"s",	"",		release,
 						G_DBUS_METHOD_FLAG_ASYNC},
 	{ "SetProperty",	"sv",	"",		set_property },
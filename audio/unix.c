@@ -48,6 +48,7 @@
 #include "media.h"
 #include "a2dp.h"
 #include "headset.h"
+#include "telephony.h"
 #include "sink.h"
 #include "source.h"
 #include "gateway.h"
@@ -82,6 +83,7 @@ struct unix_client {
 	service_type_t type;
 	char *interface;
 	uint8_t seid;
+	gboolean low_latency;
 	union {
 		struct a2dp_data a2dp;
 		struct headset_data hs;
@@ -260,6 +262,12 @@ static uint8_t headset_generate_capability(struct audio_device *dev,
 
 	pcm = (void *) codec;
 	pcm->sampling_rate = 8000;
+
+	if (dev->headset && headset_get_codec(dev) == HFP_CODEC_MSBC) {
+		codec->type = BT_HFP_CODEC_MSBC;
+		pcm->sampling_rate = 16000;
+	}
+
 	if (dev->headset) {
 		if (headset_get_nrec(dev))
 			pcm->flags |= BT_PCM_FLAG_NREC;
@@ -743,6 +751,9 @@ static void a2dp_config_complete(struct avdtp *session, struct a2dp_sep *sep,
 	a2dp->sep = sep;
 	a2dp->stream = stream;
 
+	if (client->low_latency)
+		avdtp_stream_set_low_latency(stream, TRUE);
+
 	if (!avdtp_stream_get_transport(stream, &client->data_fd, &imtu, &omtu,
 					&caps)) {
 		error("Unable to get stream transport");
@@ -1446,6 +1457,7 @@ static void handle_open_req(struct unix_client *client, struct bt_open_req *req)
 
 	client->seid = req->seid;
 	client->lock = req->lock;
+	client->low_latency = (req->flags & BT_FLAG_LOW_LATENCY) != 0;
 
 	start_open(dev, client);
 
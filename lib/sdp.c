@@ -1466,6 +1466,150 @@ sdp_record_t *sdp_extract_pdu(const uint8_t *buf, int bufsize, int *scanned)
 	return rec;
 }
 
+/* Deeper than any real record, bounds the recursion below */
+#define SDP_MAX_NESTING 16
+
+/*
+ * Checks that the data element at p is well formed, including every
+ * element nested in it, and that each sequence holds exactly the number
+ * of bytes it declares. Returns the size of the element or -1.
+ */
+static int check_data(const uint8_t *p, int bufsize, int depth)
+{
+	sdp_data_t *data;
+	int scanned, seqlen = 0, n = 0;
+	uint8_t dtd;
+
+	if (bufsize < (int) sizeof(uint8_t))
+		return -1;
+
+	switch (*p) {
+	case SDP_SEQ8:
+	case SDP_SEQ16:
+	case SDP_SEQ32:
+	case SDP_ALT8:
+	case SDP_ALT16:
+	case SDP_ALT32:
+		break;
+	default:
+		data = sdp_extract_attr(p, bufsize, &n, NULL);
+		if (data == NULL)
+			return -1;
+
+		sdp_data_free(data);
+		return n > 0 && n <= bufsize ? n : -1;
+	}
+
+	if (depth >= SDP_MAX_NESTING) {
+		SDPERR("Sequences nested too deep");
+		return -1;
+	}
+
+	scanned = sdp_extract_seqtype(p, bufsize, &dtd, &seqlen);
+	if (scanned == 0 || seqlen < 0 || seqlen > bufsize - scanned) {
+		SDPERR("Sequence length exceeds the packet");
+		return -1;
+	}
+
+	p += scanned;
+
+	while (n < seqlen) {
+		int len = check_data(p + n, seqlen - n, depth + 1);
+
+		if (len < 0)
+			return -1;
+
+		n += len;
+	}
+
+	return scanned + seqlen;
+}
+
+/*
+ * Strict variant of sdp_extract_pdu() for service records supplied by
+ * untrusted parties. The buffer must contain exactly one data element
+ * sequence of attribute id/value pairs, attribute ids must be UINT16 in
+ * strictly ascending order and every value must be well formed.
+ *
+ * Returns the record or NULL (and sets errno) if the PDU is invalid.
+ */
+sdp_record_t *sdp_extract_record_pdu(const uint8_t *buf, int bufsize)
+{
+	sdp_record_t *rec;
+	int scanned, seqlen = 0, last = -1;
+	uint8_t dtd;
+
+	scanned = sdp_extract_seqtype(buf, bufsize, &dtd, &seqlen);
+	if (scanned == 0 || dtd < SDP_SEQ8 || dtd > SDP_SEQ32 ||
+						scanned + seqlen != bufsize) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	rec = sdp_record_alloc();
+	if (!rec)
+		return NULL;
+
+	buf += scanned;
+	bufsize -= scanned;
+
+	while (bufsize > 0) {
+		sdp_data_t *data;
+		uint16_t attr;
+		int attrlen = 0, len;
+
+		if (bufsize < (int) (sizeof(uint8_t) + sizeof(uint16_t)) ||
+							*buf != SDP_UINT16) {
+			SDPERR("Invalid attribute id");
+			goto invalid;
+		}
+
+		attr = ntohs(bt_get_unaligned((uint16_t *) (buf + 1)));
+		if (attr <= last) {
+			SDPERR("Attribute 0x%04x out of order", attr);
+			goto invalid;
+		}
+
+		last = attr;
+		buf += sizeof(uint8_t) + sizeof(uint16_t);
+		bufsize -= sizeof(uint8_t) + sizeof(uint16_t);
+
+		/* sdp_extract_attr() skips over broken nested elements */
+		len = check_data(buf, bufsize, 0);
+		if (len < 0) {
+			SDPERR("Malformed value for attribute 0x%04x", attr);
+			goto invalid;
+		}
+
+		data = sdp_extract_attr(buf, bufsize, &attrlen, rec);
+		if (data == NULL)
+			goto invalid;
+
+		if (attrlen != len ||
+				(attr == SDP_ATTR_RECORD_HANDLE &&
+						data->dtd != SDP_UINT32)) {
+			SDPERR("Invalid value for attribute 0x%04x", attr);
+			sdp_data_free(data);
+			goto invalid;
+		}
+
+		if (attr == SDP_ATTR_RECORD_HANDLE)
+			rec->handle = data->val.uint32;
+
+		sdp_attr_replace(rec, attr, data);
+
+		buf += attrlen;
+		bufsize -= attrlen;
+	}
+
+	return rec;
+
+invalid:
+	sdp_record_free(rec);
+	errno = EINVAL;
+	return NULL;
+}
+
 static void sdp_copy_pattern(void *value, void *udata)
 {
 	uuid_t *uuid = value;
@@ -31,6 +31,7 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/wait.h>
+#include <time.h>
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/hci.h>
@@ -65,6 +66,12 @@
 #define LENGTH_BR_INQ 0x08
 #define LENGTH_BR_LE_INQ 0x04
 
+#define HCI_CMD_TIMEOUT 2 /* seconds */
+
+#define NAME_REQ_MAX 4 /* Remote Name Requests in flight */
+#define NAME_TIMEOUT_MIN 3000 /* msec */
+#define NAME_TIMEOUT_MAX 10240 /* msec, twice the default page timeout */
+
 static int start_scanning(int index, int timeout);
 
 static int child_pipe[2] = { -1, -1 };
@@ -87,6 +94,20 @@ enum {
 	PENDING_NAME,
 };
 
+typedef void (*hci_cmd_cb_t) (int index, uint8_t status, void *rp,
+							gpointer user_data);
+
+struct hci_cmd {
+	int index;
+	uint16_t ogf;
+	uint16_t ocf;
+	uint8_t plen;
+	void *param;
+	hci_cmd_cb_t cb;
+	gpointer user_data;
+	guint timeout_id;
+};
+
 struct bt_conn {
 	struct dev_info *dev;
 	bdaddr_t bdaddr;
@@ -115,9 +136,12 @@ enum name_state {
 };
 
 struct found_dev {
+	int index;
 	bdaddr_t bdaddr;
 	int8_t rssi;
 	enum name_state name_state;
+	struct timespec started;
+	guint timeout_id;
 };
 
 static int max_dev = -1;
@@ -154,8 +178,14 @@ static struct dev_info {
 	gboolean up;
 	uint32_t pending;
 
+	/* Num_HCI_Command_Packets from the last Command Complete/Status */
+	uint8_t cmd_credits;
+	GSList *cmd_queue;
+	GSList *cmd_sent;
+
 	GIOChannel *io;
 	guint watch_id;
+	int clock_sk;			/* Private socket for Read Clock */
 
 	gboolean debug_keys;
 	GSList *keys;
@@ -169,6 +199,9 @@ static struct dev_info {
 
 	GSList *found_devs;
 	GSList *need_name;
+	unsigned int names_pending;
+	unsigned int names_max;
+	unsigned int name_rtt;	/* msec, average for resolved names */
 
 	guint stop_scan_id;
 
@@ -176,6 +209,165 @@ static struct dev_info {
 	guint discoverable_id;
 } *devs = NULL;
 
+/* HCI command queue, commands are only written to the controller while it
+ * has room for them and complete through Command Complete/Status */
+
+static void process_cmd_queue(int index);
+
+static void hci_cmd_free(struct hci_cmd *cmd)
+{
+	if (cmd->timeout_id > 0)
+		g_source_remove(cmd->timeout_id);
+
+	g_free(cmd->param);
+	g_free(cmd);
+}
+
+static void hci_cmd_complete(struct hci_cmd *cmd, uint8_t status, void *rp)
+{
+	if (cmd->cb)
+		cmd->cb(cmd->index, status, rp, cmd->user_data);
+
+	hci_cmd_free(cmd);
+}
+
+static gboolean hci_cmd_timeout(gpointer user_data)
+{
+	struct hci_cmd *cmd = user_data;
+	struct dev_info *dev = &devs[cmd->index];
+
+	error("hci%d: command 0x%4.4x timed out", cmd->index,
+					cmd_opcode_pack(cmd->ogf, cmd->ocf));
+
+	cmd->timeout_id = 0;
+	dev->cmd_sent = g_slist_remove(dev->cmd_sent, cmd);
+
+	/* The response got lost, don't stall everything behind it */
+	if (dev->cmd_credits == 0)
+		dev->cmd_credits = 1;
+
+	hci_cmd_complete(cmd, HCI_UNSPECIFIED_ERROR, NULL);
+
+	process_cmd_queue(dev->id);
+
+	return FALSE;
+}
+
+static int send_cmd(struct dev_info *dev, struct hci_cmd *cmd)
+{
+	if (hci_send_cmd(dev->sk, cmd->ogf, cmd->ocf, cmd->plen,
+							cmd->param) < 0)
+		return -errno;
+
+	dev->cmd_credits--;
+	dev->cmd_sent = g_slist_append(dev->cmd_sent, cmd);
+	cmd->timeout_id = g_timeout_add_seconds(HCI_CMD_TIMEOUT,
+							hci_cmd_timeout, cmd);
+
+	return 0;
+}
+
+static void process_cmd_queue(int index)
+{
+	struct dev_info *dev = &devs[index];
+
+	while (dev->cmd_credits > 0 && dev->cmd_queue != NULL) {
+		struct hci_cmd *cmd = dev->cmd_queue->data;
+		int err;
+
+		dev->cmd_queue = g_slist_remove(dev->cmd_queue, cmd);
+
+		err = send_cmd(dev, cmd);
+		if (err < 0) {
+			error("hci%d: sending command 0x%4.4x failed: %s (%d)",
+					index, cmd_opcode_pack(cmd->ogf,
+					cmd->ocf), strerror(-err), -err);
+			hci_cmd_complete(cmd, HCI_UNSPECIFIED_ERROR, NULL);
+		}
+	}
+}
+
+static int hci_queue_cmd_cb(int index, uint16_t ogf, uint16_t ocf,
+				uint8_t plen, void *param, hci_cmd_cb_t cb,
+				gpointer user_data)
+{
+	struct dev_info *dev = &devs[index];
+	struct hci_cmd *cmd;
+	int err;
+
+	if (dev->sk < 0)
+		return -ENODEV;
+
+	cmd = g_new0(struct hci_cmd, 1);
+	cmd->index = index;
+	cmd->ogf = ogf;
+	cmd->ocf = ocf;
+	cmd->plen = plen;
+	cmd->param = plen > 0 ? g_memdup(param, plen) : NULL;
+	cmd->cb = cb;
+	cmd->user_data = user_data;
+
+	/* Keep the order, only go straight out if nothing is waiting */
+	if (dev->cmd_credits == 0 || dev->cmd_queue != NULL) {
+		dev->cmd_queue = g_slist_append(dev->cmd_queue, cmd);
+		return 0;
+	}
+
+	err = send_cmd(dev, cmd);
+	if (err < 0)
+		hci_cmd_free(cmd);
+
+	return err;
+}
+
+static int hci_queue_cmd(int index, uint16_t ogf, uint16_t ocf, uint8_t plen,
+								void *param)
+{
+	return hci_queue_cmd_cb(index, ogf, ocf, plen, param, NULL, NULL);
+}
+
+static void cmd_credits_update(int index, uint16_t opcode, uint8_t ncmd,
+						uint8_t status, void *rp)
+{
+	struct dev_info *dev = &devs[index];
+	struct hci_cmd *cmd;
+
+	dev->cmd_credits = ncmd;
+
+	/* Events carry no more than the opcode, and the kernel or tools
+	 * like hciconfig may send the same command on this controller.
+	 * Commands are answered in the order they're sent, so only an
+	 * event for the oldest one sent is taken as ours. Anything else
+	 * that got answered out of order is left to its timeout. */
+	cmd = dev->cmd_sent ? dev->cmd_sent->data : NULL;
+	if (cmd && cmd_opcode_pack(cmd->ogf, cmd->ocf) == opcode) {
+		dev->cmd_sent = g_slist_remove(dev->cmd_sent, cmd);
+		hci_cmd_complete(cmd, status, rp);
+	}
+
+	process_cmd_queue(index);
+}
+
+static void cmd_queue_flush(int index, uint8_t status)
+{
+	struct dev_info *dev = &devs[index];
+	GSList *sent = dev->cmd_sent, *queue = dev->cmd_queue;
+
+	dev->cmd_sent = NULL;
+	dev->cmd_queue = NULL;
+	dev->cmd_credits = 1;
+
+	while (sent != NULL) {
+		hci_cmd_complete(sent->data, status, NULL);
+		sent = g_slist_delete_link(sent, sent);
+	}
+
+	while (queue != NULL) {
+		hci_cmd_complete(queue->data, status, NULL);
+		queue = g_slist_delete_link(queue, queue);
+	}
+}
+
 static int found_dev_rssi_cmp(gconstpointer a, gconstpointer b)
 {
 	const struct found_dev *d1 = a, *d2 = b;
@@ -197,47 +389,232 @@ static int found_dev_bda_cmp(gconstpointer a, gconstpointer b)
 	return bacmp(&d1->bdaddr, &d2->bdaddr);
 }
 
+static void found_dev_free(gpointer data)
+{
+	struct found_dev *dev = data;
+
+	if (dev->timeout_id > 0)
+		g_source_remove(dev->timeout_id);
+
+	g_free(dev);
+}
+
 static void found_dev_cleanup(struct dev_info *info)
 {
-	g_slist_free_full(info->found_devs, g_free);
+	g_slist_free_full(info->found_devs, found_dev_free);
 	info->found_devs = NULL;
 
-	g_slist_free_full(info->need_name, g_free);
+	g_slist_free_full(info->need_name, found_dev_free);
 	info->need_name = NULL;
+
+	info->names_pending = 0;
 }
 
-static int resolve_name(struct dev_info *info, bdaddr_t *bdaddr)
+/* Remote name resolution. Up to names_max requests are kept in flight;
+ * the controller gets to page the next device while earlier ones are
+ * still being answered. */
+
+static void set_state(int index, int state);
+static int resolve_names(struct dev_info *info);
+
+static unsigned int elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000 +
+				(now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Devices that haven't answered within a few times the usual response
+ * time are given up on instead of waiting out the page timeout */
+static unsigned int name_timeout(struct dev_info *info)
+{
+	if (info->name_rtt == 0)
+		return NAME_TIMEOUT_MAX;
+
+	return CLAMP(info->name_rtt * 4, NAME_TIMEOUT_MIN, NAME_TIMEOUT_MAX);
+}
+
+static void name_request_done(int index, GSList *match, gboolean resolved)
+{
+	struct dev_info *info = &devs[index];
+	struct found_dev *dev = match->data;
+
+	if (dev->timeout_id > 0) {
+		g_source_remove(dev->timeout_id);
+		dev->timeout_id = 0;
+	}
+
+	if (resolved) {
+		unsigned int ms = elapsed_ms(&dev->started);
+
+		info->name_rtt = info->name_rtt == 0 ? ms :
+					(info->name_rtt * 7 + ms) / 8;
+	}
+
+	if (dev->name_state == NAME_PENDING && info->names_pending > 0)
+		info->names_pending--;
+
+	dev->name_state = NAME_NOT_NEEDED;
+
+	info->need_name = g_slist_remove_link(info->need_name, match);
+
+	match->next = info->found_devs;
+	info->found_devs = match;
+	info->found_devs = g_slist_sort(info->found_devs, found_dev_rssi_cmp);
+
+	if (info->discov_state != DISCOV_NAMES)
+		return;
+
+	if (resolve_names(info) < 0)
+		set_state(index, DISCOV_HALTED);
+}
+
+static int cancel_name_request(int index, bdaddr_t *bdaddr)
+{
+	remote_name_req_cancel_cp cp;
+
+	memset(&cp, 0, sizeof(cp));
+	bacpy(&cp.bdaddr, bdaddr);
+
+	return hci_queue_cmd(index, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL,
+				REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cp);
+}
+
+static gboolean name_request_timeout(gpointer user_data)
+{
+	struct found_dev *dev = user_data;
+	int index = dev->index;
+	GSList *match;
+	char addr[18];
+
+	dev->timeout_id = 0;
+
+	ba2str(&dev->bdaddr, addr);
+	DBG("hci%d giving up on %s", index, addr);
+
+	cancel_name_request(index, &dev->bdaddr);
+
+	/* Not waiting for the cancel to complete the request, the
+	 * controller may never answer it. A late completion finds the
+	 * device no longer in need_name and is ignored. */
+	match = g_slist_find(devs[index].need_name, dev);
+	if (match != NULL)
+		name_request_done(index, match, FALSE);
+
+	return FALSE;
+}
+
+static void remote_name_req_status(int index, uint8_t status, void *rp,
+							gpointer user_data)
+{
+	struct dev_info *info = &devs[index];
+	bdaddr_t *bdaddr = user_data;
+	struct found_dev *dev;
+	GSList *match;
+
+	if (status == 0 || status == HCI_OE_POWER_OFF)
+		goto done;
+
+	match = g_slist_find_custom(info->need_name, bdaddr,
+							found_dev_bda_cmp);
+	if (match == NULL)
+		goto done;
+
+	dev = match->data;
+	if (dev->name_state != NAME_PENDING)
+		goto done;
+
+	DBG("hci%d status 0x%02x with %u pending", index, status,
+						info->names_pending);
+
+	switch (status) {
+	case HCI_COMMAND_DISALLOWED:
+	case HCI_MEMORY_FULL:
+	case HCI_MAX_NUMBER_OF_CONNECTIONS:
+	case HCI_REJECTED_LIMITED_RESOURCES:
+		/* The controller can't page that many devices at once,
+		 * retry when one of the others is done */
+		if (info->names_pending > 1) {
+			if (dev->timeout_id > 0) {
+				g_source_remove(dev->timeout_id);
+				dev->timeout_id = 0;
+			}
+			dev->name_state = NAME_NEEDED;
+			info->names_pending--;
+			info->names_max = info->names_pending;
+			break;
+		}
+		/* fall through */
+	default:
+		name_request_done(index, match, FALSE);
+		break;
+	}
+
+done:
+	g_free(bdaddr);
+}
+
+static int resolve_name(struct dev_info *info, struct found_dev *dev)
 {
 	remote_name_req_cp cp;
+	bdaddr_t *bdaddr;
 	char addr[18];
+	int err;
 
-	ba2str(bdaddr, addr);
+	ba2str(&dev->bdaddr, addr);
 	DBG("hci%d dba %s", info->id, addr);
 
 	memset(&cp, 0, sizeof(cp));
-	bacpy(&cp.bdaddr, bdaddr);
+	bacpy(&cp.bdaddr, &dev->bdaddr);
 	cp.pscan_rep_mode = 0x02;
 
-	if (hci_send_cmd(info->sk, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ,
-					REMOTE_NAME_REQ_CP_SIZE, &cp) < 0)
-		return -errno;
+	bdaddr = g_memdup(&dev->bdaddr, sizeof(bdaddr_t));
+
+	err = hci_queue_cmd_cb(info->id, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ,
+					REMOTE_NAME_REQ_CP_SIZE, &cp,
+					remote_name_req_status, bdaddr);
+	if (err < 0) {
+		g_free(bdaddr);
+		return err;
+	}
+
+	dev->name_state = NAME_PENDING;
+	clock_gettime(CLOCK_MONOTONIC, &dev->started);
+	dev->timeout_id = g_timeout_add(name_timeout(info),
+						name_request_timeout, dev);
+	info->names_pending++;
 
 	return 0;
 }
 
-static int resolve_names(struct dev_info *info, struct btd_adapter *adapter)
+static int resolve_names(struct dev_info *info)
 {
-	struct found_dev *dev;
+	GSList *l;
 
-	DBG("found_dev %u need_name %u", g_slist_length(info->found_devs),
-					g_slist_length(info->need_name));
+	DBG("found_dev %u need_name %u pending %u",
+					g_slist_length(info->found_devs),
+					g_slist_length(info->need_name),
+					info->names_pending);
 
-	if (g_slist_length(info->need_name) == 0)
+	if (info->need_name == NULL)
 		return -ENOENT;
 
-	dev = info->need_name->data;
-	resolve_name(info, &dev->bdaddr);
-	dev->name_state = NAME_PENDING;
+	/* need_name is in RSSI order, closest devices go first */
+	for (l = info->need_name; l != NULL; l = l->next) {
+		struct found_dev *dev = l->data;
+
+		if (info->names_pending >= info->names_max)
+			break;
+
+		if (dev->name_state != NAME_NEEDED)
+			continue;
+
+		if (resolve_name(info, dev) < 0)
+			break;
+	}
 
 	return 0;
 }
@@ -270,7 +647,8 @@ static void set_state(int index, int state)
 		adapter_set_discovering(adapter, TRUE);
 		break;
 	case DISCOV_NAMES:
-		if (resolve_names(dev, adapter) < 0)
+		dev->names_max = NAME_REQ_MAX;
+		if (resolve_names(dev) < 0)
 			set_state(index, DISCOV_HALTED);
 		break;
 	}
@@ -317,11 +695,13 @@ static struct dev_info *init_dev_info(int index, int sk, gboolean registered,
 
 	dev->id = index;
 	dev->sk = sk;
+	dev->clock_sk = -1;
 	dev->cache_enable = TRUE;
 	dev->registered = registered;
 	dev->already_up = already_up;
 	dev->io_capability = 0x03; /* No Input No Output */
 	dev->discov_state = DISCOV_HALTED;
+	dev->cmd_credits = 1;
 
 	return dev;
 }
@@ -433,15 +813,16 @@ failed:
 
 static int write_inq_mode(int index, uint8_t mode)
 {
-	struct dev_info *dev = &devs[index];
 	write_inquiry_mode_cp cp;
+	int err;
 
 	memset(&cp, 0, sizeof(cp));
 	cp.mode = mode;
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE,
-					WRITE_INQUIRY_MODE_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE,
+					WRITE_INQUIRY_MODE_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
@@ -483,6 +864,7 @@ static int init_ssp_mode(int index)
 {
 	struct dev_info *dev = &devs[index];
 	write_simple_pairing_mode_cp cp;
+	int err;
 
 	if (ioctl(dev->sk, HCIGETAUTHINFO, NULL) < 0 && errno == EINVAL)
 		return 0;
@@ -490,10 +872,11 @@ static int init_ssp_mode(int index)
 	memset(&cp, 0, sizeof(cp));
 	cp.mode = 0x01;
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
+	err = hci_queue_cmd(index, OGF_HOST_CTL,
 				OCF_WRITE_SIMPLE_PAIRING_MODE,
-				WRITE_SIMPLE_PAIRING_MODE_CP_SIZE, &cp) < 0)
-		return -errno;
+				WRITE_SIMPLE_PAIRING_MODE_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
@@ -503,6 +886,7 @@ static int hciops_set_discoverable(int index, gboolean discoverable,
 {
 	struct dev_info *dev = &devs[index];
 	uint8_t mode;
+	int err;
 
 	if (discoverable)
 		mode = (SCAN_PAGE | SCAN_INQUIRY);
@@ -511,9 +895,10 @@ static int hciops_set_discoverable(int index, gboolean discoverable,
 
 	DBG("hci%d discoverable %d", index, discoverable);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE,
-								1, &mode) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE,
+								1, &mode);
+	if (err < 0)
+		return err;
 
 	dev->discoverable_timeout = timeout;
 
@@ -547,6 +932,14 @@ static int hciops_power_off(int index)
 	return 0;
 }
 
+static void set_event_mask_complete(int index, uint8_t status, void *rp,
+							gpointer user_data)
+{
+	if (status)
+		error("hci%d: setting event mask failed with status 0x%02x",
+							index, status);
+}
+
 static void set_event_mask(int index)
 {
 	struct dev_info *dev = &devs[index];
@@ -598,8 +991,9 @@ static void set_event_mask(int index)
 	if (dev->features[4] & LMP_LE)
 		events[7] |= 0x20;	/* LE Meta-Event */
 
-	hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_SET_EVENT_MASK,
-						sizeof(events), events);
+	hci_queue_cmd_cb(index, OGF_HOST_CTL, OCF_SET_EVENT_MASK,
+					sizeof(events), events,
+					set_event_mask_complete, NULL);
 }
 
 static void start_adapter(int index)
@@ -618,7 +1012,7 @@ static void start_adapter(int index)
 		write_inq_mode(index, inqmode);
 
 	if (dev->features[7] & LMP_INQ_TX_PWR)
-		hci_send_cmd(dev->sk, OGF_HOST_CTL,
+		hci_queue_cmd(index, OGF_HOST_CTL,
 				OCF_READ_INQ_RESPONSE_TX_POWER_LEVEL, 0, NULL);
 
 	/* Set default link policy */
@@ -634,7 +1028,7 @@ static void start_adapter(int index)
 		link_policy &= ~HCI_LP_PARK;
 
 	link_policy = htobs(link_policy);
-	hci_send_cmd(dev->sk, OGF_LINK_POLICY, OCF_WRITE_DEFAULT_LINK_POLICY,
+	hci_queue_cmd(index, OGF_LINK_POLICY, OCF_WRITE_DEFAULT_LINK_POLICY,
 					sizeof(link_policy), &link_policy);
 
 	dev->current_cod = 0;
@@ -643,20 +1037,37 @@ static void start_adapter(int index)
 
 static int hciops_stop_inquiry(int index)
 {
-	struct dev_info *dev = &devs[index];
+	int err;
 
 	DBG("hci%d", index);
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, 0) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_LINK_CTL, OCF_INQUIRY_CANCEL, 0, 0);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
 
+static void write_eir_failed(int index, uint8_t status, void *rp,
+							gpointer user_data)
+{
+	struct dev_info *dev = &devs[index];
+
+	if (status == 0)
+		return;
+
+	error("hci%d: writing EIR data failed with status 0x%02x", index,
+								status);
+
+	/* Not what the controller has, write it again on the next update */
+	memset(dev->eir, 0, sizeof(dev->eir));
+}
+
 static void update_ext_inquiry_response(int index)
 {
 	struct dev_info *dev = &devs[index];
 	write_ext_inquiry_response_cp cp;
+	int err;
 
 	DBG("hci%d", index);
 
@@ -679,26 +1090,32 @@ static void update_ext_inquiry_response(int index)
 
 	memcpy(dev->eir, cp.data, sizeof(cp.data));
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
+	err = hci_queue_cmd_cb(index, OGF_HOST_CTL,
 				OCF_WRITE_EXT_INQUIRY_RESPONSE,
-				WRITE_EXT_INQUIRY_RESPONSE_CP_SIZE, &cp) < 0)
+				WRITE_EXT_INQUIRY_RESPONSE_CP_SIZE, &cp,
+				write_eir_failed, NULL);
+	if (err < 0) {
 		error("Unable to write EIR data: %s (%d)",
-						strerror(errno), errno);
+						strerror(-err), -err);
+		memset(dev->eir, 0, sizeof(dev->eir));
+	}
 }
 
 static int hciops_set_name(int index, const char *name)
 {
 	struct dev_info *dev = &devs[index];
 	change_local_name_cp cp;
+	int err;
 
 	DBG("hci%d, name %s", index, name);
 
 	memset(&cp, 0, sizeof(cp));
 	strncpy((char *) cp.name, name, sizeof(cp.name));
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME,
-				CHANGE_LOCAL_NAME_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME,
+				CHANGE_LOCAL_NAME_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	memcpy(dev->name, cp.name, 248);
 	update_ext_inquiry_response(index);
@@ -706,18 +1123,34 @@ static int hciops_set_name(int index, const char *name)
 	return 0;
 }
 
+static void write_class_failed(int index, uint8_t status, void *rp,
+							gpointer user_data)
+{
+	if (status == 0)
+		return;
+
+	error("hci%d: writing class failed with status 0x%02x", index,
+								status);
+
+	/* Let the next class change go out instead of waiting forever */
+	devs[index].pending_cod = 0;
+}
+
 static int write_class(int index, uint32_t class)
 {
 	struct dev_info *dev = &devs[index];
 	write_class_of_dev_cp cp;
+	int err;
 
 	DBG("hci%d class 0x%06x", index, class);
 
 	memcpy(cp.dev_class, &class, 3);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV,
-					WRITE_CLASS_OF_DEV_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd_cb(index, OGF_HOST_CTL, OCF_WRITE_CLASS_OF_DEV,
+					WRITE_CLASS_OF_DEV_CP_SIZE, &cp,
+					write_class_failed, NULL);
+	if (err < 0)
+		return err;
 
 	dev->pending_cod = class;
 
@@ -994,9 +1427,10 @@ static int disconnect_addr(int index, bdaddr_t *dba, uint8_t reason)
 	cp.handle = htobs(handle);
 	cp.reason = reason;
 
-	if (hci_send_cmd(devs[index].sk, OGF_LINK_CTL, OCF_DISCONNECT,
-						DISCONNECT_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_LINK_CTL, OCF_DISCONNECT,
+						DISCONNECT_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
@@ -1075,7 +1509,7 @@ static void link_key_request(int index, bdaddr_t *dba)
 
 	if (key_info == NULL || (!dev->debug_keys && key_info->type == 0x03)) {
 		/* Link key not found */
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
+		hci_queue_cmd(index, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
 								6, dba);
 		return;
 	}
@@ -1088,7 +1522,7 @@ static void link_key_request(int index, bdaddr_t *dba)
 	 * required */
 	if (key_info->type == 0x04 && conn->loc_auth != 0xff &&
 						(conn->loc_auth & 0x01))
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
+		hci_queue_cmd(index, OGF_LINK_CTL, OCF_LINK_KEY_NEG_REPLY,
 								6, dba);
 	else {
 		link_key_reply_cp lr;
@@ -1096,7 +1530,7 @@ static void link_key_request(int index, bdaddr_t *dba)
 		memcpy(lr.link_key, key_info->key, 16);
 		bacpy(&lr.bdaddr, dba);
 
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_LINK_KEY_REPLY,
+		hci_queue_cmd(index, OGF_LINK_CTL, OCF_LINK_KEY_REPLY,
 						LINK_KEY_REPLY_CP_SIZE, &lr);
 	}
 }
@@ -1243,7 +1677,6 @@ static void return_link_keys(int index, void *ptr)
 static int hciops_confirm_reply(int index, bdaddr_t *bdaddr, addr_type_t type,
 							gboolean success)
 {
-	struct dev_info *dev = &devs[index];
 	user_confirm_reply_cp cp;
 	char addr[18];
 	int err;
@@ -1255,17 +1688,14 @@ static int hciops_confirm_reply(int index, bdaddr_t *bdaddr, addr_type_t type,
 	bacpy(&cp.bdaddr, bdaddr);
 
 	if (success)
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = hci_queue_cmd(index, OGF_LINK_CTL,
 					OCF_USER_CONFIRM_REPLY,
 					USER_CONFIRM_REPLY_CP_SIZE, &cp);
 	else
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = hci_queue_cmd(index, OGF_LINK_CTL,
 					OCF_USER_CONFIRM_NEG_REPLY,
 					USER_CONFIRM_REPLY_CP_SIZE, &cp);
 
-	if (err < 0)
-		err = -errno;
-
 	return err;
 }
 
@@ -1314,7 +1744,7 @@ static void user_confirm_request(int index, void *ptr)
 		return;
 
 fail:
-	hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_USER_CONFIRM_NEG_REPLY,
+	hci_queue_cmd(index, OGF_LINK_CTL, OCF_USER_CONFIRM_NEG_REPLY,
 								6, ptr);
 }
 
@@ -1326,7 +1756,7 @@ static void user_passkey_request(int index, void *ptr)
 	DBG("hci%d", index);
 
 	if (btd_event_user_passkey(&dev->bdaddr, &req->bdaddr) < 0)
-		hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		hci_queue_cmd(index, OGF_LINK_CTL,
 				OCF_USER_PASSKEY_NEG_REPLY, 6, ptr);
 }
 
@@ -1370,11 +1800,11 @@ static void remote_oob_data_request(int index, bdaddr_t *bdaddr)
 
 		dev->oob_data = g_slist_delete_link(dev->oob_data, match);
 
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_REMOTE_OOB_DATA_REPLY,
+		hci_queue_cmd(index, OGF_LINK_CTL, OCF_REMOTE_OOB_DATA_REPLY,
 				REMOTE_OOB_DATA_REPLY_CP_SIZE, &cp);
 
 	} else {
-		hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		hci_queue_cmd(index, OGF_LINK_CTL,
 				OCF_REMOTE_OOB_DATA_NEG_REPLY, 6, bdaddr);
 	}
 }
@@ -1469,7 +1899,7 @@ static void io_capa_request(int index, void *ptr)
 		memset(&cp, 0, sizeof(cp));
 		bacpy(&cp.bdaddr, dba);
 		cp.reason = HCI_PAIRING_NOT_ALLOWED;
-		hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		hci_queue_cmd(index, OGF_LINK_CTL,
 					OCF_IO_CAPABILITY_NEG_REPLY,
 					IO_CAPABILITY_NEG_REPLY_CP_SIZE, &cp);
 	} else {
@@ -1491,7 +1921,7 @@ static void io_capa_request(int index, void *ptr)
 		else
 			cp.oob_data = 0x00;
 
-		hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_IO_CAPABILITY_REPLY,
+		hci_queue_cmd(index, OGF_LINK_CTL, OCF_IO_CAPABILITY_REPLY,
 					IO_CAPABILITY_REPLY_CP_SIZE, &cp);
 	}
 }
@@ -1546,7 +1976,7 @@ static void pin_code_request(int index, bdaddr_t *dba)
 	return;
 
 reject:
-	hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_PIN_CODE_NEG_REPLY, 6, dba);
+	hci_queue_cmd(index, OGF_LINK_CTL, OCF_PIN_CODE_NEG_REPLY, 6, dba);
 }
 
 static inline void remote_features_notify(int index, void *ptr)
@@ -1730,6 +2160,8 @@ static inline void cmd_status(int index, void *ptr)
 
 	if (opcode == cmd_opcode_pack(OGF_LINK_CTL, OCF_INQUIRY))
 		cs_inquiry_evt(index, evt->status);
+
+	cmd_credits_update(index, opcode, evt->ncmd, evt->status, NULL);
 }
 
 static gboolean discoverable_timeout_handler(gpointer user_data)
@@ -1750,6 +2182,7 @@ static int hciops_set_limited_discoverable(int index, gboolean limited)
 	int num = (limited ? 2 : 1);
 	uint8_t lap[] = { 0x33, 0x8b, 0x9e, 0x00, 0x8b, 0x9e };
 	write_current_iac_lap_cp cp;
+	int err;
 
 	DBG("hci%d limited %d", index, limited);
 
@@ -1771,9 +2204,10 @@ static int hciops_set_limited_discoverable(int index, gboolean limited)
 	cp.num_current_iac = num;
 	memcpy(&cp.lap, lap, num * 3);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_CURRENT_IAC_LAP,
-						(num * 3 + 1), &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_WRITE_CURRENT_IAC_LAP,
+						(num * 3 + 1), &cp);
+	if (err < 0)
+		return err;
 
 	return write_class(index, dev->wanted_cod);
 }
@@ -1936,10 +2370,10 @@ static inline void cc_le_set_scan_enable(int index, uint8_t status)
 
 static inline void cmd_complete(int index, void *ptr)
 {
-	struct dev_info *dev = &devs[index];
 	evt_cmd_complete *evt = ptr;
 	uint16_t opcode = btohs(evt->opcode);
-	uint8_t status = *((uint8_t *) ptr + EVT_CMD_COMPLETE_SIZE);
+	uint8_t *rp = (uint8_t *) ptr + EVT_CMD_COMPLETE_SIZE;
+	uint8_t status = *rp;
 
 	switch (opcode) {
 	case cmd_opcode_pack(OGF_INFO_PARAM, OCF_READ_LOCAL_VERSION):
@@ -1966,11 +2400,11 @@ static inline void cmd_complete(int index, void *ptr)
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_CHANGE_LOCAL_NAME):
 		if (!status)
-			hci_send_cmd(dev->sk, OGF_HOST_CTL,
+			hci_queue_cmd(index, OGF_HOST_CTL,
 						OCF_READ_LOCAL_NAME, 0, 0);
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_SCAN_ENABLE):
-		hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_READ_SCAN_ENABLE,
+		hci_queue_cmd(index, OGF_HOST_CTL, OCF_READ_SCAN_ENABLE,
 								0, NULL);
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_READ_SCAN_ENABLE):
@@ -1982,7 +2416,7 @@ static inline void cmd_complete(int index, void *ptr)
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_WRITE_SIMPLE_PAIRING_MODE):
 		if (!status)
-			hci_send_cmd(dev->sk, OGF_HOST_CTL,
+			hci_queue_cmd(index, OGF_HOST_CTL,
 					OCF_READ_SIMPLE_PAIRING_MODE, 0, NULL);
 		break;
 	case cmd_opcode_pack(OGF_HOST_CTL, OCF_READ_SIMPLE_PAIRING_MODE):
@@ -2003,49 +2437,33 @@ static inline void cmd_complete(int index, void *ptr)
 		read_local_oob_data_complete(index, status, ptr);
 		break;
 	};
+
+	cmd_credits_update(index, opcode, evt->ncmd, status, rp);
 }
 
 static inline void remote_name_information(int index, void *ptr)
 {
 	struct dev_info *dev = &devs[index];
 	evt_remote_name_req_complete *evt = ptr;
-	struct btd_adapter *adapter;
 	char name[MAX_NAME_LENGTH + 1];
-	struct found_dev *found;
-
 	GSList *match;
 
 	DBG("hci%d status %u", index, evt->status);
 
 	memset(name, 0, sizeof(name));
 
+	/* Each name goes out as soon as it's known */
 	if (evt->status == 0) {
 		memcpy(name, evt->name, MAX_NAME_LENGTH);
 		btd_event_remote_name(&dev->bdaddr, &evt->bdaddr, name);
 	}
 
-	adapter = manager_find_adapter_by_id(index);
-	if (!adapter) {
-		error("No matching adapter found");
-		return;
-	}
-
 	match = g_slist_find_custom(dev->need_name, &evt->bdaddr,
 							found_dev_bda_cmp);
 	if (match == NULL)
 		return;
 
-	found = match->data;
-	found->name_state = NAME_NOT_NEEDED;
-
-	dev->need_name = g_slist_remove_link(dev->need_name, match);
-
-	match->next = dev->found_devs;
-	dev->found_devs = match;
-	dev->found_devs = g_slist_sort(dev->found_devs, found_dev_rssi_cmp);
-
-	if (resolve_names(dev, adapter) < 0)
-		set_state(index, DISCOV_HALTED);
+	name_request_done(index, match, evt->status == 0);
 }
 
 static inline void remote_version_information(int index, void *ptr)
@@ -2082,6 +2500,7 @@ static void dev_found(struct dev_info *info, bdaddr_t *dba, addr_type_t type,
 	}
 
 	dev = g_new0(struct found_dev, 1);
+	dev->index = info->id;
 	bacpy(&dev->bdaddr, dba);
 	dev->rssi = rssi;
 	if (cfm_name)
@@ -2204,7 +2623,6 @@ struct remote_version_req {
 static gboolean __get_remote_version(gpointer user_data)
 {
 	struct remote_version_req *req = user_data;
-	struct dev_info *dev = &devs[req->index];
 	read_remote_version_cp cp;
 
 	DBG("hci%d handle %u", req->index, req->handle);
@@ -2212,7 +2630,7 @@ static gboolean __get_remote_version(gpointer user_data)
 	memset(&cp, 0, sizeof(cp));
 	cp.handle = htobs(req->handle);
 
-	hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_READ_REMOTE_VERSION,
+	hci_queue_cmd(req->index, OGF_LINK_CTL, OCF_READ_REMOTE_VERSION,
 					READ_REMOTE_VERSION_CP_SIZE, &cp);
 
 	return FALSE;
@@ -2465,11 +2883,17 @@ static void stop_hci_dev(int index)
 	if (dev->io != NULL)
 		g_io_channel_unref(dev->io);
 
+	cmd_queue_flush(index, HCI_OE_POWER_OFF);
+
+	if (dev->clock_sk >= 0)
+		hci_close_dev(dev->clock_sk);
+
 	hci_close_dev(dev->sk);
 
 	g_slist_free_full(dev->keys, g_free);
 	g_slist_free_full(dev->uuids, g_free);
 	g_slist_free_full(dev->connections, g_free);
+	found_dev_cleanup(dev);
 
 	init_dev_info(index, -1, dev->registered, dev->already_up);
 }
@@ -2731,7 +3155,7 @@ static void device_devup_setup(int index)
 	if (dev->features[7] & LMP_EXT_FEAT) {
 		uint8_t page_num = 0x01;
 
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
+		hci_queue_cmd(index, OGF_INFO_PARAM,
 				OCF_READ_LOCAL_EXT_FEATURES, 1, &page_num);
 	}
 
@@ -2740,13 +3164,13 @@ static void device_devup_setup(int index)
 		write_page_timeout_cp cp;
 
 		cp.timeout = htobs(main_opts.pageto);
-		hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT,
+		hci_queue_cmd(index, OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT,
 					WRITE_PAGE_TIMEOUT_CP_SIZE, &cp);
 	}
 
 	bacpy(&cp.bdaddr, BDADDR_ANY);
 	cp.read_all = 1;
-	hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_READ_STORED_LINK_KEY,
+	hci_queue_cmd(index, OGF_HOST_CTL, OCF_READ_STORED_LINK_KEY,
 					READ_STORED_LINK_KEY_CP_SIZE, &cp);
 
 	if (!dev->pending) {
@@ -2760,19 +3184,19 @@ static void device_devup_setup(int index)
 	 * it here and resend the ones we haven't seen their results yet */
 
 	if (hci_test_bit(PENDING_FEATURES, &dev->pending))
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
+		hci_queue_cmd(index, OGF_INFO_PARAM,
 					OCF_READ_LOCAL_FEATURES, 0, NULL);
 
 	if (hci_test_bit(PENDING_VERSION, &dev->pending))
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
+		hci_queue_cmd(index, OGF_INFO_PARAM,
 					OCF_READ_LOCAL_VERSION, 0, NULL);
 
 	if (hci_test_bit(PENDING_NAME, &dev->pending))
-		hci_send_cmd(dev->sk, OGF_HOST_CTL,
+		hci_queue_cmd(index, OGF_HOST_CTL,
 					OCF_READ_LOCAL_NAME, 0, 0);
 
 	if (hci_test_bit(PENDING_BDADDR, &dev->pending))
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
+		hci_queue_cmd(index, OGF_INFO_PARAM,
 					OCF_READ_BD_ADDR, 0, NULL);
 }
 
@@ -2916,6 +3340,7 @@ static void device_event(int event, int index)
 		devs[index].cache_enable = TRUE;
 		devs[index].discov_state = DISCOV_HALTED;
 		reset_discoverable_timeout(index);
+		cmd_queue_flush(index, HCI_OE_POWER_OFF);
 		if (!devs[index].pending) {
 			struct btd_adapter *adapter;
 
@@ -2973,7 +3398,7 @@ static gboolean init_known_adapters(gpointer user_data)
 
 		dev->pending = 0;
 		hci_set_bit(PENDING_VERSION, &dev->pending);
-		hci_send_cmd(dev->sk, OGF_INFO_PARAM,
+		hci_queue_cmd(dr->dev_id, OGF_INFO_PARAM,
 					OCF_READ_LOCAL_VERSION, 0, NULL);
 		device_event(HCI_DEV_UP, dr->dev_id);
 	}
@@ -3153,9 +3578,9 @@ static int hciops_set_powered(int index, gboolean powered)
 
 static int start_inquiry(int index, uint8_t length)
 {
-	struct dev_info *dev = &devs[index];
 	uint8_t lap[3] = { 0x33, 0x8b, 0x9e };
 	inquiry_cp inq_cp;
+	int err;
 
 	DBG("hci%d length %u", index, length);
 
@@ -3164,17 +3589,18 @@ static int start_inquiry(int index, uint8_t length)
 	inq_cp.length = length;
 	inq_cp.num_rsp = 0x00;
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL,
-			OCF_INQUIRY, INQUIRY_CP_SIZE, &inq_cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_LINK_CTL,
+			OCF_INQUIRY, INQUIRY_CP_SIZE, &inq_cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
 
 static int le_set_scan_enable(int index, uint8_t enable)
 {
-	struct dev_info *dev = &devs[index];
 	le_set_scan_enable_cp cp;
+	int err;
 
 	DBG("hci%d enable %u", index, enable);
 
@@ -3182,9 +3608,10 @@ static int le_set_scan_enable(int index, uint8_t enable)
 	cp.enable = enable;
 	cp.filter_dup = 0;
 
-	if (hci_send_cmd(dev->sk, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
-				LE_SET_SCAN_ENABLE_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_LE_CTL, OCF_LE_SET_SCAN_ENABLE,
+				LE_SET_SCAN_ENABLE_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
@@ -3220,9 +3647,10 @@ static int start_scanning(int index, int timeout)
 	cp.own_bdaddr_type = 0;		/* Public address */
 	cp.filter = 0;			/* Accept all adv packets */
 
-	if (hci_send_cmd(dev->sk, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
-				LE_SET_SCAN_PARAMETERS_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_LE_CTL, OCF_LE_SET_SCAN_PARAMETERS,
+				LE_SET_SCAN_PARAMETERS_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	err = le_set_scan_enable(index, 1);
 	if (err < 0)
@@ -3251,21 +3679,22 @@ static int hciops_stop_scanning(int index)
 static int cancel_resolve_name(int index)
 {
 	struct dev_info *info = &devs[index];
-	struct found_dev *dev;
-	remote_name_req_cancel_cp cp;
 	struct btd_adapter *adapter;
+	GSList *l;
 
 	DBG("hci%d", index);
 
-	if (g_slist_length(info->need_name) == 0)
+	if (info->names_pending == 0)
 		return 0;
 
-	dev = info->need_name->data;
-	if (dev->name_state != NAME_PENDING)
-		return 0;
+	for (l = info->need_name; l != NULL; l = l->next) {
+		struct found_dev *dev = l->data;
 
-	memset(&cp, 0, sizeof(cp));
-	bacpy(&cp.bdaddr, &dev->bdaddr);
+		if (dev->name_state != NAME_PENDING)
+			continue;
+
+		cancel_name_request(index, &dev->bdaddr);
+	}
 
 	adapter = manager_find_adapter_by_id(index);
 	if (adapter)
@@ -3273,10 +3702,6 @@ static int cancel_resolve_name(int index)
 
 	found_dev_cleanup(info);
 
-	if (hci_send_cmd(info->sk, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ_CANCEL,
-				REMOTE_NAME_REQ_CANCEL_CP_SIZE, &cp) < 0)
-		return -errno;
-
 	return 0;
 }
 
@@ -3318,9 +3743,9 @@ static int hciops_stop_discovery(int index)
 
 static int hciops_set_fast_connectable(int index, gboolean enable)
 {
-	struct dev_info *dev = &devs[index];
 	write_page_activity_cp cp;
 	uint8_t type;
+	int err;
 
 	DBG("hci%d enable %d", index, enable);
 
@@ -3334,24 +3759,50 @@ static int hciops_set_fast_connectable(int index, gboolean enable)
 
 	cp.window = 0x0012;	/* default 11.25 msec page scan window */
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_WRITE_PAGE_ACTIVITY,
-					WRITE_PAGE_ACTIVITY_CP_SIZE, &cp) < 0)
-		return -errno;
-	else if (hci_send_cmd(dev->sk, OGF_HOST_CTL,
-				OCF_WRITE_PAGE_SCAN_TYPE, 1, &type) < 0)
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_WRITE_PAGE_ACTIVITY,
+					WRITE_PAGE_ACTIVITY_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
+
+	return hci_queue_cmd(index, OGF_HOST_CTL, OCF_WRITE_PAGE_SCAN_TYPE,
+								1, &type);
+}
+
+/* Read Clock waits for its reply, it must not touch the filter of the
+ * event socket or read from it, otherwise events get lost */
+static int clock_socket(int index)
+{
+	struct dev_info *dev = &devs[index];
+	struct hci_filter flt;
+	int sk;
+
+	if (dev->clock_sk >= 0)
+		return dev->clock_sk;
+
+	sk = hci_open_dev(index);
+	if (sk < 0)
 		return -errno;
 
-	return 0;
+	/* Nothing is queued up between requests */
+	hci_filter_clear(&flt);
+	if (setsockopt(sk, SOL_HCI, HCI_FILTER, &flt, sizeof(flt)) < 0) {
+		int err = -errno;
+		hci_close_dev(sk);
+		return err;
+	}
+
+	dev->clock_sk = sk;
+
+	return sk;
 }
 
 static int hciops_read_clock(int index, bdaddr_t *bdaddr, int which,
 						int timeout, uint32_t *clock,
 						uint16_t *accuracy)
 {
-	struct dev_info *dev = &devs[index];
 	uint16_t handle = 0;
 	char addr[18];
-	int ret;
+	int ret, sk;
 
 	ba2str(bdaddr, addr);
 	DBG("hci%d addr %s which %d timeout %d", index, addr, which, timeout);
@@ -3360,7 +3811,11 @@ static int hciops_read_clock(int index, bdaddr_t *bdaddr, int which,
 	if (ret < 0)
 		return ret;
 
-	if (hci_read_clock(dev->sk, htobs(handle), which, clock, accuracy,
+	sk = clock_socket(index);
+	if (sk < 0)
+		return sk;
+
+	if (hci_read_clock(sk, htobs(handle), which, clock, accuracy,
 								timeout) < 0)
 		return -errno;
 
@@ -3438,6 +3893,7 @@ static int hciops_remove_bonding(int index, bdaddr_t *bdaddr, addr_type_t type)
 	delete_stored_link_key_cp cp;
 	GSList *match;
 	char addr[18];
+	int err;
 
 	ba2str(bdaddr, addr);
 	DBG("hci%d dba %s", index, addr);
@@ -3452,9 +3908,10 @@ static int hciops_remove_bonding(int index, bdaddr_t *bdaddr, addr_type_t type)
 	bacpy(&cp.bdaddr, bdaddr);
 
 	/* Delete the link key from the Bluetooth chip */
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_DELETE_STORED_LINK_KEY,
-				DELETE_STORED_LINK_KEY_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_DELETE_STORED_LINK_KEY,
+				DELETE_STORED_LINK_KEY_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
@@ -3478,23 +3935,19 @@ static int hciops_pincode_reply(int index, bdaddr_t *bdaddr, const char *pin,
 		bacpy(&pr.bdaddr, bdaddr);
 		memcpy(pr.pin_code, pin, pin_len);
 		pr.pin_len = pin_len;
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = hci_queue_cmd(index, OGF_LINK_CTL,
 						OCF_PIN_CODE_REPLY,
 						PIN_CODE_REPLY_CP_SIZE, &pr);
 	} else
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = hci_queue_cmd(index, OGF_LINK_CTL,
 					OCF_PIN_CODE_NEG_REPLY, 6, bdaddr);
 
-	if (err < 0)
-		err = -errno;
-
 	return err;
 }
 
 static int hciops_passkey_reply(int index, bdaddr_t *bdaddr, addr_type_t type,
 							uint32_t passkey)
 {
-	struct dev_info *dev = &devs[index];
 	char addr[18];
 	int err;
 
@@ -3508,16 +3961,13 @@ static int hciops_passkey_reply(int index, bdaddr_t *bdaddr, addr_type_t type,
 		bacpy(&cp.bdaddr, bdaddr);
 		cp.passkey = passkey;
 
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = hci_queue_cmd(index, OGF_LINK_CTL,
 					OCF_USER_PASSKEY_REPLY,
 					USER_PASSKEY_REPLY_CP_SIZE, &cp);
 	} else
-		err = hci_send_cmd(dev->sk, OGF_LINK_CTL,
+		err = hci_queue_cmd(index, OGF_LINK_CTL,
 					OCF_USER_PASSKEY_NEG_REPLY, 6, bdaddr);
 
-	if (err < 0)
-		err = -errno;
-
 	return err;
 }
 
@@ -3678,7 +4128,6 @@ static int hciops_set_io_capability(int index, uint8_t io_capability)
 
 static int request_authentication(int index, bdaddr_t *bdaddr)
 {
-	struct dev_info *dev = &devs[index];
 	auth_requested_cp cp;
 	uint16_t handle;
 	int err;
@@ -3692,9 +4141,10 @@ static int request_authentication(int index, bdaddr_t *bdaddr)
 	memset(&cp, 0, sizeof(cp));
 	cp.handle = htobs(handle);
 
-	if (hci_send_cmd(dev->sk, OGF_LINK_CTL, OCF_AUTH_REQUESTED,
-					AUTH_REQUESTED_CP_SIZE, &cp) < 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_LINK_CTL, OCF_AUTH_REQUESTED,
+					AUTH_REQUESTED_CP_SIZE, &cp);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
@@ -3783,13 +4233,13 @@ static int hciops_cancel_bonding(int index, bdaddr_t *bdaddr)
 
 static int hciops_read_local_oob_data(int index)
 {
-	struct dev_info *dev = &devs[index];
+	int err;
 
 	DBG("hci%d", index);
 
-	if (hci_send_cmd(dev->sk, OGF_HOST_CTL, OCF_READ_LOCAL_OOB_DATA, 0, 0)
-									< 0)
-		return -errno;
+	err = hci_queue_cmd(index, OGF_HOST_CTL, OCF_READ_LOCAL_OOB_DATA, 0, 0);
+	if (err < 0)
+		return err;
 
 	return 0;
 }
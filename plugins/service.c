@@ -338,20 +338,13 @@ static void exit_callback(DBusConnection *conn, void *user_data)
 	g_free(user_record);
 }
 
-static int add_xml_record(DBusConnection *conn, const char *sender,
+static int add_record(DBusConnection *conn, const char *sender,
 			struct service_adapter *serv_adapter,
-			const char *record, dbus_uint32_t *handle)
+			sdp_record_t *sdp_record, dbus_uint32_t *handle)
 {
 	struct record_data *user_record;
-	sdp_record_t *sdp_record;
 	bdaddr_t src;
 
-	sdp_record = sdp_xml_parse_record(record, strlen(record));
-	if (!sdp_record) {
-		error("Parsing of XML service record failed");
-		return -EIO;
-	}
-
 	if (serv_adapter->adapter)
 		adapter_get_address(serv_adapter->adapter, &src);
 	else
@@ -380,6 +373,21 @@ static int add_xml_record(DBusConnection *conn, const char *sender,
 	return 0;
 }
 
+static int add_xml_record(DBusConnection *conn, const char *sender,
+			struct service_adapter *serv_adapter,
+			const char *record, dbus_uint32_t *handle)
+{
+	sdp_record_t *sdp_record;
+
+	sdp_record = sdp_xml_parse_record(record, strlen(record));
+	if (!sdp_record) {
+		error("Parsing of XML service record failed");
+		return -EIO;
+	}
+
+	return add_record(conn, sender, serv_adapter, sdp_record, handle);
+}
+
 static DBusMessage *update_record(DBusConnection *conn, DBusMessage *msg,
 		struct service_adapter *serv_adapter,
 		dbus_uint32_t handle, sdp_record_t *sdp_record)
@@ -443,6 +451,39 @@ static DBusMessage *update_xml_record(DBusConnection *conn,
 	return update_record(conn, msg, serv_adapter, handle, sdp_record);
 }
 
+static DBusMessage *update_raw_record(DBusConnection *conn,
+				DBusMessage *msg,
+				struct service_adapter *serv_adapter)
+{
+	struct record_data *user_record;
+	sdp_record_t *sdp_record;
+	const uint8_t *record;
+	dbus_uint32_t handle;
+	int len;
+
+	if (dbus_message_get_args(msg, NULL,
+				DBUS_TYPE_UINT32, &handle,
+				DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &record, &len,
+				DBUS_TYPE_INVALID) == FALSE)
+		return NULL;
+
+	if (len == 0)
+		return btd_error_invalid_args(msg);
+
+	user_record = find_record(serv_adapter, handle,
+				dbus_message_get_sender(msg));
+	if (!user_record)
+		return btd_error_not_available(msg);
+
+	sdp_record = sdp_extract_record_pdu(record, len);
+	if (!sdp_record) {
+		error("Parsing of raw service record failed");
+		return btd_error_invalid_args(msg);
+	}
+
+	return update_record(conn, msg, serv_adapter, handle, sdp_record);
+}
+
 static int remove_record(DBusConnection *conn, const char *sender,
 			struct service_adapter *serv_adapter,
 			dbus_uint32_t handle)
@@ -492,6 +533,43 @@ static DBusMessage *add_service_record(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *add_raw_service_record(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct service_adapter *serv_adapter = data;
+	DBusMessage *reply;
+	sdp_record_t *sdp_record;
+	const uint8_t *record;
+	const char *sender;
+	dbus_uint32_t handle;
+	int len, err;
+
+	if (dbus_message_get_args(msg, NULL,
+			DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &record, &len,
+			DBUS_TYPE_INVALID) == FALSE)
+		return NULL;
+
+	sdp_record = sdp_extract_record_pdu(record, len);
+	if (!sdp_record) {
+		error("Parsing of raw service record failed");
+		return btd_error_invalid_args(msg);
+	}
+
+	sender = dbus_message_get_sender(msg);
+	err = add_record(conn, sender, serv_adapter, sdp_record, &handle);
+	if (err < 0)
+		return btd_error_failed(msg, strerror(-err));
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_append_args(reply, DBUS_TYPE_UINT32, &handle,
+							DBUS_TYPE_INVALID);
+
+	return reply;
+}
+
 static DBusMessage *update_service_record(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -500,6 +578,14 @@ static DBusMessage *update_service_record(DBusConnection *conn,
 	return update_xml_record(conn, msg, serv_adapter);
 }
 
+static DBusMessage *update_raw_service_record(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct service_adapter *serv_adapter = data;
+
+	return update_raw_record(conn, msg, serv_adapter);
+}
+
 static DBusMessage *remove_service_record(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -699,6 +785,8 @@ done:
 static GDBusMethodTable service_methods[] = {
 	{ "AddRecord",		"s",	"u",	add_service_record	},
 	{ "UpdateRecord",	"us",	"",	update_service_record	},
+	{ "AddRawRecord",	"ay",	"u",	add_raw_service_record	},
+	{ "UpdateRawRecord",	"uay",	"",	update_raw_service_record },
 	{ "RemoveRecord",	"u",	"",	remove_service_record	},
 	{ "RequestAuthorization","su",	"",	request_authorization,
 						G_DBUS_METHOD_FLAG_ASYNC},
@@ -64,6 +64,9 @@ extern "C" {
 #define SBC_LE			0x00
 #define SBC_BE			0x01
 
+/* sbc_init flags */
+#define SBC_MSBC		0x01	/* HFP wideband speech, 16 kHz mono */
+
 struct sbc_struct {
 	unsigned long flags;
 
@@ -81,6 +84,8 @@ struct sbc_struct {
 
 typedef struct sbc_struct sbc_t;
 
+/* With SBC_MSBC the configuration is fixed and frames carry the mSBC
+ * header, the blocks field doesn't apply as they have 15 of them */
 int sbc_init(sbc_t *sbc, unsigned long flags);
 int sbc_reinit(sbc_t *sbc, unsigned long flags);
 
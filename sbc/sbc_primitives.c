@@ -209,6 +209,12 @@ static inline void sbc_analyze_4b_8s_simd(int16_t *x,
 	sbc_analyze_eight_simd(x + 0, out, analysis_consts_fixed8_simd_even);
 }
 
+static inline void sbc_analyze_1b_8s_simd(int16_t *x, int32_t *out, int odd)
+{
+	sbc_analyze_eight_simd(x, out, odd ? analysis_consts_fixed8_simd_odd :
+					analysis_consts_fixed8_simd_even);
+}
+
 static inline int16_t unaligned16_be(const uint8_t *ptr)
 {
 	return (int16_t) ((ptr[0] << 8) | ptr[1]);
@@ -282,20 +288,54 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_internal(
 	const uint8_t *pcm, int16_t X[2][SBC_X_BUFFER_SIZE],
 	int nsamples, int nchannels, int big_endian)
 {
-	/* handle X buffer wraparound */
+	/* handle X buffer wraparound, keeping the group alignment */
 	if (position < nsamples) {
+		int half = position % 16;
+
 		if (nchannels > 0)
-			memcpy(&X[0][SBC_X_BUFFER_SIZE - 72], &X[0][position],
-							72 * sizeof(int16_t));
+			memcpy(&X[0][SBC_X_BUFFER_SIZE - 72 - 2 * half],
+					&X[0][position - half],
+					(72 + half) * sizeof(int16_t));
 		if (nchannels > 1)
-			memcpy(&X[1][SBC_X_BUFFER_SIZE - 72], &X[1][position],
-							72 * sizeof(int16_t));
-		position = SBC_X_BUFFER_SIZE - 72;
+			memcpy(&X[1][SBC_X_BUFFER_SIZE - 72 - 2 * half],
+					&X[1][position - half],
+					(72 + half) * sizeof(int16_t));
+		position = SBC_X_BUFFER_SIZE - 72 - half;
 	}
 
 	#define PCM(i) (big_endian ? \
 		unaligned16_be(pcm + (i) * 2) : unaligned16_le(pcm + (i) * 2))
 
+	/* mSBC frames are 120 samples long, so every other one starts with
+	 * the newer half of a 16 sample group whose older half came last */
+	if (position % 16 == 8) {
+		position -= 8;
+		nsamples -= 8;
+		if (nchannels > 0) {
+			int16_t *x = &X[0][position];
+			x[0]  = PCM(0 + 7 * nchannels);
+			x[2]  = PCM(0 + 6 * nchannels);
+			x[3]  = PCM(0 + 0 * nchannels);
+			x[4]  = PCM(0 + 5 * nchannels);
+			x[5]  = PCM(0 + 1 * nchannels);
+			x[6]  = PCM(0 + 4 * nchannels);
+			x[7]  = PCM(0 + 2 * nchannels);
+			x[8]  = PCM(0 + 3 * nchannels);
+		}
+		if (nchannels > 1) {
+			int16_t *x = &X[1][position];
+			x[0]  = PCM(1 + 7 * nchannels);
+			x[2]  = PCM(1 + 6 * nchannels);
+			x[3]  = PCM(1 + 0 * nchannels);
+			x[4]  = PCM(1 + 5 * nchannels);
+			x[5]  = PCM(1 + 1 * nchannels);
+			x[6]  = PCM(1 + 4 * nchannels);
+			x[7]  = PCM(1 + 2 * nchannels);
+			x[8]  = PCM(1 + 3 * nchannels);
+		}
+		pcm += 16 * nchannels;
+	}
+
 	/* copy/permutate audio samples */
 	while ((nsamples -= 16) >= 0) {
 		position -= 16;
@@ -339,6 +379,34 @@ static SBC_ALWAYS_INLINE int sbc_encoder_process_input_s8_internal(
 		}
 		pcm += 32 * nchannels;
 	}
+
+	/* Older half of the next group, x[8] gets its sample with the newer
+	 * half and until then is only seen with a zero coefficient */
+	if (nsamples == -8) {
+		position -= 8;
+		if (nchannels > 0) {
+			int16_t *x = &X[0][position - 8];
+			x[1]  = PCM(0 + 7 * nchannels);
+			x[9]  = PCM(0 + 3 * nchannels);
+			x[10] = PCM(0 + 6 * nchannels);
+			x[11] = PCM(0 + 0 * nchannels);
+			x[12] = PCM(0 + 5 * nchannels);
+			x[13] = PCM(0 + 1 * nchannels);
+			x[14] = PCM(0 + 4 * nchannels);
+			x[15] = PCM(0 + 2 * nchannels);
+		}
+		if (nchannels > 1) {
+			int16_t *x = &X[1][position - 8];
+			x[1]  = PCM(1 + 7 * nchannels);
+			x[9]  = PCM(1 + 3 * nchannels);
+			x[10] = PCM(1 + 6 * nchannels);
+			x[11] = PCM(1 + 0 * nchannels);
+			x[12] = PCM(1 + 5 * nchannels);
+			x[13] = PCM(1 + 1 * nchannels);
+			x[14] = PCM(1 + 4 * nchannels);
+			x[15] = PCM(1 + 2 * nchannels);
+		}
+	}
 	#undef PCM
 
 	return position;
@@ -524,6 +592,7 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 	/* Default implementation for analyze functions */
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_simd;
 	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_simd;
+	state->sbc_analyze_1b_8s = sbc_analyze_1b_8s_simd;
 
 	/* Default implementation for input reordering / deinterleaving */
 	state->sbc_enc_process_input_4s_le = sbc_enc_process_input_4s_le;
@@ -551,4 +620,10 @@ void sbc_init_primitives(struct sbc_encoder_state *state)
 #ifdef SBC_BUILD_WITH_NEON_SUPPORT
 	sbc_init_primitives_neon(state);
 #endif
+
+	/* Only the generic input reordering copes with half groups */
+	if (state->increment == 1) {
+		state->sbc_enc_process_input_8s_le = sbc_enc_process_input_8s_le;
+		state->sbc_enc_process_input_8s_be = sbc_enc_process_input_8s_be;
+	}
 }
@@ -38,6 +38,9 @@
 
 struct sbc_encoder_state {
 	int position;
+	/* Number of blocks analyzed at once, 1 for mSBC as its 15 blocks
+	 * per frame don't divide into groups of 4 */
+	int increment;
 	int16_t SBC_ALIGNED X[2][SBC_X_BUFFER_SIZE];
 	/* Polyphase analysis filter for 4 subbands configuration,
 	 * it handles 4 blocks at once */
@@ -45,6 +48,9 @@ struct sbc_encoder_state {
 	/* Polyphase analysis filter for 8 subbands configuration,
 	 * it handles 4 blocks at once */
 	void (*sbc_analyze_4b_8s)(int16_t *x, int32_t *out, int out_stride);
+	/* Single block variant of the above, odd tells which of the two
+	 * interleaved input layouts x points into */
+	void (*sbc_analyze_1b_8s)(int16_t *x, int32_t *out, int odd);
 	/* Process input data (deinterleave, endian conversion, reordering),
 	 * depending on the number of subbands and input data byte order */
 	int (*sbc_enc_process_input_4s_le)(int position,
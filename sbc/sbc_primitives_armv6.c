@@ -289,10 +289,17 @@ static void sbc_analyze_4b_8s_armv6(int16_t *x, int32_t *out, int out_stride)
 	sbc_analyze_eight(x + 0, out, analysis_consts_fixed8_simd_even);
 }
 
+static void sbc_analyze_1b_8s_armv6(int16_t *x, int32_t *out, int odd)
+{
+	sbc_analyze_eight(x, out, odd ? analysis_consts_fixed8_simd_odd :
+					analysis_consts_fixed8_simd_even);
+}
+
 void sbc_init_primitives_armv6(struct sbc_encoder_state *state)
 {
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_armv6;
 	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_armv6;
+	state->sbc_analyze_1b_8s = sbc_analyze_1b_8s_armv6;
 	state->implementation_info = "ARMv6 SIMD";
 }
 
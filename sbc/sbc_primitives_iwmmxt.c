@@ -294,10 +294,17 @@ static inline void sbc_analyze_4b_8s_iwmmxt(int16_t *x, int32_t *out,
 	sbc_analyze_eight_iwmmxt(x + 0, out, analysis_consts_fixed8_simd_even);
 }
 
+static inline void sbc_analyze_1b_8s_iwmmxt(int16_t *x, int32_t *out, int odd)
+{
+	sbc_analyze_eight_iwmmxt(x, out, odd ? analysis_consts_fixed8_simd_odd :
+					analysis_consts_fixed8_simd_even);
+}
+
 void sbc_init_primitives_iwmmxt(struct sbc_encoder_state *state)
 {
 	state->sbc_analyze_4b_4s = sbc_analyze_4b_4s_iwmmxt;
 	state->sbc_analyze_4b_8s = sbc_analyze_4b_8s_iwmmxt;
+	state->sbc_analyze_1b_8s = sbc_analyze_1b_8s_iwmmxt;
 	state->implementation_info = "IWMMXT";
 }
 
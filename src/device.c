@@ -105,6 +105,7 @@ struct browse_req {
 	GSList *profiles_removed;
 	sdp_list_t *records;
 	int search_uuid;
+	gboolean pnp_found;
 	int reconnect_attempt;
 	guint listener_id;
 };
@@ -717,6 +718,16 @@ static const char *browse_request_get_requestor(struct browse_req *req)
 	return dbus_message_get_sender(req->msg);
 }
 
+static gboolean is_discover_services(DBusMessage *msg)
+{
+	if (dbus_message_is_method_call(msg, DEVICE_INTERFACE,
+							"DiscoverServices"))
+		return TRUE;
+
+	return dbus_message_is_method_call(msg, DEVICE_INTERFACE,
+							"DiscoverServicesRaw");
+}
+
 static void iter_append_record(DBusMessageIter *dict, uint32_t handle,
 							const char *record)
 {
@@ -732,34 +743,33 @@ static void iter_append_record(DBusMessageIter *dict, uint32_t handle,
 	dbus_message_iter_close_container(dict, &entry);
 }
 
-static void discover_services_reply(struct browse_req *req, int err,
-							sdp_list_t *recs)
+static void iter_append_raw_record(DBusMessageIter *dict, uint32_t handle,
+						const uint8_t *record, int len)
 {
-	DBusMessage *reply;
-	DBusMessageIter iter, dict;
-	sdp_list_t *seq;
+	DBusMessageIter entry, array;
 
-	if (err) {
-		const char *err_if;
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
 
-		if (err == -EHOSTDOWN)
-			err_if = ERROR_INTERFACE ".ConnectionAttemptFailed";
-		else
-			err_if = ERROR_INTERFACE ".Failed";
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &handle);
 
-		reply = dbus_message_new_error(req->msg, err_if,
-							strerror(-err));
-		g_dbus_send_message(req->conn, reply);
-		return;
-	}
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+					DBUS_TYPE_BYTE_AS_STRING, &array);
 
-	reply = dbus_message_new_method_return(req->msg);
-	if (!reply)
-		return;
+	dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE,
+								&record, len);
 
-	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_close_container(&entry, &array);
 
-	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_xml_records(DBusMessageIter *iter, sdp_list_t *recs)
+{
+	DBusMessageIter dict;
+	sdp_list_t *seq;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
 			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
 			DBUS_TYPE_UINT32_AS_STRING DBUS_TYPE_STRING_AS_STRING
 			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
@@ -782,7 +792,71 @@ static void discover_services_reply(struct browse_req *req, int err,
 		g_string_free(result, TRUE);
 	}
 
-	dbus_message_iter_close_container(&iter, &dict);
+	dbus_message_iter_close_container(iter, &dict);
+}
+
+static void append_raw_records(DBusMessageIter *iter, sdp_list_t *recs)
+{
+	DBusMessageIter dict;
+	sdp_list_t *seq;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_UINT32_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING DBUS_TYPE_BYTE_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	for (seq = recs; seq; seq = seq->next) {
+		sdp_record_t *rec = (sdp_record_t *) seq->data;
+		sdp_buf_t buf;
+
+		if (!rec)
+			break;
+
+		if (sdp_gen_record_pdu(rec, &buf) < 0)
+			continue;
+
+		if (buf.data_size)
+			iter_append_raw_record(&dict, rec->handle, buf.data,
+								buf.data_size);
+
+		free(buf.data);
+	}
+
+	dbus_message_iter_close_container(iter, &dict);
+}
+
+static void discover_services_reply(struct browse_req *req, int err,
+							sdp_list_t *recs)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter;
+
+	if (err) {
+		const char *err_if;
+
+		if (err == -EHOSTDOWN)
+			err_if = ERROR_INTERFACE ".ConnectionAttemptFailed";
+		else
+			err_if = ERROR_INTERFACE ".Failed";
+
+		reply = dbus_message_new_error(req->msg, err_if,
+							strerror(-err));
+		g_dbus_send_message(req->conn, reply);
+		return;
+	}
+
+	reply = dbus_message_new_method_return(req->msg);
+	if (!reply)
+		return;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	if (dbus_message_is_method_call(req->msg, DEVICE_INTERFACE,
+						"DiscoverServicesRaw"))
+		append_raw_records(&iter, recs);
+	else
+		append_xml_records(&iter, recs);
 
 	g_dbus_send_message(req->conn, reply);
 }
@@ -797,8 +871,7 @@ static DBusMessage *cancel_discover(DBusConnection *conn,
 	if (!device->browse)
 		return btd_error_does_not_exist(msg);
 
-	if (!dbus_message_is_method_call(device->browse->msg, DEVICE_INTERFACE,
-					"DiscoverServices"))
+	if (!is_discover_services(device->browse->msg))
 		return btd_error_not_authorized(msg);
 
 	requestor = browse_request_get_requestor(device->browse);
@@ -891,6 +964,8 @@ static GDBusMethodTable device_methods[] = {
 	{ "SetProperty",	"sv",	"",		set_property	},
 	{ "DiscoverServices",	"s",	"a{us}",	discover_services,
 						G_DBUS_METHOD_FLAG_ASYNC},
+	{ "DiscoverServicesRaw", "s",	"a{uay}",	discover_services,
+						G_DBUS_METHOD_FLAG_ASYNC},
 	{ "CancelDiscovery",	"",	"",		cancel_discover	},
 	{ "Disconnect",		"",	"",		disconnect,
 						G_DBUS_METHOD_FLAG_ASYNC},
@@ -1455,6 +1530,8 @@ static void update_services(struct browse_req *req, sdp_list_t *recs)
 			uint16_t source, vendor, product, version;
 			sdp_data_t *pdlist;
 
+			req->pnp_found = TRUE;
+
 			pdlist = sdp_data_get(rec, SDP_ATTR_VENDOR_ID_SOURCE);
 			source = pdlist ? pdlist->val.uint16 : 0x0000;
 
@@ -1630,8 +1707,7 @@ send_reply:
 	if (!req->msg)
 		goto cleanup;
 
-	if (dbus_message_is_method_call(req->msg, DEVICE_INTERFACE,
-					"DiscoverServices"))
+	if (is_discover_services(req->msg))
 		discover_services_reply(req, err, device->tmp_records);
 	else if (dbus_message_is_method_call(req->msg, ADAPTER_INTERFACE,
 						"CreatePairedDevice"))
@@ -1683,6 +1759,14 @@ static void browse_cb(sdp_list_t *recs, int err, gpointer user_data)
 
 	update_services(req, recs);
 
+	/* The PnP record is normally part of the L2CAP search response
+	 * already, so avoid a second round-trip just for it */
+	if (uuid_list[req->search_uuid] == PNP_INFO_SVCLASS_ID &&
+							req->pnp_found) {
+		search_cb(NULL, 0, user_data);
+		return;
+	}
+
 	adapter_get_address(adapter, &src);
 
 	/* Search for mandatory uuids */
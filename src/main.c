@@ -39,6 +39,8 @@
 
 #include <bluetooth/bluetooth.h>
 #include <bluetooth/uuid.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
 
 #include <glib.h>
 
@@ -54,6 +56,7 @@
 #include "dbus-common.h"
 #include "agent.h"
 #include "manager.h"
+#include "sdp-client.h"
 
 #ifdef HAVE_CAPNG
 #include <cap-ng.h>
@@ -65,6 +68,7 @@
 
 #define DEFAULT_DISCOVERABLE_TIMEOUT 180 /* 3 minutes */
 #define DEFAULT_AUTO_CONNECT_TIMEOUT  60 /* 60 seconds */
+#define DEFAULT_SDP_SEARCHES 4
 
 struct main_opts main_opts;
 
@@ -163,6 +167,16 @@ static void parse_config(GKeyFile *config)
 		g_free(str);
 	}
 
+	val = g_key_file_get_integer(config, "General", "MaxSDPSearches",
+									&err);
+	if (err) {
+		DBG("%s", err->message);
+		g_clear_error(&err);
+	} else {
+		DBG("sdp_searches=%d", val);
+		main_opts.sdp_searches = val;
+	}
+
 	val = g_key_file_get_integer(config, "General",
 					"DiscoverSchedulerInterval", &err);
 	if (err) {
@@ -243,6 +257,7 @@ static void init_defaults(void)
 	main_opts.name	= g_strdup("BlueZ");
 	main_opts.discovto	= DEFAULT_DISCOVERABLE_TIMEOUT;
 	main_opts.autoto = DEFAULT_AUTO_CONNECT_TIMEOUT;
+	main_opts.sdp_searches = DEFAULT_SDP_SEARCHES;
 	main_opts.remember_powered = TRUE;
 	main_opts.reverse_sdp = TRUE;
 	main_opts.name_resolv = TRUE;
@@ -505,6 +520,8 @@ int main(int argc, char *argv[])
 
 	parse_config(config);
 
+	bt_search_set_max_pending(main_opts.sdp_searches);
+
 	agent_init();
 
 	if (option_udev == FALSE) {
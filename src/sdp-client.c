@@ -39,6 +39,9 @@
 /* Number of seconds to keep a sdp_session_t in the cache */
 #define CACHE_TIMEOUT 2
 
+/* Default number of searches allowed to page remote devices at once */
+#define DEFAULT_MAX_SEARCHES 4
+
 struct cached_sdp_session {
 	bdaddr_t src;
 	bdaddr_t dst;
@@ -61,28 +64,40 @@ static gboolean cached_session_expired(gpointer user_data)
 	return FALSE;
 }
 
-static sdp_session_t *get_sdp_session(const bdaddr_t *src, const bdaddr_t *dst)
+static struct cached_sdp_session *find_cached_session(const bdaddr_t *src,
+							const bdaddr_t *dst)
 {
 	GSList *l;
 
 	for (l = cached_sdp_sessions; l != NULL; l = l->next) {
 		struct cached_sdp_session *c = l->data;
-		sdp_session_t *session;
 
 		if (bacmp(&c->src, src) || bacmp(&c->dst, dst))
 			continue;
 
-		g_source_remove(c->timer);
+		return c;
+	}
 
-		session = c->session;
+	return NULL;
+}
 
-		cached_sdp_sessions = g_slist_remove(cached_sdp_sessions, c);
-		g_free(c);
+static sdp_session_t *get_sdp_session(const bdaddr_t *src, const bdaddr_t *dst)
+{
+	struct cached_sdp_session *c;
+	sdp_session_t *session;
 
-		return session;
-	}
+	c = find_cached_session(src, dst);
+	if (c == NULL)
+		return sdp_connect(src, dst, SDP_NON_BLOCKING);
+
+	g_source_remove(c->timer);
 
-	return sdp_connect(src, dst, SDP_NON_BLOCKING);
+	session = c->session;
+
+	cached_sdp_sessions = g_slist_remove(cached_sdp_sessions, c);
+	g_free(c);
+
+	return session;
 }
 
 static void cache_sdp_session(bdaddr_t *src, bdaddr_t *dst,
@@ -115,7 +130,13 @@ struct search_context {
 	guint			io_id;
 };
 
+/* Searches currently running and searches waiting for a free slot */
 static GSList *context_list = NULL;
+static GSList *pending_list = NULL;
+
+static unsigned int max_searches = DEFAULT_MAX_SEARCHES;
+
+static void process_pending_searches(void);
 
 static void search_context_cleanup(struct search_context *ctxt)
 {
@@ -125,6 +146,8 @@ static void search_context_cleanup(struct search_context *ctxt)
 		ctxt->destroy(ctxt->user_data);
 
 	g_free(ctxt);
+
+	process_pending_searches();
 }
 
 static void search_completed_cb(uint8_t type, uint16_t status,
@@ -267,60 +290,124 @@ failed:
 	return FALSE;
 }
 
-static int create_search_context(struct search_context **ctxt,
-					const bdaddr_t *src,
-					const bdaddr_t *dst,
-					uuid_t *uuid)
+static int start_search_context(struct search_context *ctxt)
 {
 	sdp_session_t *s;
 	GIOChannel *chan;
 
-	if (!ctxt)
-		return -EINVAL;
-
-	s = get_sdp_session(src, dst);
+	s = get_sdp_session(&ctxt->src, &ctxt->dst);
 	if (!s)
 		return -errno;
 
-	*ctxt = g_try_malloc0(sizeof(struct search_context));
-	if (!*ctxt) {
-		sdp_close(s);
-		return -ENOMEM;
-	}
-
-	bacpy(&(*ctxt)->src, src);
-	bacpy(&(*ctxt)->dst, dst);
-	(*ctxt)->session = s;
-	(*ctxt)->uuid = *uuid;
+	ctxt->session = s;
 
 	chan = g_io_channel_unix_new(sdp_get_socket(s));
-	(*ctxt)->io_id = g_io_add_watch(chan,
+	ctxt->io_id = g_io_add_watch(chan,
 				G_IO_OUT | G_IO_HUP | G_IO_ERR | G_IO_NVAL,
-				connect_watch, *ctxt);
+				connect_watch, ctxt);
 	g_io_channel_unref(chan);
 
+	context_list = g_slist_append(context_list, ctxt);
+
 	return 0;
 }
 
+static gboolean search_slot_available(const bdaddr_t *src,
+							const bdaddr_t *dst)
+{
+	/* A cached session means the remote is already connected, so
+	 * follow-up searches for the same device never wait for a slot */
+	if (find_cached_session(src, dst))
+		return TRUE;
+
+	if (max_searches == 0)
+		return TRUE;
+
+	return g_slist_length(context_list) < max_searches;
+}
+
+static struct search_context *next_pending_search(void)
+{
+	GSList *l;
+
+	/* Searches on a cached session may overtake ones waiting for a
+	 * slot; the order among the latter is kept */
+	for (l = pending_list; l != NULL; l = g_slist_next(l)) {
+		struct search_context *ctxt = l->data;
+
+		if (search_slot_available(&ctxt->src, &ctxt->dst))
+			return ctxt;
+	}
+
+	return NULL;
+}
+
+static void process_pending_searches(void)
+{
+	struct search_context *ctxt;
+
+	/* The list is scanned again after each start since callbacks may
+	 * queue or cancel searches */
+	while ((ctxt = next_pending_search()) != NULL) {
+		int err;
+
+		pending_list = g_slist_remove(pending_list, ctxt);
+
+		err = start_search_context(ctxt);
+		if (err == 0)
+			continue;
+
+		if (ctxt->cb)
+			ctxt->cb(NULL, err, ctxt->user_data);
+
+		if (ctxt->destroy)
+			ctxt->destroy(ctxt->user_data);
+
+		g_free(ctxt);
+	}
+}
+
+void bt_search_set_max_pending(unsigned int max)
+{
+	max_searches = max;
+
+	process_pending_searches();
+}
+
 int bt_search_service(const bdaddr_t *src, const bdaddr_t *dst,
 			uuid_t *uuid, bt_callback_t cb, void *user_data,
 			bt_destroy_t destroy)
 {
-	struct search_context *ctxt = NULL;
+	struct search_context *ctxt;
 	int err;
 
 	if (!cb)
 		return -EINVAL;
 
-	err = create_search_context(&ctxt, src, dst, uuid);
-	if (err < 0)
-		return err;
+	ctxt = g_try_malloc0(sizeof(struct search_context));
+	if (!ctxt)
+		return -ENOMEM;
 
+	bacpy(&ctxt->src, src);
+	bacpy(&ctxt->dst, dst);
+	ctxt->uuid	= *uuid;
 	ctxt->cb	= cb;
 	ctxt->destroy	= destroy;
 	ctxt->user_data	= user_data;
 
-	context_list = g_slist_append(context_list, ctxt);
+	/* Keep the FIFO order of searches already waiting for a slot,
+	 * unless a cached session lets this one start right away */
+	if (!find_cached_session(src, dst) && (pending_list ||
+					!search_slot_available(src, dst))) {
+		pending_list = g_slist_append(pending_list, ctxt);
+		return 0;
+	}
+
+	err = start_search_context(ctxt);
+	if (err < 0) {
+		g_free(ctxt);
+		return err;
+	}
 
 	return 0;
 }
@@ -346,6 +433,21 @@ int bt_cancel_discovery(const bdaddr_t *src, const bdaddr_t *dst)
 	bacpy(&match.src, src);
 	bacpy(&match.dst, dst);
 
+	/* Queued SDP Discovery, not connected yet */
+	l = g_slist_find_custom(pending_list, &match, find_by_bdaddr);
+	if (l != NULL) {
+		ctxt = l->data;
+
+		pending_list = g_slist_remove(pending_list, ctxt);
+
+		if (ctxt->destroy)
+			ctxt->destroy(ctxt->user_data);
+
+		g_free(ctxt);
+
+		return 0;
+	}
+
 	/* Ongoing SDP Discovery */
 	l = g_slist_find_custom(context_list, &match, find_by_bdaddr);
 	if (l == NULL)
@@ -366,4 +468,3 @@ int bt_cancel_discovery(const bdaddr_t *src, const bdaddr_t *dst)
 
 	return 0;
 }
-
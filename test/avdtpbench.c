@@ -0,0 +1,1054 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2007-2010  Marcel Holtmann <marcel@holtmann.org>
+ *  Copyright (C) 2009-2010  Nokia Corporation
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "log.h"
+#include "btio.h"
+#include "../src/adapter.h"
+#include "../src/manager.h"
+#include "../src/device.h"
+#include "sbc.h"
+#include "../audio/device.h"
+#include "../audio/manager.h"
+#include "../audio/avdtp.h"
+#include "../audio/sink.h"
+#include "../audio/source.h"
+#include "../audio/a2dp.h"
+#include "../audio/rtp.h"
+#include "../audio/rtp-sbc.h"
+
+/*
+ * The AVDTP implementation of bluetoothd is linked in directly. L2CAP is
+ * replaced by sequential packet socket pairs and the functions below
+ * stand in for the parts of bluetoothd it depends on.
+ */
+
+#define BENCH_MTU		895
+#define BENCH_RATE		44100
+#define BENCH_TICK		5	/* ms */
+#define BENCH_MAX_CATCHUP	4	/* packets */
+#define BENCH_SETUP_TIMEOUT	5	/* s */
+
+struct fake_chan {
+	GIOChannel *io;
+	bdaddr_t src;
+	bdaddr_t dst;
+};
+
+struct fake_listener {
+	bdaddr_t src;
+	BtIOConfirm confirm;
+};
+
+struct fake_connect {
+	GIOChannel *io;
+	GIOChannel *peer;
+	BtIOConnect connect;
+	gpointer user_data;
+	BtIOConnect accept;
+	gpointer accept_data;
+};
+
+struct fake_auth {
+	authorization_cb cb;
+	void *user_data;
+};
+
+static GSList *chans = NULL;
+static GSList *listeners = NULL;
+static GSList *connects = NULL;
+static GSList *devices = NULL;
+static int dummy_endpoint;
+
+static struct fake_chan *find_chan(GIOChannel *io)
+{
+	GSList *l;
+
+	for (l = chans; l; l = l->next) {
+		struct fake_chan *chan = l->data;
+
+		if (chan->io == io)
+			return chan;
+	}
+
+	return NULL;
+}
+
+static GIOChannel *new_chan(int fd, const bdaddr_t *src, const bdaddr_t *dst)
+{
+	struct fake_chan *chan;
+
+	chan = g_new0(struct fake_chan, 1);
+	chan->io = g_io_channel_unix_new(fd);
+	bacpy(&chan->src, src);
+	bacpy(&chan->dst, dst);
+
+	g_io_channel_set_close_on_unref(chan->io, TRUE);
+
+	chans = g_slist_prepend(chans, chan);
+
+	return chan->io;
+}
+
+static void free_chans(void)
+{
+	g_slist_free_full(chans, g_free);
+	chans = NULL;
+
+	g_slist_free_full(listeners, g_free);
+	listeners = NULL;
+
+	g_slist_free_full(connects, g_free);
+	connects = NULL;
+}
+
+static GError *fake_error(int err)
+{
+	return g_error_new(g_quark_from_static_string("avdtpbench"), err,
+							"%s", strerror(err));
+}
+
+static gboolean parse_opts(bdaddr_t *src, bdaddr_t *dst, BtIOOption opt,
+								va_list args)
+{
+	while (opt != BT_IO_OPT_INVALID) {
+		switch (opt) {
+		case BT_IO_OPT_SOURCE_BDADDR:
+			bacpy(src, va_arg(args, const bdaddr_t *));
+			break;
+		case BT_IO_OPT_DEST_BDADDR:
+			bacpy(dst, va_arg(args, const bdaddr_t *));
+			break;
+		case BT_IO_OPT_PSM:
+		case BT_IO_OPT_SEC_LEVEL:
+		case BT_IO_OPT_MASTER:
+		case BT_IO_OPT_FLUSHABLE:
+			va_arg(args, int);
+			break;
+		default:
+			return FALSE;
+		}
+
+		opt = va_arg(args, int);
+	}
+
+	return TRUE;
+}
+
+GIOChannel *bt_io_listen(BtIOType type, BtIOConnect connect,
+				BtIOConfirm confirm, gpointer user_data,
+				GDestroyNotify destroy, GError **err,
+				BtIOOption opt1, ...)
+{
+	struct fake_listener *listener;
+	bdaddr_t src, dst;
+	va_list args;
+	gboolean ret;
+	int sk;
+
+	bacpy(&src, BDADDR_ANY);
+
+	va_start(args, opt1);
+	ret = parse_opts(&src, &dst, opt1, args);
+	va_end(args);
+
+	if (!ret) {
+		*err = fake_error(EINVAL);
+		return NULL;
+	}
+
+	sk = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sk < 0) {
+		*err = fake_error(errno);
+		return NULL;
+	}
+
+	listener = g_new0(struct fake_listener, 1);
+	bacpy(&listener->src, &src);
+	listener->confirm = confirm;
+
+	listeners = g_slist_append(listeners, listener);
+
+	return new_chan(sk, &src, BDADDR_ANY);
+}
+
+static gboolean confirm_idle(gpointer user_data)
+{
+	struct fake_connect *conn = user_data;
+	struct fake_chan *chan = find_chan(conn->peer);
+	GSList *l;
+
+	for (l = listeners; l; l = l->next) {
+		struct fake_listener *listener = l->data;
+
+		if (bacmp(&listener->src, &chan->src) == 0) {
+			listener->confirm(conn->peer, NULL);
+			return FALSE;
+		}
+	}
+
+	return FALSE;
+}
+
+GIOChannel *bt_io_connect(BtIOType type, BtIOConnect connect,
+				gpointer user_data, GDestroyNotify destroy,
+				GError **err, BtIOOption opt1, ...)
+{
+	struct fake_connect *conn;
+	bdaddr_t src, dst;
+	va_list args;
+	gboolean ret;
+	GSList *l;
+	int sv[2];
+
+	bacpy(&src, BDADDR_ANY);
+	bacpy(&dst, BDADDR_ANY);
+
+	va_start(args, opt1);
+	ret = parse_opts(&src, &dst, opt1, args);
+	va_end(args);
+
+	if (!ret) {
+		*err = fake_error(EINVAL);
+		return NULL;
+	}
+
+	for (l = listeners; l; l = l->next) {
+		struct fake_listener *listener = l->data;
+
+		if (bacmp(&listener->src, &dst) == 0)
+			break;
+	}
+
+	if (l == NULL) {
+		*err = fake_error(EHOSTDOWN);
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		*err = fake_error(errno);
+		return NULL;
+	}
+
+	conn = g_new0(struct fake_connect, 1);
+	conn->io = new_chan(sv[0], &src, &dst);
+	conn->peer = new_chan(sv[1], &dst, &src);
+	conn->connect = connect;
+	conn->user_data = user_data;
+
+	connects = g_slist_append(connects, conn);
+
+	g_idle_add(confirm_idle, conn);
+
+	return conn->io;
+}
+
+static gboolean connect_idle(gpointer user_data)
+{
+	struct fake_connect *conn = user_data;
+
+	/* Acceptor first, as with a real L2CAP connection the initiator
+	 * can only send once the remote side is ready */
+	conn->accept(conn->peer, NULL, conn->accept_data);
+	conn->connect(conn->io, NULL, conn->user_data);
+
+	return FALSE;
+}
+
+gboolean bt_io_accept(GIOChannel *io, BtIOConnect connect, gpointer user_data,
+					GDestroyNotify destroy, GError **err)
+{
+	GSList *l;
+
+	for (l = connects; l; l = l->next) {
+		struct fake_connect *conn = l->data;
+
+		if (conn->peer != io)
+			continue;
+
+		conn->accept = connect;
+		conn->accept_data = user_data;
+		g_idle_add(connect_idle, conn);
+
+		return TRUE;
+	}
+
+	if (err)
+		*err = fake_error(ENOTCONN);
+
+	return FALSE;
+}
+
+gboolean bt_io_get(GIOChannel *io, BtIOType type, GError **err,
+						BtIOOption opt1, ...)
+{
+	struct fake_chan *chan = find_chan(io);
+	BtIOOption opt = opt1;
+	va_list args;
+
+	if (chan == NULL) {
+		*err = fake_error(ENOTCONN);
+		return FALSE;
+	}
+
+	va_start(args, opt1);
+
+	while (opt != BT_IO_OPT_INVALID) {
+		switch (opt) {
+		case BT_IO_OPT_SOURCE_BDADDR:
+			bacpy(va_arg(args, bdaddr_t *), &chan->src);
+			break;
+		case BT_IO_OPT_DEST_BDADDR:
+			bacpy(va_arg(args, bdaddr_t *), &chan->dst);
+			break;
+		case BT_IO_OPT_DEST:
+			ba2str(&chan->dst, va_arg(args, char *));
+			break;
+		case BT_IO_OPT_IMTU:
+		case BT_IO_OPT_OMTU:
+			*(va_arg(args, uint16_t *)) = BENCH_MTU;
+			break;
+		default:
+			va_end(args);
+			*err = fake_error(EINVAL);
+			return FALSE;
+		}
+
+		opt = va_arg(args, int);
+	}
+
+	va_end(args);
+
+	return TRUE;
+}
+
+gboolean bt_io_set(GIOChannel *io, BtIOType type, GError **err,
+						BtIOOption opt1, ...)
+{
+	return TRUE;
+}
+
+struct audio_device *manager_get_device(const bdaddr_t *src,
+					const bdaddr_t *dst,
+					gboolean create)
+{
+	struct audio_device *dev;
+	GSList *l;
+
+	for (l = devices; l; l = l->next) {
+		dev = l->data;
+
+		if (bacmp(&dev->src, src) == 0 && bacmp(&dev->dst, dst) == 0)
+			return dev;
+	}
+
+	/* Both roles are there so that AVDTP accepts any configuration */
+	dev = g_new0(struct audio_device, 1);
+	bacpy(&dev->src, src);
+	bacpy(&dev->dst, dst);
+	dev->sink = (struct sink *) &dummy_endpoint;
+	dev->source = (struct source *) &dummy_endpoint;
+
+	devices = g_slist_append(devices, dev);
+
+	return dev;
+}
+
+static gboolean auth_idle(gpointer user_data)
+{
+	struct fake_auth *auth = user_data;
+
+	auth->cb(NULL, auth->user_data);
+	g_free(auth);
+
+	return FALSE;
+}
+
+int audio_device_request_authorization(struct audio_device *dev,
+					const char *uuid, authorization_cb cb,
+					void *user_data)
+{
+	struct fake_auth *auth;
+
+	auth = g_new0(struct fake_auth, 1);
+	auth->cb = cb;
+	auth->user_data = user_data;
+
+	g_idle_add(auth_idle, auth);
+
+	return 0;
+}
+
+int audio_device_cancel_authorization(struct audio_device *dev,
+					authorization_cb cb, void *user_data)
+{
+	return 0;
+}
+
+gboolean sink_setup_stream(struct sink *sink, struct avdtp *session)
+{
+	return TRUE;
+}
+
+gboolean source_setup_stream(struct source *source, struct avdtp *session)
+{
+	return TRUE;
+}
+
+struct btd_adapter *manager_find_adapter(const bdaddr_t *sba)
+{
+	return NULL;
+}
+
+struct btd_device *adapter_find_device(struct btd_adapter *adapter,
+							const char *dest)
+{
+	return NULL;
+}
+
+const sdp_record_t *btd_device_get_record(struct btd_device *device,
+							const char *uuid)
+{
+	return NULL;
+}
+
+void btd_device_add_uuid(struct btd_device *device, const char *uuid)
+{
+}
+
+struct bench_stream {
+	unsigned int id;
+	bdaddr_t dst;
+	struct avdtp *session;
+	struct avdtp_local_sep *src_sep;
+	struct avdtp_local_sep *snk_sep;
+	double setup_start;
+	double setup;
+	gboolean started;
+
+	int sk;
+	uint16_t omtu;
+	sbc_t encoder;
+	struct rtp_sbc_payloader pay;
+	uint64_t samples_sent;
+	unsigned long packets_sent;
+
+	int rx_sk;
+	guint rx_watch;
+	sbc_t decoder;
+	struct rtp_sbc_depayloader depay;
+	unsigned long packets_received;
+	gboolean have_transit;
+	double transit;
+	double jitter;			/* RTP timestamp units */
+};
+
+static GMainLoop *main_loop = NULL;
+static struct bench_stream *streams = NULL;
+static unsigned int n_streams = 0;
+static unsigned int n_started = 0;
+static bdaddr_t src_addr;
+static double stream_start;
+static int16_t pcm[256];
+static guint timeout_id = 0;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static double cpu_time(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+			ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+static void setup_sbc(sbc_t *sbc)
+{
+	sbc_init(sbc, 0);
+
+	sbc->frequency = SBC_FREQ_44100;
+	sbc->mode = SBC_MODE_JOINT_STEREO;
+	sbc->subbands = SBC_SB_8;
+	sbc->blocks = SBC_BLK_16;
+	sbc->allocation = SBC_AM_LOUDNESS;
+	sbc->bitpool = 53;
+}
+
+static struct avdtp_service_capability *sbc_caps_new(void)
+{
+	struct sbc_codec_cap sbc_cap;
+
+	memset(&sbc_cap, 0, sizeof(sbc_cap));
+
+	sbc_cap.cap.media_type = AVDTP_MEDIA_TYPE_AUDIO;
+	sbc_cap.cap.media_codec_type = A2DP_CODEC_SBC;
+	sbc_cap.frequency = SBC_SAMPLING_FREQ_44100;
+	sbc_cap.channel_mode = SBC_CHANNEL_MODE_JOINT_STEREO;
+	sbc_cap.block_length = SBC_BLOCK_LENGTH_16;
+	sbc_cap.subbands = SBC_SUBBANDS_8;
+	sbc_cap.allocation_method = SBC_ALLOCATION_LOUDNESS;
+	sbc_cap.min_bitpool = MIN_BITPOOL;
+	sbc_cap.max_bitpool = 53;
+
+	return avdtp_service_cap_new(AVDTP_MEDIA_CODEC, &sbc_cap,
+							sizeof(sbc_cap));
+}
+
+static void stream_failed(struct bench_stream *bs, const char *what)
+{
+	fprintf(stderr, "Stream %u: %s failed\n", bs->id, what);
+
+	g_main_loop_quit(main_loop);
+}
+
+static gboolean getcap_ind(struct avdtp *session, struct avdtp_local_sep *sep,
+				gboolean get_all, GSList **caps, uint8_t *err,
+				void *user_data)
+{
+	*caps = g_slist_append(NULL, avdtp_service_cap_new(
+					AVDTP_MEDIA_TRANSPORT, NULL, 0));
+	*caps = g_slist_append(*caps, sbc_caps_new());
+
+	return TRUE;
+}
+
+static gboolean setconf_ind(struct avdtp *session,
+				struct avdtp_local_sep *sep,
+				struct avdtp_stream *stream, GSList *caps,
+				avdtp_set_configuration_cb cb, void *user_data)
+{
+	cb(session, stream, NULL);
+
+	return TRUE;
+}
+
+static gboolean accept_ind(struct avdtp *session, struct avdtp_local_sep *sep,
+				struct avdtp_stream *stream, uint8_t *err,
+				void *user_data)
+{
+	return TRUE;
+}
+
+static gboolean receive_cb(GIOChannel *io, GIOCondition cond,
+							gpointer user_data)
+{
+	struct bench_stream *bs = user_data;
+	uint8_t buf[BENCH_MTU], frames[BENCH_MTU], out[4096];
+	const struct rtp_header *header = (const void *) buf;
+	unsigned int n_frames;
+	double transit;
+	ssize_t len;
+	int size;
+
+	if (cond & (G_IO_ERR | G_IO_HUP | G_IO_NVAL)) {
+		bs->rx_watch = 0;
+		return FALSE;
+	}
+
+	len = recv(bs->rx_sk, buf, sizeof(buf), MSG_DONTWAIT);
+	if (len < (ssize_t) RTP_SBC_HEADER_SIZE)
+		return TRUE;
+
+	bs->packets_received++;
+
+	/* Interarrival jitter as in RFC 3550 section 6.4.1 */
+	transit = (now() - stream_start) * BENCH_RATE -
+					ntohl(header->timestamp);
+	if (bs->have_transit) {
+		double d = transit - bs->transit;
+
+		if (d < 0)
+			d = -d;
+
+		bs->jitter += (d - bs->jitter) / 16;
+	}
+
+	bs->transit = transit;
+	bs->have_transit = TRUE;
+
+	if (rtp_sbc_depayloader_push(&bs->depay, buf, len) < 0)
+		return TRUE;
+
+	while ((size = rtp_sbc_depayloader_pop(&bs->depay, frames,
+					sizeof(frames), &n_frames)) > 0) {
+		uint8_t *frame = frames;
+
+		while (size > 0) {
+			size_t written;
+			ssize_t ret;
+
+			ret = sbc_decode(&bs->decoder, frame, size, out,
+							sizeof(out), &written);
+			if (ret <= 0)
+				break;
+
+			frame += ret;
+			size -= ret;
+		}
+	}
+
+	return TRUE;
+}
+
+static gboolean start_ind(struct avdtp *session, struct avdtp_local_sep *sep,
+				struct avdtp_stream *stream, uint8_t *err,
+				void *user_data)
+{
+	struct bench_stream *bs = user_data;
+	GIOChannel *io;
+
+	if (!avdtp_stream_get_transport(stream, &bs->rx_sk, NULL, NULL,
+								NULL)) {
+		*err = AVDTP_UNSUPPORTED_CONFIGURATION;
+		return FALSE;
+	}
+
+	io = g_io_channel_unix_new(bs->rx_sk);
+	bs->rx_watch = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP |
+						G_IO_NVAL, receive_cb, bs);
+	g_io_channel_unref(io);
+
+	return TRUE;
+}
+
+static struct avdtp_sep_ind sink_ind = {
+	.get_capability		= getcap_ind,
+	.set_configuration	= setconf_ind,
+	.open			= accept_ind,
+	.start			= start_ind,
+	.suspend		= accept_ind,
+	.close			= accept_ind,
+	.abort			= accept_ind,
+};
+
+static struct avdtp_sep_ind source_ind = {
+	.get_capability		= getcap_ind,
+	.open			= accept_ind,
+	.suspend		= accept_ind,
+	.close			= accept_ind,
+	.abort			= accept_ind,
+};
+
+static void setconf_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
+				struct avdtp_stream *stream,
+				struct avdtp_error *err, void *user_data)
+{
+	struct bench_stream *bs = user_data;
+
+	if (err || avdtp_open(session, stream) < 0)
+		stream_failed(bs, "Set Configuration");
+}
+
+static void open_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
+				struct avdtp_stream *stream,
+				struct avdtp_error *err, void *user_data)
+{
+	struct bench_stream *bs = user_data;
+
+	if (err || avdtp_start(session, stream) < 0)
+		stream_failed(bs, "Open");
+}
+
+static void start_cfm(struct avdtp *session, struct avdtp_local_sep *sep,
+				struct avdtp_stream *stream,
+				struct avdtp_error *err, void *user_data)
+{
+	struct bench_stream *bs = user_data;
+
+	if (err || !avdtp_stream_get_transport(stream, &bs->sk, NULL,
+							&bs->omtu, NULL)) {
+		stream_failed(bs, "Start");
+		return;
+	}
+
+	bs->setup = now() - bs->setup_start;
+	bs->started = TRUE;
+
+	rtp_sbc_payloader_reset(&bs->pay, bs->omtu);
+
+	if (++n_started == n_streams)
+		g_main_loop_quit(main_loop);
+}
+
+static struct avdtp_sep_cfm source_cfm = {
+	.set_configuration	= setconf_cfm,
+	.open			= open_cfm,
+	.start			= start_cfm,
+};
+
+static void discover_cb(struct avdtp *session, GSList *seps,
+				struct avdtp_error *err, void *user_data)
+{
+	struct bench_stream *bs = user_data;
+	struct avdtp_remote_sep *rsep;
+	GSList *caps;
+
+	if (err) {
+		stream_failed(bs, "Discover");
+		return;
+	}
+
+	rsep = avdtp_find_remote_sep(session, bs->src_sep);
+	if (rsep == NULL) {
+		stream_failed(bs, "Endpoint lookup");
+		return;
+	}
+
+	caps = g_slist_append(NULL, avdtp_service_cap_new(
+					AVDTP_MEDIA_TRANSPORT, NULL, 0));
+	caps = g_slist_append(caps, sbc_caps_new());
+
+	if (avdtp_set_configuration(session, rsep, bs->src_sep, caps,
+								NULL) < 0)
+		stream_failed(bs, "Set Configuration");
+
+	g_slist_free_full(caps, g_free);
+}
+
+static gboolean step_timeout(gpointer user_data)
+{
+	timeout_id = 0;
+	g_main_loop_quit(main_loop);
+
+	return FALSE;
+}
+
+/* Sends whatever is due by the clock, a stream that fell behind catches
+ * up a few packets at a time like a real source would */
+static void send_due(struct bench_stream *bs, double elapsed)
+{
+	uint64_t due = elapsed * BENCH_RATE;
+	size_t codesize = sbc_get_codesize(&bs->encoder);
+	unsigned int packets = 0;
+
+	while (bs->samples_sent < due && packets < BENCH_MAX_CATCHUP) {
+		size_t len;
+		ssize_t written;
+		uint8_t *frame;
+
+		frame = rtp_sbc_payloader_get_frame(&bs->pay, &len);
+
+		if (sbc_encode(&bs->encoder, pcm, codesize, frame, len,
+							&written) < 0)
+			break;
+
+		bs->samples_sent += codesize / 4;
+
+		if (rtp_sbc_payloader_commit(&bs->pay, written,
+							codesize / 4) == 0)
+			continue;
+
+		bs->packets_sent++;
+		packets++;
+	}
+
+	rtp_sbc_payloader_send(&bs->pay, bs->sk);
+}
+
+static gboolean tick_cb(gpointer user_data)
+{
+	double elapsed = now() - stream_start;
+	unsigned int i;
+
+	for (i = 0; i < n_streams; i++) {
+		if (streams[i].started)
+			send_due(&streams[i], elapsed);
+	}
+
+	return TRUE;
+}
+
+static int setup_streams(unsigned int count)
+{
+	unsigned int i;
+
+	str2ba("00:AA:00:00:00:00", &src_addr);
+
+	if (avdtp_init(&src_addr, NULL, NULL) < 0)
+		return -EIO;
+
+	streams = g_new0(struct bench_stream, count);
+	n_streams = count;
+	n_started = 0;
+
+	for (i = 0; i < count; i++) {
+		struct bench_stream *bs = &streams[i];
+		char addr[18];
+
+		bs->id = i;
+		bs->sk = -1;
+		bs->rx_sk = -1;
+
+		snprintf(addr, sizeof(addr), "00:BB:00:00:%02X:%02X",
+							i >> 8, i & 0xff);
+		str2ba(addr, &bs->dst);
+
+		if (avdtp_init(&bs->dst, NULL, NULL) < 0)
+			return -EIO;
+
+		bs->src_sep = avdtp_register_sep(&src_addr,
+						AVDTP_SEP_TYPE_SOURCE,
+						AVDTP_MEDIA_TYPE_AUDIO,
+						A2DP_CODEC_SBC, FALSE,
+						&source_ind, &source_cfm, bs);
+		bs->snk_sep = avdtp_register_sep(&bs->dst,
+						AVDTP_SEP_TYPE_SINK,
+						AVDTP_MEDIA_TYPE_AUDIO,
+						A2DP_CODEC_SBC, FALSE,
+						&sink_ind, NULL, bs);
+		if (!bs->src_sep || !bs->snk_sep)
+			return -EIO;
+
+		setup_sbc(&bs->encoder);
+		setup_sbc(&bs->decoder);
+
+		if (rtp_sbc_payloader_init(&bs->pay, 4, BENCH_MTU) < 0 ||
+				rtp_sbc_depayloader_init(&bs->depay, 16,
+							BENCH_MTU, 4) < 0)
+			return -ENOMEM;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct bench_stream *bs = &streams[i];
+
+		bs->setup_start = now();
+
+		bs->session = avdtp_get(&src_addr, &bs->dst);
+		if (!bs->session ||
+				avdtp_discover(bs->session, discover_cb, bs) < 0)
+			return -EIO;
+	}
+
+	return 0;
+}
+
+static void cleanup_streams(void)
+{
+	GSList *l;
+	unsigned int i;
+
+	for (i = 0; i < n_streams; i++) {
+		struct bench_stream *bs = &streams[i];
+
+		if (bs->rx_watch)
+			g_source_remove(bs->rx_watch);
+
+		avdtp_unregister_sep(bs->src_sep);
+		avdtp_unregister_sep(bs->snk_sep);
+
+		if (bs->session)
+			avdtp_unref(bs->session);
+
+		avdtp_exit(&bs->dst);
+
+		sbc_finish(&bs->encoder);
+		sbc_finish(&bs->decoder);
+		rtp_sbc_payloader_free(&bs->pay);
+		rtp_sbc_depayloader_free(&bs->depay);
+	}
+
+	avdtp_exit(&src_addr);
+
+	/* Let the shut down sockets be released */
+	while (g_main_context_iteration(NULL, FALSE));
+
+	g_free(streams);
+	streams = NULL;
+	n_streams = 0;
+
+	for (l = devices; l; l = l->next)
+		g_free(l->data);
+
+	g_slist_free(devices);
+	devices = NULL;
+
+	free_chans();
+}
+
+static void run_step(unsigned int count, unsigned int duration)
+{
+	double setup_max = 0, setup_sum = 0, jitter = 0, cpu, elapsed;
+	unsigned long packets = 0, lost = 0;
+	guint tick_id;
+	unsigned int i;
+
+	if (setup_streams(count) < 0) {
+		fprintf(stderr, "Can't set up %u streams\n", count);
+		cleanup_streams();
+		return;
+	}
+
+	timeout_id = g_timeout_add_seconds(BENCH_SETUP_TIMEOUT, step_timeout,
+									NULL);
+	g_main_loop_run(main_loop);
+
+	if (timeout_id) {
+		g_source_remove(timeout_id);
+		timeout_id = 0;
+	}
+
+	if (n_started < count) {
+		fprintf(stderr, "Only %u of %u streams started\n", n_started,
+									count);
+		cleanup_streams();
+		return;
+	}
+
+	stream_start = now();
+	cpu = cpu_time();
+
+	tick_id = g_timeout_add(BENCH_TICK, tick_cb, NULL);
+	timeout_id = g_timeout_add_seconds(duration, step_timeout, NULL);
+	g_main_loop_run(main_loop);
+	g_source_remove(tick_id);
+
+	if (timeout_id) {
+		g_source_remove(timeout_id);
+		timeout_id = 0;
+	}
+
+	elapsed = now() - stream_start;
+	cpu = cpu_time() - cpu;
+
+	for (i = 0; i < count; i++) {
+		struct bench_stream *bs = &streams[i];
+
+		setup_sum += bs->setup;
+		if (bs->setup > setup_max)
+			setup_max = bs->setup;
+
+		packets += bs->packets_received;
+		/* Dropped on ring overflow, by the socket or never
+		 * delivered before the step ended */
+		if (bs->packets_sent > bs->packets_received)
+			lost += bs->packets_sent - bs->packets_received;
+		jitter += bs->jitter;
+	}
+
+	printf("%7u %10.2f %10.2f %10.0f %10.1f %10.2f %10.3f %6lu\n", count,
+			setup_sum / count * 1000, setup_max * 1000,
+			packets / elapsed, packets / elapsed / count,
+			cpu / elapsed / count * 100,
+			jitter / count / BENCH_RATE * 1000, lost);
+
+	cleanup_streams();
+}
+
+static void usage(void)
+{
+	printf("avdtpbench - AVDTP signalling and media streaming benchmark\n"
+		"Usage:\n");
+	printf("\tavdtpbench [options]\n");
+	printf("Options:\n"
+		"\t-n <streams>     Maximum number of streams (default 8)\n"
+		"\t-d <seconds>     Streaming time per step (default 5)\n"
+		"\t-h               Display help\n");
+}
+
+static struct option main_options[] = {
+	{ "streams",	1, 0, 'n' },
+	{ "duration",	1, 0, 'd' },
+	{ "help",	0, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int max_streams = 8, duration = 5, i;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "+n:d:h",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			max_streams = atoi(optarg);
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (max_streams == 0 || max_streams > 0xffff || duration == 0) {
+		usage();
+		exit(1);
+	}
+
+	/* A 1 kHz tone, 128 stereo samples */
+	for (i = 0; i < G_N_ELEMENTS(pcm) / 2; i++) {
+		pcm[2 * i] = (i % 44) < 22 ? 8192 : -8192;
+		pcm[2 * i + 1] = pcm[2 * i];
+	}
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	printf("%7s %10s %10s %10s %10s %10s %10s %6s\n", "streams",
+			"setup(ms)", "worst(ms)", "pkts/s", "pkts/s/str",
+			"%cpu/str", "jitter(ms)", "lost");
+
+	for (i = 1; i <= max_streams; i++)
+		run_step(i, duration);
+
+	g_main_loop_unref(main_loop);
+
+	return 0;
+}
@@ -0,0 +1,518 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2002-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+
+#include "sdpd.h"
+
+/*
+ * The request handling code of the SDP server is linked in directly and
+ * the functions below replace the parts of bluetoothd it depends on.
+ */
+
+struct btd_adapter;
+
+void manager_foreach_adapter(void (*func) (struct btd_adapter *adapter,
+						void *user_data), void *data)
+{
+}
+
+struct btd_adapter *manager_find_adapter(const bdaddr_t *sba)
+{
+	return NULL;
+}
+
+void adapter_service_insert(struct btd_adapter *adapter, void *rec)
+{
+}
+
+void adapter_service_remove(struct btd_adapter *adapter, void *rec)
+{
+}
+
+int service_register_req(sdp_req_t *req, sdp_buf_t *rsp)
+{
+	return SDP_INVALID_SYNTAX;
+}
+
+int service_update_req(sdp_req_t *req, sdp_buf_t *rsp)
+{
+	return SDP_INVALID_SYNTAX;
+}
+
+int service_remove_req(sdp_req_t *req, sdp_buf_t *rsp)
+{
+	return SDP_INVALID_SYNTAX;
+}
+
+uint32_t sdp_get_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return (uint32_t) tv.tv_sec;
+}
+
+/* Allocation counting, enabled with -Wl,--wrap=malloc,... at link time */
+
+static unsigned long alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	alloc_count++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	alloc_count++;
+	return __real_realloc(ptr, size);
+}
+
+#define BASE_UUID16	0x8000
+#define MAX_RSP_SIZE	0xffff
+
+struct stats {
+	const char *name;
+	unsigned long transactions;
+	unsigned long pdus;
+	unsigned long allocs;
+	unsigned long errors;
+	double elapsed;
+	double worst;
+};
+
+static int server_sk = -1;
+static int client_sk = -1;
+static uint16_t tid = 0;
+static uint16_t max_bytes = 48;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static sdp_record_t *create_record(unsigned int index)
+{
+	sdp_list_t *svclass, *root, *proto, *aproto, *l2cap, *rfcomm;
+	uuid_t svclass_uuid, unique_uuid, root_uuid, l2cap_uuid, rfcomm_uuid;
+	sdp_data_t *channel;
+	sdp_record_t *record;
+	uint8_t ch = (index % 30) + 1;
+	char name[32];
+
+	record = sdp_record_alloc();
+	if (!record)
+		return NULL;
+
+	sdp_uuid16_create(&svclass_uuid, SERIAL_PORT_SVCLASS_ID);
+	sdp_uuid16_create(&unique_uuid, BASE_UUID16 + (index & 0x7fff));
+	svclass = sdp_list_append(NULL, &unique_uuid);
+	svclass = sdp_list_append(svclass, &svclass_uuid);
+	sdp_set_service_classes(record, svclass);
+
+	sdp_uuid16_create(&root_uuid, PUBLIC_BROWSE_GROUP);
+	root = sdp_list_append(NULL, &root_uuid);
+	sdp_set_browse_groups(record, root);
+
+	sdp_uuid16_create(&l2cap_uuid, L2CAP_UUID);
+	l2cap = sdp_list_append(NULL, &l2cap_uuid);
+	proto = sdp_list_append(NULL, l2cap);
+
+	sdp_uuid16_create(&rfcomm_uuid, RFCOMM_UUID);
+	channel = sdp_data_alloc(SDP_UINT8, &ch);
+	rfcomm = sdp_list_append(NULL, &rfcomm_uuid);
+	rfcomm = sdp_list_append(rfcomm, channel);
+	proto = sdp_list_append(proto, rfcomm);
+
+	aproto = sdp_list_append(NULL, proto);
+	sdp_set_access_protos(record, aproto);
+
+	snprintf(name, sizeof(name), "Benchmark service %u", index);
+	sdp_set_info_attr(record, name, "BlueZ", "SDP server benchmark");
+
+	sdp_data_free(channel);
+	sdp_list_free(l2cap, NULL);
+	sdp_list_free(rfcomm, NULL);
+	sdp_list_free(proto, NULL);
+	sdp_list_free(aproto, NULL);
+	sdp_list_free(root, NULL);
+	sdp_list_free(svclass, NULL);
+
+	return record;
+}
+
+static int add_records(unsigned int from, unsigned int to)
+{
+	unsigned int i;
+
+	for (i = from; i < to; i++) {
+		sdp_record_t *record;
+		sdp_data_t *data;
+
+		record = create_record(i);
+		if (!record)
+			return -ENOMEM;
+
+		record->handle = sdp_next_handle();
+		sdp_record_add(BDADDR_ANY, record);
+
+		data = sdp_data_alloc(SDP_UINT32, &record->handle);
+		sdp_attr_replace(record, SDP_ATTR_RECORD_HANDLE, data);
+	}
+
+	return 0;
+}
+
+static int put_uuid_seq(uint8_t *ptr, uint16_t uuid16)
+{
+	ptr[0] = SDP_SEQ8;
+	ptr[1] = 3;
+	ptr[2] = SDP_UUID16;
+	bt_put_unaligned(htons(uuid16), (uint16_t *) &ptr[3]);
+
+	return 5;
+}
+
+static int put_attr_seq(uint8_t *ptr)
+{
+	ptr[0] = SDP_SEQ8;
+	ptr[1] = 5;
+	ptr[2] = SDP_UINT32;
+	bt_put_unaligned(htonl(0x0000ffff), (uint32_t *) &ptr[3]);
+
+	return 7;
+}
+
+static int put_cstate(uint8_t *ptr, const uint8_t *cstate, uint8_t len)
+{
+	ptr[0] = len;
+	memcpy(&ptr[1], cstate, len);
+
+	return len + 1;
+}
+
+static uint8_t *build_request(uint8_t pdu_id, uint32_t arg,
+					const uint8_t *cstate, uint8_t cstate_len,
+					int *len)
+{
+	sdp_pdu_hdr_t *hdr;
+	uint8_t *buf, *ptr;
+
+	/* handle_request() takes ownership of the buffer */
+	buf = malloc(SDP_REQ_BUFFER_SIZE);
+	if (!buf)
+		return NULL;
+
+	hdr = (sdp_pdu_hdr_t *) buf;
+	hdr->pdu_id = pdu_id;
+	hdr->tid = htons(++tid);
+
+	ptr = buf + sizeof(sdp_pdu_hdr_t);
+
+	switch (pdu_id) {
+	case SDP_SVC_SEARCH_REQ:
+		ptr += put_uuid_seq(ptr, arg);
+		bt_put_unaligned(htons(MAX_RSP_SIZE), (uint16_t *) ptr);
+		ptr += sizeof(uint16_t);
+		break;
+	case SDP_SVC_ATTR_REQ:
+		bt_put_unaligned(htonl(arg), (uint32_t *) ptr);
+		ptr += sizeof(uint32_t);
+		bt_put_unaligned(htons(max_bytes), (uint16_t *) ptr);
+		ptr += sizeof(uint16_t);
+		ptr += put_attr_seq(ptr);
+		break;
+	case SDP_SVC_SEARCH_ATTR_REQ:
+		ptr += put_uuid_seq(ptr, arg);
+		bt_put_unaligned(htons(max_bytes), (uint16_t *) ptr);
+		ptr += sizeof(uint16_t);
+		ptr += put_attr_seq(ptr);
+		break;
+	}
+
+	ptr += put_cstate(ptr, cstate, cstate_len);
+
+	*len = ptr - buf;
+	hdr->plen = htons(*len - sizeof(sdp_pdu_hdr_t));
+
+	return buf;
+}
+
+/* Returns the continuation state length or a negative error */
+static int parse_response(uint8_t pdu_id, const uint8_t *rsp, int len,
+						uint8_t *cstate)
+{
+	const sdp_pdu_hdr_t *hdr = (const sdp_pdu_hdr_t *) rsp;
+	const uint8_t *ptr = rsp + sizeof(sdp_pdu_hdr_t);
+	int count, cstate_len;
+
+	if (len < (int) sizeof(sdp_pdu_hdr_t) + 3)
+		return -EPROTO;
+
+	if (hdr->pdu_id != pdu_id + 1)
+		return -EPROTO;
+
+	if (pdu_id == SDP_SVC_SEARCH_REQ) {
+		count = ntohs(bt_get_unaligned((uint16_t *) (ptr + 2)));
+		ptr += 2 * sizeof(uint16_t) + count * sizeof(uint32_t);
+	} else {
+		count = ntohs(bt_get_unaligned((uint16_t *) ptr));
+		ptr += sizeof(uint16_t) + count;
+	}
+
+	if (ptr >= rsp + len)
+		return -EPROTO;
+
+	cstate_len = *ptr++;
+	if (ptr + cstate_len > rsp + len || cstate_len > 16)
+		return -EPROTO;
+
+	memcpy(cstate, ptr, cstate_len);
+
+	return cstate_len;
+}
+
+static int run_transaction(uint8_t pdu_id, uint32_t arg, struct stats *st)
+{
+	uint8_t rsp[MAX_RSP_SIZE], cstate[16];
+	int cstate_len = 0;
+
+	do {
+		unsigned long allocs;
+		double start, latency;
+		uint8_t *req;
+		ssize_t len;
+		int req_len;
+
+		req = build_request(pdu_id, arg, cstate, cstate_len, &req_len);
+		if (!req)
+			return -ENOMEM;
+
+		allocs = alloc_count;
+		start = now();
+
+		handle_request(server_sk, req, req_len);
+
+		len = recv(client_sk, rsp, sizeof(rsp), 0);
+
+		latency = now() - start;
+		st->allocs += alloc_count - allocs;
+		st->pdus++;
+
+		if (latency > st->worst)
+			st->worst = latency;
+
+		if (len < 0)
+			return -errno;
+
+		cstate_len = parse_response(pdu_id, rsp, len, cstate);
+		if (cstate_len < 0)
+			return cstate_len;
+	} while (cstate_len > 0);
+
+	st->transactions++;
+
+	return 0;
+}
+
+static void run_step(unsigned int records, unsigned int iterations)
+{
+	struct stats st[3];
+	unsigned int i, j;
+
+	memset(st, 0, sizeof(st));
+	st[0].name = "ServiceSearch";
+	st[1].name = "ServiceAttribute";
+	st[2].name = "ServiceSearchAttribute";
+
+	for (i = 0; i < iterations; i++) {
+		unsigned int index = rand() % records;
+		sdp_list_t *list = sdp_get_record_list();
+		sdp_record_t *rec = NULL;
+		double start;
+
+		for (j = 0; list && j <= index; list = list->next, j++)
+			rec = list->data;
+
+		start = now();
+		if (run_transaction(SDP_SVC_SEARCH_REQ,
+					PUBLIC_BROWSE_GROUP, &st[0]) < 0)
+			st[0].errors++;
+		st[0].elapsed += now() - start;
+
+		start = now();
+		if (!rec || run_transaction(SDP_SVC_ATTR_REQ,
+						rec->handle, &st[1]) < 0)
+			st[1].errors++;
+		st[1].elapsed += now() - start;
+
+		start = now();
+		if (run_transaction(SDP_SVC_SEARCH_ATTR_REQ,
+				BASE_UUID16 + (index & 0x7fff), &st[2]) < 0)
+			st[2].errors++;
+		st[2].elapsed += now() - start;
+	}
+
+	for (i = 0; i < 3; i++) {
+		double rate = st[i].elapsed > 0 ?
+					st[i].pdus / st[i].elapsed : 0;
+
+		printf("%6u  %-22s %10.0f %10.1f %10.1f %10.1f %6lu\n",
+			records, st[i].name, rate,
+			st[i].transactions ?
+				(double) st[i].pdus / st[i].transactions : 0,
+			st[i].pdus ? (double) st[i].allocs / st[i].pdus : 0,
+			st[i].worst * 1000000, st[i].errors);
+	}
+}
+
+static void usage(void)
+{
+	printf("sdpbench - SDP server request handling benchmark\n"
+		"Usage:\n");
+	printf("\tsdpbench [options]\n");
+	printf("Options:\n"
+		"\t-n <records>     Maximum number of records (default 4096)\n"
+		"\t-s <records>     Initial number of records (default 16)\n"
+		"\t-i <iterations>  Transactions per request type and step "
+							"(default 200)\n"
+		"\t-b <bytes>       Maximum attribute byte count per PDU "
+							"(default 48)\n"
+		"\t-h               Display help\n");
+}
+
+static struct option main_options[] = {
+	{ "records",	1, 0, 'n' },
+	{ "start",	1, 0, 's' },
+	{ "iterations",	1, 0, 'i' },
+	{ "bytes",	1, 0, 'b' },
+	{ "help",	0, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+int main(int argc, char *argv[])
+{
+	unsigned int max_records = 4096, records = 16, iterations = 200;
+	unsigned int registered = 0;
+	int opt, sv[2];
+
+	while ((opt = getopt_long(argc, argv, "+n:s:i:b:h",
+						main_options, NULL)) != -1) {
+		switch (opt) {
+		case 'n':
+			max_records = atoi(optarg);
+			break;
+		case 's':
+			records = atoi(optarg);
+			break;
+		case 'i':
+			iterations = atoi(optarg);
+			break;
+		case 'b':
+			max_bytes = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (records == 0 || max_records < records || max_bytes < 7) {
+		usage();
+		exit(1);
+	}
+
+	/* Local connections are handled like the Unix socket interface */
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror("Can't create socket pair");
+		exit(1);
+	}
+
+	server_sk = sv[0];
+	client_sk = sv[1];
+
+	printf("%6s  %-22s %10s %10s %10s %10s %6s\n", "recs", "request",
+			"pdus/s", "pdus/txn", "allocs/pdu", "worst(us)",
+			"errors");
+
+	while (1) {
+		if (add_records(registered, records) < 0) {
+			fprintf(stderr, "Can't create records\n");
+			break;
+		}
+
+		registered = records;
+
+		run_step(records, iterations);
+
+		if (records == max_records)
+			break;
+
+		/* The last step is always the requested maximum */
+		records = records > max_records / 4 ? max_records :
+								records * 4;
+	}
+
+	sdp_svcdb_reset();
+
+	close(server_sk);
+	close(client_sk);
+
+	return 0;
+}
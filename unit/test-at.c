@@ -0,0 +1,238 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <check.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "at.h"
+
+static void feed(struct at_buf *buf, const char *data, size_t len)
+{
+	int fds[2];
+
+	ck_assert(pipe(fds) == 0);
+	ck_assert(write(fds[1], data, len) == (ssize_t) len);
+	ck_assert(at_buf_read(buf, fds[0]) == (ssize_t) len);
+
+	close(fds[0]);
+	close(fds[1]);
+}
+
+START_TEST(test_buf_lines)
+{
+	static const char data[] = "\r\nAT+BRSF=16\r\nAT+CIND?\rAT+CH";
+	struct at_buf buf;
+	char *line;
+
+	at_buf_reset(&buf);
+	feed(&buf, data, sizeof(data) - 1);
+
+	line = at_buf_get_line(&buf);
+	ck_assert(line != NULL && strcmp(line, "AT+BRSF=16") == 0);
+
+	line = at_buf_get_line(&buf);
+	ck_assert(line != NULL && strcmp(line, "AT+CIND?") == 0);
+
+	/* Incomplete until its terminator arrives */
+	ck_assert(at_buf_get_line(&buf) == NULL);
+
+	feed(&buf, "LD=1\n", 5);
+
+	line = at_buf_get_line(&buf);
+	ck_assert(line != NULL && strcmp(line, "AT+CHLD=1") == 0);
+
+	ck_assert(at_buf_get_line(&buf) == NULL);
+}
+END_TEST
+
+START_TEST(test_buf_wrap)
+{
+	static const char data[] = "AT+BRSF=16\r\nAT+CIND?\r";
+	char fill[AT_BUF_SIZE - 8];
+	struct at_buf buf;
+	char *line;
+
+	at_buf_reset(&buf);
+
+	/* Leaves the next line starting 8 bytes before the end */
+	memset(fill, 'A', sizeof(fill));
+	fill[sizeof(fill) - 1] = '\r';
+	feed(&buf, fill, sizeof(fill));
+
+	line = at_buf_get_line(&buf);
+	ck_assert(line != NULL && strlen(line) == sizeof(fill) - 1);
+
+	feed(&buf, data, sizeof(data) - 1);
+
+	line = at_buf_get_line(&buf);
+	ck_assert(line != NULL && strcmp(line, "AT+BRSF=16") == 0);
+
+	line = at_buf_get_line(&buf);
+	ck_assert(line != NULL && strcmp(line, "AT+CIND?") == 0);
+
+	ck_assert(at_buf_get_line(&buf) == NULL);
+}
+END_TEST
+
+START_TEST(test_buf_overflow)
+{
+	char fill[AT_BUF_SIZE];
+	struct at_buf buf;
+	int fds[2];
+
+	at_buf_reset(&buf);
+
+	memset(fill, 'A', sizeof(fill));
+	feed(&buf, fill, sizeof(fill));
+
+	ck_assert(at_buf_get_line(&buf) == NULL);
+
+	ck_assert(pipe(fds) == 0);
+	ck_assert(at_buf_read(&buf, fds[0]) == -ENOBUFS);
+	close(fds[0]);
+	close(fds[1]);
+}
+END_TEST
+
+START_TEST(test_trie)
+{
+	struct at_trie *trie;
+
+	trie = at_trie_new();
+
+	ck_assert(at_trie_add(trie, "AT+CHLD", 1) == 0);
+	ck_assert(at_trie_add(trie, "AT+CHUP", 2) == 0);
+	ck_assert(at_trie_add(trie, "AT+C", 3) == 0);
+	ck_assert(at_trie_add(trie, "AT+CHLD", 4) == -EALREADY);
+
+	ck_assert(at_trie_lookup(trie, "AT+CHLD=1") == 1);
+	ck_assert(at_trie_lookup(trie, "AT+CHUP") == 2);
+	/* Longest matching prefix wins */
+	ck_assert(at_trie_lookup(trie, "AT+CIND?") == 3);
+	ck_assert(at_trie_lookup(trie, "AT+CH") == 3);
+	ck_assert(at_trie_lookup(trie, "ATD1234;") == -ENOENT);
+	ck_assert(at_trie_lookup(trie, "") == -ENOENT);
+
+	at_trie_free(trie);
+}
+END_TEST
+
+START_TEST(test_args)
+{
+	struct at_args args;
+	char str[8];
+	int val;
+
+	ck_assert(at_args_init(&args, "AT+CMER=3, 0,0 ,1"));
+	ck_assert(at_args_int(&args, &val) && val == 3);
+	ck_assert(at_args_skip(&args));
+	ck_assert(at_args_skip(&args));
+	ck_assert(at_args_int(&args, &val) && val == 1);
+
+	ck_assert(at_args_init(&args, "+CLIP: \"1,2\",129"));
+	ck_assert(at_args_string(&args, str, sizeof(str)));
+	ck_assert(strcmp(str, "1,2") == 0);
+	ck_assert(at_args_int(&args, &val) && val == 129);
+
+	ck_assert(at_args_init(&args, "AT+BAC=1,2"));
+	ck_assert(at_args_int(&args, &val) && val == 1);
+	ck_assert(at_args_int(&args, &val) && val == 2);
+	ck_assert(!at_args_int(&args, &val));
+}
+END_TEST
+
+START_TEST(test_args_malformed)
+{
+	struct at_args args;
+	char str[4];
+	int val;
+
+	ck_assert(!at_args_init(&args, "AT+CHUP"));
+
+	ck_assert(at_args_init(&args, "AT+VGS=x"));
+	ck_assert(!at_args_int(&args, &val));
+
+	ck_assert(at_args_init(&args, "AT+VGS=7x"));
+	ck_assert(!at_args_int(&args, &val));
+
+	ck_assert(at_args_init(&args, "AT+VGS="));
+	ck_assert(!at_args_int(&args, &val));
+
+	ck_assert(at_args_init(&args, "AT+CNUM=\"123"));
+	ck_assert(!at_args_string(&args, str, sizeof(str)));
+
+	ck_assert(at_args_init(&args, "AT+CNUM=\"1234\""));
+	ck_assert(!at_args_string(&args, str, sizeof(str)));
+
+	ck_assert(at_args_init(&args, "AT+CNUM=\"12\"3"));
+	ck_assert(!at_args_string(&args, str, sizeof(str)));
+}
+END_TEST
+
+static void add_test(Suite *s, const char *name, TFun func)
+{
+	TCase *t;
+
+	t = tcase_create(name);
+	tcase_add_test(t, func);
+	suite_add_tcase(s, t);
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	SRunner *sr;
+	Suite *s;
+
+	s = suite_create("AT");
+
+	add_test(s, "line splitting", test_buf_lines);
+	add_test(s, "line across ring wrap", test_buf_wrap);
+	add_test(s, "line too long", test_buf_overflow);
+	add_test(s, "command trie", test_trie);
+	add_test(s, "arguments", test_args);
+	add_test(s, "malformed arguments", test_args_malformed);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+
+	fails = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	if (fails > 0)
+		return -1;
+
+	return 0;
+}
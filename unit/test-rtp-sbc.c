@@ -0,0 +1,256 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <check.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+
+#include "rtp.h"
+#include "rtp-sbc.h"
+
+#define FRAME_LEN	20
+#define MTU		100
+
+static void fill_frames(struct rtp_sbc_payloader *pay, unsigned int n)
+{
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		uint8_t *frame;
+		size_t len;
+
+		frame = rtp_sbc_payloader_get_frame(pay, &len);
+		ck_assert(len >= FRAME_LEN);
+
+		memset(frame, i, FRAME_LEN);
+		rtp_sbc_payloader_commit(pay, FRAME_LEN, 128);
+	}
+}
+
+START_TEST(test_payloader)
+{
+	struct rtp_sbc_payloader pay;
+	struct rtp_header *header;
+	struct rtp_payload *payload;
+	uint8_t buf[MTU];
+	int sv[2];
+	ssize_t len;
+
+	ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+	ck_assert(rtp_sbc_payloader_init(&pay, 4, MTU) == 0);
+
+	/* The fourth frame leaves no room for a fifth */
+	fill_frames(&pay, 4);
+	ck_assert(pay.queued == 1);
+
+	fill_frames(&pay, 2);
+	rtp_sbc_payloader_complete(&pay);
+	ck_assert(pay.queued == 2);
+
+	ck_assert(rtp_sbc_payloader_send(&pay, sv[0]) == 2);
+	ck_assert(pay.queued == 0);
+
+	len = recv(sv[1], buf, sizeof(buf), 0);
+	ck_assert(len == (ssize_t) (RTP_SBC_HEADER_SIZE + 4 * FRAME_LEN));
+
+	header = (void *) buf;
+	payload = (void *) (header + 1);
+	ck_assert(header->v == 2);
+	ck_assert(ntohs(header->sequence_number) == 0);
+	ck_assert(ntohl(header->timestamp) == 0);
+	ck_assert(payload->frame_count == 4);
+
+	len = recv(sv[1], buf, sizeof(buf), 0);
+	ck_assert(len == (ssize_t) (RTP_SBC_HEADER_SIZE + 2 * FRAME_LEN));
+	ck_assert(ntohs(header->sequence_number) == 1);
+	ck_assert(ntohl(header->timestamp) == 4 * 128);
+	ck_assert(payload->frame_count == 2);
+	ck_assert(buf[RTP_SBC_HEADER_SIZE + FRAME_LEN] == 1);
+
+	rtp_sbc_payloader_free(&pay);
+	close(sv[0]);
+	close(sv[1]);
+}
+END_TEST
+
+START_TEST(test_payloader_overflow)
+{
+	struct rtp_sbc_payloader pay;
+
+	ck_assert(rtp_sbc_payloader_init(&pay, 2, MTU) == 0);
+
+	/* The oldest packet makes room once the ring is full */
+	fill_frames(&pay, 12);
+	ck_assert(pay.queued == 2);
+	ck_assert(pay.dropped == 1);
+	ck_assert(pay.seq_num == 3);
+
+	rtp_sbc_payloader_free(&pay);
+}
+END_TEST
+
+static size_t build_packet(uint8_t *buf, uint16_t seq, uint8_t fill)
+{
+	struct rtp_header *header = (void *) buf;
+	struct rtp_payload *payload = (void *) (header + 1);
+
+	memset(buf, 0, RTP_SBC_HEADER_SIZE);
+	header->v = 2;
+	header->sequence_number = htons(seq);
+	payload->frame_count = 1;
+	memset(buf + RTP_SBC_HEADER_SIZE, fill, FRAME_LEN);
+
+	return RTP_SBC_HEADER_SIZE + FRAME_LEN;
+}
+
+static void push(struct rtp_sbc_depayloader *depay, uint16_t seq)
+{
+	uint8_t buf[MTU];
+	size_t len;
+
+	len = build_packet(buf, seq, seq);
+	ck_assert(rtp_sbc_depayloader_push(depay, buf, len) == 0);
+}
+
+static int pop(struct rtp_sbc_depayloader *depay)
+{
+	uint8_t buf[MTU];
+	unsigned int frames;
+	int len;
+
+	len = rtp_sbc_depayloader_pop(depay, buf, sizeof(buf), &frames);
+	if (len <= 0)
+		return -1;
+
+	ck_assert(len == FRAME_LEN && frames == 1);
+
+	return buf[0];
+}
+
+START_TEST(test_depayloader_reorder)
+{
+	struct rtp_sbc_depayloader depay;
+	uint8_t buf[MTU];
+	size_t len;
+
+	ck_assert(rtp_sbc_depayloader_init(&depay, 8, MTU, 3) == 0);
+
+	push(&depay, 10);
+	push(&depay, 12);
+	push(&depay, 11);
+
+	ck_assert(pop(&depay) == 10);
+	ck_assert(pop(&depay) == 11);
+	ck_assert(pop(&depay) == 12);
+	ck_assert(pop(&depay) == -1);
+
+	/* Late and duplicate packets are refused */
+	len = build_packet(buf, 11, 0);
+	ck_assert(rtp_sbc_depayloader_push(&depay, buf, len) == -EALREADY);
+
+	push(&depay, 13);
+	len = build_packet(buf, 13, 0);
+	ck_assert(rtp_sbc_depayloader_push(&depay, buf, len) == -EALREADY);
+
+	ck_assert(depay.lost == 0);
+
+	rtp_sbc_depayloader_free(&depay);
+}
+END_TEST
+
+START_TEST(test_depayloader_loss)
+{
+	struct rtp_sbc_depayloader depay;
+	uint8_t buf[MTU];
+	size_t len;
+
+	ck_assert(rtp_sbc_depayloader_init(&depay, 8, MTU, 2) == 0);
+
+	push(&depay, 0);
+	ck_assert(pop(&depay) == 0);
+
+	/* Waits for the gap to be filled until depth packets are held */
+	push(&depay, 2);
+	ck_assert(pop(&depay) == -1);
+
+	push(&depay, 3);
+	ck_assert(pop(&depay) == 2);
+	ck_assert(pop(&depay) == 3);
+	ck_assert(depay.lost == 1);
+
+	/* Malformed packets */
+	len = build_packet(buf, 4, 0);
+	buf[0] = 0;
+	ck_assert(rtp_sbc_depayloader_push(&depay, buf, len) == -EINVAL);
+	ck_assert(rtp_sbc_depayloader_push(&depay, buf,
+					RTP_SBC_HEADER_SIZE) == -EINVAL);
+
+	rtp_sbc_depayloader_free(&depay);
+}
+END_TEST
+
+static void add_test(Suite *s, const char *name, TFun func)
+{
+	TCase *t;
+
+	t = tcase_create(name);
+	tcase_add_test(t, func);
+	suite_add_tcase(s, t);
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	SRunner *sr;
+	Suite *s;
+
+	s = suite_create("RTP SBC");
+
+	add_test(s, "payloader", test_payloader);
+	add_test(s, "payloader overflow", test_payloader_overflow);
+	add_test(s, "depayloader reordering", test_depayloader_reorder);
+	add_test(s, "depayloader loss", test_depayloader_loss);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+
+	fails = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	if (fails > 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2006-2010  Nokia Corporation
+ *  Copyright (C) 2004-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <check.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "sco-pcm.h"
+
+#define MTU		48
+
+static void send_packet(int sk, uint8_t first, size_t len)
+{
+	uint8_t buf[MTU + 16];
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = first + i;
+
+	ck_assert(send(sk, buf, len, 0) == (ssize_t) len);
+}
+
+static void check_data(const uint8_t *buf, uint8_t first, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		ck_assert(buf[i] == (uint8_t) (first + i));
+}
+
+START_TEST(test_rx_short_packets)
+{
+	struct sco_pcm_rx rx;
+	uint8_t buf[3 * MTU];
+	int sv[2];
+
+	ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+	ck_assert(sco_pcm_rx_init(&rx, MTU, 3) == 0);
+
+	/* The gap a short packet leaves is closed up */
+	send_packet(sv[1], 0, 40);
+	send_packet(sv[1], 40, MTU);
+	ck_assert(sco_pcm_rx_fill(&rx, sv[0], 0) == 40 + MTU);
+
+	ck_assert(sco_pcm_rx_read(&rx, buf, sizeof(buf)) == 40 + MTU);
+	check_data(buf, 0, 40 + MTU);
+
+	/* Now the second packet wraps around the end of the ring */
+	send_packet(sv[1], 100, MTU);
+	send_packet(sv[1], 148, MTU);
+	ck_assert(sco_pcm_rx_fill(&rx, sv[0], 0) == 2 * MTU);
+
+	ck_assert(sco_pcm_rx_read(&rx, buf, sizeof(buf)) == 2 * MTU);
+	check_data(buf, 100, 2 * MTU);
+
+	/* Odd lengths are cut to whole samples */
+	send_packet(sv[1], 0, 7);
+	ck_assert(sco_pcm_rx_fill(&rx, sv[0], 0) == 6);
+
+	sco_pcm_rx_free(&rx);
+	close(sv[0]);
+	close(sv[1]);
+}
+END_TEST
+
+START_TEST(test_rx_overrun)
+{
+	struct sco_pcm_rx rx;
+	uint8_t buf[2 * MTU];
+	int sv[2];
+
+	ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+	ck_assert(sco_pcm_rx_init(&rx, MTU, 2) == 0);
+
+	send_packet(sv[1], 0, MTU);
+	send_packet(sv[1], 48, MTU);
+	ck_assert(sco_pcm_rx_fill(&rx, sv[0], 0) == 2 * MTU);
+
+	/* A full ring drops its oldest packet */
+	send_packet(sv[1], 96, MTU);
+	ck_assert(sco_pcm_rx_fill(&rx, sv[0], 0) == MTU);
+	ck_assert(rx.overruns == 1);
+
+	ck_assert(sco_pcm_rx_read(&rx, buf, sizeof(buf)) == 2 * MTU);
+	check_data(buf, 48, 2 * MTU);
+
+	sco_pcm_rx_free(&rx);
+	close(sv[0]);
+	close(sv[1]);
+}
+END_TEST
+
+START_TEST(test_resampler)
+{
+	struct sco_pcm_resampler rs;
+	int16_t in[10], out[16];
+	size_t consumed, n, i;
+
+	for (i = 0; i < 10; i++)
+		in[i] = (i + 1) * 100;
+
+	/* At 1:1 the output is the input one sample late */
+	sco_pcm_resampler_init(&rs);
+	n = sco_pcm_resample(&rs, in, 10, &consumed, out, 16);
+	ck_assert(n == 10 && consumed == 10);
+	ck_assert(out[0] == 0);
+	for (i = 1; i < n; i++)
+		ck_assert(out[i] == in[i - 1]);
+
+	/* The next block continues from the last sample */
+	n = sco_pcm_resample(&rs, in, 10, &consumed, out, 16);
+	ck_assert(n == 10 && out[0] == 1000);
+
+	/* Output space limits the input consumed */
+	n = sco_pcm_resample(&rs, in, 10, &consumed, out, 4);
+	ck_assert(n == 4 && consumed == 4);
+}
+END_TEST
+
+START_TEST(test_resampler_adjust)
+{
+	struct sco_pcm_resampler rs;
+	int16_t in[1000], out[1000];
+	size_t consumed, n;
+
+	memset(in, 0, sizeof(in));
+
+	sco_pcm_resampler_init(&rs);
+
+	/* Too much queued, input is consumed faster */
+	sco_pcm_resampler_adjust(&rs, 10, 2);
+	ck_assert(rs.step > 1 << 16);
+
+	/* But never more than 0.5% off */
+	sco_pcm_resampler_adjust(&rs, 1000, 0);
+	ck_assert(rs.step == (1 << 16) + 328);
+
+	n = sco_pcm_resample(&rs, in, 1000, &consumed, out, 1000);
+	ck_assert(n == 996 && consumed == 1000);
+
+	sco_pcm_resampler_init(&rs);
+
+	sco_pcm_resampler_adjust(&rs, 0, 1000);
+	ck_assert(rs.step == (1 << 16) - 328);
+}
+END_TEST
+
+START_TEST(test_msbc_deframe)
+{
+	struct sco_msbc_deframer d;
+	struct sco_pcm_rx rx;
+	uint8_t buf[64];
+	const uint8_t *frame;
+	int sv[2];
+
+	ck_assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+	ck_assert(sco_pcm_rx_init(&rx, sizeof(buf), 4) == 0);
+	memset(&d, 0, sizeof(d));
+
+	/* Two bytes of garbage ahead of a packet */
+	memset(buf, 0x55, sizeof(buf));
+	sco_msbc_h2_header(buf + 2, 1);
+	buf[4] = 0xad;
+	ck_assert(send(sv[1], buf, 2 + SCO_MSBC_PACKET_LEN, 0) ==
+						2 + SCO_MSBC_PACKET_LEN);
+	ck_assert(sco_pcm_rx_fill(&rx, sv[0], 0) == 2 + SCO_MSBC_PACKET_LEN);
+
+	frame = sco_msbc_deframe(&d, &rx);
+	ck_assert(frame != NULL && frame[0] == 0xad);
+	ck_assert(d.resyncs == 2);
+
+	ck_assert(sco_msbc_deframe(&d, &rx) == NULL);
+
+	sco_pcm_rx_free(&rx);
+	close(sv[0]);
+	close(sv[1]);
+}
+END_TEST
+
+static void add_test(Suite *s, const char *name, TFun func)
+{
+	TCase *t;
+
+	t = tcase_create(name);
+	tcase_add_test(t, func);
+	suite_add_tcase(s, t);
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	SRunner *sr;
+	Suite *s;
+
+	s = suite_create("SCO PCM");
+
+	add_test(s, "receive short packets", test_rx_short_packets);
+	add_test(s, "receive overrun", test_rx_overrun);
+	add_test(s, "resampler", test_resampler);
+	add_test(s, "resampler adjustment", test_resampler_adjust);
+	add_test(s, "mSBC deframing", test_msbc_deframe);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+
+	fails = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	if (fails > 0)
+		return -1;
+
+	return 0;
+}
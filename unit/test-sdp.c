@@ -0,0 +1,154 @@
+/*
+ *
+ *  BlueZ - Bluetooth protocol stack for Linux
+ *
+ *  Copyright (C) 2002-2010  Marcel Holtmann <marcel@holtmann.org>
+ *
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <check.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <bluetooth/bluetooth.h>
+#include <bluetooth/sdp.h>
+#include <bluetooth/sdp_lib.h>
+
+/* ServiceClassIDList with the Audio Source UUID */
+static const uint8_t valid_record[] = {
+	0x35, 0x08, 0x09, 0x00, 0x01, 0x35, 0x03, 0x19, 0x11, 0x0a,
+};
+
+/* Inner sequence claims 16 bytes but only 3 follow */
+static const uint8_t inner_too_long[] = {
+	0x35, 0x08, 0x09, 0x00, 0x01, 0x35, 0x10, 0x19, 0x11, 0x01,
+};
+
+/* Inner sequence claims 1 byte but holds a 3 byte UUID */
+static const uint8_t inner_too_short[] = {
+	0x35, 0x08, 0x09, 0x00, 0x01, 0x35, 0x01, 0x19, 0x11, 0x01,
+};
+
+/* Outer sequence shorter than the buffer */
+static const uint8_t trailing_data[] = {
+	0x35, 0x07, 0x09, 0x00, 0x01, 0x35, 0x03, 0x19, 0x11, 0x0a,
+};
+
+/* Attribute ids out of order */
+static const uint8_t unsorted_attrs[] = {
+	0x35, 0x0a, 0x09, 0x00, 0x04, 0x08, 0x00, 0x09, 0x00, 0x01,
+	0x08, 0x00,
+};
+
+static void check_invalid(const uint8_t *buf, int size)
+{
+	sdp_record_t *rec;
+
+	errno = 0;
+	rec = sdp_extract_record_pdu(buf, size);
+	ck_assert(rec == NULL);
+	ck_assert(errno == EINVAL);
+}
+
+START_TEST(test_valid)
+{
+	sdp_record_t *rec;
+	sdp_list_t *classes = NULL;
+	uuid_t *uuid;
+
+	rec = sdp_extract_record_pdu(valid_record, sizeof(valid_record));
+	ck_assert(rec != NULL);
+
+	ck_assert(sdp_get_service_classes(rec, &classes) == 0);
+	ck_assert(sdp_list_len(classes) == 1);
+
+	uuid = classes->data;
+	ck_assert(uuid->type == SDP_UUID16);
+	ck_assert(uuid->value.uuid16 == AUDIO_SOURCE_SVCLASS_ID);
+
+	sdp_list_free(classes, free);
+	sdp_record_free(rec);
+}
+END_TEST
+
+START_TEST(test_inner_too_long)
+{
+	check_invalid(inner_too_long, sizeof(inner_too_long));
+}
+END_TEST
+
+START_TEST(test_inner_too_short)
+{
+	check_invalid(inner_too_short, sizeof(inner_too_short));
+}
+END_TEST
+
+START_TEST(test_trailing_data)
+{
+	check_invalid(trailing_data, sizeof(trailing_data));
+}
+END_TEST
+
+START_TEST(test_unsorted_attrs)
+{
+	check_invalid(unsorted_attrs, sizeof(unsorted_attrs));
+}
+END_TEST
+
+static void add_test(Suite *s, const char *name, TFun func)
+{
+	TCase *t;
+
+	t = tcase_create(name);
+	tcase_add_test(t, func);
+	suite_add_tcase(s, t);
+}
+
+int main(int argc, char *argv[])
+{
+	int fails;
+	SRunner *sr;
+	Suite *s;
+
+	s = suite_create("SDP");
+
+	add_test(s, "valid record", test_valid);
+	add_test(s, "inner sequence too long", test_inner_too_long);
+	add_test(s, "inner sequence too short", test_inner_too_short);
+	add_test(s, "trailing data", test_trailing_data);
+	add_test(s, "unsorted attributes", test_unsorted_attrs);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+
+	fails = srunner_ntests_failed(sr);
+
+	srunner_free(sr);
+
+	if (fails > 0)
+		return -1;
+
+	return 0;
+}